@@ -0,0 +1,52 @@
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <filesystem>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+
+    // A cache directory of its own, emptied first, so that the first compile
+    // is really cold.
+    auto aot_options = AotOptions();
+    aot_options.cache_directory /= "aot_bench";
+    std::filesystem::remove_all(aot_options.cache_directory);
+
+    for (auto shape : {ScriptShape::Arithmetic, ScriptShape::Variables, ScriptShape::Calls}) {
+        auto source = generateScript({.shape = shape, .statements = options.statements});
+        auto chunk = compile(parse(tokenize(source)));
+        auto instructions = countInstructions(chunk->opcodes.data(), chunk->opcodes.size());
+        auto name = std::string("aot/") + getScriptShapeName(shape);
+
+        auto start = std::chrono::steady_clock::now();
+        auto module = compileAot(chunk, aot_options);
+        auto cold = std::chrono::steady_clock::now() - start;
+        if (!module) {
+            fprintf(stderr, "%s: AOT compilation failed\n", name.c_str());
+            return 1;
+        }
+        start = std::chrono::steady_clock::now();
+        auto cached = compileAot(chunk, aot_options);
+        auto warm = std::chrono::steady_clock::now() - start;
+        fprintf(options.output, R"({"name":"%s/compile","cold_ms":%.3f,"cached_ms":%.3f})" "\n",
+            name.c_str(),
+            std::chrono::duration<double, std::milli>(cold).count(),
+            std::chrono::duration<double, std::milli>(warm).count());
+
+        runBenchmark(options, name + "/interpreter", "instructions", static_cast<double>(instructions), [&] {
+            execute(vm, *chunk);
+        });
+        runBenchmark(options, name + "/native", "instructions", static_cast<double>(instructions), [&] {
+            execute(vm, *module);
+        });
+    }
+    return 0;
+}
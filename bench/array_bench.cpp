@@ -0,0 +1,41 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Whole-array operations written as element loops in the script against the
+// builtins and array arithmetic, which run one vectorized kernel each.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+    auto length = std::to_string(options.statements);
+
+    auto setup = "auto n = " + length + ";\n"
+        "auto a = array(n);\n"
+        "auto b = array(n);\n"
+        "for (auto i = 0; i < n; i = i + 1) {\n"
+        "    a[i] = i;\n"
+        "    b[i] = n - i;\n"
+        "}\n";
+    auto loop = [&](const std::string& body) {
+        return setup + "for (auto i = 0; i < n; i = i + 1) {\n    " + body + "\n}\n";
+    };
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+    auto elements = static_cast<double>(options.statements);
+    auto run = [&](const char* name, const std::string& source) {
+        auto chunk = compile(parse(tokenize(source)));
+        runBenchmark(options, name, "elements", elements, [&] {
+            execute(vm, *chunk);
+        });
+    };
+
+    run("array/setup", setup);
+    run("array/sum_loop", "auto s = 0;\n" + loop("s = s + a[i];"));
+    run("array/sum_builtin", setup + "auto s = sum(a);\n");
+    run("array/dot_loop", "auto s = 0;\n" + loop("s = s + a[i] * b[i];"));
+    run("array/dot_builtin", setup + "auto s = dot(a, b);\n");
+    run("array/map_loop", loop("b[i] = a[i] * 3 + 1;"));
+    run("array/map_builtin", setup + "b = a * 3 + 1;\n");
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    static constexpr size_t kRows = 1 << 20;
+    static constexpr const char* kFormula = "auto result = (price * quantity - discount) * 100 / (quantity + 1) + -price;";
+
+    auto inputs = std::vector<std::string>{"price", "quantity", "discount"};
+    auto chunk = compile(parse(tokenize(kFormula)), inputs);
+    auto result_slot = chunk->getVariable("result");
+
+    std::vector<int> price(kRows), quantity(kRows), discount(kRows);
+    std::vector<double> price_f(kRows), quantity_f(kRows), discount_f(kRows);
+    for (size_t i = 0; i < kRows; ++i) {
+        price[i] = static_cast<int>(i % 1000) + 1;
+        quantity[i] = static_cast<int>(i % 17);
+        discount[i] = static_cast<int>(i % 7);
+        price_f[i] = price[i];
+        quantity_f[i] = quantity[i];
+        discount_f[i] = discount[i];
+    }
+
+    std::vector<int> expected(kRows);
+    // The program is loaded once per block, like a batch program sets up its
+    // slots, and only restarted for the rows in between: every row sets the
+    // inputs and assigns `result`, so nothing carries over.
+    runBenchmark(options, "batch/per-row-vm", "rows", kRows, [&] {
+        VM vm;
+        for (size_t i = 0; i < kRows; ++i) {
+            if (i % BatchProgram<int>::kBlockSize == 0) {
+                vm.load(chunk->getProgram());
+            }
+            vm.setInstructionPointer(0);
+            vm.setGlobal(0, price[i]);
+            vm.setGlobal(1, quantity[i]);
+            vm.setGlobal(2, discount[i]);
+            vm.run();
+            expected[i] = vm.getGlobal(result_slot);
+        }
+    });
+
+    std::vector<int> out(kRows);
+    auto program = BatchProgram<int>(chunk);
+    program.bind("price", price);
+    program.bind("quantity", quantity);
+    program.bind("discount", discount);
+    runBenchmark(options, "batch/int", "rows", kRows, [&] {
+        program.run(out, "result");
+    });
+    if (out != expected) {
+        fprintf(stderr, "batch/int result differs from the per-row VM\n");
+        return 1;
+    }
+
+    std::vector<double> out_f(kRows);
+    auto program_f = BatchProgram<double>(chunk);
+    program_f.bind("price", price_f);
+    program_f.bind("quantity", quantity_f);
+    program_f.bind("discount", discount_f);
+    runBenchmark(options, "batch/double", "rows", kRows, [&] {
+        program_f.run(out_f, "result");
+    });
+    return 0;
+}
@@ -0,0 +1,213 @@
+module;
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string_view>
+
+export module cpp_script_bench;
+
+export enum class ScriptShape {
+    Arithmetic,     // constant expressions assigned to variables
+    Variables,      // expressions over previously assigned variables
+    Calls,          // print(...) calls with variable arguments
+    Functions,      // calls to script functions, one of them recursive
+    Library,        // functions of which only every 100th is called
+};
+
+export struct ScriptOptions {
+    ScriptShape shape = ScriptShape::Arithmetic;
+    size_t statements = 1000;
+    size_t depth = 3;
+    size_t variables = 64;
+    uint32_t seed = 1;
+};
+
+export auto parseScriptShape(std::string_view name) -> ScriptShape {
+    if (name == "arithmetic") {
+        return ScriptShape::Arithmetic;
+    }
+    if (name == "variables") {
+        return ScriptShape::Variables;
+    }
+    if (name == "calls") {
+        return ScriptShape::Calls;
+    }
+    if (name == "functions") {
+        return ScriptShape::Functions;
+    }
+    if (name == "library") {
+        return ScriptShape::Library;
+    }
+    fprintf(stderr, "Unknown script shape '%.*s'\n", (int) name.size(), name.data());
+    abort();
+}
+
+export auto getScriptShapeName(ScriptShape shape) -> const char* {
+    switch (shape) {
+        case ScriptShape::Arithmetic: return "arithmetic";
+        case ScriptShape::Variables: return "variables";
+        case ScriptShape::Calls: return "calls";
+        case ScriptShape::Functions: return "functions";
+        case ScriptShape::Library: return "library";
+    }
+    return "unknown";
+}
+
+// Generates deterministic scripts that stay within what the VM can execute:
+// at most `variables` slots, shallow operand stacks and values that cannot
+// overflow no matter how many statements are generated.
+export class ScriptGenerator {
+public:
+    explicit ScriptGenerator(ScriptOptions options) : options_(options), random_(options.seed) {}
+
+    auto generate() -> std::string {
+        std::string source;
+        source.reserve(options_.statements * 24);
+        for (size_t i = 0; i < options_.variables; ++i) {
+            source += "auto v" + std::to_string(i) + " = " + std::to_string(i % 9 + 1) + ";\n";
+        }
+        if (options_.shape == ScriptShape::Functions) {
+            // count(n) recurses n times and returns n, so values stay those
+            // of the averages.
+            source += "auto mix(auto a, auto b) { return (a + b) / 2; }\n";
+            source += "auto count(auto n) { if (n < 1) { return 0; } return count(n - 1) + 1; }\n";
+        }
+        for (size_t i = 0; i < options_.statements; ++i) {
+            switch (options_.shape) {
+                case ScriptShape::Arithmetic: {
+                    source += variable() + " = " + constant(options_.depth) + ";\n";
+                    break;
+                }
+                case ScriptShape::Variables: {
+                    source += variable() + " = " + average(options_.depth) + ";\n";
+                    break;
+                }
+                case ScriptShape::Calls: {
+                    source += "print(" + variable() + ", " + variable() + " + 1);\n";
+                    break;
+                }
+                case ScriptShape::Functions: {
+                    source += variable() + " = mix(count(" + variable() + "), " + variable() + ");\n";
+                    break;
+                }
+                case ScriptShape::Library: {
+                    if (i % kFunctionSize == 0) {
+                        source += "auto f" + std::to_string(i / kFunctionSize) + "(auto a, auto b) {\n";
+                        source += "    auto t = (a + b) / 2;\n";
+                    }
+                    static constexpr const char* operands[] = {"a", "b", "t"};
+                    source += std::string("    t = (") + operands[pick(3)] + " + " + operands[pick(3)] + ") / 2;\n";
+                    if (i % kFunctionSize == kFunctionSize - 1 || i + 1 == options_.statements) {
+                        source += "    return t;\n}\n";
+                    }
+                    break;
+                }
+            }
+        }
+        if (options_.shape == ScriptShape::Library) {
+            auto functions = (options_.statements + kFunctionSize - 1) / kFunctionSize;
+            for (size_t i = 0; i < functions; i += 100) {
+                source += "print(f" + std::to_string(i) + "(" + variable() + ", " + variable() + "));\n";
+            }
+        }
+        return source;
+    }
+
+private:
+    // Statements per function body in the library shape.
+    static constexpr size_t kFunctionSize = 8;
+
+    auto pick(size_t count) -> size_t {
+        return std::uniform_int_distribution<size_t>(0, count - 1)(random_);
+    }
+
+    auto variable() -> std::string {
+        return "v" + std::to_string(pick(options_.variables));
+    }
+
+    // Multiplication only appears between two digits, so the magnitude of an
+    // expression of depth `d` is bounded by 81 * 2^d.
+    auto constant(size_t depth) -> std::string {
+        if (depth <= 1) {
+            static constexpr const char* ops[] = {" + ", " - ", " * "};
+            return std::to_string(pick(9) + 1) + ops[pick(3)] + std::to_string(pick(9) + 1);
+        }
+        static constexpr const char* ops[] = {" + ", " - "};
+        auto expr = "(" + constant(depth - 1) + ")" + ops[pick(2)] + constant(depth - 1);
+        return pick(4) == 0 ? "-(" + expr + ")" : expr;
+    }
+
+    // Averages never leave the range of the initial values.
+    auto average(size_t depth) -> std::string {
+        if (depth <= 1) {
+            return variable();
+        }
+        static constexpr const char* ops[] = {" + ", " - "};
+        return "(" + average(depth - 1) + ops[pick(2)] + average(depth - 1) + ") / 2";
+    }
+
+private:
+    ScriptOptions options_;
+    std::minstd_rand random_;
+};
+
+export auto generateScript(const ScriptOptions& options) -> std::string {
+    return ScriptGenerator(options).generate();
+}
+
+export struct BenchmarkOptions {
+    double min_time = 0.5;
+    size_t statements = 10000;
+    FILE* output = stdout;
+};
+
+export auto parseBenchmarkOptions(int argc, char** argv) -> BenchmarkOptions {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--statements" && i + 1 < argc) {
+            options.statements = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [--min-time <seconds>] [--statements <count>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    return options;
+}
+
+// Runs `fn` until at least `min_time` seconds have passed and prints one JSON
+// object per line, so that runs can be diffed or loaded with any JSON tool.
+// Returns the time one call of `fn` took, in nanoseconds.
+export template<typename Fn>
+auto runBenchmark(const BenchmarkOptions& options, std::string_view name, std::string_view unit, double items_per_iteration, Fn&& fn) -> double {
+    fn();
+
+    size_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration<double>::zero();
+    while (elapsed.count() < options.min_time) {
+        fn();
+        iterations += 1;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    auto seconds = elapsed.count();
+    fprintf(options.output,
+        "{\"name\":\"%.*s\",\"iterations\":%zu,\"seconds\":%.6f,\"ns_per_iteration\":%.1f,\"items_per_iteration\":%.0f,\"unit\":\"%.*s\",\"items_per_second\":%.1f}\n",
+        (int) name.size(), name.data(),
+        iterations,
+        seconds,
+        seconds * 1e9 / static_cast<double>(iterations),
+        items_per_iteration,
+        (int) unit.size(), unit.data(),
+        items_per_iteration * static_cast<double>(iterations) / seconds
+    );
+    fflush(options.output);
+    return seconds * 1e9 / static_cast<double>(iterations);
+}
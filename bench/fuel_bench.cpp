@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <string>
+#include <cstdint>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Fuel is only charged at backward jumps and calls, so these are the two
+// worst cases: a tight loop and a loop that calls a small function, each
+// run with and without metering.
+struct FuelWorkload {
+    const char* name;
+    std::string source;
+};
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto bound = std::to_string(options.statements);
+    FuelWorkload workloads[] = {
+        {
+            "fuel/loop",
+            "auto s = 0;\n"
+            "for (auto i = 0; i < " + bound + "; i = i + 1) {\n"
+            "    s = s + i;\n"
+            "}\n",
+        },
+        {
+            "fuel/calls",
+            "auto step(auto x) {\n"
+            "    return x + 1;\n"
+            "}\n"
+            "auto s = 0;\n"
+            "for (auto i = 0; i < " + bound + "; i = i + 1) {\n"
+            "    s = step(s);\n"
+            "}\n",
+        },
+    };
+
+    auto vm = VM();
+    for (auto& workload : workloads) {
+        // Calls would be inlined away otherwise.
+        auto chunk = compile(parse(tokenize(workload.source)), {}, ManagedShared<NativeRegistry>(), {.inline_budget = 0});
+        auto name = std::string(workload.name);
+
+        vm.disableFuel();
+        auto plain = runBenchmark(options, name + "/unmetered", "iterations", static_cast<double>(options.statements), [&] {
+            execute(vm, *chunk);
+        });
+
+        vm.setFuel(UINT64_MAX);
+        auto metered = runBenchmark(options, name + "/metered", "iterations", static_cast<double>(options.statements), [&] {
+            execute(vm, *chunk);
+        });
+
+        fprintf(options.output, R"({"name":"%s/overhead","percent":%.1f})" "\n", name.c_str(), (metered / plain - 1.0) * 100.0);
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    ScriptOptions options;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if (arg == "--shape" && i + 1 < argc) {
+            options.shape = parseScriptShape(argv[++i]);
+        } else if (arg == "--statements" && i + 1 < argc) {
+            options.statements = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--depth" && i + 1 < argc) {
+            options.depth = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--variables" && i + 1 < argc) {
+            options.variables = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            fprintf(stderr, "usage: %s [--shape arithmetic|variables|calls|functions|library] [--statements N] [--depth N] [--variables N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+    auto source = generateScript(options);
+    fwrite(source.data(), 1, source.size(), stdout);
+    return 0;
+}
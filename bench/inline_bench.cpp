@@ -0,0 +1,53 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Calls to small helpers, half of them with literal arguments that fold away
+// entirely once inlined.
+static auto generateHelperScript(size_t statements) -> std::string {
+    std::string source = R"(
+        auto sq(auto x) { return x * x; }
+        auto avg(auto a, auto b) { auto s = a + b; return s / 2; }
+        auto mix(auto a, auto b) { return avg(a, avg(a, b)); }
+    )";
+    for (size_t i = 0; i < 64; ++i) {
+        source += "auto v" + std::to_string(i) + " = " + std::to_string(i % 9 + 1) + ";\n";
+    }
+    auto random = std::minstd_rand(1);
+    auto pick = [&](size_t count) {
+        return std::uniform_int_distribution<size_t>(0, count - 1)(random);
+    };
+    for (size_t i = 0; i < statements; ++i) {
+        auto target = "v" + std::to_string(pick(64));
+        if (i % 2 == 0) {
+            source += target + " = mix(v" + std::to_string(pick(64)) + ", v" + std::to_string(pick(64)) + ");\n";
+        } else {
+            source += target + " = sq(" + std::to_string(pick(9) + 1) + ") - avg(" + std::to_string(pick(9) + 1) + ", 7);\n";
+        }
+    }
+    return source;
+}
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+    auto source = generateHelperScript(options.statements);
+    auto statements = parse(tokenize(source));
+
+    auto calls = compile(statements, {}, ManagedShared<NativeRegistry>(), {.inline_budget = 0, .fold_constants = false, .optimize = false});
+    auto inlined = compile(statements);
+
+    runBenchmark(options, "inline/calls", "statements", static_cast<double>(options.statements), [&] {
+        execute(vm, *calls);
+    });
+    runBenchmark(options, "inline/inlined", "statements", static_cast<double>(options.statements), [&] {
+        execute(vm, *inlined);
+    });
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    for (auto shape : {ScriptShape::Arithmetic, ScriptShape::Variables, ScriptShape::Calls}) {
+        auto source = generateScript({.shape = shape, .statements = options.statements * 10});
+        auto tokens = tokenize(source).size();
+
+        auto name = std::string("lexer/") + getScriptShapeName(shape);
+        // One measurement, also reported as a byte rate.
+        auto ns = runBenchmark(options, name + "/tokens", "tokens", static_cast<double>(tokens), [&] {
+            auto stream = TokenStream(source);
+            stream.readToken();
+            while (stream.peekToken().type != TOKEN_EOF) {
+                stream.readToken();
+            }
+        });
+        fprintf(options.output, R"({"name":"%s/bytes","bytes_per_second":%.1f})" "\n", name.c_str(), static_cast<double>(source.size()) * 1e9 / ns);
+        runBenchmark(options, name + "/tokenize", "tokens", static_cast<double>(tokens), [&] {
+            tokenize(source);
+        });
+    }
+    return 0;
+}
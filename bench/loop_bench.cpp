@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <string>
+
+import cpp_script;
+import cpp_script_bench;
+
+// The same counted loop with its condition in three forms, from the one
+// compare-and-branch instruction a constant bound compiles to, through a
+// comparison of two loads, to a comparison kept in a variable that needs a
+// separate compare and conditional jump.
+struct LoopVariant {
+    const char* name;
+    std::string source;
+};
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto bound = std::to_string(options.statements);
+    LoopVariant variants[] = {
+        {
+            "loop/local_const",
+            "auto s = 0;\n"
+            "for (auto i = 0; i < " + bound + "; i = i + 1) {\n"
+            "    s = s + i;\n"
+            "}\n",
+        },
+        {
+            "loop/local_local",
+            "auto s = 0;\n"
+            "auto n = " + bound + ";\n"
+            "for (auto i = 0; i < n; i = i + 1) {\n"
+            "    s = s + i;\n"
+            "}\n",
+        },
+        {
+            "loop/compare_then_jump",
+            "auto s = 0;\n"
+            "auto i = 0;\n"
+            "auto more = i < " + bound + ";\n"
+            "while (more) {\n"
+            "    s = s + i;\n"
+            "    i = i + 1;\n"
+            "    more = i < " + bound + ";\n"
+            "}\n",
+        },
+    };
+
+    auto vm = VM();
+    for (auto& variant : variants) {
+        auto chunk = compile(parse(tokenize(variant.source)));
+        auto instructions = countInstructions(chunk->opcodes.data(), chunk->opcodes.size());
+        fprintf(options.output, R"({"name":"%s/code","instructions":%zu})" "\n", variant.name, instructions);
+        runBenchmark(options, variant.name, "iterations", static_cast<double>(options.statements), [&] {
+            execute(vm, *chunk);
+        });
+    }
+    return 0;
+}
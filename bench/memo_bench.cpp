@@ -0,0 +1,51 @@
+#include <string>
+#include <cstdio>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Pure helpers called over and over with the same few arguments, compiled
+// with and without memoization: a loop-heavy cost function and a naive
+// recursive Fibonacci.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto source = R"(
+        auto cost(auto n) {
+            auto s = 0;
+            for (auto i = 0; i < n; i = i + 1) {
+                s = s + i * i;
+            }
+            return s;
+        }
+        auto fib(auto n) {
+            if (n < 2) {
+                return n;
+            }
+            return fib(n - 1) + fib(n - 2);
+        }
+        auto total = 0;
+        for (auto i = 0; i < )" + std::to_string(options.statements) + R"(; i = i + 1) {
+            auto k = i / 64;
+            total = total + cost(k - k / 16 * 16 + 100) + fib(i - i / 8 * 8 + 8);
+        }
+        print(total);
+    )";
+    auto statements = parse(tokenize(source));
+    auto plain = compile(statements, {}, ManagedShared<NativeRegistry>(), {.memoize = false});
+    auto memoized = compile(statements);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+    auto calls = static_cast<double>(options.statements);
+
+    runBenchmark(options, "memo/plain", "iterations", calls, [&] {
+        execute(vm, *plain);
+    });
+    runBenchmark(options, "memo/memoized", "iterations", calls, [&] {
+        execute(vm, *memoized);
+    });
+    fprintf(options.output, R"({"name":"memo/counters","hits":%llu,"misses":%llu})" "\n",
+        static_cast<unsigned long long>(vm.getMemo().getHits()), static_cast<unsigned long long>(vm.getMemo().getMisses()));
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <string>
+#include <vector>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+static auto add(int lhs, int rhs) -> int {
+    return lhs + rhs;
+}
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    static constexpr size_t kCalls = 1000;
+
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("add", &add);
+    natives->define("scale", [factor = 3](int value) { return value * factor; });
+    natives->define("nop", [] {});
+
+    auto run = [&](std::string_view name, std::string_view statement) {
+        std::string source = "auto v = 0;\n";
+        for (size_t i = 0; i < kCalls; ++i) {
+            source += statement;
+        }
+        // Unoptimized, or the stores to `v` between the calls would go away.
+        auto chunk = compile(parse(tokenize(source)), {}, natives, {.optimize = false});
+        auto vm = VM();
+        runBenchmark(options, name, "calls", kCalls, [&] {
+            execute(vm, *chunk);
+        });
+    };
+
+    // The inline variant does the same work as add() without the call, so the
+    // difference between the two is the cost of CALL_NATIVE itself.
+    run("native/inline", "v = v + 1;\n");
+    run("native/add", "v = add(v, 1);\n");
+    run("native/scale", "v = scale(v) / 3;\n");
+    run("native/nop", "nop();\n");
+    return 0;
+}
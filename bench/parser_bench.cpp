@@ -0,0 +1,44 @@
+#include <string>
+#include <vector>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+    auto pool = ThreadPool();
+
+    for (auto shape : {ScriptShape::Arithmetic, ScriptShape::Variables, ScriptShape::Calls}) {
+        auto source = generateScript({.shape = shape, .statements = options.statements});
+        auto tokens = tokenize(source);
+
+        PhaseStats stats;
+        {
+            auto scope = PhaseScope(&stats);
+            parse(tokens);
+        }
+        auto nodes = static_cast<double>(stats.created_objects);
+
+        auto name = std::string("parser/") + getScriptShapeName(shape);
+        runBenchmark(options, name + "/parse", "nodes", nodes, [&] {
+            parse(tokens);
+        });
+
+        auto statements = parse(tokens);
+        runBenchmark(options, name + "/compile", "nodes", nodes, [&] {
+            compile(statements);
+        });
+        runBenchmark(options, name + "/parse+compile", "nodes", nodes, [&] {
+            compile(parse(tokens));
+        });
+
+        // Both include lexing, which the parallel front end does per piece.
+        runBenchmark(options, name + "/lex+parse", "nodes", nodes, [&] {
+            parse(tokenize(source));
+        });
+        runBenchmark(options, name + "/parallel-lex+parse", "nodes", nodes, [&] {
+            parse(pool, source);
+        });
+    }
+    return 0;
+}
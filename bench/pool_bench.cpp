@@ -0,0 +1,33 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto source = generateScript({.shape = ScriptShape::Variables, .statements = 1000});
+    auto chunk = compile(parse(tokenize(source)));
+
+    static constexpr size_t kInvocations = 10000;
+
+    std::vector<size_t> thread_counts;
+    auto max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.emplace_back(threads);
+    }
+    thread_counts.emplace_back(max_threads);
+
+    for (auto threads : thread_counts) {
+        ThreadPool pool(threads);
+        auto name = "pool/threads=" + std::to_string(threads);
+        runBenchmark(options, name, "invocations", static_cast<double>(kInvocations), [&] {
+            execute(pool, *chunk, kInvocations, discard);
+        });
+    }
+    return 0;
+}
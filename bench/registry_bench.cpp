@@ -0,0 +1,67 @@
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Many threads looking up and running the same scripts: a mutex-guarded map
+// handing out references against the lock-free registry of frozen chunks.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    constexpr size_t kScripts = 64;
+    constexpr size_t kLookups = 20000;
+    auto threads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+
+    auto chunks = std::map<std::string, ManagedShared<Chunk>>();
+    auto registry = ChunkRegistry();
+    auto keys = std::vector<std::string>();
+    for (size_t i = 0; i < kScripts; ++i) {
+        auto key = "script" + std::to_string(i) + ".cps";
+        auto chunk = compile(parse(tokenize("auto add(auto x) { return x + " + std::to_string(i) + "; }\nprint(add(1));\n")));
+        registry.publish(key, *chunk);
+        chunks.emplace(key, chunk);
+        keys.emplace_back(std::move(key));
+    }
+
+    auto runThreads = [&](auto&& body) {
+        auto workers = std::vector<std::thread>();
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&body, t] {
+                auto discard = CallbackOutputSink([](std::string_view) {});
+                auto vm = VM(discard);
+                body(vm, t);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    auto mutex = std::mutex();
+    runBenchmark(options, "registry/locked", "lookups", static_cast<double>(threads * kLookups), [&] {
+        runThreads([&](VM& vm, size_t t) {
+            for (size_t i = 0; i < kLookups; ++i) {
+                auto chunk = ManagedShared<Chunk>();
+                {
+                    std::lock_guard lock(mutex);
+                    chunk = chunks.find(keys[(i + t) % kScripts])->second;
+                }
+                execute(vm, *chunk);
+            }
+        });
+    });
+    runBenchmark(options, "registry/frozen", "lookups", static_cast<double>(threads * kLookups), [&] {
+        runThreads([&](VM& vm, size_t t) {
+            for (size_t i = 0; i < kLookups; ++i) {
+                auto reader = registry.read();
+                execute(vm, *reader.find(keys[(i + t) % kScripts]));
+            }
+        });
+    });
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <string>
+#include <cstdio>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Latency of picking up an edit to one function of a library with every
+// function compiled: compiling the whole script again against a reload
+// that only compiles what changed.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto source = generateScript({.shape = ScriptShape::Library, .statements = options.statements});
+    auto bytes = static_cast<double>(source.size());
+
+    // The same library with the first statement of a function in the middle
+    // edited, so reloads alternate between two versions.
+    auto edited = source;
+    auto function = "auto f" + std::to_string(options.statements / 16) + "(auto a, auto b) {\n    auto t = (a + b) / 2;";
+    auto at = edited.find(function);
+    if (at == std::string::npos) {
+        fprintf(stderr, "Function to edit not found\n");
+        return 1;
+    }
+    edited.replace(at + function.size() - 2, 1, "3");
+
+    runBenchmark(options, "reload/full", "bytes", bytes, [&] {
+        auto chunk = compile(parse(tokenize(source)));
+        chunk->functions->compileAll();
+    });
+
+    auto script = HotScript(source);
+    script.getChunk()->functions->compileAll();
+    auto version = size_t(0);
+    auto stats = ReloadStats();
+    runBenchmark(options, "reload/incremental", "bytes", bytes, [&] {
+        version += 1;
+        stats = script.reload(version % 2 == 0 ? source : edited);
+        script.getChunk()->functions->compileAll();
+    });
+    fprintf(options.output, R"({"name":"reload/incremental","reused":%zu,"changed":%zu})" "\n", stats.reused, stats.changed);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    static constexpr std::string_view kSource = R"(
+        auto area = width * height;
+        auto border = (width + height) * 2;
+        return area - border / 4;
+    )";
+
+    auto script = PreparedScript(kSource, {"width", "height"});
+    auto arguments = std::array{640, 480};
+    auto vm = VM();
+
+    volatile int result = 0;
+    runBenchmark(options, "script/prepared", "calls", 1, [&] {
+        result = script.execute(vm, arguments);
+    });
+
+    // Allocations are only counted when built with
+    // CPP_SCRIPT_COUNT_ALLOCATIONS; otherwise this checks nothing.
+    if (!areAllocationsCounted()) {
+        fprintf(stderr, "Allocations are not counted in this build, not checking PreparedScript::execute\n");
+    }
+    PhaseStats stats;
+    {
+        auto scope = PhaseScope(&stats);
+        script.execute(vm, arguments);
+    }
+    if (stats.allocations != 0) {
+        fprintf(stderr, "PreparedScript::execute allocated %llu times\n", (unsigned long long) stats.allocations);
+        return 1;
+    }
+
+    runBenchmark(options, "script/compile+execute", "calls", 1, [&] {
+        auto chunk = compile(parse(tokenize(kSource)), std::array<std::string, 2>{"width", "height"});
+        vm.load(chunk->getProgram());
+        vm.setGlobal(0, arguments[0]);
+        vm.setGlobal(1, arguments[1]);
+        vm.run();
+        result = vm.getResult();
+    });
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <csignal>
+#include <malloc.h>
+#include <unistd.h>
+#include <filesystem>
+#include <sys/wait.h>
+
+import cpp_script;
+import cpp_script_bench;
+
+static auto getAllocatedBytes() -> size_t {
+    return mallinfo2().uordblks;
+}
+
+// Startup of a script compiled in every process against one fetched from a
+// compile server that already has it, and how much of each process's own
+// memory the compiled script takes either way.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+    auto source = generateScript({.shape = ScriptShape::Library, .statements = options.statements});
+
+    // listen() creates the directory, private to this user.
+    auto socket_directory = std::filesystem::temp_directory_path() / ("cpp_script_server_bench-" + std::to_string(getpid()));
+    auto socket_path = socket_directory / "compile.sock";
+    auto server = fork();
+    if (server == 0) {
+        auto daemon = CompileServer({.socket_path = socket_path});
+        if (daemon.listen()) {
+            daemon.serve();
+        }
+        _exit(1);
+    }
+    while (access(socket_path.c_str(), F_OK) != 0) {
+        usleep(1000);
+    }
+    auto client = CompileClientOptions{.socket_path = socket_path};
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+
+    runBenchmark(options, "server/local", "starts", 1, [&] {
+        auto chunk = compile(parse(tokenize(source)));
+        execute(vm, *chunk);
+    });
+    runBenchmark(options, "server/shared", "starts", 1, [&] {
+        auto snapshot = compileShared(source, client);
+        snapshot->load(vm);
+        vm.runToCompletion();
+    });
+
+    // A fleet of processes running the same script pays for the compiled
+    // code once per process when each compiles it, and once in total when
+    // they map the server's image.
+    constexpr size_t kCopies = 16;
+    auto before = getAllocatedBytes();
+    {
+        auto chunks = std::vector<ManagedShared<Chunk>>();
+        for (size_t i = 0; i < kCopies; ++i) {
+            chunks.emplace_back(compile(parse(tokenize(source))));
+        }
+        auto local = (getAllocatedBytes() - before) / kCopies;
+
+        before = getAllocatedBytes();
+        auto snapshots = std::vector<ManagedShared<Snapshot>>();
+        for (size_t i = 0; i < kCopies; ++i) {
+            snapshots.emplace_back(compileShared(source, client));
+        }
+        auto shared = (getAllocatedBytes() - before) / kCopies;
+        auto image = snapshots.front()->getImageSize();
+
+        fprintf(options.output, R"({"name":"server/memory","local_bytes":%zu,"shared_private_bytes":%zu,"shared_image_bytes":%zu})" "\n", local, shared, image);
+        fprintf(options.output, R"({"name":"server/fleet64","local_bytes":%zu,"shared_bytes":%zu})" "\n", local * 64, shared * 64 + image);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    auto error = std::error_code();
+    std::filesystem::remove_all(socket_directory, error);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <string>
+#include <cstdio>
+#include <filesystem>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Time to the first statement after a script's initialization: running it
+// from source every time against mapping a snapshot taken at its `yield`.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+
+    auto bound = std::to_string(options.statements);
+    auto source =
+        "auto mix(auto x) {\n"
+        "    return x * 31 + 7;\n"
+        "}\n"
+        "auto table = 0;\n"
+        "for (auto i = 0; i < " + bound + "; i = i + 1) {\n"
+        "    table = mix(table + i) / 3;\n"
+        "}\n"
+        "yield;\n"
+        "print(table);\n";
+
+    auto path = std::filesystem::temp_directory_path() / "cpp_script_snapshot_bench.snap";
+    {
+        auto chunk = compile(parse(tokenize(source)));
+        vm.load(chunk->getProgram());
+        vm.run();
+        if (!writeSnapshot(vm, *chunk, path)) {
+            return 1;
+        }
+    }
+
+    runBenchmark(options, "snapshot/evaluate", "starts", 1, [&] {
+        auto chunk = compile(parse(tokenize(source)));
+        execute(vm, *chunk);
+    });
+    runBenchmark(options, "snapshot/restore", "starts", 1, [&] {
+        auto snapshot = Snapshot::open(path);
+        snapshot->load(vm);
+        vm.runToCompletion();
+    });
+
+    auto error = std::error_code();
+    std::filesystem::remove(path, error);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Straight-line code with repeated subexpressions, copies and overwritten
+// stores, as inlining tends to leave behind. Everything derives from the
+// input `x`, so none of it folds to constants.
+static auto generateRedundantScript(size_t statements) -> std::string {
+    std::string source;
+    for (size_t i = 0; i < 16; ++i) {
+        source += "auto v" + std::to_string(i) + " = x + " + std::to_string(i + 1) + ";\n";
+    }
+    source += "auto t = 0;\n";
+    for (size_t i = 0; i < statements; ++i) {
+        auto a = "v" + std::to_string(i % 16);
+        auto b = "v" + std::to_string((i * 7 + 3) % 16);
+        auto c = "v" + std::to_string((i * 5 + 1) % 16);
+        source += "t = " + a + " * " + b + ";\n";
+        source += c + " = t + " + a + " * " + b + " - " + c + ";\n";
+    }
+    return source;
+}
+
+static const std::string kInputs[] = {"x"};
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto source = generateRedundantScript(options.statements);
+    auto statements = parse(tokenize(source));
+    auto vm = VM();
+
+    for (auto optimize : {false, true}) {
+        auto chunk = compile(statements, kInputs, ManagedShared<NativeRegistry>(), {.optimize = optimize});
+        auto instructions = countInstructions(chunk->opcodes.data(), chunk->opcodes.size());
+        auto name = std::string("ssa/") + (optimize ? "optimized" : "plain");
+        fprintf(options.output, R"({"name":"%s/code","instructions":%zu})" "\n", name.c_str(), instructions);
+        runBenchmark(options, name, "statements", static_cast<double>(options.statements), [&] {
+            execute(vm, *chunk);
+        });
+    }
+
+    runBenchmark(options, "ssa/compile", "statements", static_cast<double>(options.statements), [&] {
+        compile(statements, kInputs);
+    });
+    return 0;
+}
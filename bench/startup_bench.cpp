@@ -0,0 +1,35 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+
+    // Time from source text to the end of the run for a library where only
+    // every 100th function is called.
+    auto source = generateScript({.shape = ScriptShape::Library, .statements = options.statements});
+    auto bytes = static_cast<double>(source.size());
+
+    auto chunk = compile(parse(tokenize(source)));
+    execute(vm, *chunk);
+    fprintf(options.output, R"({"name":"startup/library","functions":%zu,"called":%zu})" "\n",
+        chunk->functions->size(), chunk->functions->getCompiledCount());
+
+    runBenchmark(options, "startup/library/lazy", "bytes", bytes, [&] {
+        auto chunk = compile(parse(tokenize(source)));
+        execute(vm, *chunk);
+    });
+    runBenchmark(options, "startup/library/eager", "bytes", bytes, [&] {
+        auto chunk = compile(parse(tokenize(source)));
+        chunk->functions->compileAll();
+        execute(vm, *chunk);
+    });
+    return 0;
+}
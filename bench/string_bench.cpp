@@ -0,0 +1,37 @@
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+import cpp_script;
+import cpp_script_bench;
+
+// A script building one long string piece by piece and printing it: every
+// concatenation copying both halves against concatenations that build
+// ropes, flattened once when the string is printed.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+    // Copying keeps every intermediate string until the next load, which is
+    // quadratic in memory too.
+    auto pieces = std::min<size_t>(options.statements, 4000);
+
+    auto source = "auto s = \"\";\n"
+        "for (auto i = 0; i < " + std::to_string(pieces) + "; i = i + 1) {\n"
+        "    s = s + \"0123456789abcdef\";\n"
+        "}\n"
+        "print(len(s), s);\n";
+    auto chunk = compile(parse(tokenize(source)));
+    auto appends = static_cast<double>(pieces);
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto vm = VM(discard);
+
+    vm.getStrings().setRopeThreshold(SIZE_MAX);
+    runBenchmark(options, "string/copy", "appends", appends, [&] {
+        execute(vm, *chunk);
+    });
+    vm.getStrings().setRopeThreshold(StringHeap::kDefaultRopeThreshold);
+    runBenchmark(options, "string/rope", "appends", appends, [&] {
+        execute(vm, *chunk);
+    });
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdint>
+
+import cpp_script;
+import cpp_script_bench;
+
+// Many small scripts interleaved on a pool. Each turn of a task is one
+// switch, so switches per second is the scheduling throughput; creating
+// the tasks and their VMs is part of every iteration.
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    static constexpr size_t kTasks = 1000;
+    static constexpr size_t kTurns = 100;
+
+    auto discard = CallbackOutputSink([](std::string_view) {});
+    auto turns = std::to_string(kTurns);
+    auto yielding = compile(parse(tokenize(
+        "auto s = 0;\n"
+        "for (auto i = 0; i < " + turns + "; i = i + 1) {\n"
+        "    s = s + i;\n"
+        "    yield;\n"
+        "}\n"
+    )));
+    // Never yields, so it only gives up the thread when its slice runs out.
+    auto spinning = compile(parse(tokenize(
+        "auto s = 0;\n"
+        "for (auto i = 0; i < " + turns + "; i = i + 1) {\n"
+        "    s = s + i;\n"
+        "}\n"
+    )));
+
+    std::vector<size_t> thread_counts;
+    auto max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.emplace_back(threads);
+    }
+    thread_counts.emplace_back(max_threads);
+
+    for (auto threads : thread_counts) {
+        ThreadPool pool(threads);
+        auto suffix = "/threads=" + std::to_string(threads);
+        runBenchmark(options, "task/yield" + suffix, "switches", static_cast<double>(kTasks * (kTurns + 1)), [&] {
+            ScriptScheduler scheduler(pool);
+            for (size_t i = 0; i < kTasks; ++i) {
+                scheduler.spawn(yielding, discard);
+            }
+            scheduler.run();
+        });
+        runBenchmark(options, "task/slice" + suffix, "switches", static_cast<double>(kTasks * kTurns), [&] {
+            ScriptScheduler scheduler(pool, {.slice = 1});
+            for (size_t i = 0; i < kTasks; ++i) {
+                scheduler.spawn(spinning, discard);
+            }
+            scheduler.run();
+        });
+    }
+    return 0;
+}
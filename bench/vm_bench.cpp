@@ -0,0 +1,45 @@
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <string_view>
+
+import cpp_script;
+import cpp_script_bench;
+
+auto main(int argc, char** argv) -> int {
+    auto options = parseBenchmarkOptions(argc, argv);
+
+    // Script output is discarded so that the calls benchmark measures the
+    // interpreter and number formatting rather than the terminal.
+    auto discard = CallbackOutputSink([](std::string_view) {});
+
+    for (auto shape : {ScriptShape::Arithmetic, ScriptShape::Variables, ScriptShape::Calls, ScriptShape::Functions}) {
+        auto source = generateScript({.shape = shape, .statements = options.statements});
+        // Without folding and SSA optimization, so that the arithmetic shape
+        // still measures the instructions that evaluate it rather than a
+        // handful of PUSHes, and without inlining or memoization, so that
+        // the functions shape makes every call.
+        auto chunk = compile(parse(tokenize(source)), {}, ManagedShared<NativeRegistry>(), {.inline_budget = 0, .fold_constants = false, .optimize = false, .memoize = false});
+        auto instructions = countInstructions(chunk->opcodes.data(), chunk->opcodes.size());
+
+        // One VM for all runs, so that its stacks are only allocated once.
+        auto vm = VM(discard);
+        auto name = std::string("vm/") + getScriptShapeName(shape);
+        if (shape == ScriptShape::Functions) {
+            // The script has no loops, so every unit of fuel it spends is a
+            // call.
+            vm.setFuel(UINT64_MAX);
+            execute(vm, *chunk);
+            auto calls = UINT64_MAX - vm.getFuel();
+            vm.disableFuel();
+            runBenchmark(options, name + "/calls", "calls", static_cast<double>(calls), [&] {
+                execute(vm, *chunk);
+            });
+            continue;
+        }
+        runBenchmark(options, name + "/dispatch", "instructions", static_cast<double>(instructions), [&] {
+            execute(vm, *chunk);
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+
+// Replacement global allocation functions that count every allocation made on
+// the calling thread, so evaluation phases can report their allocation cost.
+// Counters are per thread to keep concurrent evaluations from mixing up.
+//
+// Only the CLI and the benchmarks link this file, and only when built with
+// CPP_SCRIPT_COUNT_ALLOCATIONS, so that programs embedding the library keep
+// their own operator new.
+
+// Defined in stats.cc, which reports them per phase.
+extern thread_local uint64_t cpp_script_allocation_count;
+extern thread_local uint64_t cpp_script_allocation_bytes;
+extern bool cpp_script_allocations_counted;
+
+// Tells stats.cc the counters are live. Its flag is constant-initialized,
+// so this runs after it whatever the order of static initialization.
+static const bool registered = (cpp_script_allocations_counted = true);
+
+static auto allocate(std::size_t size) -> void* {
+    cpp_script_allocation_count += 1;
+    cpp_script_allocation_bytes += size;
+    if (auto ptr = std::malloc(size != 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+static auto allocate(std::size_t size, std::align_val_t align) -> void* {
+    cpp_script_allocation_count += 1;
+    cpp_script_allocation_bytes += size;
+    auto alignment = static_cast<std::size_t>(align);
+    auto rounded = (size + alignment - 1) / alignment * alignment;
+    if (auto ptr = std::aligned_alloc(alignment, rounded != 0 ? rounded : alignment)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator new(std::size_t size) -> void* {
+    return allocate(size);
+}
+
+auto operator new[](std::size_t size) -> void* {
+    return allocate(size);
+}
+
+auto operator new(std::size_t size, std::align_val_t align) -> void* {
+    return allocate(size, align);
+}
+
+auto operator new[](std::size_t size, std::align_val_t align) -> void* {
+    return allocate(size, align);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
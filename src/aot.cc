@@ -0,0 +1,473 @@
+module;
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+#include <pwd.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+export module cpp_script:aot;
+import :ir;
+import :gc;
+import :vm;
+import :ast;
+
+// Translates bytecode into a C function. The operand stack depth is known
+// at every instruction, so stack slots become fixed elements of a local
+// array the C compiler is free to keep in registers. Jumps become gotos,
+// which needs the stack to be empty wherever control flow meets; the
+// compiler never leaves values on it across statements.
+class AotTranslator {
+public:
+    explicit AotTranslator(const Chunk& chunk) : chunk_(chunk) {}
+
+    auto translate() -> std::optional<std::string> {
+        const auto& code = chunk_.opcodes;
+        auto targets = std::vector<bool>(code.size() + 1, false);
+        for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+            if (isJump(code[ip])) {
+                auto target = getJumpTarget(code.data(), ip);
+                if (target > code.size()) {
+                    return std::nullopt;
+                }
+                targets[target] = true;
+            }
+        }
+
+        size_t ip = 0;
+        while (ip < code.size()) {
+            auto opcode = code[ip];
+            if (targets[ip]) {
+                if (depth_ != 0) {
+                    return std::nullopt;
+                }
+                line(label(static_cast<int>(ip)) + ": ;");
+            }
+            auto operands = std::span<const int>(code).subspan(ip + 1, getOperandCount(opcode));
+            if (!translateInstruction(static_cast<OpCode>(opcode), operands)) {
+                return std::nullopt;
+            }
+            ip += 1 + operands.size();
+        }
+        if (targets[code.size()]) {
+            line(label(static_cast<int>(code.size())) + ": ;");
+        }
+
+        auto source = std::string();
+        source += "/* Generated from '" + chunk_.name + "'. */\n";
+        source += "#include <stddef.h>\n";
+        source += "\n";
+        source += "struct cpp_script_native {\n";
+        source += "    int (*invoke)(void* callable, const int* args);\n";
+        source += "    void* callable;\n";
+        source += "    size_t arity;\n";
+        source += "};\n";
+        source += "\n";
+        source += "struct cpp_script_env {\n";
+        source += "    void* output;\n";
+        source += "    void (*print)(void* output, const int* values, int count);\n";
+        source += "    const struct cpp_script_native* natives;\n";
+        source += "};\n";
+        source += "\n";
+        source += "size_t cpp_script_entry(int* g, int* stack, const struct cpp_script_env* env) {\n";
+        source += "    int s[" + std::to_string(std::max<size_t>(max_depth_, 1)) + "];\n";
+        source += body_;
+        source += "    return 0;\n";
+        source += "}\n";
+        return source;
+    }
+
+private:
+    auto translateInstruction(OpCode opcode, std::span<const int> operands) -> bool {
+        auto arg = operands.empty() ? 0 : operands[0];
+        switch (opcode) {
+            case OP_HALT:
+                for (size_t i = 0; i < depth_; ++i) {
+                    line("stack[" + std::to_string(i) + "] = " + slot(i) + ";");
+                }
+                line("return " + std::to_string(depth_) + ";");
+                // Whatever follows is only reached by a jump.
+                depth_ = 0;
+                return true;
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+                line(slot(depth_) + " = g[" + std::to_string(arg) + "];");
+                return push(1);
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL:
+                if (!pop(1)) {
+                    return false;
+                }
+                line("g[" + std::to_string(arg) + "] = " + slot(depth_) + ";");
+                return true;
+            case OP_PUSH:
+                line(slot(depth_) + " = " + literal(arg) + ";");
+                return push(1);
+            case OP_ADD:
+                return binary("(int) ((unsigned) ", " + (unsigned) ", ")");
+            case OP_SUB:
+                return binary("(int) ((unsigned) ", " - (unsigned) ", ")");
+            case OP_MUL:
+                return binary("(int) ((unsigned) ", " * (unsigned) ", ")");
+            case OP_DIV:
+                return binary("", " / ", "");
+            case OP_NEG:
+                if (depth_ < 1) {
+                    return false;
+                }
+                line(slot(depth_ - 1) + " = (int) (0u - (unsigned) " + slot(depth_ - 1) + ");");
+                return true;
+            case OP_PRINT:
+                if (arg < 0 || !pop(static_cast<size_t>(arg))) {
+                    return false;
+                }
+                if (arg != 0) {
+                    line("env->print(env->output, &" + slot(depth_) + ", " + std::to_string(arg) + ");");
+                }
+                return true;
+            case OP_POP:
+                return pop(1);
+            case OP_CALL_NATIVE: {
+                if (!chunk_.natives || arg < 0 || static_cast<size_t>(arg) >= chunk_.natives->getFunctions().size()) {
+                    return false;
+                }
+                auto arity = chunk_.natives->getFunctions()[arg].arity;
+                if (!pop(arity)) {
+                    return false;
+                }
+                auto native = "env->natives[" + std::to_string(arg) + "]";
+                line(slot(depth_) + " = " + native + ".invoke(" + native + ".callable, &" + slot(depth_) + ");");
+                return push(1);
+            }
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            case OP_EQ:
+            case OP_NE:
+                return binary("", getOperator(opcode), "");
+            case OP_JUMP:
+                if (depth_ != 0) {
+                    return false;
+                }
+                line("goto " + label(arg) + ";");
+                return true;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                if (!pop(1) || depth_ != 0) {
+                    return false;
+                }
+                line(std::string("if (") + (opcode == OP_JUMP_IF_FALSE ? "!" : "") + slot(0) + ") goto " + label(arg) + ";");
+                return true;
+            case OP_JUMP_IF_LT:
+            case OP_JUMP_IF_LE:
+            case OP_JUMP_IF_GT:
+            case OP_JUMP_IF_GE:
+            case OP_JUMP_IF_EQ:
+            case OP_JUMP_IF_NE:
+                if (!pop(2) || depth_ != 0) {
+                    return false;
+                }
+                line("if (" + slot(0) + getOperator(getBranchComparison(opcode)) + slot(1) + ") goto " + label(arg) + ";");
+                return true;
+            case OP_JUMP_IF_LT_LOCAL_CONST:
+            case OP_JUMP_IF_LE_LOCAL_CONST:
+            case OP_JUMP_IF_GT_LOCAL_CONST:
+            case OP_JUMP_IF_GE_LOCAL_CONST:
+            case OP_JUMP_IF_EQ_LOCAL_CONST:
+            case OP_JUMP_IF_NE_LOCAL_CONST:
+                if (depth_ != 0) {
+                    return false;
+                }
+                line("if (g[" + std::to_string(arg) + "]" + getOperator(getBranchComparison(opcode)) + literal(operands[1]) + ") goto " + label(operands[2]) + ";");
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    auto binary(const std::string& prefix, const std::string& op, const std::string& suffix) -> bool {
+        if (!pop(1) || depth_ < 1) {
+            return false;
+        }
+        auto lhs = slot(depth_ - 1);
+        line(lhs + " = " + prefix + lhs + op + slot(depth_) + suffix + ";");
+        return true;
+    }
+
+    auto push(size_t count) -> bool {
+        depth_ += count;
+        max_depth_ = std::max(max_depth_, depth_);
+        return depth_ <= VM::kStackSize;
+    }
+
+    auto pop(size_t count) -> bool {
+        if (depth_ < count) {
+            return false;
+        }
+        depth_ -= count;
+        return true;
+    }
+
+    static auto getOperator(OpCode comparison) -> std::string {
+        switch (comparison) {
+            case OP_LT:
+                return " < ";
+            case OP_LE:
+                return " <= ";
+            case OP_GT:
+                return " > ";
+            case OP_GE:
+                return " >= ";
+            case OP_EQ:
+                return " == ";
+            default:
+                return " != ";
+        }
+    }
+
+    static auto label(int offset) -> std::string {
+        return "L" + std::to_string(offset);
+    }
+
+    static auto slot(size_t index) -> std::string {
+        return "s[" + std::to_string(index) + "]";
+    }
+
+    // INT_MIN has no literal of type int in C.
+    static auto literal(int value) -> std::string {
+        if (value == INT32_MIN) {
+            return "(-2147483647 - 1)";
+        }
+        return std::to_string(value);
+    }
+
+    void line(const std::string& statement) {
+        body_ += "    ";
+        body_ += statement;
+        body_ += "\n";
+    }
+
+private:
+    const Chunk& chunk_;
+    std::string body_;
+    size_t depth_ = 0;
+    size_t max_depth_ = 0;
+};
+
+// Returns the C translation of `chunk`, or nothing if it uses an instruction
+// the translator cannot express yet (calls into script functions), or
+// leaves values on the stack across a jump.
+export auto translateToC(const Chunk& chunk) -> std::optional<std::string> {
+    return AotTranslator(chunk).translate();
+}
+
+// Shared objects in the cache are loaded into the process, so it has to be
+// a directory only the current user can write to: compileAot() checks that
+// before using it. Without a home directory, the fallback under the temp
+// directory is per user.
+export auto getDefaultAotCacheDirectory() -> std::filesystem::path {
+    if (auto dir = getenv("CPP_SCRIPT_CACHE_DIR"); dir != nullptr && *dir != '\0') {
+        return dir;
+    }
+    if (auto dir = getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != '\0') {
+        return std::filesystem::path(dir) / "cpp_script";
+    }
+    if (auto dir = getenv("HOME"); dir != nullptr && *dir != '\0') {
+        return std::filesystem::path(dir) / ".cache" / "cpp_script";
+    }
+    if (auto user = getpwuid(geteuid()); user != nullptr && user->pw_dir != nullptr && *user->pw_dir != '\0') {
+        return std::filesystem::path(user->pw_dir) / ".cache" / "cpp_script";
+    }
+    return std::filesystem::temp_directory_path() / ("cpp_script-" + std::to_string(geteuid()));
+}
+
+export struct AotOptions {
+    std::string compiler = "cc";
+    std::string flags = "-O2";
+    std::filesystem::path cache_directory = getDefaultAotCacheDirectory();
+};
+
+// A chunk compiled to machine code and loaded into the process. The bytecode
+// chunk stays attached because the VM still takes the variable layout and
+// the native function table from it.
+export class AotModule : public ManagedObject {
+public:
+    AotModule(ManagedShared<Chunk> chunk, void* handle, CompiledEntry entry)
+        : chunk_(std::move(chunk)), handle_(handle), entry_(entry) {}
+
+    AotModule(const AotModule&) = delete;
+    auto operator=(const AotModule&) -> AotModule& = delete;
+
+    ~AotModule() override {
+        dlclose(handle_);
+    }
+
+    [[nodiscard]] auto getChunk() const -> const Chunk& {
+        return *chunk_;
+    }
+
+    [[nodiscard]] auto getEntry() const -> CompiledEntry {
+        return entry_;
+    }
+
+private:
+    const ManagedShared<Chunk> chunk_;
+    void* const handle_;
+    const CompiledEntry entry_;
+};
+
+auto hashAotInput(const std::string& source, const AotOptions& options) -> uint64_t {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const std::string& text) {
+        for (auto c : text) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        hash = (hash ^ 0xff) * 1099511628211ull;
+    };
+    mix(source);
+    mix(options.compiler);
+    mix(options.flags);
+    return hash;
+}
+
+auto quoteShellArgument(const std::string& argument) -> std::string {
+    auto quoted = std::string("'");
+    for (auto c : argument) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    quoted += "'";
+    return quoted;
+}
+
+// Creates `path` if needed and checks that it is a directory, not a
+// symlink, owned by the current user and not accessible to anyone else.
+auto prepareAotCacheDirectory(const std::filesystem::path& path) -> bool {
+    auto error = std::error_code();
+    if (path.has_parent_path()) {
+        std::filesystem::create_directories(path.parent_path(), error);
+    }
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create '%s': %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat info = {};
+    if (lstat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid()) {
+        fprintf(stderr, "AOT cache '%s' is not a directory owned by the current user\n", path.c_str());
+        return false;
+    }
+    if ((info.st_mode & 077) != 0) {
+        fprintf(stderr, "AOT cache '%s' is accessible to other users\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+auto readFile(const std::filesystem::path& path) -> std::optional<std::string> {
+    auto file = std::ifstream(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Translates `chunk` to C, builds it into a shared object with the system
+// compiler and loads it. Shared objects are cached in
+// `options.cache_directory` under a hash of the generated source, the
+// compiler and its flags, so a script is only compiled once per machine.
+// The source is kept next to each shared object, headed by the command
+// that built it, and a cached object is only loaded if that matches
+// exactly, so a hash collision costs a rebuild rather than running the
+// wrong code.
+// Returns null when the chunk cannot be translated, the cache directory is
+// unsafe or the compiler fails; the chunk can then still be run by the
+// interpreter.
+export auto compileAot(ManagedShared<Chunk> chunk, const AotOptions& options = {}) -> ManagedShared<AotModule> {
+    auto source = translateToC(*chunk);
+    if (!source.has_value()) {
+        return ManagedShared<AotModule>();
+    }
+    if (!prepareAotCacheDirectory(options.cache_directory)) {
+        return ManagedShared<AotModule>();
+    }
+
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hashAotInput(*source, options)));
+
+    auto error = std::error_code();
+    auto library = options.cache_directory / (std::string(name) + ".so");
+    auto library_source = options.cache_directory / (std::string(name) + ".c");
+    auto contents = "// " + options.compiler + " " + options.flags + "\n" + *source;
+
+    if (readFile(library_source) != contents || !std::filesystem::exists(library)) {
+        // Build under a per-process name and rename into place, so that
+        // processes racing on the same script never load a partial file.
+        // The object goes first: whoever sees the new source also sees it.
+        auto suffix = "." + std::to_string(getpid());
+        auto c_path = options.cache_directory / (std::string(name) + suffix + ".c");
+        auto tmp_path = options.cache_directory / (std::string(name) + suffix + ".so");
+        {
+            std::ofstream file(c_path, std::ios::binary | std::ios::trunc);
+            file << contents;
+            if (!file) {
+                fprintf(stderr, "Failed to write '%s'\n", c_path.c_str());
+                return ManagedShared<AotModule>();
+            }
+        }
+
+        auto command = options.compiler + " " + options.flags + " -shared -fPIC -o " + quoteShellArgument(tmp_path) + " " + quoteShellArgument(c_path);
+        auto status = std::system(command.c_str());
+        if (status != 0) {
+            fprintf(stderr, "AOT compilation of '%s' failed: %s\n", chunk->name.c_str(), command.c_str());
+            std::filesystem::remove(c_path, error);
+            std::filesystem::remove(tmp_path, error);
+            return ManagedShared<AotModule>();
+        }
+        std::filesystem::rename(tmp_path, library, error);
+        if (!error) {
+            std::filesystem::rename(c_path, library_source, error);
+        }
+        if (error) {
+            fprintf(stderr, "Failed to move '%s' into the cache: %s\n", tmp_path.c_str(), error.message().c_str());
+            std::filesystem::remove(c_path, error);
+            std::filesystem::remove(tmp_path, error);
+            return ManagedShared<AotModule>();
+        }
+    }
+
+    auto handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        fprintf(stderr, "Failed to load '%s': %s\n", library.c_str(), dlerror());
+        return ManagedShared<AotModule>();
+    }
+    auto entry = reinterpret_cast<CompiledEntry>(dlsym(handle, "cpp_script_entry"));
+    if (entry == nullptr) {
+        fprintf(stderr, "'%s' has no cpp_script_entry\n", library.c_str());
+        dlclose(handle);
+        return ManagedShared<AotModule>();
+    }
+    return ManagedShared(new AotModule(std::move(chunk), handle, entry));
+}
+
+// Same contract as execute(VM&, const Chunk&), but runs the native code.
+export auto execute(VM& vm, const AotModule& module) -> VMStatus {
+    vm.load(module.getChunk().getProgram());
+    return vm.run(module.getEntry());
+}
@@ -0,0 +1,156 @@
+module;
+
+#include <span>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+export module cpp_script:array;
+import :kernel;
+
+// Arrays live on the VM stack and in variable slots as int handles, like
+// strings. Handle 0 is the empty array, so a zeroed slot holds one; every
+// other handle is only valid in the VM that created it.
+
+// Arrays of ints a VM builds while it runs. Each array is one contiguous
+// run of unboxed ints whose length is fixed when it is created; elements
+// can be changed in place, and every handle to the array sees the change.
+// Everything is released at once by clear(), when the VM loads a program.
+// Handles are plain ints in untyped slots, so nothing can tell which arrays
+// a running script still reaches; instead the heap has a limit, and a
+// script that builds more than it allows fails like on any other error.
+export class ArrayHeap {
+public:
+    static constexpr size_t kDefaultLimit = size_t(256) * 1024 * 1024;
+
+    ArrayHeap() {
+        clear();
+    }
+
+    ArrayHeap(const ArrayHeap&) = delete;
+    auto operator=(const ArrayHeap&) -> ArrayHeap& = delete;
+
+    // Number of arrays built since the last clear(), the empty one included.
+    [[nodiscard]] auto size() const -> size_t {
+        return arrays_.size();
+    }
+
+    void clear() {
+        arrays_.clear();
+        arrays_.emplace_back();
+        used_bytes_ = 0;
+    }
+
+    // Bytes of elements all arrays built since the last clear() may take.
+    void setLimit(size_t bytes) {
+        limit_ = bytes;
+    }
+
+    [[nodiscard]] auto getLimit() const -> size_t {
+        return limit_;
+    }
+
+    [[nodiscard]] auto getUsedBytes() const -> size_t {
+        return used_bytes_;
+    }
+
+    // A new array of `length` zeros.
+    auto create(size_t length) -> int {
+        auto& array = add(length);
+        std::fill_n(array.data.get(), length, 0);
+        return getHandle();
+    }
+
+    // A new array holding a copy of `values`.
+    auto create(std::span<const int> values) -> int {
+        auto& array = add(values.size());
+        std::copy(values.begin(), values.end(), array.data.get());
+        return getHandle();
+    }
+
+    [[nodiscard]] auto isValid(int handle) const -> bool {
+        return handle >= 0 && static_cast<size_t>(handle) < arrays_.size();
+    }
+
+    [[nodiscard]] auto get(int handle) const -> std::span<int> {
+        auto& array = arrays_[static_cast<size_t>(handle)];
+        return std::span(array.data.get(), array.length);
+    }
+
+    [[nodiscard]] auto length(int handle) const -> size_t {
+        return arrays_[static_cast<size_t>(handle)].length;
+    }
+
+    // A new array of `op` applied to each pair of elements. An operand is
+    // either an array or, when its flag is set, a single int used for every
+    // element. Arrays have to be of the same length.
+    // Bad divisors are reported up front, since the AVX2 kernel would not
+    // trap on them.
+    auto apply(BatchOp op, int lhs, bool lhs_scalar, int rhs, bool rhs_scalar) -> int {
+        auto count = lhs_scalar ? length(rhs) : length(lhs);
+        if (!lhs_scalar && !rhs_scalar && length(rhs) != count) {
+            fprintf(stderr, "Arrays of %zu and %zu elements cannot be combined\n", count, length(rhs));
+            abort();
+        }
+        if (op == BatchOp::Div) {
+            checkDivision(getOperand(lhs, lhs_scalar), getOperand(rhs, rhs_scalar), count);
+        }
+        auto& array = add(count);
+        applyKernel(op, getOperand(lhs, lhs_scalar), getOperand(rhs, rhs_scalar), array.data.get(), count);
+        return getHandle();
+    }
+
+    [[nodiscard]] auto sum(int handle) const -> int {
+        auto values = get(handle);
+        return sumKernel(values.data(), values.size());
+    }
+
+    [[nodiscard]] auto dot(int lhs, int rhs) const -> int {
+        auto a = get(lhs);
+        auto b = get(rhs);
+        if (a.size() != b.size()) {
+            fprintf(stderr, "Arrays of %zu and %zu elements have no dot product\n", a.size(), b.size());
+            abort();
+        }
+        return dotKernel(a.data(), b.data(), a.size());
+    }
+
+private:
+    struct Array {
+        std::unique_ptr<int[]> data;
+        size_t length = 0;
+    };
+
+    auto add(size_t length) -> Array& {
+        if (arrays_.size() > INT32_MAX) {
+            fprintf(stderr, "Too many arrays\n");
+            abort();
+        }
+        if (length > (limit_ - used_bytes_) / sizeof(int)) {
+            fprintf(stderr, "Arrays take more than the limit of %zu bytes\n", limit_);
+            abort();
+        }
+        used_bytes_ += length * sizeof(int);
+        auto& array = arrays_.emplace_back();
+        array.data = std::make_unique_for_overwrite<int[]>(length);
+        array.length = length;
+        return array;
+    }
+
+    [[nodiscard]] auto getHandle() const -> int {
+        return static_cast<int>(arrays_.size() - 1);
+    }
+
+    // A scalar operand points at its value, which lives in the caller.
+    auto getOperand(const int& value, bool scalar) const -> BatchOperand<int> {
+        return scalar ? BatchOperand<int>{&value, true} : BatchOperand<int>{arrays_[static_cast<size_t>(value)].data.get(), false};
+    }
+
+private:
+    std::vector<Array> arrays_;
+    size_t limit_ = kDefaultLimit;
+    size_t used_bytes_ = 0;
+};
@@ -6,21 +6,71 @@ module;
 
 #include <map>
 #include <list>
+#include <memory>
 #include <array>
 #include <string>
+#include <span>
 #include <vector>
+#include <mutex>
+#include <set>
+#include <deque>
 #include <charconv>
+#include <iterator>
+#include <algorithm>
+#include <optional>
 #include <string_view>
+#include <unordered_map>
 
 export module cpp_script:ast;
 import :ir;
 import :gc;
 import :token;
+import :stats;
+import :output;
+import :pool;
+import :vm;
+import :native;
 import :variant;
+import :ssa;
+import :string;
+import :kernel;
+import :memo;
+
+// Static type of a value. At run time every value is an int; a string is a
+// handle the VM's StringHeap resolves, an array one its ArrayHeap does.
+export enum class ValueType {
+    Int,
+    String,
+    Array,
+};
+
+export constexpr auto getTypeName(ValueType type) -> const char* {
+    switch (type) {
+        case ValueType::Int:
+            return "int";
+        case ValueType::String:
+            return "string";
+        case ValueType::Array:
+            return "array";
+    }
+    return "?";
+}
 
 export class Expression : public ManagedObject {};
 
-export class Statement : public ManagedObject {};
+export class Statement : public ManagedObject {
+public:
+    [[nodiscard]] auto getLine() const -> uint32_t {
+        return line_;
+    }
+
+    void setLine(uint32_t line) {
+        line_ = line;
+    }
+
+private:
+    uint32_t line_ = 0;
+};
 
 export class ConstExpression : public Expression {
 public:
@@ -34,6 +84,51 @@ private:
     int value_;
 };
 
+// `"text"`. There are no escapes; the text is everything between the quotes.
+export class StringExpression : public Expression {
+public:
+    explicit StringExpression(std::string value) : value_(std::move(value)) {}
+
+    [[nodiscard]] auto getValue() const -> const std::string& {
+        return value_;
+    }
+
+private:
+    std::string value_;
+};
+
+// `[a, b, c]`, an array of ints.
+export class ArrayExpression : public Expression {
+public:
+    explicit ArrayExpression(std::vector<ManagedShared<Expression>> elements) : elements_(std::move(elements)) {}
+
+    [[nodiscard]] auto getElements() const -> const std::vector<ManagedShared<Expression>>& {
+        return elements_;
+    }
+
+private:
+    std::vector<ManagedShared<Expression>> elements_;
+};
+
+// `array[index]`, which can also be assigned to.
+export class IndexExpression : public Expression {
+public:
+    explicit IndexExpression(ManagedShared<Expression> array, ManagedShared<Expression> index)
+        : array_(std::move(array)), index_(std::move(index)) {}
+
+    [[nodiscard]] auto getArray() const -> const ManagedShared<Expression>& {
+        return array_;
+    }
+
+    [[nodiscard]] auto getIndex() const -> const ManagedShared<Expression>& {
+        return index_;
+    }
+
+private:
+    ManagedShared<Expression> array_;
+    ManagedShared<Expression> index_;
+};
+
 export class VariableExpression : public Expression {
 public:
     explicit VariableExpression(std::string name) : name_(std::move(name)) {}
@@ -185,6 +280,31 @@ private:
     std::vector<ManagedShared<Expression>> args_;
 };
 
+// `lhs < rhs` and the other comparisons, told apart by the OP_LT...OP_NE
+// opcode that computes them.
+export class ComparisonExpression : public Expression {
+public:
+    explicit ComparisonExpression(OpCode comparison, ManagedShared<Expression> lhs, ManagedShared<Expression> rhs)
+        : comparison_(comparison), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
+
+    [[nodiscard]] auto getComparison() const -> OpCode {
+        return comparison_;
+    }
+
+    [[nodiscard]] auto getLhs() const -> const ManagedShared<Expression>& {
+        return lhs_;
+    }
+
+    [[nodiscard]] auto getRhs() const -> const ManagedShared<Expression>& {
+        return rhs_;
+    }
+
+private:
+    OpCode comparison_;
+    ManagedShared<Expression> lhs_;
+    ManagedShared<Expression> rhs_;
+};
+
 export class ExpressionStatement : public Statement {
 public:
     explicit ExpressionStatement(ManagedShared<Expression> expr) : expr_(std::move(expr)) {}
@@ -209,6 +329,9 @@ private:
     ManagedShared<Expression> expr_;
 };
 
+// `yield;` suspends the script until the host runs it again.
+export class YieldStatement : public Statement {};
+
 export class VariableDeclarationStatement : public Statement {
 public:
     explicit VariableDeclarationStatement(std::string name, ManagedShared<Expression> initializer)
@@ -227,10 +350,131 @@ private:
     ManagedShared<Expression> initializer_;
 };
 
+// Statements in braces. Variables declared in a block go out of scope at
+// its end.
+export class BlockStatement : public Statement {
+public:
+    explicit BlockStatement(std::vector<ManagedShared<Statement>> statements) : statements_(std::move(statements)) {}
+
+    [[nodiscard]] auto getStatements() const -> const std::vector<ManagedShared<Statement>>& {
+        return statements_;
+    }
+
+private:
+    std::vector<ManagedShared<Statement>> statements_;
+};
+
+export class IfStatement : public Statement {
+public:
+    explicit IfStatement(ManagedShared<Expression> condition, ManagedShared<Statement> then_branch, ManagedShared<Statement> else_branch)
+        : condition_(std::move(condition)), then_branch_(std::move(then_branch)), else_branch_(std::move(else_branch)) {}
+
+    [[nodiscard]] auto getCondition() const -> const ManagedShared<Expression>& {
+        return condition_;
+    }
+
+    [[nodiscard]] auto getThenBranch() const -> const ManagedShared<Statement>& {
+        return then_branch_;
+    }
+
+    // Null without an `else`.
+    [[nodiscard]] auto getElseBranch() const -> const ManagedShared<Statement>& {
+        return else_branch_;
+    }
+
+private:
+    ManagedShared<Expression> condition_;
+    ManagedShared<Statement> then_branch_;
+    ManagedShared<Statement> else_branch_;
+};
+
+export class WhileStatement : public Statement {
+public:
+    explicit WhileStatement(ManagedShared<Expression> condition, ManagedShared<Statement> body)
+        : condition_(std::move(condition)), body_(std::move(body)) {}
+
+    [[nodiscard]] auto getCondition() const -> const ManagedShared<Expression>& {
+        return condition_;
+    }
+
+    [[nodiscard]] auto getBody() const -> const ManagedShared<Statement>& {
+        return body_;
+    }
+
+private:
+    ManagedShared<Expression> condition_;
+    ManagedShared<Statement> body_;
+};
+
+// `for (initializer; condition; step) body`. Each of the three clauses may
+// be missing, in which case its getter returns null; a missing condition
+// always holds. The initializer is a declaration or an expression
+// statement, scoped to the loop.
+export class ForStatement : public Statement {
+public:
+    explicit ForStatement(ManagedShared<Statement> initializer, ManagedShared<Expression> condition, ManagedShared<Expression> step, ManagedShared<Statement> body)
+        : initializer_(std::move(initializer)), condition_(std::move(condition)), step_(std::move(step)), body_(std::move(body)) {}
+
+    [[nodiscard]] auto getInitializer() const -> const ManagedShared<Statement>& {
+        return initializer_;
+    }
+
+    [[nodiscard]] auto getCondition() const -> const ManagedShared<Expression>& {
+        return condition_;
+    }
+
+    [[nodiscard]] auto getStep() const -> const ManagedShared<Expression>& {
+        return step_;
+    }
+
+    [[nodiscard]] auto getBody() const -> const ManagedShared<Statement>& {
+        return body_;
+    }
+
+private:
+    ManagedShared<Statement> initializer_;
+    ManagedShared<Expression> condition_;
+    ManagedShared<Expression> step_;
+    ManagedShared<Statement> body_;
+};
+
+// Function body kept by the parser instead of statements: the text between
+// its braces is text[begin, end). Every body of a parse points into the
+// same copy of the script, so they stay valid after the source is gone
+// without each holding text of its own. `line` and `column` are where the
+// body starts in the script. Not a ManagedObject, so that the copy does not
+// count as an AST node.
+export struct DeferredBody {
+    std::shared_ptr<const std::string> text;
+    size_t begin = 0;
+    size_t end = 0;
+    uint32_t line = 1;
+    uint32_t column = 1;
+};
+
+// Declared types of a function's parameters and result. `string` is a
+// string, `array` an array, `auto` and every other type name an int.
+export struct FunctionTypes {
+    std::vector<ValueType> args;
+    ValueType result = ValueType::Int;
+};
+
+// Whether calls to a function go through the VM's memo cache, as set by a
+// `[[memoize]]` or `[[memoize(false)]]` after its parameters. Without one,
+// the compiler decides.
+export enum class MemoizeMode {
+    Auto,
+    Always,
+    Never,
+};
+
 export class FunctionDeclarationStatement : public Statement {
 public:
-    explicit FunctionDeclarationStatement(std::string name, std::vector<std::string> args, std::vector<ManagedShared<Statement>> body)
-        : name_(std::move(name)), args_(std::move(args)), body_(std::move(body)) {}
+    explicit FunctionDeclarationStatement(std::string name, std::vector<std::string> args, std::vector<ManagedShared<Statement>> body, FunctionTypes types = {}, MemoizeMode memoize = MemoizeMode::Auto)
+        : name_(std::move(name)), args_(std::move(args)), types_(std::move(types)), memoize_(memoize), body_(std::move(body)) {}
+
+    explicit FunctionDeclarationStatement(std::string name, std::vector<std::string> args, DeferredBody body, FunctionTypes types = {}, MemoizeMode memoize = MemoizeMode::Auto)
+        : name_(std::move(name)), args_(std::move(args)), types_(std::move(types)), memoize_(memoize), deferred_(std::move(body)) {}
 
     [[nodiscard]] auto getName() const -> std::string {
         return name_;
@@ -240,14 +484,38 @@ public:
         return args_;
     }
 
-    [[nodiscard]] auto getBody() const -> const std::vector<ManagedShared<Statement>>& {
-        return body_;
+    [[nodiscard]] auto getArgType(size_t index) const -> ValueType {
+        return index < types_.args.size() ? types_.args[index] : ValueType::Int;
+    }
+
+    [[nodiscard]] auto getResultType() const -> ValueType {
+        return types_.result;
+    }
+
+    [[nodiscard]] auto getMemoizeMode() const -> MemoizeMode {
+        return memoize_;
+    }
+
+    // Statements of the body, parsed anew from its text every time when the
+    // parser deferred it. FunctionLibrary::getBody() parses it once.
+    [[nodiscard]] auto parseBody() const -> std::vector<ManagedShared<Statement>>;
+
+    // Text of the body between its braces, when the parser deferred it.
+    [[nodiscard]] auto getSource() const -> std::optional<std::string_view> {
+        if (deferred_.text == nullptr) {
+            return std::nullopt;
+        }
+        return std::string_view(*deferred_.text).substr(deferred_.begin, deferred_.end - deferred_.begin);
     }
 
 private:
     std::string name_;
     std::vector<std::string> args_;
-    std::vector<ManagedShared<Statement>> body_;
+    FunctionTypes types_;
+    MemoizeMode memoize_;
+    const std::vector<ManagedShared<Statement>> body_;
+    // Kept after the body is parsed, so reloads can tell whether it changed.
+    const DeferredBody deferred_;
 };
 
 static auto parseInteger(std::string_view str) -> int {
@@ -256,11 +524,31 @@ static auto parseInteger(std::string_view str) -> int {
     return result;
 }
 
-auto parseStatement(TokenStream& stream) -> ManagedShared<Statement>;
-auto parseStatements(TokenStream& stream) -> std::vector<ManagedShared<Statement>>;
+// Text a parse reads, the part of the script that tokens point into. It is
+// copied the first time a function body is deferred, and every later body
+// of the parse refers into the same copy.
+struct ParsedSource {
+    explicit ParsedSource(std::string_view source, std::shared_ptr<const std::string> text = nullptr)
+        : source(source), text(std::move(text)) {}
+
+    std::string_view source;
+    std::shared_ptr<const std::string> text;
+
+    auto getText() -> const std::shared_ptr<const std::string>& {
+        if (text == nullptr) {
+            text = std::make_shared<const std::string>(source);
+        }
+        return text;
+    }
+};
+
+auto parseStatement(TokenStream& stream, ParsedSource& source) -> ManagedShared<Statement>;
+auto parseStatements(TokenStream& stream, ParsedSource& source) -> std::vector<ManagedShared<Statement>>;
 auto parsePrimaryExpression(TokenStream& stream) -> ManagedShared<Expression>;
 auto parseExpression(TokenStream& stream) -> ManagedShared<Expression>;
 auto parseAssignment(TokenStream& stream) -> ManagedShared<Expression>;
+auto parseEquality(TokenStream& stream) -> ManagedShared<Expression>;
+auto parseRelational(TokenStream& stream) -> ManagedShared<Expression>;
 auto parseArithmetic(TokenStream& stream) -> ManagedShared<Expression>;
 auto parseMultiplication(TokenStream& stream) -> ManagedShared<Expression>;
 auto parsePrefixExpression(TokenStream& stream) -> ManagedShared<Expression>;
@@ -271,15 +559,64 @@ auto parseExpression(TokenStream& stream) -> ManagedShared<Expression> {
 }
 
 auto parseAssignment(TokenStream& stream) -> ManagedShared<Expression> {
-    auto lhs = parseArithmetic(stream);
+    auto lhs = parseEquality(stream);
     if (stream.peekToken().type == TOKEN_EQUAL) {
         stream.readToken();
-        auto rhs = parseArithmetic(stream);
+        auto rhs = parseEquality(stream);
         return ManagedShared(new AssignExpression(lhs, rhs));
     }
     return lhs;
 }
 
+auto parseEquality(TokenStream& stream) -> ManagedShared<Expression> {
+    auto lhs = parseRelational(stream);
+    while (true) {
+        switch (stream.peekToken().type) {
+            case TOKEN_EQUAL_EQUAL: {
+                stream.readToken();
+                auto rhs = parseRelational(stream);
+                lhs = ManagedShared(new ComparisonExpression(OP_EQ, lhs, rhs));
+                break;
+            }
+            case TOKEN_BANG_EQUAL: {
+                stream.readToken();
+                auto rhs = parseRelational(stream);
+                lhs = ManagedShared(new ComparisonExpression(OP_NE, lhs, rhs));
+                break;
+            }
+            default: {
+                return lhs;
+            }
+        }
+    }
+}
+
+auto parseRelational(TokenStream& stream) -> ManagedShared<Expression> {
+    auto lhs = parseArithmetic(stream);
+    while (true) {
+        OpCode comparison;
+        switch (stream.peekToken().type) {
+            case TOKEN_LESS:
+                comparison = OP_LT;
+                break;
+            case TOKEN_LESS_EQUAL:
+                comparison = OP_LE;
+                break;
+            case TOKEN_GREATER:
+                comparison = OP_GT;
+                break;
+            case TOKEN_GREATER_EQUAL:
+                comparison = OP_GE;
+                break;
+            default:
+                return lhs;
+        }
+        stream.readToken();
+        auto rhs = parseArithmetic(stream);
+        lhs = ManagedShared(new ComparisonExpression(comparison, lhs, rhs));
+    }
+}
+
 auto parseArithmetic(TokenStream& stream) -> ManagedShared<Expression> {
     auto lhs = parseMultiplication(stream);
     while (stream.peekToken().type != TOKEN_EOF) {
@@ -363,6 +700,17 @@ auto parsePostfixExpression(TokenStream& stream) -> ManagedShared<Expression> {
             lhs = ManagedShared(new CallExpression(lhs, args));
             continue;
         }
+        if (stream.peekToken().type == TOKEN_LEFT_SQUARE) {
+            stream.readToken();
+            auto index = parseExpression(stream);
+            if (stream.peekToken().type != TOKEN_RIGHT_SQUARE) {
+                std::fprintf(stderr, "Expected ']'\n");
+                abort();
+            }
+            stream.readToken();
+            lhs = ManagedShared(new IndexExpression(lhs, index));
+            continue;
+        }
         break;
     }
     return lhs;
@@ -384,6 +732,28 @@ auto parsePrimaryExpression(TokenStream& stream) -> ManagedShared<Expression> {
         stream.readToken();
         return ManagedShared(new ConstExpression(number));
     }
+    if (stream.peekToken().type == TOKEN_LEFT_SQUARE) {
+        stream.readToken();
+        std::vector<ManagedShared<Expression>> elements;
+        if (stream.peekToken().type != TOKEN_RIGHT_SQUARE) {
+            elements.push_back(parseExpression(stream));
+            while (stream.peekToken().type == TOKEN_COMMA) {
+                stream.readToken();
+                elements.push_back(parseExpression(stream));
+            }
+            if (stream.peekToken().type != TOKEN_RIGHT_SQUARE) {
+                std::fprintf(stderr, "Expected ']'\n");
+                abort();
+            }
+        }
+        stream.readToken();
+        return ManagedShared(new ArrayExpression(std::move(elements)));
+    }
+    if (stream.peekToken().type == TOKEN_STRING_LITERAL) {
+        auto text = stream.peekToken().str;
+        stream.readToken();
+        return ManagedShared(new StringExpression(std::string(text)));
+    }
     if (stream.peekToken().type == TOKEN_IDENTIFIER) {
         auto variable = stream.peekToken().str;
         stream.readToken();
@@ -407,6 +777,51 @@ auto parseTypename(TokenStream& stream) -> std::string {
     abort();
 }
 
+auto getValueType(std::string_view type_name) -> ValueType {
+    if (type_name == "string") {
+        return ValueType::String;
+    }
+    if (type_name == "array") {
+        return ValueType::Array;
+    }
+    return ValueType::Int;
+}
+
+// `[[memoize]]` or `[[memoize(false)]]`, if the next token starts one.
+auto parseMemoizeMode(TokenStream& stream) -> MemoizeMode {
+    auto expect = [&](TokenType type, const char* text) {
+        if (stream.peekToken().type != type) {
+            std::fprintf(stderr, "Expected '%s'\n", text);
+            abort();
+        }
+        stream.readToken();
+    };
+    if (stream.peekToken().type != TOKEN_LEFT_SQUARE) {
+        return MemoizeMode::Auto;
+    }
+    stream.readToken();
+    expect(TOKEN_LEFT_SQUARE, "[");
+    if (stream.peekToken().type != TOKEN_IDENTIFIER || stream.peekToken().str != "memoize") {
+        std::fprintf(stderr, "Unknown annotation '%.*s'\n", (int) stream.peekToken().str.size(), stream.peekToken().str.data());
+        abort();
+    }
+    stream.readToken();
+    auto mode = MemoizeMode::Always;
+    if (stream.peekToken().type == TOKEN_LEFT_PAREN) {
+        stream.readToken();
+        if (stream.peekToken().type != TOKEN_TRUE_LITERAL && stream.peekToken().type != TOKEN_FALSE_LITERAL) {
+            std::fprintf(stderr, "Expected 'true' or 'false'\n");
+            abort();
+        }
+        mode = stream.peekToken().type == TOKEN_TRUE_LITERAL ? MemoizeMode::Always : MemoizeMode::Never;
+        stream.readToken();
+        expect(TOKEN_RIGHT_PAREN, ")");
+    }
+    expect(TOKEN_RIGHT_SQUARE, "]");
+    expect(TOKEN_RIGHT_SQUARE, "]");
+    return mode;
+}
+
 auto parseIdentifier(TokenStream& stream) -> std::string {
     if (stream.peekToken().type == TOKEN_IDENTIFIER) {
         auto name = std::string(stream.peekToken().str);
@@ -417,7 +832,89 @@ auto parseIdentifier(TokenStream& stream) -> std::string {
     abort();
 }
 
-auto parseStatement(TokenStream& stream) -> ManagedShared<Statement> {
+void expectToken(TokenStream& stream, TokenType type, const char* text) {
+    if (stream.peekToken().type != type) {
+        std::fprintf(stderr, "Expected '%s'\n", text);
+        abort();
+    }
+    stream.readToken();
+}
+
+// `(condition)` of an if or a while.
+auto parseCondition(TokenStream& stream) -> ManagedShared<Expression> {
+    expectToken(stream, TOKEN_LEFT_PAREN, "(");
+    auto condition = parseExpression(stream);
+    expectToken(stream, TOKEN_RIGHT_PAREN, ")");
+    return condition;
+}
+
+auto parseBareStatement(TokenStream& stream, ParsedSource& source) -> ManagedShared<Statement> {
+    if (stream.peekToken().type == TOKEN_LEFT_CURLY) {
+        stream.readToken();
+        std::vector<ManagedShared<Statement>> statements;
+        while (stream.peekToken().type != TOKEN_RIGHT_CURLY) {
+            if (stream.peekToken().type == TOKEN_EOF) {
+                std::fprintf(stderr, "Expected '}'\n");
+                abort();
+            }
+            statements.emplace_back(parseStatement(stream, source));
+        }
+        stream.readToken();
+        return ManagedShared(new BlockStatement(std::move(statements)));
+    }
+
+    if (stream.peekToken().type == TOKEN_KEYWORD_IF) {
+        stream.readToken();
+        auto condition = parseCondition(stream);
+        auto then_branch = parseStatement(stream, source);
+        auto else_branch = ManagedShared<Statement>();
+        if (stream.peekToken().type == TOKEN_KEYWORD_ELSE) {
+            stream.readToken();
+            else_branch = parseStatement(stream, source);
+        }
+        return ManagedShared(new IfStatement(condition, then_branch, else_branch));
+    }
+
+    if (stream.peekToken().type == TOKEN_KEYWORD_WHILE) {
+        stream.readToken();
+        auto condition = parseCondition(stream);
+        auto body = parseStatement(stream, source);
+        return ManagedShared(new WhileStatement(condition, body));
+    }
+
+    if (stream.peekToken().type == TOKEN_KEYWORD_FOR) {
+        stream.readToken();
+        expectToken(stream, TOKEN_LEFT_PAREN, "(");
+        auto initializer = ManagedShared<Statement>();
+        if (stream.peekToken().type == TOKEN_SEMICOLON) {
+            stream.readToken();
+        } else {
+            initializer = parseStatement(stream, source);
+            if (!dynamic_cast<VariableDeclarationStatement*>(initializer.get()) && !dynamic_cast<ExpressionStatement*>(initializer.get())) {
+                std::fprintf(stderr, "Expected a declaration or an expression in a for initializer\n");
+                abort();
+            }
+        }
+        auto condition = ManagedShared<Expression>();
+        if (stream.peekToken().type != TOKEN_SEMICOLON) {
+            condition = parseExpression(stream);
+        }
+        expectToken(stream, TOKEN_SEMICOLON, ";");
+        auto step = ManagedShared<Expression>();
+        if (stream.peekToken().type != TOKEN_RIGHT_PAREN) {
+            step = parseExpression(stream);
+        }
+        expectToken(stream, TOKEN_RIGHT_PAREN, ")");
+        auto body = parseStatement(stream, source);
+        return ManagedShared(new ForStatement(initializer, condition, step, body));
+    }
+
+    if (stream.peekToken().type == TOKEN_KEYWORD_YIELD) {
+        stream.readToken();
+        expectToken(stream, TOKEN_SEMICOLON, ";");
+        return ManagedShared(new YieldStatement());
+    }
+
     if (stream.peekToken().type == TOKEN_KEYWORD_AUTO) {
         stream.readToken();
 
@@ -448,11 +945,13 @@ auto parseStatement(TokenStream& stream) -> ManagedShared<Statement> {
             stream.readToken();
 
             std::vector<std::string> args;
+            FunctionTypes types;
             if (stream.peekToken().type != TOKEN_RIGHT_PAREN) {
                 while (true) {
                     auto arg_type = parseTypename(stream);
                     auto arg_name = parseIdentifier(stream);
                     args.emplace_back(arg_name);
+                    types.args.emplace_back(getValueType(arg_type));
 
                     if (stream.peekToken().type != TOKEN_COMMA) {
                         break;
@@ -468,25 +967,49 @@ auto parseStatement(TokenStream& stream) -> ManagedShared<Statement> {
             }
             stream.readToken();
 
+            auto memoize = parseMemoizeMode(stream);
+
             if (stream.peekToken().type == TOKEN_ARROW) {
                 stream.readToken();
 
                 auto return_type = parseTypename(stream);
+                types.result = getValueType(return_type);
             }
 
             if (stream.peekToken().type != TOKEN_LEFT_CURLY) {
                 std::fprintf(stderr, "Expected '{'\n");
                 abort();
             }
+            auto open = stream.peekToken();
             stream.readToken();
 
-            std::vector<ManagedShared<Statement>> statements;
-            while (stream.peekToken().type != TOKEN_RIGHT_CURLY) {
-                statements.emplace_back(parseStatement(stream));
+            // Most functions of a library are never called, so the body is
+            // only skipped over here and parsed on the first call.
+            size_t depth = 1;
+            while (true) {
+                auto type = stream.peekToken().type;
+                if (type == TOKEN_EOF) {
+                    std::fprintf(stderr, "Expected '}'\n");
+                    abort();
+                }
+                if (type == TOKEN_LEFT_CURLY) {
+                    depth += 1;
+                } else if (type == TOKEN_RIGHT_CURLY && --depth == 0) {
+                    break;
+                }
+                stream.readToken();
             }
+            auto close = stream.peekToken();
             stream.readToken();
 
-            return ManagedShared(new FunctionDeclarationStatement(std::string(name), args, statements));
+            auto body = DeferredBody{
+                .text = source.getText(),
+                .begin = static_cast<size_t>(open.str.data() + 1 - source.source.data()),
+                .end = static_cast<size_t>(close.str.data() - source.source.data()),
+                .line = open.line,
+                .column = open.column + 1,
+            };
+            return ManagedShared(new FunctionDeclarationStatement(std::string(name), args, std::move(body), std::move(types), memoize));
         }
 
         fprintf(stderr, "declaration of variable '%.*s' with deduced type 'auto' requires an initializer", (int) name.size(), name.data());
@@ -520,48 +1043,356 @@ auto parseStatement(TokenStream& stream) -> ManagedShared<Statement> {
     return ManagedShared(new ExpressionStatement(e));
 }
 
-auto parseStatements(TokenStream& stream) -> std::vector<ManagedShared<Statement>> {
+auto parseStatement(TokenStream& stream, ParsedSource& source) -> ManagedShared<Statement> {
+    auto line = stream.peekToken().line;
+    auto statement = parseBareStatement(stream, source);
+    statement->setLine(line);
+    return statement;
+}
+
+auto parseStatements(TokenStream& stream, ParsedSource& source) -> std::vector<ManagedShared<Statement>> {
     std::vector<ManagedShared<Statement>> statements;
     while (stream.peekToken().type != TOKEN_EOF) {
-        statements.emplace_back(parseStatement(stream));
+        statements.emplace_back(parseStatement(stream, source));
     }
     return statements;
 }
 
-class Chunk : public ManagedObject {
-public:
-    ManagedShared<Chunk> parent;
-    std::vector<int> opcodes;
-    std::map<std::string, int> variables;
-    std::map<std::string, ManagedShared<Chunk>> functions;
+auto FunctionDeclarationStatement::parseBody() const -> std::vector<ManagedShared<Statement>> {
+    if (deferred_.text == nullptr) {
+        return body_;
+    }
+    // The copied text need not start at a line start. Putting the start of
+    // the body's line `column - 1` characters before it (modulo 2^64) gives
+    // the tokens the same columns as in the script.
+    auto source = ParsedSource(*deferred_.text, deferred_.text);
+    auto stream = TokenStream(source.source.substr(0, deferred_.end), deferred_.begin, deferred_.line, deferred_.begin - (deferred_.column - 1));
+    stream.readToken();
+    return parseStatements(stream, source);
+}
 
-    auto getVariable(const std::string& name) -> int {
-        if (auto it = variables.find(name); it != variables.end()) {
-            return it->second;
-        }
-        if (parent.get() != nullptr) {
-            return parent->getVariable(name);
+export class Chunk;
+
+export struct CompileOptions {
+    // Largest function body, counted in AST nodes, that is inlined at its
+    // call sites. 0 disables inlining.
+    size_t inline_budget = 32;
+    bool fold_constants = true;
+    // Rewrite each chunk through SSA form: common subexpression elimination,
+    // copy propagation and dead store elimination.
+    bool optimize = true;
+    // Memoize pure functions that loop or recurse, or call functions that
+    // do, unless they are annotated otherwise. Cheaper ones run about as fast
+    // as a lookup in the memo cache, and are better inlined.
+    bool memoize = true;
+};
+
+// Inlining binds parameters and locals to borrowed slots and constants, and
+// the memo cache keys calls by their arguments, which are all ints.
+static auto hasIntSignature(const FunctionDeclarationStatement& declaration) -> bool {
+    for (size_t i = 0; i < declaration.getArgs().size(); ++i) {
+        if (declaration.getArgType(i) != ValueType::Int) {
+            return false;
         }
-        fprintf(stderr, "Unknown variable '%s'\n", name.c_str());
-        abort();
     }
-};
+    return declaration.getResultType() == ValueType::Int;
+}
 
-class ASTVisitor {
+// Functions declared by a script. Declaring a function only registers its
+// name and parameters; the body is parsed and compiled by the first CALL
+// that reaches it, or by compileAll(), so a function that is never called
+// costs little more than skipping over its text. Function bodies see all
+// of the script's variables and functions.
+export class FunctionLibrary : public FunctionTable {
 public:
-    ManagedShared<Chunk> chunk;
+    explicit FunctionLibrary(const Chunk& script, CompileOptions options) : script_(script), options_(options) {}
+    ~FunctionLibrary() override;
 
-    ASTVisitor() {
-        chunk = ManagedShared(new Chunk());
+    // Options the script was compiled with, which its functions use too.
+    [[nodiscard]] auto getOptions() const -> const CompileOptions& {
+        return options_;
     }
 
-    void accept(Statement* statement) {
-        if (auto stmt = dynamic_cast<ExpressionStatement*>(statement)) {
-            visitExpressionStatement(stmt);
-            return;
+    auto declare(ManagedShared<FunctionDeclarationStatement> declaration) -> size_t {
+        auto name = declaration->getName();
+        if (indices_.contains(name)) {
+            fprintf(stderr, "Redefinition of function '%s'\n", name.c_str());
+            abort();
         }
-        if (auto stmt = dynamic_cast<VariableDeclarationStatement*>(statement)) {
-            visitVariableDeclarationStatement(stmt);
+        auto& entry = entries_.emplace_back();
+        entry.declaration = std::move(declaration);
+        indices_.emplace(std::move(name), entries_.size() - 1);
+        return addTarget();
+    }
+
+    [[nodiscard]] auto find(const std::string& name) const -> std::optional<size_t> {
+        if (auto it = indices_.find(name); it != indices_.end()) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto getDeclaration(size_t index) const -> const FunctionDeclarationStatement& {
+        return *entries_[index].declaration;
+    }
+
+    // Statements of function `index`, parsed the first time they are asked
+    // for. Safe to call from several threads.
+    [[nodiscard]] auto getBody(size_t index) -> const std::vector<ManagedShared<Statement>>& {
+        std::lock_guard lock(bodies_mutex_);
+        auto& entry = entries_[index];
+        if (!entry.parsed) {
+            entry.body = entry.declaration->parseBody();
+            entry.parsed = true;
+        }
+        return entry.body;
+    }
+
+    // Compiled code of function `index`, compiling it if it has not been
+    // called yet.
+    [[nodiscard]] auto getChunk(size_t index) -> const Chunk& {
+        get(index);
+        return *entries_[index].chunk;
+    }
+
+    void compileAll() {
+        for (size_t i = 0; i < size(); ++i) {
+            get(i);
+        }
+    }
+
+    // Code of function `index` if it was compiled, without compiling it.
+    [[nodiscard]] auto getCompiledChunk(size_t index) const -> ManagedShared<Chunk> {
+        return isCompiled(index) ? entries_[index].chunk : ManagedShared<Chunk>();
+    }
+
+    // Makes function `index` use `chunk`, compiled earlier for the same
+    // declaration, instead of compiling it. `line_delta` is how many lines
+    // the declaration moved since, which only its line table cares about.
+    void adopt(size_t index, ManagedShared<Chunk> chunk, int64_t line_delta);
+
+    [[nodiscard]] auto getCompiledCount() const -> size_t {
+        size_t count = 0;
+        for (size_t i = 0; i < size(); ++i) {
+            count += isCompiled(i) ? 1 : 0;
+        }
+        return count;
+    }
+
+    // Whether function `index` is pure: it neither reads nor writes the
+    // script's variables, does not print or yield, calls no native
+    // functions and only calls pure script functions, so its result only
+    // depends on its arguments. Parses the bodies of the functions it
+    // reaches.
+    [[nodiscard]] auto isPure(size_t index) -> bool;
+
+    // Whether calls to function `index` go through the VM's memo cache.
+    // Fails if it is annotated `[[memoize]]` but cannot be memoized.
+    [[nodiscard]] auto isMemoized(size_t index) -> bool;
+
+protected:
+    auto compile(size_t index) -> const CallTarget* override;
+
+private:
+    struct Entry {
+        ManagedShared<FunctionDeclarationStatement> declaration;
+        // Guarded by `bodies_mutex_`; never changes once parsed.
+        std::vector<ManagedShared<Statement>> body;
+        bool parsed = false;
+        ManagedShared<Chunk> chunk;
+        CallTarget target;
+        std::once_flag compiled;
+        // Set by isPure() for every function it reached.
+        std::optional<bool> pure;
+        // Whether it loops or recurses, or calls a function that does. Set
+        // along with `pure`.
+        bool costly = false;
+    };
+
+    struct PurityScan;
+
+    void scanPurity(size_t index, PurityScan& scan);
+
+    auto makeTarget(Entry& entry, size_t index) -> CallTarget;
+
+    const Chunk& script_;
+    const CompileOptions options_;
+    std::deque<Entry> entries_;
+    std::map<std::string, size_t> indices_;
+    std::mutex bodies_mutex_;
+    std::mutex purity_mutex_;
+};
+
+export class Chunk : public ManagedObject {
+public:
+    std::string name = "<main>";
+    ManagedShared<Chunk> parent;
+    ManagedShared<NativeRegistry> natives;
+    std::vector<int> opcodes;
+    LineTable lines;
+    std::map<std::string, int> variables;
+    // Types of the slots that do not hold ints.
+    std::map<int, ValueType> slot_types;
+    // Only the script's top-level chunk has functions.
+    std::unique_ptr<FunctionLibrary> functions;
+
+    [[nodiscard]] auto getSlotType(int slot) const -> ValueType {
+        if (auto it = slot_types.find(slot); it != slot_types.end()) {
+            return it->second;
+        }
+        return ValueType::Int;
+    }
+
+    auto getVariable(const std::string& name) -> int {
+        if (auto it = variables.find(name); it != variables.end()) {
+            return it->second;
+        }
+        if (parent.get() != nullptr) {
+            return parent->getVariable(name);
+        }
+        fprintf(stderr, "Unknown variable '%s'\n", name.c_str());
+        abort();
+    }
+
+    // Slots a frame running the chunk needs: one past the highest slot any
+    // variable, hidden ones included, was given. Counting the names comes up
+    // short as soon as a slot loses its name, e.g. to a redeclaration that
+    // binds the name to a new slot.
+    [[nodiscard]] auto getSlotCount() const -> size_t {
+        size_t count = 0;
+        for (const auto& [name, slot] : variables) {
+            count = std::max(count, static_cast<size_t>(slot) + 1);
+        }
+        return count;
+    }
+
+    [[nodiscard]] auto getProgram() const -> Program {
+        Program program;
+        program.code = opcodes.data();
+        program.lines = &lines;
+        program.name = name.c_str();
+        program.slots = getSlotCount();
+        // compile() froze the registry, so its table stays where it is.
+        if (natives) {
+            program.natives = natives->getFunctions();
+        }
+        program.functions = functions.get();
+        return program;
+    }
+};
+
+FunctionLibrary::~FunctionLibrary() = default;
+
+// Calls `fn` on each operand of `expression`.
+template<typename Fn>
+void forEachOperand(Expression* expression, Fn&& fn) {
+    if (auto expr = dynamic_cast<AddExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<SubExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<MulExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<DivExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<ModExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<AssignExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<ComparisonExpression*>(expression)) {
+        fn(expr->getLhs().get());
+        fn(expr->getRhs().get());
+    } else if (auto expr = dynamic_cast<NegExpression*>(expression)) {
+        fn(expr->getExpr().get());
+    } else if (auto expr = dynamic_cast<CallExpression*>(expression)) {
+        for (auto& arg : expr->getArgs()) {
+            fn(arg.get());
+        }
+    } else if (auto expr = dynamic_cast<ArrayExpression*>(expression)) {
+        for (auto& element : expr->getElements()) {
+            fn(element.get());
+        }
+    } else if (auto expr = dynamic_cast<IndexExpression*>(expression)) {
+        fn(expr->getArray().get());
+        fn(expr->getIndex().get());
+    }
+}
+
+class ASTVisitor {
+public:
+    // Variables of a function body that is being inlined. Parameters and
+    // locals live in slots borrowed from the caller's frame, or, when they
+    // are never assigned and start out constant, are replaced by their value.
+    // What typeOf() and foldConstant() found for an expression, kept so
+    // that compiling a tree does not recompute them for every subtree at
+    // every level, which made deep expressions take quadratic time.
+    struct ExpressionFacts {
+        std::optional<ValueType> type;
+        std::optional<std::optional<int>> constant;
+    };
+    using FactCache = std::unordered_map<const Expression*, ExpressionFacts>;
+
+    struct InlineScope {
+        std::map<std::string, int> slots;
+        std::map<std::string, int> constants;
+        // Facts about the inlined body under these bindings.
+        FactCache facts;
+    };
+
+    ManagedShared<Chunk> chunk;
+    // Top-level chunk of the script, which is `chunk` itself unless a
+    // function body is being compiled.
+    const Chunk* script;
+    // Function whose body is being compiled, if any.
+    const FunctionDeclarationStatement* function = nullptr;
+    CompileOptions options;
+    std::vector<InlineScope> inline_scopes;
+    // Functions being inlined, innermost last, so that recursion stops, and
+    // the names each of their bodies assigns to.
+    std::vector<size_t> inlining;
+    std::vector<const std::set<std::string>*> inline_assigned;
+    // Slots ever borrowed for inlining; the first `inline_slots_used` are
+    // taken. A call site returns what it borrowed once it is done.
+    std::vector<int> inline_slots;
+    size_t inline_slots_used = 0;
+    // Variables declared in each enclosing block, innermost last, paired
+    // with the name the binding they shadow was hidden under, if any.
+    std::vector<std::vector<std::pair<std::string, std::string>>> block_scopes;
+    // Facts about expressions outside of inlined bodies. They depend on what
+    // names resolve to, so they are dropped whenever that changes.
+    FactCache facts;
+
+    explicit ASTVisitor(CompileOptions options = {}) : options(options) {
+        chunk = ManagedShared(new Chunk());
+        chunk->functions = std::make_unique<FunctionLibrary>(*chunk, options);
+        script = chunk.get();
+    }
+
+    explicit ASTVisitor(const Chunk& script) : script(&script), options(script.functions->getOptions()) {
+        chunk = ManagedShared(new Chunk());
+        chunk->natives = script.natives;
+    }
+
+    [[nodiscard]] auto isFunction() const -> bool {
+        return script != chunk.get();
+    }
+
+    void accept(Statement* statement) {
+        // Inlined code keeps the line of the call site.
+        if (inline_scopes.empty()) {
+            chunk->lines.addLine(chunk->opcodes.size(), statement->getLine());
+        }
+        if (auto stmt = dynamic_cast<ExpressionStatement*>(statement)) {
+            visitExpressionStatement(stmt);
+            return;
+        }
+        if (auto stmt = dynamic_cast<VariableDeclarationStatement*>(statement)) {
+            visitVariableDeclarationStatement(stmt);
             return;
         }
         if (auto stmt = dynamic_cast<ReturnStatement*>(statement)) {
@@ -572,14 +1403,48 @@ public:
             visitFunctionDeclarationStatement(stmt);
             return;
         }
+        if (auto stmt = dynamic_cast<BlockStatement*>(statement)) {
+            visitBlockStatement(stmt);
+            return;
+        }
+        if (auto stmt = dynamic_cast<IfStatement*>(statement)) {
+            visitIfStatement(stmt);
+            return;
+        }
+        if (auto stmt = dynamic_cast<WhileStatement*>(statement)) {
+            visitWhileStatement(stmt);
+            return;
+        }
+        if (auto stmt = dynamic_cast<ForStatement*>(statement)) {
+            visitForStatement(stmt);
+            return;
+        }
+        if (dynamic_cast<YieldStatement*>(statement)) {
+            chunk->opcodes.emplace_back(OP_YIELD);
+            return;
+        }
         std::fprintf(stderr, "Unknown statement type\n");
         abort();
     }
 
     void accept(Expression* expression) {
+        if (auto value = foldConstant(expression)) {
+            chunk->opcodes.emplace_back(OP_PUSH);
+            chunk->opcodes.emplace_back(*value);
+            return;
+        }
         if (auto expr = dynamic_cast<ConstExpression*>(expression)) {
             return visitConstExpression(expr);
         }
+        if (auto expr = dynamic_cast<StringExpression*>(expression)) {
+            return visitStringExpression(expr);
+        }
+        if (auto expr = dynamic_cast<ArrayExpression*>(expression)) {
+            return visitArrayExpression(expr);
+        }
+        if (auto expr = dynamic_cast<IndexExpression*>(expression)) {
+            return visitIndexExpression(expr);
+        }
         if (auto expr = dynamic_cast<VariableExpression*>(expression)) {
             return visitVariableExpression(expr);
         }
@@ -604,6 +1469,9 @@ public:
         if (auto expr = dynamic_cast<NegExpression*>(expression)) {
             return visitNegExpression(expr);
         }
+        if (auto expr = dynamic_cast<ComparisonExpression*>(expression)) {
+            return visitComparisonExpression(expr);
+        }
         if (auto expr = dynamic_cast<AssignExpression*>(expression)) {
             return visitAssignExpression(expr);
         }
@@ -616,46 +1484,374 @@ public:
         chunk->opcodes.emplace_back(expr->getValue());
     }
 
+    // Literals are interned here, so running the chunk never copies them.
+    void visitStringExpression(StringExpression* expr) {
+        chunk->opcodes.emplace_back(OP_PUSH_STRING);
+        chunk->opcodes.emplace_back(StringTable::intern(expr->getValue()));
+    }
+
     void visitVariableExpression(VariableExpression* expr) {
-        chunk->opcodes.emplace_back(OP_GET_LOCAL);
-        chunk->opcodes.emplace_back(chunk->variables.at(expr->getName()));
+        emitVariable(OP_GET_LOCAL, OP_GET_GLOBAL, expr->getName());
+    }
+
+    void visitArrayExpression(ArrayExpression* expr) {
+        for (auto& element : expr->getElements()) {
+            checkInt("[]", element.get());
+        }
+        for (auto& element : expr->getElements()) {
+            accept(element.get());
+        }
+        chunk->opcodes.emplace_back(OP_MAKE_ARRAY);
+        chunk->opcodes.emplace_back(expr->getElements().size());
+    }
+
+    void visitIndexExpression(IndexExpression* expr) {
+        checkIndex(expr);
+        accept(expr->getArray().get());
+        accept(expr->getIndex().get());
+        chunk->opcodes.emplace_back(OP_ARRAY_GET);
+    }
+
+    void checkIndex(IndexExpression* expr) {
+        if (auto type = typeOf(expr->getArray().get()); type != ValueType::Array) {
+            fprintf(stderr, "Cannot index %s\n", getTypeName(type));
+            abort();
+        }
+        checkInt("[]", expr->getIndex().get());
+    }
+
+    // Static type of `expression`. Arithmetic on an array gives an array
+    // and `+` on strings a string; the operands are checked when it is
+    // compiled. The right operand is looked at first, so left-nested chains
+    // of string concatenations are typed in constant time.
+    auto typeOf(Expression* expression) -> ValueType {
+        if (dynamic_cast<ConstExpression*>(expression)) {
+            return ValueType::Int;
+        }
+        if (dynamic_cast<StringExpression*>(expression)) {
+            return ValueType::String;
+        }
+        if (dynamic_cast<ArrayExpression*>(expression)) {
+            return ValueType::Array;
+        }
+        if (auto expr = dynamic_cast<VariableExpression*>(expression)) {
+            return getVariableType(expr->getName());
+        }
+        if (auto it = getFacts().find(expression); it != getFacts().end() && it->second.type.has_value()) {
+            return *it->second.type;
+        }
+        auto type = computeType(expression);
+        getFacts()[expression].type = type;
+        return type;
+    }
+
+    auto computeType(Expression* expression) -> ValueType {
+        if (auto expr = dynamic_cast<AddExpression*>(expression)) {
+            return typeOfArithmetic(expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<SubExpression*>(expression)) {
+            return typeOfArithmetic(expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<MulExpression*>(expression)) {
+            return typeOfArithmetic(expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<DivExpression*>(expression)) {
+            return typeOfArithmetic(expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<AssignExpression*>(expression)) {
+            return typeOf(expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<CallExpression*>(expression)) {
+            auto variable = dynamic_cast<VariableExpression*>(expr->getCallee().get());
+            if (variable != nullptr) {
+                if (auto index = script->functions->find(variable->getName())) {
+                    return script->functions->getDeclaration(*index).getResultType();
+                }
+                auto native = chunk->natives ? chunk->natives->find(variable->getName()) : std::nullopt;
+                if (!native.has_value() && variable->getName() == "array") {
+                    return ValueType::Array;
+                }
+            }
+        }
+        return ValueType::Int;
+    }
+
+    // Cache of the innermost inlined body, or of the code being compiled.
+    auto getFacts() -> FactCache& {
+        return inline_scopes.empty() ? facts : inline_scopes.back().facts;
+    }
+
+    // Drops the facts of the innermost scope after its names changed.
+    void forgetFacts() {
+        getFacts().clear();
+    }
+
+    auto typeOfArithmetic(Expression* lhs, Expression* rhs) -> ValueType {
+        if (auto type = typeOf(rhs); type != ValueType::Int) {
+            return type;
+        }
+        return typeOf(lhs);
+    }
+
+    auto getVariableType(const std::string& name) -> ValueType {
+        if (!inline_scopes.empty() && inline_scopes.back().constants.contains(name)) {
+            return ValueType::Int;
+        }
+        auto variable = resolveVariable(name);
+        return (variable.global ? script : chunk.get())->getSlotType(variable.slot);
+    }
+
+    // Checks that both operands of `op` have the same type and returns it.
+    auto checkOperands(const char* op, Expression* lhs, Expression* rhs) -> ValueType {
+        auto type = typeOf(lhs);
+        if (auto other = typeOf(rhs); other != type) {
+            fprintf(stderr, "Operands of '%s' are %s and %s\n", op, getTypeName(type), getTypeName(other));
+            abort();
+        }
+        return type;
+    }
+
+    // Arithmetic between arrays, or between an array and an int, is done
+    // element by element into a new array.
+    void emitArithmetic(const char* op, OpCode opcode, BatchOp batch, Expression* lhs, Expression* rhs) {
+        auto lhs_type = typeOf(lhs);
+        auto rhs_type = typeOf(rhs);
+        auto arrays = lhs_type == ValueType::Array || rhs_type == ValueType::Array;
+        if ((lhs_type != ValueType::Int && lhs_type != ValueType::Array) || (rhs_type != ValueType::Int && rhs_type != ValueType::Array)) {
+            fprintf(stderr, "Operands of '%s' are %s and %s\n", op, getTypeName(lhs_type), getTypeName(rhs_type));
+            abort();
+        }
+        accept(lhs);
+        accept(rhs);
+        if (arrays) {
+            chunk->opcodes.emplace_back(OP_ARRAY_ARITH);
+            chunk->opcodes.emplace_back(encodeArrayArith(static_cast<int>(batch), lhs_type == ValueType::Int, rhs_type == ValueType::Int));
+        } else {
+            chunk->opcodes.emplace_back(opcode);
+        }
+    }
+
+    void checkInt(const char* op, Expression* operand) {
+        if (auto type = typeOf(operand); type != ValueType::Int) {
+            fprintf(stderr, "Operator '%s' expects an int, got %s\n", op, getTypeName(type));
+            abort();
+        }
+    }
+
+    // Type of the operands of a comparison. Strings can only be compared
+    // for equality.
+    auto checkComparison(ComparisonExpression* expr) -> ValueType {
+        auto type = checkOperands(getComparisonName(expr->getComparison()), expr->getLhs().get(), expr->getRhs().get());
+        if (type == ValueType::String && expr->getComparison() != OP_EQ && expr->getComparison() != OP_NE) {
+            fprintf(stderr, "Strings can only be compared with '==' and '!='\n");
+            abort();
+        }
+        if (type == ValueType::Array) {
+            fprintf(stderr, "Arrays cannot be compared\n");
+            abort();
+        }
+        return type;
+    }
+
+    static auto getComparisonName(OpCode comparison) -> const char* {
+        switch (comparison) {
+            case OP_LT:
+                return "<";
+            case OP_LE:
+                return "<=";
+            case OP_GT:
+                return ">";
+            case OP_GE:
+                return ">=";
+            case OP_EQ:
+                return "==";
+            default:
+                return "!=";
+        }
+    }
+
+    void emitVariable(OpCode local, OpCode global, const std::string& name) {
+        auto variable = resolveVariable(name);
+        chunk->opcodes.emplace_back(variable.global ? global : local);
+        chunk->opcodes.emplace_back(variable.slot);
+    }
+
+    struct ResolvedVariable {
+        bool global;
+        int slot;
+    };
+
+    // A function's own variables shadow the script's, which live in the
+    // bottom frame and are reached with the GLOBAL opcodes.
+    auto resolveVariable(const std::string& name) -> ResolvedVariable {
+        if (!inline_scopes.empty()) {
+            auto& scope = inline_scopes.back();
+            if (auto it = scope.slots.find(name); it != scope.slots.end()) {
+                return {false, it->second};
+            }
+            if (auto it = script->variables.find(name); it != script->variables.end()) {
+                return {isFunction(), it->second};
+            }
+            fprintf(stderr, "Unknown variable '%s'\n", name.c_str());
+            abort();
+        }
+        if (auto it = chunk->variables.find(name); it != chunk->variables.end()) {
+            return {false, it->second};
+        }
+        if (isFunction()) {
+            if (auto it = script->variables.find(name); it != script->variables.end()) {
+                return {true, it->second};
+            }
+        }
+        fprintf(stderr, "Unknown variable '%s'\n", name.c_str());
+        abort();
     }
 
     void visitCallExpression(CallExpression* expr) {
         auto variable = dynamic_cast<VariableExpression*>(expr->getCallee().get());
         if (variable->getName() == "print") {
+            // Only a print with strings among its arguments needs to know
+            // which ones they are.
+            auto argc = expr->getArgs().size();
+            auto mixed = false;
+            int strings = 0;
+            for (size_t i = 0; i < argc; ++i) {
+                auto type = typeOf(expr->getArgs()[i].get());
+                if (type == ValueType::Array) {
+                    fprintf(stderr, "print() cannot print arrays\n");
+                    abort();
+                }
+                if (type == ValueType::String) {
+                    mixed = true;
+                    strings |= i < kPrintMixedMaxArgs ? 1 << i : 0;
+                }
+            }
+            if (mixed && argc > kPrintMixedMaxArgs) {
+                fprintf(stderr, "print() takes at most %d arguments when any is a string\n", kPrintMixedMaxArgs);
+                abort();
+            }
+            for (auto& arg : expr->getArgs()) {
+                accept(arg.get());
+            }
+            if (mixed) {
+                chunk->opcodes.emplace_back(OP_PRINT_MIXED);
+                chunk->opcodes.emplace_back(encodePrintMixed(static_cast<int>(argc), strings));
+            } else {
+                chunk->opcodes.emplace_back(OP_PRINT);
+                chunk->opcodes.emplace_back(argc);
+            }
+            return;
+        }
+        if (auto index = script->functions->find(variable->getName())) {
+            auto& declaration = script->functions->getDeclaration(*index);
+            if (expr->getArgs().size() != declaration.getArgs().size()) {
+                fprintf(stderr, "Function '%s' expects %zu arguments, got %zu\n", variable->getName().c_str(), declaration.getArgs().size(), expr->getArgs().size());
+                abort();
+            }
+            for (size_t i = 0; i < expr->getArgs().size(); ++i) {
+                checkArgument(variable->getName(), i, declaration.getArgType(i), expr->getArgs()[i].get());
+            }
+            if (auto assigned = analyzeInline(*index)) {
+                inlineCall(*index, expr, *assigned);
+                return;
+            }
+            for (auto& arg : expr->getArgs()) {
+                accept(arg.get());
+            }
+            chunk->opcodes.emplace_back(OP_CALL);
+            chunk->opcodes.emplace_back(*index);
+            return;
+        }
+        if (auto index = chunk->natives ? chunk->natives->find(variable->getName()) : std::nullopt) {
+            auto& native = chunk->natives->getFunctions()[*index];
+            if (expr->getArgs().size() != native.arity) {
+                fprintf(stderr, "Function '%s' expects %zu arguments, got %zu\n", variable->getName().c_str(), native.arity, expr->getArgs().size());
+                abort();
+            }
+            for (size_t i = 0; i < expr->getArgs().size(); ++i) {
+                checkArgument(variable->getName(), i, ValueType::Int, expr->getArgs()[i].get());
+            }
             for (auto& arg : expr->getArgs()) {
                 accept(arg.get());
             }
-            chunk->opcodes.emplace_back(OP_PRINT);
-            chunk->opcodes.emplace_back(expr->getArgs().size());
+            chunk->opcodes.emplace_back(OP_CALL_NATIVE);
+            chunk->opcodes.emplace_back(*index);
+            return;
+        }
+        // Builtins come last, so that scripts and hosts can define their own.
+        if (variable->getName() == "len") {
+            checkArgumentCount("len", 1, expr);
+            auto type = typeOf(expr->getArgs()[0].get());
+            if (type == ValueType::Int) {
+                fprintf(stderr, "Argument 1 of 'len' must be string or array, got int\n");
+                abort();
+            }
+            accept(expr->getArgs()[0].get());
+            chunk->opcodes.emplace_back(type == ValueType::String ? OP_STRING_LENGTH : OP_ARRAY_LENGTH);
+            return;
+        }
+        if (variable->getName() == "array") {
+            emitBuiltin("array", OP_NEW_ARRAY, {ValueType::Int}, expr);
             return;
         }
+        if (variable->getName() == "sum") {
+            emitBuiltin("sum", OP_ARRAY_SUM, {ValueType::Array}, expr);
+            return;
+        }
+        if (variable->getName() == "dot") {
+            emitBuiltin("dot", OP_ARRAY_DOT, {ValueType::Array, ValueType::Array}, expr);
+            return;
+        }
+        fprintf(stderr, "Unknown function '%s'\n", variable->getName().c_str());
         abort();
     }
 
+    void emitBuiltin(const std::string& name, OpCode opcode, std::initializer_list<ValueType> args, CallExpression* expr) {
+        checkArgumentCount(name, args.size(), expr);
+        for (size_t i = 0; i < args.size(); ++i) {
+            checkArgument(name, i, args.begin()[i], expr->getArgs()[i].get());
+        }
+        for (auto& arg : expr->getArgs()) {
+            accept(arg.get());
+        }
+        chunk->opcodes.emplace_back(opcode);
+    }
+
+    static void checkArgumentCount(const std::string& name, size_t count, CallExpression* expr) {
+        if (expr->getArgs().size() != count) {
+            fprintf(stderr, "Function '%s' expects %zu arguments, got %zu\n", name.c_str(), count, expr->getArgs().size());
+            abort();
+        }
+    }
+
+    void checkArgument(const std::string& callee, size_t index, ValueType expected, Expression* arg) {
+        if (auto type = typeOf(arg); type != expected) {
+            fprintf(stderr, "Argument %zu of '%s' must be %s, got %s\n", index + 1, callee.c_str(), getTypeName(expected), getTypeName(type));
+            abort();
+        }
+    }
+
     void visitAddExpression(AddExpression* expr) {
-        accept(expr->getLhs().get());
-        accept(expr->getRhs().get());
-        chunk->opcodes.emplace_back(OP_ADD);
+        if (typeOf(expr->getLhs().get()) == ValueType::String || typeOf(expr->getRhs().get()) == ValueType::String) {
+            checkOperands("+", expr->getLhs().get(), expr->getRhs().get());
+            accept(expr->getLhs().get());
+            accept(expr->getRhs().get());
+            chunk->opcodes.emplace_back(OP_CONCAT);
+            return;
+        }
+        emitArithmetic("+", OP_ADD, BatchOp::Add, expr->getLhs().get(), expr->getRhs().get());
     }
 
     void visitSubExpression(SubExpression* expr) {
-        accept(expr->getLhs().get());
-        accept(expr->getRhs().get());
-        chunk->opcodes.emplace_back(OP_SUB);
+        emitArithmetic("-", OP_SUB, BatchOp::Sub, expr->getLhs().get(), expr->getRhs().get());
     }
 
     void visitMulExpression(MulExpression* expr) {
-        accept(expr->getLhs().get());
-        accept(expr->getRhs().get());
-        chunk->opcodes.emplace_back(OP_MUL);
+        emitArithmetic("*", OP_MUL, BatchOp::Mul, expr->getLhs().get(), expr->getRhs().get());
     }
 
     void visitDivExpression(DivExpression* expr) {
-        accept(expr->getLhs().get());
-        accept(expr->getRhs().get());
-        chunk->opcodes.emplace_back(OP_DIV);
+        emitArithmetic("/", OP_DIV, BatchOp::Div, expr->getLhs().get(), expr->getRhs().get());
     }
 
     void visitModExpression(ModExpression* expr) {
@@ -663,46 +1859,1052 @@ public:
     }
 
     void visitNegExpression(NegExpression* expr) {
+        checkInt("-", expr->getExpr().get());
         accept(expr->getExpr().get());
         chunk->opcodes.emplace_back(OP_NEG);
     }
 
+    void visitComparisonExpression(ComparisonExpression* expr) {
+        auto type = checkComparison(expr);
+        accept(expr->getLhs().get());
+        accept(expr->getRhs().get());
+        if (type == ValueType::String) {
+            chunk->opcodes.emplace_back(expr->getComparison() == OP_EQ ? OP_STRING_EQ : OP_STRING_NE);
+        } else {
+            chunk->opcodes.emplace_back(expr->getComparison());
+        }
+    }
+
     void visitAssignExpression(AssignExpression* expr) {
+        if (auto element = dynamic_cast<IndexExpression*>(expr->getLhs().get())) {
+            checkIndex(element);
+            checkInt("=", expr->getRhs().get());
+            accept(element->getArray().get());
+            accept(element->getIndex().get());
+            accept(expr->getRhs().get());
+            chunk->opcodes.emplace_back(OP_ARRAY_SET);
+            return;
+        }
         auto variable = dynamic_cast<VariableExpression*>(expr->getLhs().get());
+        auto type = getVariableType(variable->getName());
+        if (auto value = typeOf(expr->getRhs().get()); value != type) {
+            fprintf(stderr, "Cannot assign %s to %s variable '%s'\n", getTypeName(value), getTypeName(type), variable->getName().c_str());
+            abort();
+        }
         accept(expr->getRhs().get());
-        chunk->opcodes.emplace_back(OP_SET_LOCAL);
-        chunk->opcodes.emplace_back(chunk->variables.at(variable->getName()));
+        emitVariable(OP_SET_LOCAL, OP_SET_GLOBAL, variable->getName());
     }
 
     void visitExpressionStatement(ExpressionStatement* stmt) {
         accept(stmt->getExpr().get());
+        if (producesValue(stmt->getExpr().get())) {
+            chunk->opcodes.emplace_back(OP_POP);
+        }
+    }
+
+    // Assignments and print() leave nothing on the stack, everything else
+    // leaves exactly one value.
+    static auto producesValue(Expression* expression) -> bool {
+        if (dynamic_cast<AssignExpression*>(expression)) {
+            return false;
+        }
+        if (auto expr = dynamic_cast<CallExpression*>(expression)) {
+            auto variable = dynamic_cast<VariableExpression*>(expr->getCallee().get());
+            return variable == nullptr || variable->getName() != "print";
+        }
+        return true;
     }
 
     void visitVariableDeclarationStatement(VariableDeclarationStatement* stmt) {
+        if (!inline_scopes.empty()) {
+            declareInlineVariable(stmt->getName(), stmt->getInitializer().get());
+            return;
+        }
+        auto type = typeOf(stmt->getInitializer().get());
         accept(stmt->getInitializer().get());
-        auto variable = chunk->variables.size();
         chunk->opcodes.emplace_back(OP_SET_LOCAL);
-        chunk->opcodes.emplace_back(variable);
-        chunk->variables.insert_or_assign(stmt->getName(), variable);
-    }
-
-    void visitReturnStatement(ReturnStatement* stmt) {
-        abort();
+        chunk->opcodes.emplace_back(declareVariable(stmt->getName(), type));
     }
 
+    // Every declaration gets a slot of its own. A binding it shadows, from
+    // an enclosing block or an earlier declaration of the same name, keeps
+    // its slot under a hidden name.
+    auto declareVariable(const std::string& name, ValueType type) -> int {
+        forgetFacts();
+        auto slot = static_cast<int>(chunk->variables.size());
+        if (type != ValueType::Int) {
+            chunk->slot_types.insert_or_assign(slot, type);
+        }
+        auto shadowed = std::string();
+        if (chunk->variables.contains(name)) {
+            shadowed = hideVariable(name);
+        }
+        chunk->variables.emplace(name, slot);
+        if (!block_scopes.empty()) {
+            block_scopes.back().emplace_back(name, std::move(shadowed));
+        }
+        return slot;
+    }
+
+    auto hideVariable(const std::string& name) -> std::string {
+        auto node = chunk->variables.extract(name);
+        node.key() = "$" + name + "." + std::to_string(node.mapped());
+        auto hidden = node.key();
+        chunk->variables.insert(std::move(node));
+        return hidden;
+    }
+
+    void enterScope() {
+        block_scopes.emplace_back();
+    }
+
+    // Hides the variables declared in the innermost block and brings back
+    // what they shadowed. Their slots stay allocated, so the frame size
+    // counts every variable the chunk ever declared.
+    void exitScope() {
+        forgetFacts();
+        auto& declared = block_scopes.back();
+        for (auto it = declared.rbegin(); it != declared.rend(); ++it) {
+            hideVariable(it->first);
+            if (!it->second.empty()) {
+                auto node = chunk->variables.extract(it->second);
+                node.key() = it->first;
+                chunk->variables.insert(std::move(node));
+            }
+        }
+        block_scopes.pop_back();
+    }
+
+    // Whether `name` currently refers to a variable declared in a block of
+    // the script's top level, which functions cannot see.
+    [[nodiscard]] auto isBlockScoped(const std::string& name) const -> bool {
+        if (isFunction()) {
+            return false;
+        }
+        for (auto& declared : block_scopes) {
+            for (auto& [declared_name, shadowed] : declared) {
+                if (declared_name == name) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void visitBlockStatement(BlockStatement* stmt) {
+        enterScope();
+        for (auto& statement : stmt->getStatements()) {
+            accept(statement.get());
+        }
+        exitScope();
+    }
+
+    // Branches and loop bodies are scopes of their own, braces or not.
+    void acceptScoped(Statement* statement) {
+        enterScope();
+        accept(statement);
+        exitScope();
+    }
+
+    void visitIfStatement(IfStatement* stmt) {
+        auto skip_then = emitBranch(stmt->getCondition().get(), false);
+        acceptScoped(stmt->getThenBranch().get());
+        if (stmt->getElseBranch()) {
+            auto skip_else = emitJump(OP_JUMP);
+            patchJump(skip_then);
+            acceptScoped(stmt->getElseBranch().get());
+            patchJump(skip_else);
+        } else {
+            patchJump(skip_then);
+        }
+    }
+
+    // Loops are rotated so that each iteration runs a single conditional
+    // jump at the bottom:
+    //
+    //         JUMP check
+    //     top:
+    //         body
+    //     check:
+    //         JUMP_IF_<condition> top
+    void visitWhileStatement(WhileStatement* stmt) {
+        auto enter = emitJump(OP_JUMP);
+        auto top = static_cast<int>(chunk->opcodes.size());
+        acceptScoped(stmt->getBody().get());
+        patchJump(enter);
+        addLine(stmt->getLine());
+        emitBranch(stmt->getCondition().get(), true, top);
+    }
+
+    void visitForStatement(ForStatement* stmt) {
+        enterScope();
+        if (stmt->getInitializer()) {
+            accept(stmt->getInitializer().get());
+        }
+        auto enter = emitJump(OP_JUMP);
+        auto top = static_cast<int>(chunk->opcodes.size());
+        acceptScoped(stmt->getBody().get());
+        addLine(stmt->getLine());
+        if (stmt->getStep()) {
+            auto step = stmt->getStep().get();
+            accept(step);
+            if (producesValue(step)) {
+                chunk->opcodes.emplace_back(OP_POP);
+            }
+        }
+        patchJump(enter);
+        if (stmt->getCondition()) {
+            emitBranch(stmt->getCondition().get(), true, top);
+        } else {
+            emitJump(OP_JUMP, top);
+        }
+        exitScope();
+    }
+
+    void addLine(uint32_t line) {
+        if (inline_scopes.empty()) {
+            chunk->lines.addLine(chunk->opcodes.size(), line);
+        }
+    }
+
+    // Emits a jump to `target` and returns the offset of its target operand,
+    // which patchJump() fills in when the target is not known yet.
+    auto emitJump(OpCode opcode, int target = 0) -> size_t {
+        chunk->opcodes.emplace_back(opcode);
+        chunk->opcodes.emplace_back(target);
+        return chunk->opcodes.size() - 1;
+    }
+
+    void patchJump(std::optional<size_t> operand) {
+        if (operand) {
+            chunk->opcodes[*operand] = static_cast<int>(chunk->opcodes.size());
+        }
+    }
+
+    // Emits code that jumps to `target` if `condition` evaluates to `when`,
+    // and returns the offset of the target operand, or nothing if no jump
+    // was needed because the condition is constant. A comparison between a
+    // local and a constant becomes a single fused instruction, any other
+    // comparison jumps on its operands without materializing a 0 or 1.
+    auto emitBranch(Expression* condition, bool when, int target = 0) -> std::optional<size_t> {
+        if (auto value = foldConstant(condition)) {
+            if ((*value != 0) != when) {
+                return std::nullopt;
+            }
+            return emitJump(OP_JUMP, target);
+        }
+        auto expr = dynamic_cast<ComparisonExpression*>(condition);
+        // Strings are compared by OP_STRING_EQ and OP_STRING_NE, which have no
+        // fused jumps.
+        if (expr == nullptr || checkComparison(expr) == ValueType::String) {
+            if (auto type = typeOf(condition); type != ValueType::Int) {
+                fprintf(stderr, "Condition must be an int, got %s\n", getTypeName(type));
+                abort();
+            }
+            accept(condition);
+            return emitJump(when ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, target);
+        }
+
+        auto comparison = when ? expr->getComparison() : negateComparison(expr->getComparison());
+        auto lhs = expr->getLhs().get();
+        auto rhs = expr->getRhs().get();
+        auto constant = foldConstant(rhs);
+        if (!constant) {
+            // A constant operand has no side effects, so it can go last.
+            if (auto value = foldConstant(lhs)) {
+                std::swap(lhs, rhs);
+                comparison = mirrorComparison(comparison);
+                constant = value;
+            }
+        }
+        if (auto variable = dynamic_cast<VariableExpression*>(lhs); variable != nullptr && constant) {
+            if (auto resolved = resolveVariable(variable->getName()); !resolved.global) {
+                chunk->opcodes.emplace_back(getLocalConstBranchOpcode(comparison));
+                chunk->opcodes.emplace_back(resolved.slot);
+                chunk->opcodes.emplace_back(*constant);
+                chunk->opcodes.emplace_back(target);
+                return chunk->opcodes.size() - 1;
+            }
+        }
+        accept(lhs);
+        accept(rhs);
+        return emitJump(getBranchOpcode(comparison), target);
+    }
+
+    // A top-level return leaves the value on the stack as the script's
+    // result and stops execution.
+    void visitReturnStatement(ReturnStatement* stmt) {
+        // Functions that are inlined only deal in ints.
+        if (inline_scopes.empty()) {
+            auto type = typeOf(stmt->getExpr().get());
+            if (isFunction() && type != function->getResultType()) {
+                fprintf(stderr, "Function '%s' returns %s, got %s\n", function->getName().c_str(), getTypeName(function->getResultType()), getTypeName(type));
+                abort();
+            }
+            if (!isFunction() && type != ValueType::Int) {
+                fprintf(stderr, "The script can only return an int, got %s\n", getTypeName(type));
+                abort();
+            }
+        }
+        accept(stmt->getExpr().get());
+        if (inline_scopes.empty()) {
+            chunk->opcodes.emplace_back(isFunction() ? OP_RET : OP_HALT);
+        }
+    }
+
+    // Only registers the function, its body is compiled on the first call.
     void visitFunctionDeclarationStatement(FunctionDeclarationStatement* stmt) {
-        abort();
+        if (isFunction() || !block_scopes.empty()) {
+            fprintf(stderr, "Function '%s' is not declared at the top level\n", stmt->getName().c_str());
+            abort();
+        }
+        stmt->retain();
+        chunk->functions->declare(ManagedShared(stmt));
+        forgetFacts();
+    }
+
+    // Constant value of `expression`, if folding is enabled and it has one.
+    // Calls fold when the callee can be inlined, its arguments are constant
+    // and its body consists of constant declarations and a return.
+    auto foldConstant(Expression* expression) -> std::optional<int> {
+        if (!options.fold_constants) {
+            return std::nullopt;
+        }
+        if (auto expr = dynamic_cast<ConstExpression*>(expression)) {
+            return expr->getValue();
+        }
+        if (auto expr = dynamic_cast<VariableExpression*>(expression)) {
+            if (inline_scopes.empty()) {
+                return std::nullopt;
+            }
+            auto& constants = inline_scopes.back().constants;
+            if (auto it = constants.find(expr->getName()); it != constants.end()) {
+                return it->second;
+            }
+            return std::nullopt;
+        }
+        if (auto it = getFacts().find(expression); it != getFacts().end() && it->second.constant.has_value()) {
+            return *it->second.constant;
+        }
+        // Folding a call pushes and pops an inline scope, which may move the
+        // cache of the current one, so it is looked up again.
+        auto value = computeConstant(expression);
+        getFacts()[expression].constant = value;
+        return value;
+    }
+
+    auto computeConstant(Expression* expression) -> std::optional<int> {
+        if (auto expr = dynamic_cast<NegExpression*>(expression)) {
+            auto value = foldConstant(expr->getExpr().get());
+            return value ? foldOperation(OP_NEG, 0, *value) : std::nullopt;
+        }
+        if (auto expr = dynamic_cast<AddExpression*>(expression)) {
+            return foldBinary(OP_ADD, expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<SubExpression*>(expression)) {
+            return foldBinary(OP_SUB, expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<MulExpression*>(expression)) {
+            return foldBinary(OP_MUL, expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<DivExpression*>(expression)) {
+            return foldBinary(OP_DIV, expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<ComparisonExpression*>(expression)) {
+            return foldBinary(expr->getComparison(), expr->getLhs().get(), expr->getRhs().get());
+        }
+        if (auto expr = dynamic_cast<CallExpression*>(expression)) {
+            return foldCall(expr);
+        }
+        return std::nullopt;
+    }
+
+    auto foldBinary(OpCode opcode, Expression* lhs, Expression* rhs) -> std::optional<int> {
+        auto a = foldConstant(lhs);
+        if (!a) {
+            return std::nullopt;
+        }
+        auto b = foldConstant(rhs);
+        if (!b) {
+            return std::nullopt;
+        }
+        return foldOperation(opcode, *a, *b);
+    }
+
+    auto foldCall(CallExpression* expr) -> std::optional<int> {
+        auto variable = dynamic_cast<VariableExpression*>(expr->getCallee().get());
+        if (variable == nullptr || variable->getName() == "print") {
+            return std::nullopt;
+        }
+        auto index = script->functions->find(variable->getName());
+        if (!index) {
+            return std::nullopt;
+        }
+        auto& declaration = script->functions->getDeclaration(*index);
+        if (expr->getArgs().size() != declaration.getArgs().size()) {
+            return std::nullopt;
+        }
+        auto assigned = analyzeInline(*index);
+        if (!assigned) {
+            return std::nullopt;
+        }
+
+        InlineScope scope;
+        for (size_t i = 0; i < expr->getArgs().size(); ++i) {
+            auto value = foldConstant(expr->getArgs()[i].get());
+            if (!value || assigned->contains(declaration.getArgs()[i])) {
+                return std::nullopt;
+            }
+            scope.constants.insert_or_assign(declaration.getArgs()[i], *value);
+        }
+
+        inline_scopes.emplace_back(std::move(scope));
+        inlining.emplace_back(*index);
+        std::optional<int> result = 0;
+        for (auto& statement : script->functions->getBody(*index)) {
+            if (auto stmt = dynamic_cast<VariableDeclarationStatement*>(statement.get())) {
+                auto value = assigned->contains(stmt->getName()) ? std::nullopt : foldConstant(stmt->getInitializer().get());
+                if (!value) {
+                    result = std::nullopt;
+                    break;
+                }
+                inline_scopes.back().constants.insert_or_assign(stmt->getName(), *value);
+                forgetFacts();
+            } else if (auto stmt = dynamic_cast<ReturnStatement*>(statement.get())) {
+                result = foldConstant(stmt->getExpr().get());
+                break;
+            } else {
+                result = std::nullopt;
+                break;
+            }
+        }
+        inlining.pop_back();
+        inline_scopes.pop_back();
+        return result;
+    }
+
+    // Decides whether function `index` is inlined at a call site compiled
+    // now, and if so returns the names its body assigns to. The body has to
+    // fit the budget, end in its only return (if any), not call itself, and
+    // only refer to names that already resolve here. Calls to memoized
+    // functions have to go through the memo cache.
+    auto analyzeInline(size_t index) -> std::optional<std::set<std::string>> {
+        if (options.inline_budget == 0 || std::find(inlining.begin(), inlining.end(), index) != inlining.end()) {
+            return std::nullopt;
+        }
+        auto& declaration = script->functions->getDeclaration(index);
+        if (!hasIntSignature(declaration) || script->functions->isMemoized(index)) {
+            return std::nullopt;
+        }
+        auto analysis = InlineAnalysis{.self = declaration.getName()};
+        analysis.declared.insert(declaration.getArgs().begin(), declaration.getArgs().end());
+
+        auto& body = script->functions->getBody(index);
+        for (size_t i = 0; i < body.size() && analysis.inlinable; ++i) {
+            analysis.nodes += 1;
+            if (auto stmt = dynamic_cast<VariableDeclarationStatement*>(body[i].get())) {
+                analyzeExpression(stmt->getInitializer().get(), analysis);
+                analysis.declared.insert(stmt->getName());
+            } else if (auto stmt = dynamic_cast<ExpressionStatement*>(body[i].get())) {
+                analyzeExpression(stmt->getExpr().get(), analysis);
+            } else if (auto stmt = dynamic_cast<ReturnStatement*>(body[i].get())) {
+                analysis.inlinable = i + 1 == body.size();
+                analyzeExpression(stmt->getExpr().get(), analysis);
+            } else {
+                analysis.inlinable = false;
+            }
+            analysis.inlinable = analysis.inlinable && analysis.nodes <= options.inline_budget;
+        }
+        if (!analysis.inlinable) {
+            return std::nullopt;
+        }
+        return std::move(analysis.assigned);
+    }
+
+    struct InlineAnalysis {
+        std::string self;
+        std::set<std::string> declared;
+        std::set<std::string> assigned;
+        size_t nodes = 0;
+        bool inlinable = true;
+    };
+
+    void analyzeExpression(Expression* expression, InlineAnalysis& analysis) {
+        analysis.nodes += 1;
+        if (dynamic_cast<StringExpression*>(expression) || dynamic_cast<ArrayExpression*>(expression) || dynamic_cast<IndexExpression*>(expression)) {
+            analysis.inlinable = false;
+            return;
+        }
+        if (auto expr = dynamic_cast<VariableExpression*>(expression)) {
+            auto name = expr->getName();
+            if (analysis.declared.contains(name)) {
+                return;
+            }
+            auto it = script->variables.find(name);
+            analysis.inlinable = analysis.inlinable && it != script->variables.end() && !isBlockScoped(name) && script->getSlotType(it->second) == ValueType::Int;
+            return;
+        }
+        if (auto expr = dynamic_cast<AssignExpression*>(expression)) {
+            if (auto variable = dynamic_cast<VariableExpression*>(expr->getLhs().get())) {
+                analysis.assigned.insert(variable->getName());
+            }
+        }
+        if (auto expr = dynamic_cast<CallExpression*>(expression)) {
+            auto variable = dynamic_cast<VariableExpression*>(expr->getCallee().get());
+            auto name = variable != nullptr ? variable->getName() : std::string();
+            auto callee = script->functions->find(name);
+            auto known = name == "print" || callee.has_value() || (chunk->natives && chunk->natives->find(name).has_value());
+            auto typed = !callee.has_value() || hasIntSignature(script->functions->getDeclaration(*callee));
+            analysis.inlinable = analysis.inlinable && known && typed && name != analysis.self;
+            for (auto& arg : expr->getArgs()) {
+                analyzeExpression(arg.get(), analysis);
+            }
+            return;
+        }
+        if (dynamic_cast<ModExpression*>(expression)) {
+            analysis.inlinable = false;
+            return;
+        }
+        forEachOperand(expression, [&](Expression* operand) {
+            analyzeExpression(operand, analysis);
+        });
+    }
+
+    // Emits the body of function `index` in place of a call to it. The
+    // arguments are evaluated in the caller's scope, left to right, before
+    // any of the body runs, just like for a real call.
+    void inlineCall(size_t index, CallExpression* expr, const std::set<std::string>& assigned) {
+        auto& declaration = script->functions->getDeclaration(index);
+        auto mark = inline_slots_used;
+
+        InlineScope scope;
+        std::vector<int> stores;
+        for (size_t i = 0; i < expr->getArgs().size(); ++i) {
+            auto& name = declaration.getArgs()[i];
+            if (!assigned.contains(name)) {
+                if (auto value = foldConstant(expr->getArgs()[i].get())) {
+                    scope.constants.insert_or_assign(name, *value);
+                    continue;
+                }
+            }
+            accept(expr->getArgs()[i].get());
+            auto slot = borrowSlot();
+            scope.slots.insert_or_assign(name, slot);
+            stores.emplace_back(slot);
+        }
+        for (auto it = stores.rbegin(); it != stores.rend(); ++it) {
+            chunk->opcodes.emplace_back(OP_SET_LOCAL);
+            chunk->opcodes.emplace_back(*it);
+        }
+
+        inline_scopes.emplace_back(std::move(scope));
+        inlining.emplace_back(index);
+        inline_assigned.emplace_back(&assigned);
+        bool returned = false;
+        for (auto& statement : script->functions->getBody(index)) {
+            accept(statement.get());
+            returned = dynamic_cast<ReturnStatement*>(statement.get()) != nullptr;
+        }
+        if (!returned) {
+            chunk->opcodes.emplace_back(OP_PUSH);
+            chunk->opcodes.emplace_back(0);
+        }
+        inline_assigned.pop_back();
+        inlining.pop_back();
+        inline_scopes.pop_back();
+        inline_slots_used = mark;
+    }
+
+    void declareInlineVariable(const std::string& name, Expression* initializer) {
+        if (!inline_assigned.back()->contains(name)) {
+            if (auto value = foldConstant(initializer)) {
+                inline_scopes.back().constants.insert_or_assign(name, *value);
+                forgetFacts();
+                return;
+            }
+        }
+        accept(initializer);
+        auto slot = borrowSlot();
+        chunk->opcodes.emplace_back(OP_SET_LOCAL);
+        chunk->opcodes.emplace_back(slot);
+        inline_scopes.back().slots.insert_or_assign(name, slot);
+        forgetFacts();
+    }
+
+    // Slots are named so that they count towards the frame size, with names
+    // no script can refer to.
+    auto borrowSlot() -> int {
+        if (inline_slots_used == inline_slots.size()) {
+            auto slot = static_cast<int>(chunk->variables.size());
+            chunk->variables.insert_or_assign("$inline" + std::to_string(inline_slots.size()), slot);
+            inline_slots.emplace_back(slot);
+        }
+        return inline_slots[inline_slots_used++];
+    }
+
+    // Runs the SSA passes over the finished chunk. The temporaries they add
+    // get hidden names too.
+    void optimize() {
+        if (!options.optimize) {
+            return;
+        }
+        auto arities = std::vector<size_t>();
+        for (size_t i = 0; i < script->functions->size(); ++i) {
+            arities.emplace_back(script->functions->getDeclaration(i).getArgs().size());
+        }
+
+        SsaOptions ssa;
+        if (chunk->natives) {
+            ssa.natives = chunk->natives->getFunctions();
+        }
+        ssa.function_arities = arities;
+        ssa.local_slots = chunk->getSlotCount();
+        ssa.is_function = isFunction();
+        if (isFunction()) {
+            ssa.global_slots = script->getSlotCount();
+        } else {
+            ssa.shared_locals.resize(ssa.local_slots);
+            for (const auto& [name, slot] : chunk->variables) {
+                ssa.shared_locals[slot] = !name.starts_with('$');
+            }
+        }
+
+        ssa.temporary_locals.resize(ssa.local_slots);
+        for (auto slot : inline_slots) {
+            ssa.temporary_locals[slot] = true;
+        }
+
+        auto temps = optimizeSsa(chunk->opcodes, chunk->lines, ssa);
+        for (size_t i = 0; i < temps; ++i) {
+            chunk->variables.insert_or_assign("$ssa" + std::to_string(i), static_cast<int>(ssa.local_slots + i));
+        }
+    }
+
+    // Falling off the end of a function returns 0.
+    void compileFunction(size_t index) {
+        auto& declaration = script->functions->getDeclaration(index);
+        function = &declaration;
+        chunk->name = declaration.getName();
+        for (size_t i = 0; i < declaration.getArgs().size(); ++i) {
+            auto slot = static_cast<int>(chunk->variables.size());
+            chunk->variables.insert_or_assign(declaration.getArgs()[i], slot);
+            if (declaration.getArgType(i) != ValueType::Int) {
+                chunk->slot_types.insert_or_assign(slot, declaration.getArgType(i));
+            }
+        }
+        for (auto& statement : script->functions->getBody(index)) {
+            accept(statement.get());
+        }
+        chunk->opcodes.emplace_back(OP_PUSH);
+        chunk->opcodes.emplace_back(0);
+        chunk->opcodes.emplace_back(OP_RET);
+        optimize();
     }
 };
 
-export void evaluate(TokenStream& stream) {
-    ASTVisitor visitor;
-    auto statements = parseStatements(stream);
+void FunctionLibrary::adopt(size_t index, ManagedShared<Chunk> chunk, int64_t line_delta) {
+    if (line_delta != 0) {
+        auto moved = ManagedShared(new Chunk());
+        moved->name = chunk->name;
+        moved->natives = chunk->natives;
+        moved->opcodes = chunk->opcodes;
+        moved->variables = chunk->variables;
+        moved->slot_types = chunk->slot_types;
+        chunk->lines.forEachEntry([&](size_t offset, uint32_t line) {
+            moved->lines.addLine(offset, static_cast<uint32_t>(line + line_delta));
+        });
+        chunk = std::move(moved);
+    }
+    auto& entry = entries_[index];
+    std::call_once(entry.compiled, [this, &entry, &chunk, index] {
+        entry.chunk = std::move(chunk);
+        entry.target = makeTarget(entry, index);
+    });
+    get(index);
+}
+
+auto FunctionLibrary::compile(size_t index) -> const CallTarget* {
+    auto& entry = entries_[index];
+    std::call_once(entry.compiled, [this, &entry, index] {
+        ASTVisitor visitor(script_);
+        visitor.compileFunction(index);
+        entry.chunk = visitor.chunk;
+        entry.target = makeTarget(entry, index);
+    });
+    return &entry.target;
+}
+
+auto FunctionLibrary::makeTarget(Entry& entry, size_t index) -> CallTarget {
+    return CallTarget{
+        .code = entry.chunk->opcodes.data(),
+        .lines = &entry.chunk->lines,
+        .name = entry.chunk->name.c_str(),
+        .arity = entry.declaration->getArgs().size(),
+        .slots = entry.chunk->getSlotCount(),
+        .memoize = isMemoized(index),
+    };
+}
+
+// Effects found in the bodies of the functions isPure() reached. `scopes`
+// holds the names the body being scanned declared, innermost block last.
+struct FunctionLibrary::PurityScan {
+    std::vector<std::set<std::string>> scopes;
+    struct Function {
+        bool pure;
+        bool costly;
+        std::vector<size_t> callees;
+    };
+
+    // Functions reached that were not decided before. Scanning a body only
+    // tells whether it is pure and loops itself; what it calls is taken
+    // into account afterwards.
+    std::map<size_t, Function> functions;
+    bool pure = true;
+    bool costly = false;
+    std::vector<size_t> callees;
+
+    [[nodiscard]] auto isDeclared(const std::string& name) const -> bool {
+        return std::any_of(scopes.begin(), scopes.end(), [&](const auto& scope) {
+            return scope.contains(name);
+        });
+    }
+};
+
+void FunctionLibrary::scanPurity(size_t index, PurityScan& scan) {
+    auto& declaration = *entries_[index].declaration;
+    scan.scopes.assign(1, std::set<std::string>(declaration.getArgs().begin(), declaration.getArgs().end()));
+    scan.pure = true;
+    scan.costly = false;
+    scan.callees.clear();
+
+    auto expression = [&](auto& self, Expression* expr) -> void {
+        if (!scan.pure || expr == nullptr) {
+            return;
+        }
+        if (auto variable = dynamic_cast<VariableExpression*>(expr)) {
+            scan.pure = scan.isDeclared(variable->getName());
+            return;
+        }
+        if (auto call = dynamic_cast<CallExpression*>(expr)) {
+            auto callee = dynamic_cast<VariableExpression*>(call->getCallee().get());
+            auto name = callee != nullptr ? callee->getName() : std::string();
+            // Resolved in the order the compiler does.
+            if (name == "print") {
+                scan.pure = false;
+            } else if (auto function = find(name)) {
+                scan.callees.emplace_back(*function);
+            } else if (script_.natives && script_.natives->find(name).has_value()) {
+                scan.pure = false;
+            } else {
+                scan.pure = name == "len" || name == "sum" || name == "dot" || name == "array";
+            }
+            for (auto& arg : call->getArgs()) {
+                self(self, arg.get());
+            }
+            return;
+        }
+        // Locals hold the only arrays a pure function can reach, so storing
+        // into one changes nothing its callers see.
+        if (auto assign = dynamic_cast<AssignExpression*>(expr)) {
+            if (auto variable = dynamic_cast<VariableExpression*>(assign->getLhs().get())) {
+                scan.pure = scan.isDeclared(variable->getName());
+            } else {
+                self(self, assign->getLhs().get());
+            }
+            self(self, assign->getRhs().get());
+            return;
+        }
+        forEachOperand(expr, [&](Expression* operand) {
+            self(self, operand);
+        });
+    };
+    auto statement = [&](auto& self, Statement* stmt) -> void {
+        if (!scan.pure || stmt == nullptr) {
+            return;
+        }
+        if (auto block = dynamic_cast<BlockStatement*>(stmt)) {
+            scan.scopes.emplace_back();
+            for (auto& nested : block->getStatements()) {
+                self(self, nested.get());
+            }
+            scan.scopes.pop_back();
+        } else if (auto branch = dynamic_cast<IfStatement*>(stmt)) {
+            expression(expression, branch->getCondition().get());
+            scan.scopes.emplace_back();
+            self(self, branch->getThenBranch().get());
+            scan.scopes.back().clear();
+            self(self, branch->getElseBranch().get());
+            scan.scopes.pop_back();
+        } else if (auto loop = dynamic_cast<WhileStatement*>(stmt)) {
+            scan.costly = true;
+            expression(expression, loop->getCondition().get());
+            scan.scopes.emplace_back();
+            self(self, loop->getBody().get());
+            scan.scopes.pop_back();
+        } else if (auto loop = dynamic_cast<ForStatement*>(stmt)) {
+            scan.costly = true;
+            scan.scopes.emplace_back();
+            self(self, loop->getInitializer().get());
+            expression(expression, loop->getCondition().get());
+            expression(expression, loop->getStep().get());
+            scan.scopes.emplace_back();
+            self(self, loop->getBody().get());
+            scan.scopes.pop_back();
+            scan.scopes.pop_back();
+        } else if (auto declaration = dynamic_cast<VariableDeclarationStatement*>(stmt)) {
+            expression(expression, declaration->getInitializer().get());
+            scan.scopes.back().insert(declaration->getName());
+        } else if (auto expr = dynamic_cast<ExpressionStatement*>(stmt)) {
+            expression(expression, expr->getExpr().get());
+        } else if (auto ret = dynamic_cast<ReturnStatement*>(stmt)) {
+            expression(expression, ret->getExpr().get());
+        } else {
+            scan.pure = false;
+        }
+    };
+    for (auto& stmt : getBody(index)) {
+        statement(statement, stmt.get());
+    }
+}
+
+// Scans every function reachable from `index` that was not decided before.
+// Recursive functions are assumed pure until a function they reach is found
+// not to be, which is then passed on to its callers until nothing changes.
+// Functions decided before cannot reach any that are not, so recursion only
+// goes through the ones scanned now.
+auto FunctionLibrary::isPure(size_t index) -> bool {
+    std::lock_guard lock(purity_mutex_);
+    if (entries_[index].pure.has_value()) {
+        return *entries_[index].pure;
+    }
+    auto scan = PurityScan();
+    auto pending = std::vector<size_t>{index};
+    while (!pending.empty()) {
+        auto function = pending.back();
+        pending.pop_back();
+        if (entries_[function].pure.has_value() || scan.functions.contains(function)) {
+            continue;
+        }
+        scanPurity(function, scan);
+        scan.functions.emplace(function, PurityScan::Function{scan.pure, scan.costly, scan.callees});
+        pending.insert(pending.end(), scan.callees.begin(), scan.callees.end());
+    }
+
+    for (auto& [function, state] : scan.functions) {
+        auto visited = std::set<size_t>();
+        auto reached = std::vector<size_t>(state.callees);
+        while (!reached.empty() && !state.costly) {
+            auto callee = reached.back();
+            reached.pop_back();
+            auto it = scan.functions.find(callee);
+            if (it == scan.functions.end() || !visited.insert(callee).second) {
+                continue;
+            }
+            state.costly = callee == function;
+            reached.insert(reached.end(), it->second.callees.begin(), it->second.callees.end());
+        }
+    }
+    auto changed = true;
+    while (changed) {
+        changed = false;
+        for (auto& [function, state] : scan.functions) {
+            for (auto callee : state.callees) {
+                auto it = scan.functions.find(callee);
+                auto pure = it != scan.functions.end() ? it->second.pure : *entries_[callee].pure;
+                auto costly = it != scan.functions.end() ? it->second.costly : entries_[callee].costly;
+                if ((state.pure && !pure) || (!state.costly && costly)) {
+                    state.pure = state.pure && pure;
+                    state.costly = state.costly || costly;
+                    changed = true;
+                }
+            }
+        }
+    }
+    for (const auto& [function, state] : scan.functions) {
+        entries_[function].pure = state.pure;
+        entries_[function].costly = state.costly;
+    }
+    return *entries_[index].pure;
+}
+
+auto FunctionLibrary::isMemoized(size_t index) -> bool {
+    auto& declaration = *entries_[index].declaration;
+    auto mode = declaration.getMemoizeMode();
+    if (mode == MemoizeMode::Never || (mode == MemoizeMode::Auto && !options_.memoize)) {
+        return false;
+    }
+    auto memoizable = hasIntSignature(declaration) && declaration.getArgs().size() <= MemoCache::kMaxArgs;
+    if (mode == MemoizeMode::Always) {
+        if (!memoizable) {
+            fprintf(stderr, "Function '%s' cannot be memoized: only functions of up to %zu ints returning an int can be\n", declaration.getName().c_str(), MemoCache::kMaxArgs);
+            abort();
+        }
+        if (!isPure(index)) {
+            fprintf(stderr, "Function '%s' cannot be memoized: it is not pure\n", declaration.getName().c_str());
+            abort();
+        }
+        return true;
+    }
+    return memoizable && isPure(index) && entries_[index].costly;
+}
+
+export auto parse(std::span<const Token> tokens) -> std::vector<ManagedShared<Statement>> {
+    // Function bodies lie between curly braces, which unlike other
+    // punctuation point into the source, so the text from the first brace
+    // to the last one holds all of them.
+    auto first = std::find_if(tokens.begin(), tokens.end(), [](const Token& token) {
+        return token.type == TOKEN_LEFT_CURLY;
+    });
+    auto last = std::find_if(tokens.rbegin(), tokens.rend(), [](const Token& token) {
+        return token.type == TOKEN_RIGHT_CURLY;
+    });
+    auto source = ParsedSource(std::string_view());
+    if (first != tokens.end() && last != tokens.rend() && first->str.data() < last->str.data()) {
+        source.source = std::string_view(first->str.data(), last->str.data() + 1);
+    }
+    auto stream = TokenStream(tokens);
+    stream.readToken();
+    return parseStatements(stream, source);
+}
+
+// Same result as parse(tokenize(source)), but tokens are lexed as the
+// parser asks for them, so no token array is built.
+export auto parse(std::string_view source) -> std::vector<ManagedShared<Statement>> {
+    auto stream = TokenStream(source);
+    auto parsed = ParsedSource(source);
+    stream.readToken();
+    return parseStatements(stream, parsed);
+}
+
+// Lexes and parses `source` on `pool`. The source is cut at top-level
+// statement boundaries into a few pieces per worker, which are parsed
+// independently and concatenated in source order, so the result is the same
+// as parse(tokenize(source)). Sources shorter than `min_piece_size` are
+// parsed on the calling thread.
+export auto parse(ThreadPool& pool, std::string_view source, size_t min_piece_size = 64 * 1024) -> std::vector<ManagedShared<Statement>> {
+    auto count = std::min(pool.getThreadCount() * 4, std::max<size_t>(source.size() / std::max<size_t>(min_piece_size, 1), 1));
+    auto pieces = splitSource(source, count);
+
+    auto parsePiece = [source](const SourcePiece& piece) {
+        auto stream = TokenStream(source.substr(0, piece.end), piece.begin, piece.line, piece.line_start);
+        // Each piece copies only its own text for the bodies it defers.
+        auto parsed = ParsedSource(source.substr(piece.begin, piece.end - piece.begin));
+        stream.readToken();
+        return parseStatements(stream, parsed);
+    };
+    if (pieces.size() == 1) {
+        return parsePiece(pieces.front());
+    }
+
+    auto results = std::vector<std::vector<ManagedShared<Statement>>>(pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        pool.submit([&parsePiece, &pieces, &results, i] {
+            results[i] = parsePiece(pieces[i]);
+        });
+    }
+    pool.wait();
+
+    size_t total = 0;
+    for (const auto& result : results) {
+        total += result.size();
+    }
+    std::vector<ManagedShared<Statement>> statements;
+    statements.reserve(total);
+    for (auto& result : results) {
+        std::move(result.begin(), result.end(), std::back_inserter(statements));
+    }
+    return statements;
+}
+
+// Names in `inputs` are declared up front in slots 0..inputs.size() - 1, so
+// that the host can bind values to them before the chunk runs.
+export auto compile(const std::vector<ManagedShared<Statement>>& statements, std::span<const std::string> inputs = {}, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>(), CompileOptions options = {}) -> ManagedShared<Chunk> {
+    ASTVisitor visitor(options);
+    if (natives) {
+        natives->freeze();
+    }
+    visitor.chunk->natives = std::move(natives);
+    for (auto& input : inputs) {
+        visitor.chunk->variables.insert_or_assign(input, visitor.chunk->variables.size());
+    }
     for (auto& statement : statements) {
         visitor.accept(statement.get());
     }
-    statements.clear();
     visitor.chunk->opcodes.emplace_back(OP_HALT);
-//    disassemble(visitor.chunk->opcodes.data(), visitor.chunk->opcodes.size());
-    execute(visitor.chunk->opcodes.data(), 0);
+    visitor.optimize();
+    return visitor.chunk;
+}
+
+// Runs `chunk` to its end, resuming it at every yield.
+export auto execute(VM& vm, const Chunk& chunk) -> VMStatus {
+    vm.load(chunk.getProgram());
+    return vm.runToCompletion();
+}
+
+export void execute(const Chunk& chunk, OutputSink& sink) {
+    VM vm(sink);
+    execute(vm, chunk);
+}
+
+export void execute(const Chunk& chunk) {
+    execute(chunk, getStdoutSink());
+}
+
+// Runs `chunk` `invocations` times on `pool`, each worker reusing one VM of
+// its own. All VMs write to `sink`, which therefore has to be thread-safe.
+export void execute(ThreadPool& pool, const Chunk& chunk, size_t invocations, OutputSink& sink) {
+    struct Context {
+        const Chunk& chunk;
+        OutputSink& sink;
+        std::vector<std::unique_ptr<VM>> vms;
+    };
+
+    auto context = Context{chunk, sink, std::vector<std::unique_ptr<VM>>(pool.getThreadCount())};
+    for (size_t i = 0; i < invocations; ++i) {
+        pool.submit([context = &context] {
+            auto& vm = context->vms[ThreadPool::getWorkerIndex()];
+            if (!vm) {
+                vm = std::make_unique<VM>(context->sink);
+            }
+            execute(*vm, context->chunk);
+        });
+    }
+    pool.wait();
+}
+
+export void evaluate(TokenStream& stream) {
+    auto source = ParsedSource(stream.getSource());
+    auto statements = parseStatements(stream, source);
+    auto chunk = compile(statements);
+    statements.clear();
+//    disassemble(chunk->opcodes.data(), chunk->opcodes.size());
+    execute(*chunk);
+}
+
+// Same as evaluate(TokenStream&), but runs each phase separately so that
+// their cost can be reported in `stats`.
+export void evaluate(std::string_view source, EvaluationStats& stats) {
+    std::vector<Token> tokens;
+    {
+        auto scope = PhaseScope(&stats.lex);
+        tokens = tokenize(source);
+    }
+    std::vector<ManagedShared<Statement>> statements;
+    {
+        auto scope = PhaseScope(&stats.parse);
+        statements = parse(tokens);
+    }
+    ManagedShared<Chunk> chunk;
+    {
+        auto scope = PhaseScope(&stats.compile);
+        chunk = compile(statements);
+        statements.clear();
+    }
+    {
+        auto scope = PhaseScope(&stats.execute);
+        execute(*chunk);
+    }
+    stats.token_count = tokens.size();
+    stats.ast_node_count = stats.parse.created_objects;
+    stats.bytecode_size = chunk->opcodes.size();
 }
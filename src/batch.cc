@@ -0,0 +1,238 @@
+module;
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+
+export module cpp_script:batch;
+import :ir;
+import :gc;
+import :ast;
+import :kernel;
+
+// Evaluates a compiled chunk over columns instead of single values: each
+// instruction is dispatched once per block of kBlockSize rows and applied to
+// the whole block by a SIMD kernel. Only straight-line arithmetic is
+// supported; PRINT and calls are rejected when the program is created.
+//
+// With T = double all arithmetic, including division, is floating point.
+// With T = int a division by zero or of INT32_MIN by -1 in any row aborts,
+// like it traps in the VM.
+export template<typename T>
+class BatchProgram {
+public:
+    static_assert(std::is_same_v<T, int> || std::is_same_v<T, double>);
+
+    static constexpr size_t kBlockSize = 1024;
+
+    explicit BatchProgram(ManagedShared<Chunk> chunk) : chunk_(std::move(chunk)), use_avx2_(hasAvx2()) {
+        size_t sp = 0;
+        size_t max_slot = 0;
+        auto& code = chunk_->opcodes;
+        for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+            auto opcode = static_cast<OpCode>(code[ip]);
+            auto arg = getOperandCount(opcode) != 0 ? code[ip + 1] : 0;
+            switch (opcode) {
+                case OP_HALT:
+                    break;
+                case OP_PUSH:
+                case OP_GET_LOCAL:
+                    sp += 1;
+                    break;
+                case OP_SET_LOCAL:
+                case OP_POP:
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                    sp -= 1;
+                    break;
+                case OP_NEG:
+                    break;
+                default:
+                    fprintf(stderr, "Opcode %d is not supported in batch mode\n", opcode);
+                    abort();
+            }
+            if (opcode == OP_GET_LOCAL || opcode == OP_SET_LOCAL) {
+                max_slot = std::max(max_slot, static_cast<size_t>(arg) + 1);
+            }
+            max_depth_ = std::max(max_depth_, sp);
+            instructions_.emplace_back(Instruction{opcode, arg});
+        }
+
+        max_slot = std::max(max_slot, chunk_->getSlotCount());
+        columns_.resize(max_slot);
+        slots_.resize(max_slot * kBlockSize);
+        stack_.resize(max_depth_ * kBlockSize);
+    }
+
+    // Binds the variable `name` to an input column. Every bound column has to
+    // hold at least as many rows as the output passed to run().
+    void bind(const std::string& name, std::span<const T> column) {
+        columns_[chunk_->getVariable(name)] = column;
+    }
+
+    // Runs the program for out.size() rows and stores the final value of the
+    // variable `result` for every row in `out`.
+    void run(std::span<T> out, const std::string& result) {
+        auto result_slot = static_cast<size_t>(chunk_->getVariable(result));
+        for (auto& column : columns_) {
+            if (column.data() != nullptr && column.size() < out.size()) {
+                fprintf(stderr, "Input column is shorter than the output\n");
+                abort();
+            }
+        }
+
+        std::vector<Entry> stack(max_depth_);
+        std::vector<Entry> slots(columns_.size());
+        for (size_t row = 0; row < out.size(); row += kBlockSize) {
+            auto n = std::min(kBlockSize, out.size() - row);
+            runBlock(stack, slots, row, n);
+
+            auto& value = slots[result_slot];
+            if (value.scalar) {
+                std::fill_n(out.data() + row, n, value.value);
+            } else {
+                std::memcpy(out.data() + row, value.data, n * sizeof(T));
+            }
+        }
+    }
+
+private:
+    struct Instruction {
+        OpCode opcode;
+        int arg;
+    };
+
+    struct Entry {
+        const T* data;
+        T value;
+        bool scalar;
+
+        auto operand() const -> BatchOperand<T> {
+            return scalar ? BatchOperand<T>{&value, true} : BatchOperand<T>{data, false};
+        }
+    };
+
+    void runBlock(std::vector<Entry>& stack, std::vector<Entry>& slots, size_t row, size_t n) {
+        for (size_t slot = 0; slot < slots.size(); ++slot) {
+            if (columns_[slot].data() != nullptr) {
+                slots[slot] = Entry{columns_[slot].data() + row, T(), false};
+            } else {
+                slots[slot] = Entry{nullptr, T(), true};
+            }
+        }
+
+        size_t sp = 0;
+        for (auto& instruction : instructions_) {
+            switch (instruction.opcode) {
+                case OP_HALT:
+                    return;
+                case OP_PUSH:
+                    stack[sp++] = Entry{nullptr, static_cast<T>(instruction.arg), true};
+                    break;
+                case OP_GET_LOCAL:
+                    stack[sp++] = slots[instruction.arg];
+                    break;
+                case OP_POP:
+                    sp -= 1;
+                    break;
+                case OP_SET_LOCAL: {
+                    auto& value = stack[--sp];
+                    auto& slot = slots[instruction.arg];
+                    if (value.scalar) {
+                        slot = value;
+                    } else {
+                        auto buffer = slots_.data() + instruction.arg * kBlockSize;
+                        if (value.data != buffer) {
+                            detach(stack, sp, buffer, n);
+                            std::memmove(buffer, value.data, n * sizeof(T));
+                        }
+                        slot = Entry{buffer, T(), false};
+                    }
+                    break;
+                }
+                case OP_ADD:
+                    binary(BatchOp::Add, stack, sp, n);
+                    break;
+                case OP_SUB:
+                    binary(BatchOp::Sub, stack, sp, n);
+                    break;
+                case OP_MUL:
+                    binary(BatchOp::Mul, stack, sp, n);
+                    break;
+                case OP_DIV:
+                    binary(BatchOp::Div, stack, sp, n);
+                    break;
+                case OP_NEG: {
+                    auto& value = stack[sp - 1];
+                    if (value.scalar) {
+                        value.value = -value.value;
+                    } else {
+                        auto buffer = stack_.data() + (sp - 1) * kBlockSize;
+                        if (use_avx2_) {
+                            applyAvx2Negate(value.data, buffer, n);
+                        } else {
+                            applyScalarNegate(value.data, buffer, n);
+                        }
+                        value.data = buffer;
+                    }
+                    break;
+                }
+                default:
+                    abort();
+            }
+        }
+    }
+
+    // Loads of a slot alias its buffer, and SSA lowering reuses the slot of
+    // a temp once it was last read, possibly while such a load is still on
+    // the stack. Before the buffer is overwritten, those entries are moved
+    // to the scratch column of their own stack position, which only the
+    // result of an operation at that position would use.
+    void detach(std::vector<Entry>& stack, size_t sp, const T* buffer, size_t n) {
+        for (size_t i = 0; i < sp; ++i) {
+            if (!stack[i].scalar && stack[i].data == buffer) {
+                auto scratch = stack_.data() + i * kBlockSize;
+                std::memcpy(scratch, buffer, n * sizeof(T));
+                stack[i].data = scratch;
+            }
+        }
+    }
+
+    // The result goes to the scratch column of the lhs stack position, which
+    // neither operand can alias except elementwise in place.
+    void binary(BatchOp op, std::vector<Entry>& stack, size_t& sp, size_t n) {
+        auto rhs = stack[--sp];
+        auto& lhs = stack[sp - 1];
+        if (op == BatchOp::Div) {
+            checkDivision(lhs.operand(), rhs.operand(), lhs.scalar && rhs.scalar ? 1 : n);
+        }
+        if (lhs.scalar && rhs.scalar) {
+            applyScalarKernel(op, lhs.operand(), rhs.operand(), &lhs.value, 1);
+            return;
+        }
+        auto buffer = stack_.data() + (sp - 1) * kBlockSize;
+        if (use_avx2_) {
+            applyAvx2Kernel(op, lhs.operand(), rhs.operand(), buffer, n);
+        } else {
+            applyScalarKernel(op, lhs.operand(), rhs.operand(), buffer, n);
+        }
+        lhs = Entry{buffer, T(), false};
+    }
+
+private:
+    ManagedShared<Chunk> chunk_;
+    bool use_avx2_;
+    size_t max_depth_ = 0;
+    std::vector<Instruction> instructions_;
+    std::vector<std::span<const T>> columns_;
+    std::vector<T> slots_;
+    std::vector<T> stack_;
+};
@@ -0,0 +1,92 @@
+#include <string>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <filesystem>
+#include <string_view>
+
+import cpp_script;
+
+// Compiles a script with the regular compiler while the project is being
+// built and writes its bytecode out as C++, so that a program can run it
+// without lexing, parsing or compiling anything at startup:
+//
+//     cpp_script_embed default.cps default_script.inc kDefaultScript
+//
+// writes kDefaultScriptSource, kDefaultScriptCode and kDefaultScriptSlots.
+// Only top-level code that needs nothing but its slots can be embedded:
+// functions, natives and string literals live in tables of the process that
+// compiled them.
+
+static auto quote(std::string_view text) -> std::string {
+    auto quoted = std::string("\"");
+    for (auto c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c == '\n') {
+            quoted += "\\n\"\n    \"";
+        } else if (c < ' ' || c > '~') {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\%03o", static_cast<unsigned char>(c));
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    auto continued = std::string_view("\n    \"");
+    if (quoted.ends_with(continued)) {
+        quoted.resize(quoted.size() - continued.size());
+        return quoted;
+    }
+    return quoted + "\"";
+}
+
+auto main(int argc, char** argv) -> int {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <script> <output> <name>\n", argv[0]);
+        return 2;
+    }
+    auto input = std::ifstream(argv[1], std::ios::binary);
+    if (!input) {
+        fprintf(stderr, "Failed to open '%s'\n", argv[1]);
+        return 1;
+    }
+    auto source = std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    auto name = std::string(argv[3]);
+
+    auto chunk = compile(parse(tokenize(source)));
+    if (chunk->functions && chunk->functions->size() != 0) {
+        fprintf(stderr, "%s: embedded scripts cannot declare functions\n", argv[1]);
+        return 1;
+    }
+    auto& code = chunk->opcodes;
+    for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+        if (code[ip] == OP_PUSH_STRING || code[ip] == OP_CALL || code[ip] == OP_CALL_NATIVE) {
+            fprintf(stderr, "%s: embedded scripts cannot use strings or call functions other than print()\n", argv[1]);
+            return 1;
+        }
+    }
+
+    auto output = std::string();
+    output += "// Generated by cpp_script_embed from " + std::filesystem::path(argv[1]).filename().string() + ". Do not edit.\n\n";
+    output += "static constexpr std::string_view " + name + "Source = " + quote(source) + ";\n\n";
+    output += "static constexpr int " + name + "Code[] = {\n";
+    for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+        output += "   ";
+        for (size_t i = 0; i <= getOperandCount(code[ip]); ++i) {
+            output += " " + std::to_string(code[ip + i]) + ",";
+        }
+        output += "\n";
+    }
+    output += "};\n\n";
+    output += "static constexpr size_t " + name + "Slots = " + std::to_string(chunk->getProgram().slots) + ";\n";
+
+    auto file = std::ofstream(argv[2], std::ios::binary | std::ios::trunc);
+    file << output;
+    if (!file.flush()) {
+        fprintf(stderr, "Failed to write '%s'\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
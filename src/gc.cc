@@ -6,17 +6,39 @@ module;
 
 #include <atomic>
 #include <memory>
+#include <cstdint>
 #include <utility>
+#include <algorithm>
 
 export module cpp_script:gc;
 
-template<typename T>
+export template<typename T>
 class ManagedShared;
 
-class ManagedObject {
+// Objects created on a thread, and how many of them are alive net of those
+// destroyed on it. Kept per thread, so that measurements taken on
+// concurrent threads do not count each other's objects.
+export struct ManagedObjectCounters {
+    uint64_t created = 0;
+    int64_t live = 0;
+    int64_t peak_live = 0;
+};
+
+export class ManagedObject {
 public:
-    explicit ManagedObject() : strong_references_(1) {}
-    virtual ~ManagedObject() {}
+    explicit ManagedObject() : strong_references_(1) {
+        counters_.created += 1;
+        counters_.live += 1;
+        counters_.peak_live = std::max(counters_.peak_live, counters_.live);
+    }
+
+    virtual ~ManagedObject() {
+        counters_.live -= 1;
+    }
+
+    static auto getThreadCounters() -> ManagedObjectCounters& {
+        return counters_;
+    }
 
     void retain() {
         strong_references_.fetch_add(1, std::memory_order_relaxed);
@@ -30,6 +52,8 @@ public:
     }
 
 private:
+    static inline thread_local ManagedObjectCounters counters_;
+
     std::atomic_uint64_t strong_references_;
 };
 
@@ -145,8 +169,8 @@ private:
     T* object_;
 };
 
-template<typename T>
+export template<typename T>
 ManagedShared(T*) -> ManagedShared<T>;
 
-template<typename T>
+export template<typename T>
 ManagedShared(ManagedShared<T>) -> ManagedShared<T>;
\ No newline at end of file
@@ -4,8 +4,12 @@
 
 module;
 
+#include <atomic>
 #include <cstdio>
+#include <cstdint>
 #include <cstdlib>
+#include <vector>
+#include <optional>
 
 export module cpp_script:ir;
 
@@ -24,8 +28,331 @@ export enum OpCode {
     OP_DIV,
     OP_NEG,
     OP_PRINT,
+    OP_POP,
+    OP_CALL_NATIVE,
+    // Comparisons push 1 if they hold and 0 otherwise.
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    // Jumps take the absolute offset of their target as their last operand.
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    // Pop two values and jump if the comparison holds between them.
+    OP_JUMP_IF_LT,
+    OP_JUMP_IF_LE,
+    OP_JUMP_IF_GT,
+    OP_JUMP_IF_GE,
+    OP_JUMP_IF_EQ,
+    OP_JUMP_IF_NE,
+    // Compare a local slot with a constant and jump, all in one dispatch,
+    // which is what the condition of a counted loop compiles to. Operands
+    // are the slot, the constant and the target.
+    OP_JUMP_IF_LT_LOCAL_CONST,
+    OP_JUMP_IF_LE_LOCAL_CONST,
+    OP_JUMP_IF_GT_LOCAL_CONST,
+    OP_JUMP_IF_GE_LOCAL_CONST,
+    OP_JUMP_IF_EQ_LOCAL_CONST,
+    OP_JUMP_IF_NE_LOCAL_CONST,
+    // Suspends the VM, which continues with the next instruction when it is
+    // run again.
+    OP_YIELD,
+    // Strings are int handles (see StringHeap). PUSH_STRING pushes the
+    // interned string whose id is its operand.
+    OP_PUSH_STRING,
+    OP_CONCAT,
+    OP_STRING_EQ,
+    OP_STRING_NE,
+    OP_STRING_LENGTH,
+    // PRINT of arguments some of which are strings. The operand holds the
+    // argument count in its low 8 bits and above them a mask of which
+    // arguments are strings.
+    OP_PRINT_MIXED,
+    // Arrays are int handles too (see ArrayHeap). MAKE_ARRAY pops as many
+    // elements as its operand says, NEW_ARRAY a length to fill with zeros.
+    OP_MAKE_ARRAY,
+    OP_NEW_ARRAY,
+    // Pops an index and an array.
+    OP_ARRAY_GET,
+    // Pops a value, an index and an array, and pushes nothing.
+    OP_ARRAY_SET,
+    OP_ARRAY_LENGTH,
+    OP_ARRAY_SUM,
+    OP_ARRAY_DOT,
+    // Elementwise arithmetic producing a new array. The operand is made by
+    // encodeArrayArith().
+    OP_ARRAY_ARITH,
 };
 
+// Number of opcodes, which persisted bytecode records.
+export constexpr int kOpcodeCount = OP_ARRAY_ARITH + 1;
+
+// Arguments a PRINT_MIXED can take, as many as its operand has mask bits.
+export constexpr int kPrintMixedMaxArgs = 23;
+
+export constexpr auto encodePrintMixed(int argc, int string_mask) -> int {
+    return argc | (string_mask << 8);
+}
+
+// `op` is a BatchOp; a scalar operand is an int used for every element.
+export constexpr auto encodeArrayArith(int op, bool lhs_scalar, bool rhs_scalar) -> int {
+    return op | (lhs_scalar ? 4 : 0) | (rhs_scalar ? 8 : 0);
+}
+
+// Result of the arithmetic instruction `opcode` on constant operands, computed
+// the way the VM computes it (NEG only uses `rhs`). Nothing is returned for
+// divisions that would trap, so that they still fail when they run.
+export constexpr auto foldOperation(int opcode, int lhs, int rhs) -> std::optional<int> {
+    auto a = static_cast<uint32_t>(lhs);
+    auto b = static_cast<uint32_t>(rhs);
+    switch (opcode) {
+        case OP_ADD:
+            return static_cast<int>(a + b);
+        case OP_SUB:
+            return static_cast<int>(a - b);
+        case OP_MUL:
+            return static_cast<int>(a * b);
+        case OP_DIV:
+            if (rhs == 0 || (lhs == INT32_MIN && rhs == -1)) {
+                return std::nullopt;
+            }
+            return lhs / rhs;
+        case OP_NEG:
+            return static_cast<int>(0u - b);
+        case OP_LT:
+            return lhs < rhs ? 1 : 0;
+        case OP_LE:
+            return lhs <= rhs ? 1 : 0;
+        case OP_GT:
+            return lhs > rhs ? 1 : 0;
+        case OP_GE:
+            return lhs >= rhs ? 1 : 0;
+        case OP_EQ:
+            return lhs == rhs ? 1 : 0;
+        case OP_NE:
+            return lhs != rhs ? 1 : 0;
+        default:
+            return std::nullopt;
+    }
+}
+
+export constexpr auto isComparison(int opcode) -> bool {
+    return opcode >= OP_LT && opcode <= OP_NE;
+}
+
+// Comparison that holds exactly when `comparison` does not.
+export constexpr auto negateComparison(int comparison) -> OpCode {
+    switch (comparison) {
+        case OP_LT:
+            return OP_GE;
+        case OP_LE:
+            return OP_GT;
+        case OP_GT:
+            return OP_LE;
+        case OP_GE:
+            return OP_LT;
+        case OP_EQ:
+            return OP_NE;
+        default:
+            return OP_EQ;
+    }
+}
+
+// Comparison that gives the same result with its operands swapped.
+export constexpr auto mirrorComparison(int comparison) -> OpCode {
+    switch (comparison) {
+        case OP_LT:
+            return OP_GT;
+        case OP_LE:
+            return OP_GE;
+        case OP_GT:
+            return OP_LT;
+        case OP_GE:
+            return OP_LE;
+        default:
+            return static_cast<OpCode>(comparison);
+    }
+}
+
+// OP_JUMP_IF_<comparison>, and its form that compares a local with a constant.
+export constexpr auto getBranchOpcode(int comparison) -> OpCode {
+    return static_cast<OpCode>(OP_JUMP_IF_LT + (comparison - OP_LT));
+}
+
+export constexpr auto getLocalConstBranchOpcode(int comparison) -> OpCode {
+    return static_cast<OpCode>(OP_JUMP_IF_LT_LOCAL_CONST + (comparison - OP_LT));
+}
+
+// Comparison a fused compare-and-branch instruction tests.
+export constexpr auto getBranchComparison(int opcode) -> OpCode {
+    if (opcode >= OP_JUMP_IF_LT_LOCAL_CONST) {
+        return static_cast<OpCode>(OP_LT + (opcode - OP_JUMP_IF_LT_LOCAL_CONST));
+    }
+    return static_cast<OpCode>(OP_LT + (opcode - OP_JUMP_IF_LT));
+}
+
+export constexpr auto isJump(int opcode) -> bool {
+    return opcode >= OP_JUMP && opcode <= OP_JUMP_IF_NE_LOCAL_CONST;
+}
+
+// Maps bytecode offsets back to source lines. Entries are stored as pairs of
+// (offset delta, line delta) varints, the line delta zigzag-encoded so that
+// code generated out of source order still packs into one or two bytes.
+export class LineTable {
+public:
+    void addLine(size_t offset, uint32_t line) {
+        if (!bytes_.empty() && line == last_line_) {
+            return;
+        }
+        writeVarint(offset - last_offset_);
+        auto delta = static_cast<int64_t>(line) - static_cast<int64_t>(last_line_);
+        writeVarint(static_cast<uint64_t>((delta << 1) ^ (delta >> 63)));
+        last_offset_ = offset;
+        last_line_ = line;
+    }
+
+    // Does not allocate, so it is safe to call from a signal handler.
+    [[nodiscard]] auto getLine(size_t offset) const -> uint32_t {
+        size_t pos = 0;
+        size_t entry_offset = 0;
+        int64_t entry_line = 0;
+        uint32_t line = 0;
+        while (pos < bytes_.size()) {
+            entry_offset += readVarint(pos);
+            auto zigzag = readVarint(pos);
+            entry_line += static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            if (entry_offset > offset) {
+                break;
+            }
+            line = static_cast<uint32_t>(entry_line);
+        }
+        return line;
+    }
+
+    // Calls `fn(offset, line)` for each entry, in order of offsets. Walking
+    // the whole table this way is linear, unlike a getLine() per offset.
+    template<typename Fn>
+    void forEachEntry(Fn&& fn) const {
+        size_t pos = 0;
+        size_t entry_offset = 0;
+        int64_t entry_line = 0;
+        while (pos < bytes_.size()) {
+            entry_offset += readVarint(pos);
+            auto zigzag = readVarint(pos);
+            entry_line += static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            fn(entry_offset, static_cast<uint32_t>(entry_line));
+        }
+    }
+
+    [[nodiscard]] auto size() const -> size_t {
+        return bytes_.size();
+    }
+
+private:
+    void writeVarint(uint64_t value) {
+        while (value >= 0x80) {
+            bytes_.emplace_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        bytes_.emplace_back(static_cast<uint8_t>(value));
+    }
+
+    auto readVarint(size_t& pos) const -> uint64_t {
+        uint64_t value = 0;
+        for (int shift = 0; pos < bytes_.size(); shift += 7) {
+            auto byte = bytes_[pos++];
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+        return value;
+    }
+
+private:
+    std::vector<uint8_t> bytes_;
+    size_t last_offset_ = 0;
+    uint32_t last_line_ = 0;
+};
+
+// An activation record as seen from outside the interpreter. The interpreter
+// publishes the offset it is executing at into `ip` at calls, backward jumps
+// and whenever it stops, and before every instruction while
+// `profiler_active` is set, so a sampling profiler can walk `active_frame`
+// from a signal handler. `fp` and `slots` locate the frame's variables in
+// the VM's slot array. `memoized` frames store their result in the VM's
+// memo cache when they return.
+export struct Frame {
+    const char* name = "<main>";
+    const int* code = nullptr;
+    const LineTable* lines = nullptr;
+    Frame* caller = nullptr;
+    volatile size_t ip = 0;
+    size_t fp = 0;
+    size_t slots = 0;
+    bool memoized = false;
+};
+
+export thread_local Frame* volatile active_frame = nullptr;
+
+// Makes `frame` the one a sampling profiler on this thread walks from. The
+// fence keeps the compiler from moving stores that fill in the frame past
+// its publication; the profiler pairs it with an acquire fence after it
+// reads `active_frame`.
+export inline void publishFrame(Frame* frame) {
+    std::atomic_signal_fence(std::memory_order_release);
+    active_frame = frame;
+}
+
+// Set while a sampling profiler is running. The interpreter reads it when a
+// run starts, so runs started earlier keep publishing `ip` only at calls and
+// backward jumps.
+export std::atomic<bool> profiler_active = false;
+
+export auto getOperandCount(int opcode) -> size_t {
+    switch (opcode) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_PUSH:
+        case OP_CALL:
+        case OP_PRINT:
+        case OP_CALL_NATIVE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LT:
+        case OP_JUMP_IF_LE:
+        case OP_JUMP_IF_GT:
+        case OP_JUMP_IF_GE:
+        case OP_JUMP_IF_EQ:
+        case OP_JUMP_IF_NE:
+        case OP_PUSH_STRING:
+        case OP_PRINT_MIXED:
+        case OP_MAKE_ARRAY:
+        case OP_ARRAY_ARITH:
+            return 1;
+        case OP_JUMP_IF_LT_LOCAL_CONST:
+        case OP_JUMP_IF_LE_LOCAL_CONST:
+        case OP_JUMP_IF_GT_LOCAL_CONST:
+        case OP_JUMP_IF_GE_LOCAL_CONST:
+        case OP_JUMP_IF_EQ_LOCAL_CONST:
+        case OP_JUMP_IF_NE_LOCAL_CONST:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Offset the jump at `ip` goes to.
+export auto getJumpTarget(const int* code, size_t ip) -> size_t {
+    return static_cast<size_t>(code[ip + getOperandCount(code[ip])]);
+}
+
 export void disassemble(const int* code, size_t len) {
     static constexpr const char* opcodes[] = {
         "HALT",
@@ -41,134 +368,63 @@ export void disassemble(const int* code, size_t len) {
         "MUL",
         "DIV",
         "NEG",
-        "PRINT"
+        "PRINT",
+        "POP",
+        "CALL_NATIVE",
+        "LT",
+        "LE",
+        "GT",
+        "GE",
+        "EQ",
+        "NE",
+        "JUMP",
+        "JUMP_IF_FALSE",
+        "JUMP_IF_TRUE",
+        "JUMP_IF_LT",
+        "JUMP_IF_LE",
+        "JUMP_IF_GT",
+        "JUMP_IF_GE",
+        "JUMP_IF_EQ",
+        "JUMP_IF_NE",
+        "JUMP_IF_LT_LOCAL_CONST",
+        "JUMP_IF_LE_LOCAL_CONST",
+        "JUMP_IF_GT_LOCAL_CONST",
+        "JUMP_IF_GE_LOCAL_CONST",
+        "JUMP_IF_EQ_LOCAL_CONST",
+        "JUMP_IF_NE_LOCAL_CONST",
+        "YIELD",
+        "PUSH_STRING",
+        "CONCAT",
+        "STRING_EQ",
+        "STRING_NE",
+        "STRING_LENGTH",
+        "PRINT_MIXED",
+        "MAKE_ARRAY",
+        "NEW_ARRAY",
+        "ARRAY_GET",
+        "ARRAY_SET",
+        "ARRAY_LENGTH",
+        "ARRAY_SUM",
+        "ARRAY_DOT",
+        "ARRAY_ARITH",
     };
 
     for (size_t ip = 0; ip < len; ++ip) {
         auto opcode = code[ip];
         fprintf(stdout, "%04zu %s", ip, opcodes[opcode]);
-        if (opcode == OP_GET_GLOBAL || opcode == OP_SET_GLOBAL ||
-            opcode == OP_GET_LOCAL || opcode == OP_SET_LOCAL ||
-            opcode == OP_PUSH || opcode == OP_PRINT ||
-            opcode == OP_CALL || opcode == OP_RET) {
+        for (size_t i = 0; i < getOperandCount(opcode); ++i) {
             fprintf(stdout, " %d", code[++ip]);
         }
         fprintf(stdout, "\n");
     }
 }
 
-export void execute(const int* code, size_t ip) {
-    static constexpr void* jumps[] = {
-        &&JUMP_OP_HALT,
-        &&JUMP_OP_GET_LOCAL,
-        &&JUMP_OP_SET_LOCAL,
-        &&JUMP_OP_GET_GLOBAL,
-        &&JUMP_OP_SET_GLOBAL,
-        &&JUMP_OP_PUSH,
-        &&JUMP_OP_CALL,
-        &&JUMP_OP_RET,
-        &&JUMP_OP_ADD,
-        &&JUMP_OP_SUB,
-        &&JUMP_OP_MUL,
-        &&JUMP_OP_DIV,
-        &&JUMP_OP_NEG,
-        &&JUMP_OP_PRINT,
-    };
-
-    size_t sp = 0;
-    size_t fp = 0;
-
-    int stack[256] = {};
-    int globals[256] = {};
-
-    goto *jumps[code[ip++]];
-
-JUMP_OP_HALT:
-    {
-        goto JUMP_EXIT;
-    }
-JUMP_OP_GET_LOCAL:
-    {
-        auto arg = code[ip++];
-        stack[sp++] = globals[fp + arg];
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_SET_LOCAL:
-    {
-        auto arg = code[ip++];
-        globals[fp + arg] = stack[--sp];
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_GET_GLOBAL:
-    {
-        auto arg = code[ip++];
-        globals[arg] = stack[--sp];
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_SET_GLOBAL:
-    {
-        auto arg = code[ip++];
-        stack[sp++] = globals[arg];
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_PUSH:
-    {
-        auto value = code[ip++];
-        stack[sp++] = value;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_CALL:
-    {
-        abort();
-        goto *jumps[code[ip++]];
+// Number of instructions in `code`. For code without jumps or calls, this
+// is how many dispatches executing it from start to HALT takes.
+export auto countInstructions(const int* code, size_t len) -> size_t {
+    size_t count = 0;
+    for (size_t ip = 0; ip < len; ip += 1 + getOperandCount(code[ip])) {
+        count += 1;
     }
-JUMP_OP_RET:
-    {
-        abort();
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_ADD:
-    {
-        auto rhs = stack[--sp];
-        auto lhs = stack[--sp];
-        stack[sp++] = lhs + rhs;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_SUB:
-    {
-        auto rhs = stack[--sp];
-        auto lhs = stack[--sp];
-        stack[sp++] = lhs - rhs;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_MUL:
-    {
-        auto rhs = stack[--sp];
-        auto lhs = stack[--sp];
-        stack[sp++] = lhs * rhs;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_DIV:
-    {
-        auto rhs = stack[--sp];
-        auto lhs = stack[--sp];
-        stack[sp++] = lhs / rhs;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_NEG:
-    {
-        auto rhs = stack[--sp];
-        stack[sp++] = -rhs;
-        goto *jumps[code[ip++]];
-    }
-JUMP_OP_PRINT:
-    {
-        auto argc = code[ip++];
-        for (int i = 0; i < argc; i++) {
-            fprintf(stdout, "%d ", stack[sp - argc + i]);
-        }
-        sp -= argc;
-        goto *jumps[code[ip++]];
-    }
-JUMP_EXIT:
-}
\ No newline at end of file
+    return count;
+}
@@ -0,0 +1,306 @@
+module;
+
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+export module cpp_script:kernel;
+
+// Elementwise kernels over runs of ints or doubles, each with a scalar
+// version and an AVX2 one that is only called when hasAvx2() holds. Batch
+// programs apply them to columns, the VM to arrays.
+
+export enum class BatchOp {
+    Add,
+    Sub,
+    Mul,
+    Div,
+};
+
+// Operand of a batch kernel: either a column of `n` values or a single value
+// broadcast to every row.
+template<typename T>
+struct BatchOperand {
+    const T* data;
+    bool scalar;
+
+    auto at(size_t i) const -> T {
+        return scalar ? data[0] : data[i];
+    }
+};
+
+template<typename T>
+void applyScalarKernel(BatchOp op, BatchOperand<T> lhs, BatchOperand<T> rhs, T* out, size_t n) {
+    switch (op) {
+        case BatchOp::Add: for (size_t i = 0; i < n; ++i) out[i] = lhs.at(i) + rhs.at(i); break;
+        case BatchOp::Sub: for (size_t i = 0; i < n; ++i) out[i] = lhs.at(i) - rhs.at(i); break;
+        case BatchOp::Mul: for (size_t i = 0; i < n; ++i) out[i] = lhs.at(i) * rhs.at(i); break;
+        case BatchOp::Div: for (size_t i = 0; i < n; ++i) out[i] = lhs.at(i) / rhs.at(i); break;
+    }
+}
+
+// Integer division traps in the VM on a zero divisor and on INT32_MIN / -1,
+// but the AVX2 kernel divides doubles and would quietly produce INT32_MIN
+// instead. Callers check the operands of an int division with this first,
+// so that it fails on every path.
+template<typename T>
+void checkDivision(BatchOperand<T> lhs, BatchOperand<T> rhs, size_t n) {
+    if constexpr (std::is_same_v<T, int>) {
+        if (rhs.scalar) {
+            if (rhs.data[0] == 0) {
+                fprintf(stderr, "Division by zero\n");
+                abort();
+            }
+            if (rhs.data[0] != -1) {
+                return;
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            auto divisor = rhs.at(i);
+            if (divisor == 0) [[unlikely]] {
+                fprintf(stderr, "Division by zero\n");
+                abort();
+            }
+            if (divisor == -1 && lhs.at(i) == INT32_MIN) [[unlikely]] {
+                fprintf(stderr, "Division overflow\n");
+                abort();
+            }
+        }
+    }
+}
+
+template<typename T>
+void applyScalarNegate(const T* in, T* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = -in[i];
+    }
+}
+
+// Integer sums wrap around like AVX2 lanes do, so both paths agree.
+template<typename T>
+using Accumulator = std::conditional_t<std::is_same_v<T, int>, uint32_t, T>;
+
+template<typename T>
+auto applyScalarSum(const T* in, size_t n) -> T {
+    auto sum = Accumulator<T>();
+    for (size_t i = 0; i < n; ++i) {
+        sum += static_cast<Accumulator<T>>(in[i]);
+    }
+    return static_cast<T>(sum);
+}
+
+template<typename T>
+auto applyScalarDot(const T* lhs, const T* rhs, size_t n) -> T {
+    auto sum = Accumulator<T>();
+    for (size_t i = 0; i < n; ++i) {
+        sum += static_cast<Accumulator<T>>(lhs[i]) * static_cast<Accumulator<T>>(rhs[i]);
+    }
+    return static_cast<T>(sum);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+auto load8(BatchOperand<int> operand, size_t i) -> __m256i {
+    return operand.scalar
+        ? _mm256_set1_epi32(operand.data[0])
+        : _mm256_loadu_si256(reinterpret_cast<const __m256i*>(operand.data + i));
+}
+
+__attribute__((target("avx2")))
+auto load4(BatchOperand<double> operand, size_t i) -> __m256d {
+    return operand.scalar ? _mm256_set1_pd(operand.data[0]) : _mm256_loadu_pd(operand.data + i);
+}
+
+// AVX2 has no integer division, but truncating the double quotient of two
+// 32-bit integers is exact, so four lanes at a time go through vdivpd.
+__attribute__((target("avx2")))
+auto divide4(BatchOperand<int> lhs, BatchOperand<int> rhs, size_t i) -> __m128i {
+    auto a = lhs.scalar ? _mm256_set1_pd(lhs.data[0]) : _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs.data + i)));
+    auto b = rhs.scalar ? _mm256_set1_pd(rhs.data[0]) : _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs.data + i)));
+    return _mm256_cvttpd_epi32(_mm256_div_pd(a, b));
+}
+
+__attribute__((target("avx2")))
+void applyAvx2Kernel(BatchOp op, BatchOperand<int> lhs, BatchOperand<int> rhs, int* out, size_t n) {
+    size_t i = 0;
+    switch (op) {
+        case BatchOp::Add:
+            for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi32(load8(lhs, i), load8(rhs, i)));
+            }
+            break;
+        case BatchOp::Sub:
+            for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi32(load8(lhs, i), load8(rhs, i)));
+            }
+            break;
+        case BatchOp::Mul:
+            for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_mullo_epi32(load8(lhs, i), load8(rhs, i)));
+            }
+            break;
+        case BatchOp::Div:
+            for (; i + 4 <= n; i += 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), divide4(lhs, rhs, i));
+            }
+            break;
+    }
+    auto tail_lhs = BatchOperand<int>{lhs.scalar ? lhs.data : lhs.data + i, lhs.scalar};
+    auto tail_rhs = BatchOperand<int>{rhs.scalar ? rhs.data : rhs.data + i, rhs.scalar};
+    applyScalarKernel(op, tail_lhs, tail_rhs, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void applyAvx2Kernel(BatchOp op, BatchOperand<double> lhs, BatchOperand<double> rhs, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto a = load4(lhs, i);
+        auto b = load4(rhs, i);
+        switch (op) {
+            case BatchOp::Add: _mm256_storeu_pd(out + i, _mm256_add_pd(a, b)); break;
+            case BatchOp::Sub: _mm256_storeu_pd(out + i, _mm256_sub_pd(a, b)); break;
+            case BatchOp::Mul: _mm256_storeu_pd(out + i, _mm256_mul_pd(a, b)); break;
+            case BatchOp::Div: _mm256_storeu_pd(out + i, _mm256_div_pd(a, b)); break;
+        }
+    }
+    auto tail_lhs = BatchOperand<double>{lhs.scalar ? lhs.data : lhs.data + i, lhs.scalar};
+    auto tail_rhs = BatchOperand<double>{rhs.scalar ? rhs.data : rhs.data + i, rhs.scalar};
+    applyScalarKernel(op, tail_lhs, tail_rhs, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void applyAvx2Negate(const int* in, int* out, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi32(_mm256_setzero_si256(), value));
+    }
+    applyScalarNegate(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void applyAvx2Negate(const double* in, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_setzero_pd(), _mm256_loadu_pd(in + i)));
+    }
+    applyScalarNegate(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+auto reduce8(__m256i lanes) -> int {
+    auto half = _mm_add_epi32(_mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(half);
+}
+
+__attribute__((target("avx2")))
+auto reduce4(__m256d lanes) -> double {
+    auto half = _mm_add_pd(_mm256_castpd256_pd128(lanes), _mm256_extractf128_pd(lanes, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+__attribute__((target("avx2")))
+auto applyAvx2Sum(const int* in, size_t n) -> int {
+    size_t i = 0;
+    auto lanes = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+        lanes = _mm256_add_epi32(lanes, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)));
+    }
+    return static_cast<int>(static_cast<uint32_t>(reduce8(lanes)) + static_cast<uint32_t>(applyScalarSum(in + i, n - i)));
+}
+
+// Lanes add up in a different order than a loop would, so double results
+// can differ from it in the last bits.
+__attribute__((target("avx2")))
+auto applyAvx2Sum(const double* in, size_t n) -> double {
+    size_t i = 0;
+    auto lanes = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        lanes = _mm256_add_pd(lanes, _mm256_loadu_pd(in + i));
+    }
+    return reduce4(lanes) + applyScalarSum(in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+auto applyAvx2Dot(const int* lhs, const int* rhs, size_t n) -> int {
+    size_t i = 0;
+    auto lanes = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+        lanes = _mm256_add_epi32(lanes, _mm256_mullo_epi32(a, b));
+    }
+    return static_cast<int>(static_cast<uint32_t>(reduce8(lanes)) + static_cast<uint32_t>(applyScalarDot(lhs + i, rhs + i, n - i)));
+}
+
+__attribute__((target("avx2")))
+auto applyAvx2Dot(const double* lhs, const double* rhs, size_t n) -> double {
+    size_t i = 0;
+    auto lanes = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        lanes = _mm256_add_pd(lanes, _mm256_mul_pd(_mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i)));
+    }
+    return reduce4(lanes) + applyScalarDot(lhs + i, rhs + i, n - i);
+}
+
+auto hasAvx2() -> bool {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#else
+
+auto hasAvx2() -> bool {
+    return false;
+}
+
+template<typename T>
+void applyAvx2Kernel(BatchOp op, BatchOperand<T> lhs, BatchOperand<T> rhs, T* out, size_t n) {
+    applyScalarKernel(op, lhs, rhs, out, n);
+}
+
+template<typename T>
+void applyAvx2Negate(const T* in, T* out, size_t n) {
+    applyScalarNegate(in, out, n);
+}
+
+template<typename T>
+auto applyAvx2Sum(const T* in, size_t n) -> T {
+    return applyScalarSum(in, n);
+}
+
+template<typename T>
+auto applyAvx2Dot(const T* lhs, const T* rhs, size_t n) -> T {
+    return applyScalarDot(lhs, rhs, n);
+}
+
+#endif
+
+// Kernels picking the AVX2 version when the CPU has it.
+template<typename T>
+void applyKernel(BatchOp op, BatchOperand<T> lhs, BatchOperand<T> rhs, T* out, size_t n) {
+    if (hasAvx2()) {
+        applyAvx2Kernel(op, lhs, rhs, out, n);
+    } else {
+        applyScalarKernel(op, lhs, rhs, out, n);
+    }
+}
+
+export template<typename T>
+auto sumKernel(const T* in, size_t n) -> T {
+    return hasAvx2() ? applyAvx2Sum(in, n) : applyScalarSum(in, n);
+}
+
+export template<typename T>
+auto dotKernel(const T* lhs, const T* rhs, size_t n) -> T {
+    return hasAvx2() ? applyAvx2Dot(lhs, rhs, n) : applyScalarDot(lhs, rhs, n);
+}
@@ -7,4 +7,24 @@ export import :ir;
 export import :gc;
 export import :ast;
 export import :token;
-export import :variant;
\ No newline at end of file
+export import :stats;
+export import :output;
+export import :pool;
+export import :vm;
+export import :native;
+export import :batch;
+export import :script;
+export import :aot;
+export import :source;
+export import :variant;
+export import :profiler;
+export import :ssa;
+export import :task;
+export import :snapshot;
+export import :reload;
+export import :server;
+export import :registry;
+export import :string;
+export import :kernel;
+export import :array;
+export import :memo;
\ No newline at end of file
@@ -1,18 +1,237 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <span>
 #include <map>
+#include <chrono>
+#include <cstdio>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
 
 import cpp_script;
 
-auto main() -> int {
-    auto stream = TokenStream(R"(
-        auto a = 10 + 11 * (12 - 13) * -1;
-        auto b = a + 1;
-        auto c = a + b;
-        print(a, b, c);
-    )");
-    stream.readToken();
-    evaluate(stream);
-    return 0;
+// Generated from default.cps by cpp_script_embed.
+#include "default_script.inc"
+
+// Extension of the script files picked up when a directory is given.
+static constexpr std::string_view kScriptExtension = ".cps";
+
+struct ScriptRun {
+    std::filesystem::path path;
+    MemoryOutputSink output;
+    std::chrono::nanoseconds compile_time = {};
+    std::chrono::nanoseconds run_time = {};
+    bool loaded = false;
+    bool out_of_fuel = false;
+};
+
+static void collectScripts(const std::filesystem::path& path, std::vector<std::filesystem::path>& scripts) {
+    if (!std::filesystem::is_directory(path)) {
+        scripts.emplace_back(path);
+        return;
+    }
+    auto found = std::vector<std::filesystem::path>();
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+        if (entry.is_regular_file() && entry.path().extension() == kScriptExtension) {
+            found.emplace_back(entry.path());
+        }
+    }
+    std::sort(found.begin(), found.end());
+    scripts.insert(scripts.end(), found.begin(), found.end());
+}
+
+// With `server` set, scripts are compiled by the compile server listening
+// there, or in this process when there is none.
+static void runScript(ScriptRun& run, std::optional<uint64_t> fuel, const std::optional<CompileClientOptions>& server) {
+    auto source = MappedSource::open(run.path);
+    if (!source) {
+        return;
+    }
+    run.loaded = true;
+
+    auto start = std::chrono::steady_clock::now();
+    auto snapshot = server ? compileShared(source->view(), *server) : ManagedShared<Snapshot>();
+    auto chunk = snapshot ? ManagedShared<Chunk>() : compile(parse(source->view()));
+    auto compiled = std::chrono::steady_clock::now();
+    {
+        VM vm(run.output);
+        if (snapshot) {
+            snapshot->load(vm);
+        }
+        if (fuel.has_value()) {
+            vm.setFuel(*fuel);
+        }
+        auto status = snapshot ? vm.runToCompletion() : execute(vm, *chunk);
+        run.out_of_fuel = status == VMStatus::OutOfFuel;
+    }
+    auto finished = std::chrono::steady_clock::now();
+
+    run.compile_time = compiled - start;
+    run.run_time = finished - compiled;
+}
+
+// Runs every script on `pool`. Each script writes into its own buffer, and
+// the buffers are printed in the order the scripts were given, so the
+// output does not depend on scheduling.
+static auto runScripts(std::span<const std::filesystem::path> scripts, size_t jobs, std::optional<uint64_t> fuel, const std::optional<CompileClientOptions>& server) -> int {
+    auto runs = std::vector<ScriptRun>(scripts.size());
+    for (size_t i = 0; i < scripts.size(); ++i) {
+        runs[i].path = scripts[i];
+    }
+
+    if (runs.size() == 1 || jobs == 1) {
+        for (auto& run : runs) {
+            runScript(run, fuel, server);
+        }
+    } else {
+        ThreadPool pool(std::min(jobs, runs.size()));
+        for (auto& run : runs) {
+            pool.submit([&run, fuel, &server] { runScript(run, fuel, server); });
+        }
+        pool.wait();
+    }
+
+    int status = 0;
+    for (const auto& run : runs) {
+        std::cout << run.output.getContents();
+        if (!run.loaded) {
+            status = 1;
+            continue;
+        }
+        fprintf(stderr, "%s: compile %.3f ms, run %.3f ms\n",
+            run.path.c_str(),
+            std::chrono::duration<double, std::milli>(run.compile_time).count(),
+            std::chrono::duration<double, std::milli>(run.run_time).count());
+        if (run.out_of_fuel) {
+            fprintf(stderr, "%s: ran out of fuel\n", run.path.c_str());
+            status = 1;
+        }
+    }
+    std::cout.flush();
+    return status;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "usage: %s [--jobs <count>] [--fuel <units>] [--profile <path>] [--stats <path|->]\n"
+        "          [--socket <path>] [--serve | --use-server] [--] [script|directory]...\n",
+        program);
+}
+
+// The whole of `text` as a number, or nothing if it is not one.
+template<typename T>
+static auto parseNumber(std::string_view text) -> std::optional<T> {
+    T value = {};
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || end != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+auto main(int argc, char** argv) -> int {
+    const char* profile_path = nullptr;
+    const char* stats_path = nullptr;
+    size_t jobs = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    // Loop iterations and calls each script may make, unlimited if unset.
+    std::optional<uint64_t> fuel;
+    auto socket_path = getDefaultCompileServerSocket();
+    bool serve = false;
+    bool use_server = false;
+    std::vector<std::filesystem::path> scripts;
+    bool options_done = false;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if (options_done || !arg.starts_with("-") || arg == "-") {
+            collectScripts(argv[i], scripts);
+            continue;
+        }
+        if (arg == "--") {
+            options_done = true;
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--use-server") {
+            use_server = true;
+        } else if (arg != "--profile" && arg != "--stats" && arg != "--jobs" && arg != "--fuel" && arg != "--socket") {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            printUsage(argv[0]);
+            return 2;
+        } else if (i + 1 == argc) {
+            fprintf(stderr, "Option '%s' needs a value\n", argv[i]);
+            printUsage(argv[0]);
+            return 2;
+        } else if (arg == "--profile") {
+            profile_path = argv[++i];
+        } else if (arg == "--stats") {
+            stats_path = argv[++i];
+        } else if (arg == "--jobs") {
+            auto count = parseNumber<size_t>(argv[++i]);
+            if (!count.has_value()) {
+                fprintf(stderr, "Invalid job count '%s'\n", argv[i]);
+                printUsage(argv[0]);
+                return 2;
+            }
+            jobs = std::max<size_t>(*count, 1);
+        } else if (arg == "--fuel") {
+            fuel = parseNumber<uint64_t>(argv[++i]);
+            if (!fuel.has_value()) {
+                fprintf(stderr, "Invalid fuel '%s'\n", argv[i]);
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else {
+            socket_path = argv[++i];
+        }
+    }
+
+    // The stats describe one run of the built-in script, so they cannot
+    // stand for scripts given on the command line.
+    if (stats_path != nullptr && !scripts.empty()) {
+        fprintf(stderr, "--stats only applies to the built-in script, not to scripts\n");
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    if (serve) {
+        CompileServer server({.socket_path = socket_path});
+        if (!server.listen()) {
+            return 1;
+        }
+        server.serve();
+        return 1;
+    }
+    auto server = use_server ? std::optional(CompileClientOptions{.socket_path = socket_path}) : std::nullopt;
+
+    SamplingProfiler profiler;
+    if (profile_path != nullptr) {
+        profiler.start();
+    }
+    int status = 0;
+    if (!scripts.empty()) {
+        status = runScripts(scripts, jobs, fuel, server);
+    } else if (stats_path != nullptr) {
+        EvaluationStats stats;
+        evaluate(kDefaultScriptSource, stats);
+        if (std::string_view(stats_path) == "-") {
+            std::cout << stats.toJson() << std::endl;
+        } else {
+            std::ofstream(stats_path) << stats.toJson() << std::endl;
+        }
+    } else {
+        // default.cps was compiled while building the binary, so the default
+        // run does no lexing, parsing or code generation at all.
+        VM vm;
+        vm.load(Program{.code = kDefaultScriptCode, .name = "<default>", .slots = kDefaultScriptSlots});
+        vm.run();
+    }
+    if (profile_path != nullptr) {
+        profiler.stop();
+        std::ofstream(profile_path) << profiler.folded();
+    }
+    return status;
 }
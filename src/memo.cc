@@ -0,0 +1,123 @@
+module;
+
+#include <bit>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+export module cpp_script:memo;
+
+// Results of calls to pure script functions, kept by a VM so that calling
+// one again with the same arguments skips running it. A function is named
+// by its code, which the VM keeps alive while the cache may refer to it.
+//
+// The cache is direct-mapped: each call hashes to one entry, and a miss
+// replaces whatever that entry held. Its memory is therefore bounded by its
+// capacity, and is only allocated once the first result is stored.
+export class MemoCache {
+public:
+    // Functions with more parameters are never memoized.
+    static constexpr size_t kMaxArgs = 4;
+    static constexpr size_t kDefaultCapacity = 4096;
+
+    MemoCache() = default;
+    MemoCache(const MemoCache&) = delete;
+    auto operator=(const MemoCache&) -> MemoCache& = delete;
+
+    // Number of results kept at most, rounded up to a power of two. 0 turns
+    // memoization off. Drops every stored result.
+    void setCapacity(size_t capacity) {
+        capacity_ = capacity != 0 ? std::bit_ceil(capacity) : 0;
+        entries_.reset();
+    }
+
+    [[nodiscard]] auto getCapacity() const -> size_t {
+        return capacity_;
+    }
+
+    [[nodiscard]] auto isEnabled() const -> bool {
+        return capacity_ != 0;
+    }
+
+    // Calls answered from the cache and calls that had to run, since the
+    // VM was created or resetCounters() was last called.
+    [[nodiscard]] auto getHits() const -> uint64_t {
+        return hits_;
+    }
+
+    [[nodiscard]] auto getMisses() const -> uint64_t {
+        return misses_;
+    }
+
+    void resetCounters() {
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+    // Drops every stored result and every pending call. The counters stay.
+    void clear() {
+        if (entries_) {
+            std::fill_n(entries_.get(), capacity_, Entry());
+        }
+        pending_.clear();
+    }
+
+    // Looks up the result of calling `code` with `args`. On a miss the call
+    // becomes pending, and finish() stores its result when it returns.
+    // Pending calls finish in reverse order, like the frames they run in.
+    auto find(const int* code, const int* args, size_t arity, int& result) -> bool {
+        auto key = Entry{.code = code};
+        std::copy_n(args, arity, key.args);
+        if (entries_) {
+            auto& entry = entries_[getIndex(key)];
+            if (entry.code == key.code && std::equal(key.args, key.args + kMaxArgs, entry.args)) {
+                hits_ += 1;
+                result = entry.result;
+                return true;
+            }
+        }
+        misses_ += 1;
+        pending_.emplace_back(key);
+        return false;
+    }
+
+    void finish(int result) {
+        auto key = pending_.back();
+        pending_.pop_back();
+        if (capacity_ == 0) {
+            return;
+        }
+        if (!entries_) {
+            entries_ = std::make_unique<Entry[]>(capacity_);
+        }
+        auto& entry = entries_[getIndex(key)];
+        entry = key;
+        entry.result = result;
+    }
+
+private:
+    // Unused arguments are zero, so keys of different arities compare like
+    // keys of the same one; the code tells the functions apart anyway.
+    struct Entry {
+        const int* code = nullptr;
+        int args[kMaxArgs] = {};
+        int result = 0;
+    };
+
+    auto getIndex(const Entry& key) const -> size_t {
+        auto hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key.code));
+        for (auto arg : key.args) {
+            hash = (hash ^ static_cast<uint32_t>(arg)) * 0x9E3779B97F4A7C15ull;
+        }
+        return static_cast<size_t>(hash >> 32) & (capacity_ - 1);
+    }
+
+private:
+    size_t capacity_ = kDefaultCapacity;
+    std::unique_ptr<Entry[]> entries_;
+    std::vector<Entry> pending_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
@@ -0,0 +1,126 @@
+module;
+
+#include <tuple>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <utility>
+#include <string_view>
+#include <type_traits>
+
+export module cpp_script:native;
+import :gc;
+
+template<typename T>
+struct NativeSignature : NativeSignature<decltype(&T::operator())> {};
+
+template<typename R, typename... Args>
+struct NativeSignature<R(*)(Args...)> {
+    using Result = R;
+    using Arguments = std::tuple<std::decay_t<Args>...>;
+};
+
+template<typename C, typename R, typename... Args>
+struct NativeSignature<R(C::*)(Args...)> : NativeSignature<R(*)(Args...)> {};
+
+template<typename C, typename R, typename... Args>
+struct NativeSignature<R(C::*)(Args...) const> : NativeSignature<R(*)(Args...)> {};
+
+// Entry of the native function table as the interpreter sees it: CALL_NATIVE
+// pops `arity` values and pushes whatever `invoke` returns.
+export struct NativeFunction {
+    int (*invoke)(void* callable, const int* args);
+    void* callable;
+    size_t arity;
+};
+
+// Generates the unmarshalling code for one C++ signature: the arguments are
+// read straight from the VM stack and converted to the declared parameter
+// types, and a void result becomes 0.
+template<typename Fn, typename Result, typename... Args>
+auto invokeNative(void* callable, const int* args) -> int {
+    auto& fn = *static_cast<Fn*>(callable);
+    return [&]<size_t... I>(std::index_sequence<I...>) -> int {
+        if constexpr (std::is_void_v<Result>) {
+            fn(static_cast<Args>(args[I])...);
+            return 0;
+        } else {
+            return static_cast<int>(fn(static_cast<Args>(args[I])...));
+        }
+    }(std::index_sequence_for<Args...>{});
+}
+
+template<typename Fn, typename Result, typename Arguments>
+struct NativeThunk;
+
+template<typename Fn, typename Result, typename... Args>
+struct NativeThunk<Fn, Result, std::tuple<Args...>> {
+    static constexpr size_t arity = sizeof...(Args);
+    static constexpr auto invoke = &invokeNative<Fn, Result, Args...>;
+};
+
+// Host functions callable from scripts. Calls are resolved by name when a
+// chunk is compiled against the registry and emitted as CALL_NATIVE with the
+// function's index, so the interpreter never looks anything up by name.
+// Compiling a chunk against the registry freezes it: programs point into the
+// function table, so it can no longer grow and move.
+export class NativeRegistry : public ManagedObject {
+public:
+    template<typename Fn>
+    void define(std::string name, Fn fn) {
+        using Callable = std::decay_t<Fn>;
+        using Signature = NativeSignature<Callable>;
+        using Thunk = NativeThunk<Callable, typename Signature::Result, typename Signature::Arguments>;
+
+        if (isFrozen()) {
+            fprintf(stderr, "Native function '%s' defined after a script was compiled against the registry\n", name.c_str());
+            abort();
+        }
+        if (find(name).has_value()) {
+            fprintf(stderr, "Native function '%s' is already defined\n", name.c_str());
+            abort();
+        }
+
+        auto storage = std::shared_ptr<void>(new Callable(std::move(fn)), [](void* ptr) {
+            delete static_cast<Callable*>(ptr);
+        });
+        functions_.emplace_back(NativeFunction{Thunk::invoke, storage.get(), Thunk::arity});
+        names_.emplace_back(std::move(name));
+        storage_.emplace_back(std::move(storage));
+    }
+
+    void freeze() {
+        frozen_.store(true, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto isFrozen() const -> bool {
+        return frozen_.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto find(std::string_view name) const -> std::optional<size_t> {
+        for (size_t i = 0; i < names_.size(); ++i) {
+            if (names_[i] == name) {
+                return i;
+            }
+        }
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto getName(size_t index) const -> const std::string& {
+        return names_[index];
+    }
+
+    [[nodiscard]] auto getFunctions() const -> const std::vector<NativeFunction>& {
+        return functions_;
+    }
+
+private:
+    std::vector<NativeFunction> functions_;
+    std::vector<std::string> names_;
+    std::vector<std::shared_ptr<void>> storage_;
+    std::atomic<bool> frozen_ = false;
+};
@@ -0,0 +1,151 @@
+module;
+
+#include <string>
+#include <cerrno>
+#include <cstdio>
+#include <utility>
+#include <cstring>
+#include <charconv>
+#include <functional>
+#include <string_view>
+#include <unistd.h>
+
+export module cpp_script:output;
+
+export class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+
+    virtual void write(std::string_view data) = 0;
+};
+
+export class FdOutputSink : public OutputSink {
+public:
+    explicit FdOutputSink(int fd) : fd_(fd) {}
+
+    void write(std::string_view data) override {
+        while (!data.empty()) {
+            auto written = ::write(fd_, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+private:
+    int fd_;
+};
+
+// Writes through a stdio stream, so that script output stays in order with
+// whatever the host prints with printf or std::cout.
+export class StdioOutputSink : public OutputSink {
+public:
+    explicit StdioOutputSink(FILE* stream) : stream_(stream) {}
+
+    void write(std::string_view data) override {
+        std::fwrite(data.data(), 1, data.size(), stream_);
+    }
+
+private:
+    FILE* stream_;
+};
+
+export class MemoryOutputSink : public OutputSink {
+public:
+    void write(std::string_view data) override {
+        contents_.append(data);
+    }
+
+    [[nodiscard]] auto getContents() const -> const std::string& {
+        return contents_;
+    }
+
+    void clear() {
+        contents_.clear();
+    }
+
+private:
+    std::string contents_;
+};
+
+export class CallbackOutputSink : public OutputSink {
+public:
+    explicit CallbackOutputSink(std::function<void(std::string_view)> callback) : callback_(std::move(callback)) {}
+
+    void write(std::string_view data) override {
+        callback_(data);
+    }
+
+private:
+    std::function<void(std::string_view)> callback_;
+};
+
+export auto getStdoutSink() -> OutputSink& {
+    static StdioOutputSink sink(stdout);
+    return sink;
+}
+
+// Fixed-size buffer in front of an OutputSink. Numbers are formatted in place
+// with std::to_chars, so printing never allocates or takes the stdio lock;
+// the sink only sees full buffers and the final flush at HALT.
+export class OutputBuffer {
+public:
+    static constexpr size_t kCapacity = 4096;
+
+    explicit OutputBuffer(OutputSink& sink) : sink_(&sink), size_(0) {}
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    auto operator=(const OutputBuffer&) -> OutputBuffer& = delete;
+
+    ~OutputBuffer() {
+        flush();
+    }
+
+    void setSink(OutputSink& sink) {
+        flush();
+        sink_ = &sink;
+    }
+
+    void writeInt(int value) {
+        if (kCapacity - size_ < 11) {
+            flush();
+        }
+        auto result = std::to_chars(data_ + size_, data_ + kCapacity, value);
+        size_ = static_cast<size_t>(result.ptr - data_);
+    }
+
+    void writeChar(char c) {
+        if (size_ == kCapacity) {
+            flush();
+        }
+        data_[size_++] = c;
+    }
+
+    void write(std::string_view str) {
+        if (kCapacity - size_ < str.size()) {
+            flush();
+            if (str.size() >= kCapacity) {
+                sink_->write(str);
+                return;
+            }
+        }
+        std::memcpy(data_ + size_, str.data(), str.size());
+        size_ += str.size();
+    }
+
+    void flush() {
+        if (size_ != 0) {
+            sink_->write(std::string_view(data_, size_));
+            size_ = 0;
+        }
+    }
+
+private:
+    OutputSink* sink_;
+    size_t size_;
+    char data_[kCapacity];
+};
@@ -0,0 +1,150 @@
+module;
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+export module cpp_script:pool;
+
+// Fixed-size pool where every worker owns a task deque. Workers pop their own
+// deque from the back (most recently submitted, still warm in cache) and
+// steal from the front of the others when they run dry. Tasks submitted from
+// a worker go to that worker's deque, tasks from outside are spread
+// round-robin.
+export class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    static constexpr size_t kNotAWorker = SIZE_MAX;
+
+    explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency()) {
+        thread_count = std::max<size_t>(thread_count, 1);
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers_.emplace_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < thread_count; ++i) {
+            threads_.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    auto operator=(const ThreadPool&) -> ThreadPool& = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(idle_mutex_);
+            stopping_ = true;
+        }
+        idle_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void submit(Task task) {
+        auto index = current_pool_ == this ? current_index_ : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        unfinished_.fetch_add(1, std::memory_order_relaxed);
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard lock(workers_[index]->mutex);
+            workers_[index]->tasks.emplace_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(idle_mutex_);
+        }
+        idle_.notify_one();
+    }
+
+    // Blocks until every task submitted so far, and everything those tasks
+    // submitted in turn, has finished.
+    void wait() {
+        std::unique_lock lock(idle_mutex_);
+        done_.wait(lock, [this] { return unfinished_.load(std::memory_order_acquire) == 0; });
+    }
+
+    [[nodiscard]] auto getThreadCount() const -> size_t {
+        return workers_.size();
+    }
+
+    // Index of the calling worker thread in [0, getThreadCount()), or
+    // kNotAWorker when called from outside the pool.
+    [[nodiscard]] static auto getWorkerIndex() -> size_t {
+        return current_index_;
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(size_t index) {
+        current_pool_ = this;
+        current_index_ = index;
+
+        while (true) {
+            Task task;
+            if (pop(index, task) || steal(index, task)) {
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                if (unfinished_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard lock(idle_mutex_);
+                    done_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock lock(idle_mutex_);
+            idle_.wait(lock, [this] { return stopping_ || pending_.load(std::memory_order_acquire) != 0; });
+            if (stopping_ && pending_.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+        }
+    }
+
+    auto pop(size_t index, Task& task) -> bool {
+        auto& worker = *workers_[index];
+        std::lock_guard lock(worker.mutex);
+        if (worker.tasks.empty()) {
+            return false;
+        }
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        return true;
+    }
+
+    auto steal(size_t index, Task& task) -> bool {
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            auto& victim = *workers_[(index + i) % workers_.size()];
+            std::lock_guard lock(victim.mutex);
+            if (victim.tasks.empty()) {
+                continue;
+            }
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+private:
+    static inline thread_local ThreadPool* current_pool_ = nullptr;
+    static inline thread_local size_t current_index_ = kNotAWorker;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic_size_t next_ = 0;
+    std::atomic_size_t pending_ = 0;
+    std::atomic_size_t unfinished_ = 0;
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+    std::condition_variable done_;
+    bool stopping_ = false;
+};
@@ -0,0 +1,156 @@
+module;
+
+#include <map>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <csignal>
+#include <sys/time.h>
+
+export module cpp_script:profiler;
+import :ir;
+
+// Samples the interpreter from a SIGPROF handler. The handler only copies the
+// active frame chain into a preallocated buffer; line numbers are resolved
+// there too, since the chunks may be gone by the time the profile is printed.
+export class SamplingProfiler {
+public:
+    static constexpr size_t kMaxDepth = 16;
+    static constexpr size_t kMaxName = 32;
+
+    explicit SamplingProfiler(std::chrono::microseconds interval = std::chrono::milliseconds(1), size_t capacity = 1 << 14)
+        : interval_(interval), samples_(capacity), count_(0), dropped_(0) {}
+
+    SamplingProfiler(const SamplingProfiler&) = delete;
+    auto operator=(const SamplingProfiler&) -> SamplingProfiler& = delete;
+
+    ~SamplingProfiler() {
+        stop();
+    }
+
+    void start() {
+        SamplingProfiler* expected = nullptr;
+        if (!active_profiler_.compare_exchange_strong(expected, this)) {
+            fprintf(stderr, "Another profiler is already running\n");
+            abort();
+        }
+
+        struct sigaction action = {};
+        action.sa_handler = &SamplingProfiler::handleSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &previous_action_);
+
+        auto usec = static_cast<long>(interval_.count());
+        struct itimerval timer = {};
+        timer.it_interval.tv_sec = usec / 1000000;
+        timer.it_interval.tv_usec = usec % 1000000;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        profiler_active.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+        if (active_profiler_.load(std::memory_order_acquire) != this) {
+            return;
+        }
+        profiler_active.store(false, std::memory_order_relaxed);
+        struct itimerval timer = {};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &previous_action_, nullptr);
+        active_profiler_.store(nullptr, std::memory_order_release);
+    }
+
+    [[nodiscard]] auto getSampleCount() const -> size_t {
+        return std::min(count_.load(std::memory_order_relaxed), samples_.size());
+    }
+
+    [[nodiscard]] auto getDroppedCount() const -> size_t {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // Folded stacks, one "outer:line;inner:line count" entry per line, as
+    // consumed by flamegraph.pl and compatible tools.
+    [[nodiscard]] auto folded() const -> std::string {
+        std::map<std::string, size_t> stacks;
+        for (size_t i = 0; i < getSampleCount(); ++i) {
+            auto& sample = samples_[i];
+            std::string stack;
+            for (size_t depth = sample.depth; depth > 0; --depth) {
+                auto& entry = sample.entries[depth - 1];
+                if (!stack.empty()) {
+                    stack += ';';
+                }
+                stack += entry.name;
+                stack += ':';
+                stack += std::to_string(entry.line);
+            }
+            stacks[stack] += 1;
+        }
+
+        std::string result;
+        for (auto& [stack, count] : stacks) {
+            result += stack;
+            result += ' ';
+            result += std::to_string(count);
+            result += '\n';
+        }
+        return result;
+    }
+
+private:
+    struct Entry {
+        char name[kMaxName];
+        uint32_t line;
+    };
+
+    struct Sample {
+        size_t depth;
+        Entry entries[kMaxDepth];
+    };
+
+    static void handleSignal(int) {
+        auto profiler = active_profiler_.load(std::memory_order_acquire);
+        if (profiler != nullptr) {
+            profiler->record();
+        }
+    }
+
+    void record() {
+        Frame* frame = active_frame;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        if (frame == nullptr) {
+            return;
+        }
+        auto index = count_.fetch_add(1, std::memory_order_relaxed);
+        if (index >= samples_.size()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto& sample = samples_[index];
+        sample.depth = 0;
+        for (; frame != nullptr && sample.depth < kMaxDepth; frame = frame->caller) {
+            auto& entry = sample.entries[sample.depth++];
+            size_t length = 0;
+            for (; frame->name[length] != '\0' && length < kMaxName - 1; ++length) {
+                entry.name[length] = frame->name[length];
+            }
+            entry.name[length] = '\0';
+            entry.line = frame->lines != nullptr ? frame->lines->getLine(frame->ip) : 0;
+        }
+    }
+
+private:
+    static inline std::atomic<SamplingProfiler*> active_profiler_ = nullptr;
+
+    std::chrono::microseconds interval_;
+    std::vector<Sample> samples_;
+    std::atomic_size_t count_;
+    std::atomic_size_t dropped_;
+    struct sigaction previous_action_ = {};
+};
@@ -0,0 +1,413 @@
+module;
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <string_view>
+
+export module cpp_script:registry;
+import :ir;
+import :gc;
+import :vm;
+import :ast;
+import :native;
+
+// Compiled script that can no longer change: every function is compiled
+// when it is frozen and the code of all of them lives in one block, so
+// running it never compiles, allocates or writes anything in it. Any number
+// of VMs on any threads can run it without synchronizing with each other.
+export class FrozenChunk : public ManagedObject {
+public:
+    FrozenChunk(const FrozenChunk&) = delete;
+    auto operator=(const FrozenChunk&) -> FrozenChunk& = delete;
+
+    // Compiles whatever functions of `chunk` were not called yet and copies
+    // the result. `chunk` has to be a script's top-level chunk and is left
+    // as it was otherwise.
+    static auto freeze(const Chunk& chunk) -> ManagedShared<FrozenChunk> {
+        if (chunk.parent.get() != nullptr) {
+            fprintf(stderr, "Only the top-level chunk of a script can be frozen\n");
+            abort();
+        }
+        return ManagedShared(new FrozenChunk(chunk));
+    }
+
+    [[nodiscard]] auto getProgram() const -> Program {
+        Program program;
+        program.code = code_.data();
+        program.lines = &lines_.front();
+        program.name = names_.front().c_str();
+        program.slots = variables_.size();
+        program.natives = natives_;
+        program.functions = &functions_;
+        return program;
+    }
+
+    [[nodiscard]] auto getName() const -> std::string_view {
+        return names_.front();
+    }
+
+    // Slot of the script's top-level variable `name`.
+    [[nodiscard]] auto findVariable(std::string_view name) const -> std::optional<int> {
+        auto it = std::lower_bound(variables_.begin(), variables_.end(), name, [](const auto& variable, std::string_view name) {
+            return variable.first < name;
+        });
+        if (it == variables_.end() || it->first != name) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] auto getFunctionCount() const -> size_t {
+        return functions_.size();
+    }
+
+    // Total number of opcodes, the top-level code and all functions.
+    [[nodiscard]] auto getCodeSize() const -> size_t {
+        return code_.size();
+    }
+
+private:
+    explicit FrozenChunk(const Chunk& chunk) : registry_(chunk.natives), variables_(chunk.variables.begin(), chunk.variables.end()) {
+        auto count = chunk.functions ? chunk.functions->size() : 0;
+        if (count != 0) {
+            chunk.functions->compileAll();
+        }
+
+        // Offsets first, the block must not move once targets point into it.
+        auto size = chunk.opcodes.size();
+        for (size_t i = 0; i < count; ++i) {
+            size += chunk.functions->getChunk(i).opcodes.size();
+        }
+        code_.reserve(size);
+        code_.insert(code_.end(), chunk.opcodes.begin(), chunk.opcodes.end());
+        lines_.emplace_back(chunk.lines);
+        names_.emplace_back(chunk.name);
+
+        for (size_t i = 0; i < count; ++i) {
+            const auto& function = chunk.functions->getChunk(i);
+            auto offset = code_.size();
+            code_.insert(code_.end(), function.opcodes.begin(), function.opcodes.end());
+            functions_.add(CallTarget{
+                .code = code_.data() + offset,
+                .lines = &lines_.emplace_back(function.lines),
+                .name = names_.emplace_back(function.name).c_str(),
+                .arity = chunk.functions->getDeclaration(i).getArgs().size(),
+                .slots = function.getSlotCount(),
+                .memoize = chunk.functions->get(i)->memoize,
+            });
+        }
+
+        if (registry_) {
+            auto natives = registry_->getFunctions();
+            natives_.assign(natives.begin(), natives.end());
+        }
+    }
+
+private:
+    // Keeps whatever the native functions capture alive.
+    ManagedShared<NativeRegistry> registry_;
+    std::vector<int> code_;
+    std::deque<LineTable> lines_;
+    std::deque<std::string> names_;
+    // Sorted by name, like the map they come from.
+    std::vector<std::pair<std::string, int>> variables_;
+    std::vector<NativeFunction> natives_;
+    // Only get() is called through it, which changes nothing.
+    mutable PrecompiledFunctionTable functions_;
+};
+
+// Runs `chunk` to its end, resuming it at every yield.
+export auto execute(VM& vm, const FrozenChunk& chunk) -> VMStatus {
+    vm.load(chunk.getProgram());
+    return vm.runToCompletion();
+}
+
+// Epoch-based reclamation shared by all registries. A thread reading a
+// registry publishes the epoch it started in, in a slot of its own; a
+// writer tags what it replaces with the epoch it replaced it in and frees
+// it once no thread is still reading from that epoch or an earlier one.
+// Readers never wait and never write anything another thread reads often.
+class EpochDomain {
+public:
+    static auto get() -> EpochDomain& {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    void enter() {
+        auto& reader = getReader();
+        if (reader.depth++ == 0) {
+            // Has to be visible before the reader loads anything it protects,
+            // which the sequentially consistent store and load guarantee.
+            reader.slot->epoch.store(epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        }
+    }
+
+    void exit() {
+        auto& reader = getReader();
+        if (--reader.depth == 0) {
+            reader.slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    // Starts a new epoch and returns the one that ended. Anything unlinked
+    // before the call can only be seen by readers of that epoch or older.
+    auto advance() -> uint64_t {
+        return epoch_.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // Oldest epoch a thread is still reading in, or UINT64_MAX if none is.
+    [[nodiscard]] auto getOldestReader() -> uint64_t {
+        std::lock_guard lock(slots_mutex_);
+        auto oldest = UINT64_MAX;
+        for (const auto& slot : slots_) {
+            auto epoch = slot.epoch.load(std::memory_order_seq_cst);
+            if (epoch != 0) {
+                oldest = std::min(oldest, epoch);
+            }
+        }
+        return oldest;
+    }
+
+private:
+    // One cache line each, so readers do not contend on each other's slots.
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch = 0;
+        bool used = false;
+    };
+
+    struct Reader {
+        Slot* slot = nullptr;
+        size_t depth = 0;
+
+        ~Reader() {
+            if (slot != nullptr) {
+                EpochDomain::get().releaseSlot(slot);
+            }
+        }
+    };
+
+    auto getReader() -> Reader& {
+        static thread_local Reader reader;
+        if (reader.slot == nullptr) [[unlikely]] {
+            reader.slot = acquireSlot();
+        }
+        return reader;
+    }
+
+    // Slots of exited threads are reused; the deque only grows, so a slot
+    // never moves while its thread uses it.
+    auto acquireSlot() -> Slot* {
+        std::lock_guard lock(slots_mutex_);
+        for (auto& slot : slots_) {
+            if (!slot.used) {
+                slot.used = true;
+                return &slot;
+            }
+        }
+        auto& slot = slots_.emplace_back();
+        slot.used = true;
+        return &slot;
+    }
+
+    void releaseSlot(Slot* slot) {
+        std::lock_guard lock(slots_mutex_);
+        slot->epoch.store(0, std::memory_order_release);
+        slot->used = false;
+    }
+
+private:
+    // 0 marks an idle slot, so epochs start at 1.
+    std::atomic<uint64_t> epoch_ = 1;
+    std::mutex slots_mutex_;
+    std::deque<Slot> slots_;
+};
+
+// Frozen chunks shared by every thread of the process, keyed by whatever
+// identifies a script to the host: its path, its name or a hash of its
+// source. Lookups take no lock and touch no reference count: a reader sees
+// the registry as it was when the reader was created, and everything it
+// finds stays alive until the reader is destroyed, however the registry
+// changes meanwhile. Writers copy the index, so they are meant to be rare
+// next to lookups, and are serialized among themselves.
+export class ChunkRegistry {
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        ManagedShared<FrozenChunk> chunk;
+    };
+
+    // Never changes once published; sorted by hash, then key.
+    struct Index {
+        std::vector<Entry> entries;
+
+        [[nodiscard]] auto find(uint64_t hash, std::string_view key) const -> const Entry* {
+            auto it = std::lower_bound(entries.begin(), entries.end(), std::pair(hash, key), [](const Entry& entry, const auto& wanted) {
+                return std::pair<uint64_t, std::string_view>(entry.hash, entry.key) < wanted;
+            });
+            if (it == entries.end() || it->hash != hash || it->key != key) {
+                return nullptr;
+            }
+            return &*it;
+        }
+    };
+
+public:
+    // Pins one version of the registry. Chunks found through a reader must
+    // not be used after it is destroyed; acquire() one to keep it longer.
+    // Readers are cheap and can nest, but a thread that holds one for a long
+    // time keeps every replaced chunk alive until it lets go.
+    class Reader {
+    public:
+        explicit Reader(const ChunkRegistry& registry) {
+            EpochDomain::get().enter();
+            index_ = registry.index_.load(std::memory_order_seq_cst);
+        }
+
+        ~Reader() {
+            EpochDomain::get().exit();
+        }
+
+        Reader(const Reader&) = delete;
+        auto operator=(const Reader&) -> Reader& = delete;
+
+        [[nodiscard]] auto find(std::string_view key) const -> const FrozenChunk* {
+            auto entry = index_->find(hash(key), key);
+            return entry != nullptr ? entry->chunk.get() : nullptr;
+        }
+
+        [[nodiscard]] auto size() const -> size_t {
+            return index_->entries.size();
+        }
+
+    private:
+        const Index* index_;
+    };
+
+    explicit ChunkRegistry() : index_(new Index()) {}
+
+    ChunkRegistry(const ChunkRegistry&) = delete;
+    auto operator=(const ChunkRegistry&) -> ChunkRegistry& = delete;
+
+    // No reader may outlive the registry.
+    ~ChunkRegistry() {
+        for (auto& [epoch, index] : retired_) {
+            delete index;
+        }
+        delete index_.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] auto read() const -> Reader {
+        return Reader(*this);
+    }
+
+    // Looks `key` up and keeps the chunk alive past the lookup, which costs
+    // one reference count increment.
+    [[nodiscard]] auto acquire(std::string_view key) const -> ManagedShared<FrozenChunk> {
+        auto reader = read();
+        auto chunk = const_cast<FrozenChunk*>(reader.find(key));
+        if (chunk == nullptr) {
+            return ManagedShared<FrozenChunk>();
+        }
+        chunk->retain();
+        return ManagedShared(chunk);
+    }
+
+    // Makes `chunk` what `key` finds from now on. Readers created earlier
+    // keep seeing the chunk it replaces, if any.
+    void publish(std::string_view key, ManagedShared<FrozenChunk> chunk) {
+        std::lock_guard lock(write_mutex_);
+        auto index = index_.load(std::memory_order_relaxed);
+        auto next = new Index(*index);
+        auto wanted = hash(key);
+        auto it = std::lower_bound(next->entries.begin(), next->entries.end(), std::pair(wanted, key), [](const Entry& entry, const auto& wanted) {
+            return std::pair<uint64_t, std::string_view>(entry.hash, entry.key) < wanted;
+        });
+        if (it != next->entries.end() && it->hash == wanted && it->key == key) {
+            it->chunk = std::move(chunk);
+        } else {
+            next->entries.insert(it, Entry{wanted, std::string(key), std::move(chunk)});
+        }
+        replace(index, next);
+    }
+
+    // Freezes `chunk` and publishes it under `key`.
+    auto publish(std::string_view key, const Chunk& chunk) -> ManagedShared<FrozenChunk> {
+        auto frozen = FrozenChunk::freeze(chunk);
+        publish(key, frozen);
+        return frozen;
+    }
+
+    // Returns whether there was anything under `key`.
+    auto remove(std::string_view key) -> bool {
+        std::lock_guard lock(write_mutex_);
+        auto index = index_.load(std::memory_order_relaxed);
+        auto entry = index->find(hash(key), key);
+        if (entry == nullptr) {
+            return false;
+        }
+        auto next = new Index();
+        next->entries.reserve(index->entries.size() - 1);
+        for (const auto& other : index->entries) {
+            if (&other != entry) {
+                next->entries.emplace_back(other);
+            }
+        }
+        replace(index, next);
+        return true;
+    }
+
+    // Frees the versions no reader can see any more. Writers do this as they
+    // go; it only needs calling to release memory sooner once writes stop.
+    void collect() {
+        std::lock_guard lock(write_mutex_);
+        reclaim();
+    }
+
+    // Replaced versions still waiting for their readers.
+    [[nodiscard]] auto getRetiredCount() -> size_t {
+        std::lock_guard lock(write_mutex_);
+        return retired_.size();
+    }
+
+private:
+    static auto hash(std::string_view key) -> uint64_t {
+        auto hash = 14695981039346656037ull;
+        for (auto c : key) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    void replace(const Index* index, const Index* next) {
+        index_.store(next, std::memory_order_seq_cst);
+        retired_.emplace_back(EpochDomain::get().advance(), index);
+        reclaim();
+    }
+
+    void reclaim() {
+        auto oldest = EpochDomain::get().getOldestReader();
+        auto end = std::partition(retired_.begin(), retired_.end(), [oldest](const auto& retired) {
+            return retired.first >= oldest;
+        });
+        for (auto it = end; it != retired_.end(); ++it) {
+            delete it->second;
+        }
+        retired_.erase(end, retired_.end());
+    }
+
+private:
+    std::atomic<const Index*> index_;
+    std::mutex write_mutex_;
+    // Epoch each index was replaced in.
+    std::vector<std::pair<uint64_t, const Index*>> retired_;
+};
@@ -0,0 +1,216 @@
+module;
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+
+export module cpp_script:reload;
+import :gc;
+import :ast;
+import :token;
+import :native;
+
+export struct ReloadStats {
+    // Functions whose code was carried over from the previous version.
+    size_t reused = 0;
+    // Functions that are new, changed or depend on something that changed.
+    // They are compiled on their first call, like any function.
+    size_t changed = 0;
+};
+
+// A script that can be recompiled from edited source while it is in use.
+// Every version is compiled in full except for the functions: a function
+// keeps its compiled code when its declaration is textually the same, every
+// name it refers to resolves to the same thing, and the same holds for all
+// functions it calls, directly or not, since their bodies may have been
+// inlined into it. The top-level code is always compiled again; it is where
+// edits land anyway and it is parsed with function bodies skipped.
+//
+// Versions are published whole: getChunk() returns either the previous or
+// the new one, never a mix, and VMs or tasks switch over when they pick it up;
+// tasks run by a ScriptScheduler switch between turns, through its reload().
+// A running task can only switch while its top-level code is unchanged, so
+// scripts meant to be edited while they run are best compiled with
+// `inline_budget = 0`, which keeps function bodies out of it.
+export class HotScript {
+public:
+    explicit HotScript(std::string_view source, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>(), CompileOptions options = {})
+        : natives_(std::move(natives)), options_(options) {
+        reload(source);
+    }
+
+    HotScript(const HotScript&) = delete;
+    auto operator=(const HotScript&) -> HotScript& = delete;
+
+    // Compiles `source` as the next version of the script and publishes it.
+    // Can be called from any thread; concurrent reloads are serialized.
+    auto reload(std::string_view source) -> ReloadStats {
+        std::lock_guard reloading(reload_mutex_);
+
+        auto chunk = compile(parse(tokenize(source)), {}, natives_, options_);
+        auto& library = *chunk->functions;
+        auto previous = getChunk();
+
+        auto count = library.size();
+        auto keys = std::vector<std::optional<uint64_t>>(count);
+        auto dirty = std::vector<bool>(count, false);
+        auto callers = std::vector<std::vector<size_t>>(count);
+        auto worklist = std::vector<size_t>();
+        auto references = std::unordered_map<uint64_t, std::vector<std::string>>();
+        for (size_t i = 0; i < count; ++i) {
+            auto& declaration = library.getDeclaration(i);
+            auto text = declaration.getSource();
+            if (!text.has_value()) {
+                dirty[i] = true;
+                worklist.emplace_back(i);
+                continue;
+            }
+
+            auto hash = hashDeclaration(declaration, *text);
+            auto cached = references_.find(hash);
+            auto& names = references.try_emplace(hash, cached != references_.end() ? std::move(cached->second) : collectReferences(*text)).first->second;
+
+            auto key = hash;
+            for (const auto& name : names) {
+                key = mix(key, name);
+                if (auto it = chunk->variables.find(name); it != chunk->variables.end()) {
+                    key = mix(key, "variable " + std::to_string(it->second) + " " + getTypeName(chunk->getSlotType(it->second)));
+                } else if (auto index = library.find(name)) {
+                    key = mixSignature(mix(key, "function " + std::to_string(*index)), library.getDeclaration(*index));
+                    callers[*index].emplace_back(i);
+                } else if (auto native = natives_ ? natives_->find(name) : std::nullopt) {
+                    key = mix(key, "native " + std::to_string(*native) + " " + std::to_string(natives_->getFunctions()[*native].arity));
+                }
+            }
+            keys[i] = key;
+
+            auto it = versions_.find(declaration.getName());
+            if (it == versions_.end() || it->second.key != key) {
+                dirty[i] = true;
+                worklist.emplace_back(i);
+            }
+        }
+        // Callers of a changed function may have inlined it.
+        while (!worklist.empty()) {
+            auto index = worklist.back();
+            worklist.pop_back();
+            for (auto caller : callers[index]) {
+                if (!dirty[caller]) {
+                    dirty[caller] = true;
+                    worklist.emplace_back(caller);
+                }
+            }
+        }
+
+        auto stats = ReloadStats();
+        auto versions = std::map<std::string, FunctionVersion>();
+        for (size_t i = 0; i < count; ++i) {
+            auto& declaration = library.getDeclaration(i);
+            if (keys[i].has_value()) {
+                versions.insert_or_assign(declaration.getName(), FunctionVersion{*keys[i], declaration.getLine()});
+            }
+            if (dirty[i]) {
+                stats.changed += 1;
+                continue;
+            }
+            auto old_index = previous->functions->find(declaration.getName());
+            auto compiled = previous->functions->getCompiledChunk(*old_index);
+            if (compiled.get() != nullptr) {
+                auto line_delta = static_cast<int64_t>(declaration.getLine()) - static_cast<int64_t>(versions_.at(declaration.getName()).line);
+                library.adopt(i, std::move(compiled), line_delta);
+                stats.reused += 1;
+            }
+        }
+
+        versions_ = std::move(versions);
+        references_ = std::move(references);
+        {
+            std::lock_guard lock(mutex_);
+            chunk_ = std::move(chunk);
+            generation_ += 1;
+        }
+        return stats;
+    }
+
+    // The latest version.
+    [[nodiscard]] auto getChunk() const -> ManagedShared<Chunk> {
+        std::lock_guard lock(mutex_);
+        return chunk_;
+    }
+
+    // Number of versions published so far, the first one included.
+    [[nodiscard]] auto getGeneration() const -> uint64_t {
+        std::lock_guard lock(mutex_);
+        return generation_;
+    }
+
+private:
+    struct FunctionVersion {
+        uint64_t key = 0;
+        uint32_t line = 0;
+    };
+
+    static auto mix(uint64_t hash, std::string_view text) -> uint64_t {
+        for (auto c : text) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return (hash ^ 0xff) * 1099511628211ull;
+    }
+
+    // Number and types of the parameters and the result type, which is
+    // what callers compile against.
+    static auto mixSignature(uint64_t hash, const FunctionDeclarationStatement& declaration) -> uint64_t {
+        hash = mix(hash, std::to_string(declaration.getArgs().size()));
+        for (size_t i = 0; i < declaration.getArgs().size(); ++i) {
+            hash = mix(hash, getTypeName(declaration.getArgType(i)));
+        }
+        return mix(hash, getTypeName(declaration.getResultType()));
+    }
+
+    // Covers what the declaration says, but not where it is.
+    static auto hashDeclaration(const FunctionDeclarationStatement& declaration, std::string_view text) -> uint64_t {
+        auto hash = mix(14695981039346656037ull, declaration.getName());
+        for (const auto& arg : declaration.getArgs()) {
+            hash = mix(hash, arg);
+        }
+        return mix(mixSignature(hash, declaration), text);
+    }
+
+    // Every identifier in `text`, sorted and without duplicates. Locals are
+    // included too, which at worst makes a function look changed when a
+    // global of the same name appears.
+    static auto collectReferences(std::string_view text) -> std::vector<std::string> {
+        auto names = std::vector<std::string>();
+        auto stream = TokenStream(text);
+        stream.readToken();
+        while (stream.peekToken().type != TOKEN_EOF) {
+            if (stream.peekToken().type == TOKEN_IDENTIFIER) {
+                names.emplace_back(stream.peekToken().str);
+            }
+            stream.readToken();
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        return names;
+    }
+
+private:
+    const ManagedShared<NativeRegistry> natives_;
+    const CompileOptions options_;
+
+    std::mutex reload_mutex_;
+    // Only used by reload().
+    std::map<std::string, FunctionVersion> versions_;
+    std::unordered_map<uint64_t, std::vector<std::string>> references_;
+
+    mutable std::mutex mutex_;
+    ManagedShared<Chunk> chunk_;
+    uint64_t generation_ = 0;
+};
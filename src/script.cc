@@ -0,0 +1,71 @@
+module;
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <string_view>
+
+export module cpp_script:script;
+import :ir;
+import :gc;
+import :vm;
+import :ast;
+import :token;
+import :native;
+
+// A script compiled once and executed any number of times. Parameters are
+// declared up front and live in the first variable slots, so binding them
+// is a store into the VM and running the script allocates nothing. The
+// handle itself is immutable and can be shared between threads, each thread
+// executing it on its own VM.
+export class PreparedScript {
+public:
+    explicit PreparedScript(std::string_view source, std::vector<std::string> parameters = {}, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>())
+        : parameters_(std::move(parameters)), chunk_(compile(parse(tokenize(source)), parameters_, std::move(natives))) {}
+
+    [[nodiscard]] auto getParameters() const -> std::span<const std::string> {
+        return parameters_;
+    }
+
+    [[nodiscard]] auto getParameterSlot(std::string_view name) const -> size_t {
+        for (size_t i = 0; i < parameters_.size(); ++i) {
+            if (parameters_[i] == name) {
+                return i;
+            }
+        }
+        fprintf(stderr, "Unknown parameter '%.*s'\n", (int) name.size(), name.data());
+        abort();
+    }
+
+    [[nodiscard]] auto getChunk() const -> const Chunk& {
+        return *chunk_;
+    }
+
+    // Loads the script into `vm` without running it. Parameters can then be
+    // bound with vm.setGlobal(getParameterSlot(name), value) before vm.run().
+    void load(VM& vm) const {
+        vm.load(chunk_->getProgram());
+    }
+
+    // Binds `arguments` to the parameters in declaration order, runs the
+    // script and returns the value of its top-level `return` (0 without one).
+    auto execute(VM& vm, std::span<const int> arguments) const -> int {
+        if (arguments.size() != parameters_.size()) {
+            fprintf(stderr, "Expected %zu arguments, got %zu\n", parameters_.size(), arguments.size());
+            abort();
+        }
+        load(vm);
+        for (size_t i = 0; i < arguments.size(); ++i) {
+            vm.setGlobal(i, arguments[i]);
+        }
+        vm.runToCompletion();
+        return vm.getResult();
+    }
+
+private:
+    const std::vector<std::string> parameters_;
+    const ManagedShared<Chunk> chunk_;
+};
@@ -0,0 +1,581 @@
+module;
+
+#include <list>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+export module cpp_script:server;
+import :gc;
+import :ast;
+import :token;
+import :native;
+import :snapshot;
+
+// Protocol of the compile server, one request per connection: the client
+// sends a CompileRequest followed by the source, the server answers with a
+// CompileResponse and, if it compiled the script, a sealed memfd holding the
+// program image passed along with it. Both ends are the same build, so the
+// structs go over the socket as they are. Both ends also check that the
+// other runs as the same user.
+static constexpr uint32_t kCompileRequestMagic = 0x43505352;
+static constexpr uint32_t kCompileProtocolVersion = 2;
+
+struct CompileRequest {
+    uint32_t magic = kCompileRequestMagic;
+    uint32_t version = kCompileProtocolVersion;
+    uint64_t inline_budget = 0;
+    uint32_t fold_constants = 0;
+    uint32_t optimize = 0;
+    uint32_t memoize = 0;
+    uint32_t padding = 0;
+    uint64_t source_size = 0;
+};
+
+// Statuses of a CompileResponse other than 0.
+static constexpr uint32_t kCompileFailed = 1;
+static constexpr uint32_t kCompileSourceTooLarge = 2;
+
+struct CompileResponse {
+    // 0 when a memfd comes with the response.
+    uint32_t status = 0;
+    uint32_t padding = 0;
+    uint64_t size = 0;
+};
+
+// The socket lives in a directory only the user can write to: the runtime
+// directory, or one of their own in the temporary directory that listen()
+// creates.
+export auto getDefaultCompileServerSocket() -> std::filesystem::path {
+    if (auto path = getenv("CPP_SCRIPT_COMPILE_SERVER"); path != nullptr && *path != '\0') {
+        return path;
+    }
+    if (auto dir = getenv("XDG_RUNTIME_DIR"); dir != nullptr && *dir != '\0') {
+        return std::filesystem::path(dir) / "cpp_script.sock";
+    }
+    return std::filesystem::temp_directory_path() / ("cpp_script-" + std::to_string(geteuid())) / "compile.sock";
+}
+
+// Makes sends and receives on `fd` fail once they wait longer than `timeout`.
+void setSocketTimeout(int fd, std::chrono::milliseconds timeout) {
+    auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    auto limit = timeval{.tv_sec = static_cast<time_t>(microseconds / 1000000), .tv_usec = static_cast<suseconds_t>(microseconds % 1000000)};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+}
+
+// User on the other end of a connected socket.
+auto getPeerUid(int fd) -> std::optional<uid_t> {
+    auto credentials = ucred{};
+    auto size = socklen_t(sizeof(credentials));
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+        return std::nullopt;
+    }
+    return credentials.uid;
+}
+
+auto writeAll(int fd, const void* data, size_t size) -> bool {
+    auto bytes = static_cast<const char*>(data);
+    while (size != 0) {
+        auto written = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+auto readAll(int fd, void* data, size_t size) -> bool {
+    auto bytes = static_cast<char*>(data);
+    while (size != 0) {
+        auto received = recv(fd, bytes, size, 0);
+        if (received <= 0) {
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+// Sends `response` with `image` attached as ancillary data, or without
+// anything attached when `image` is -1.
+auto sendResponse(int fd, const CompileResponse& response, int image) -> bool {
+    auto data = iovec{const_cast<CompileResponse*>(&response), sizeof(response)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    auto message = msghdr{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    if (image != -1) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &image, sizeof(int));
+    }
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(response));
+}
+
+// Receives a response and the memfd that came with it, if any.
+auto receiveResponse(int fd, CompileResponse& response) -> int {
+    auto data = iovec{&response, sizeof(response)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    auto message = msghdr{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(sizeof(response))) {
+        return -1;
+    }
+    auto image = -1;
+    if (auto header = CMSG_FIRSTHDR(&message); header != nullptr && header->cmsg_type == SCM_RIGHTS) {
+        std::memcpy(&image, CMSG_DATA(header), sizeof(int));
+    }
+    return image;
+}
+
+// A memfd for one image. Once it is sealed nothing can change it, so
+// clients can map it and trust the contents.
+auto createImageFile() -> int {
+    return memfd_create("cpp_script_image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+static constexpr int kImageSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+auto sealImageFile(int fd) -> bool {
+    return fcntl(fd, F_ADD_SEALS, kImageSeals | F_SEAL_SEAL) == 0;
+}
+
+auto isImageFileSealed(int fd) -> bool {
+    auto seals = fcntl(fd, F_GET_SEALS);
+    return seals != -1 && (seals & kImageSeals) == kImageSeals;
+}
+
+// A file for an image only this process maps, which needs no seals: a
+// memfd, or an unnamed file in the temporary directory where memfds are
+// not available.
+auto createPrivateImageFile() -> int {
+    auto fd = memfd_create("cpp_script_image", MFD_CLOEXEC);
+    if (fd == -1) {
+        fd = open(std::filesystem::temp_directory_path().c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    return fd;
+}
+
+auto writeImageFile(int fd, const std::vector<char>& image) -> bool {
+    size_t offset = 0;
+    while (offset < image.size()) {
+        auto written = write(fd, image.data() + offset, image.size() - offset);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+auto hashCompileInput(std::string_view source, const CompileRequest& request) -> uint64_t {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ull;
+        }
+    };
+    mix(source.data(), source.size());
+    mix(&request.inline_budget, sizeof(request.inline_budget));
+    mix(&request.fold_constants, sizeof(request.fold_constants));
+    mix(&request.optimize, sizeof(request.optimize));
+    mix(&request.memoize, sizeof(request.memoize));
+    return hash;
+}
+
+auto hasSameOptions(const CompileRequest& lhs, const CompileRequest& rhs) -> bool {
+    return lhs.inline_budget == rhs.inline_budget && lhs.fold_constants == rhs.fold_constants && lhs.optimize == rhs.optimize && lhs.memoize == rhs.memoize;
+}
+
+// Checks that `directory`, which holds the server's socket, can only be
+// written by the current user, creating it if it does not exist yet.
+auto prepareSocketDirectory(const std::filesystem::path& directory) -> bool {
+    if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create '%s': %s\n", directory.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat info = {};
+    if (stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid()) {
+        fprintf(stderr, "Socket directory '%s' is not a directory owned by the current user\n", directory.c_str());
+        return false;
+    }
+    if ((info.st_mode & 022) != 0) {
+        fprintf(stderr, "Socket directory '%s' is writable by other users\n", directory.c_str());
+        return false;
+    }
+    return true;
+}
+
+export struct CompileServerOptions {
+    std::filesystem::path socket_path = getDefaultCompileServerSocket();
+    // Total size of the images kept; the least recently used go first.
+    size_t cache_bytes = 64 * 1024 * 1024;
+    // Larger sources are refused without being read.
+    size_t max_source_size = 16 * 1024 * 1024;
+    // How long a client may take to send its request or to take the
+    // response, so a stalled one cannot hold up the others.
+    std::chrono::milliseconds client_timeout = std::chrono::seconds(5);
+    // How long compiling one script may take before the child doing it is
+    // killed and the request fails, so one pathological script cannot
+    // stall every client.
+    std::chrono::milliseconds compile_timeout = std::chrono::seconds(10);
+};
+
+// Daemon that compiles scripts for every process on the machine. Each
+// distinct source is compiled once into a program image in a sealed memfd,
+// and every client gets the same memfd, so the bytecode of a script lives
+// in memory once however many processes run it. Compilation happens in a
+// forked child: the compiler aborts on errors in the script, which must not
+// take the server down. Requests are served one at a time on the calling
+// thread, which also keeps fork() safe.
+export class CompileServer {
+public:
+    explicit CompileServer(CompileServerOptions options = {}) : options_(std::move(options)) {}
+
+    CompileServer(const CompileServer&) = delete;
+    auto operator=(const CompileServer&) -> CompileServer& = delete;
+
+    ~CompileServer() {
+        if (socket_ != -1) {
+            close(socket_);
+            unlink(options_.socket_path.c_str());
+        }
+        for (auto& entry : entries_) {
+            close(entry.image);
+        }
+    }
+
+    // Binds the socket, replacing a stale one left by a server of the same
+    // user that died. The socket's directory has to be writable by the user
+    // alone, and anything at its path other than such a socket is left
+    // alone. Returns false and reports why on failure.
+    auto listen() -> bool {
+        auto address = sockaddr_un{.sun_family = AF_UNIX};
+        if (options_.socket_path.native().size() >= sizeof(address.sun_path)) {
+            fprintf(stderr, "Socket path '%s' is too long\n", options_.socket_path.c_str());
+            return false;
+        }
+        std::strcpy(address.sun_path, options_.socket_path.c_str());
+        if (!prepareSocketDirectory(options_.socket_path.has_parent_path() ? options_.socket_path.parent_path() : ".")) {
+            return false;
+        }
+
+        struct stat info = {};
+        if (lstat(address.sun_path, &info) == 0) {
+            if (!S_ISSOCK(info.st_mode) || info.st_uid != geteuid()) {
+                fprintf(stderr, "'%s' exists and is not a socket of the current user\n", address.sun_path);
+                return false;
+            }
+            auto probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            auto live = probe != -1 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+            if (probe != -1) {
+                close(probe);
+            }
+            if (live) {
+                fprintf(stderr, "A server is already listening on '%s'\n", address.sun_path);
+                return false;
+            }
+            unlink(address.sun_path);
+        }
+
+        socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket_ == -1 || bind(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+            fprintf(stderr, "Failed to listen on '%s': %s\n", address.sun_path, strerror(errno));
+            if (socket_ != -1) {
+                close(socket_);
+                socket_ = -1;
+            }
+            return false;
+        }
+        if (chmod(address.sun_path, 0600) == -1 || ::listen(socket_, SOMAXCONN) == -1) {
+            fprintf(stderr, "Failed to listen on '%s': %s\n", address.sun_path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Serves clients until the process is stopped.
+    void serve() {
+        while (serveOne()) {}
+    }
+
+    // Accepts one client and answers its request. Returns false only when
+    // the socket itself fails.
+    auto serveOne() -> bool {
+        auto client = accept4(socket_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            return errno == EINTR || errno == ECONNABORTED;
+        }
+        setSocketTimeout(client, options_.client_timeout);
+        if (getPeerUid(client) == geteuid()) {
+            handle(client);
+        }
+        close(client);
+        return true;
+    }
+
+    [[nodiscard]] auto getHits() const -> uint64_t {
+        return hits_;
+    }
+
+    [[nodiscard]] auto getMisses() const -> uint64_t {
+        return misses_;
+    }
+
+    [[nodiscard]] auto getCachedBytes() const -> size_t {
+        return cached_bytes_;
+    }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string source;
+        CompileRequest request;
+        int image;
+        size_t size;
+    };
+
+    void handle(int client) {
+        auto request = CompileRequest();
+        if (!readAll(client, &request, sizeof(request)) || request.magic != kCompileRequestMagic || request.version != kCompileProtocolVersion) {
+            return;
+        }
+        if (request.source_size > options_.max_source_size) {
+            sendResponse(client, CompileResponse{.status = kCompileSourceTooLarge}, -1);
+            return;
+        }
+        auto source = std::string(request.source_size, '\0');
+        if (!readAll(client, source.data(), source.size())) {
+            return;
+        }
+
+        auto hash = hashCompileInput(source, request);
+        auto entry = find(hash, source, request);
+        if (entry == entries_.end()) {
+            misses_ += 1;
+            entry = insert(hash, std::move(source), request);
+        } else {
+            hits_ += 1;
+        }
+
+        if (entry == entries_.end()) {
+            sendResponse(client, CompileResponse{.status = kCompileFailed}, -1);
+            return;
+        }
+        sendResponse(client, CompileResponse{.size = entry->size}, entry->image);
+    }
+
+    auto find(uint64_t hash, const std::string& source, const CompileRequest& request) -> std::list<Entry>::iterator {
+        auto it = index_.find(hash);
+        if (it == index_.end()) {
+            return entries_.end();
+        }
+        auto entry = it->second;
+        if (entry->source != source || !hasSameOptions(entry->request, request)) {
+            return entries_.end();
+        }
+        entries_.splice(entries_.begin(), entries_, entry);
+        return entry;
+    }
+
+    // Compiles `source` and caches the image, or returns end() if the script
+    // does not compile.
+    auto insert(uint64_t hash, std::string source, const CompileRequest& request) -> std::list<Entry>::iterator {
+        auto image = createImageFile();
+        if (image == -1) {
+            fprintf(stderr, "Failed to create an image file: %s\n", strerror(errno));
+            return entries_.end();
+        }
+
+        auto child = fork();
+        if (child == 0) {
+            auto options = CompileOptions{
+                .inline_budget = request.inline_budget,
+                .fold_constants = request.fold_constants != 0,
+                .optimize = request.optimize != 0,
+                .memoize = request.memoize != 0,
+            };
+            auto chunk = compile(parse(tokenize(source)), {}, ManagedShared<NativeRegistry>(), options);
+            _exit(writeImageFile(image, buildProgramImage(*chunk)) ? 0 : 1);
+        }
+        auto status = 0;
+        if (child != -1 && !waitForCompile(child, status)) {
+            kill(child, SIGKILL);
+            while (waitpid(child, &status, 0) == -1 && errno == EINTR) {}
+            fprintf(stderr, "Compiling a script took longer than %lld ms\n", static_cast<long long>(options_.compile_timeout.count()));
+        }
+        auto size = lseek(image, 0, SEEK_END);
+        if (child == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || size <= 0 || !sealImageFile(image)) {
+            close(image);
+            return entries_.end();
+        }
+
+        if (auto it = index_.find(hash); it != index_.end()) {
+            erase(it->second);
+        }
+        entries_.emplace_front(Entry{hash, std::move(source), request, image, static_cast<size_t>(size)});
+        index_.insert_or_assign(hash, entries_.begin());
+        cached_bytes_ += static_cast<size_t>(size);
+        while (cached_bytes_ > options_.cache_bytes && entries_.size() > 1) {
+            erase(std::prev(entries_.end()));
+        }
+        return entries_.begin();
+    }
+
+    // Waits for the compile child to exit, polling at a growing interval.
+    // Returns false if it still runs once `compile_timeout` has passed.
+    auto waitForCompile(pid_t child, int& status) const -> bool {
+        auto deadline = std::chrono::steady_clock::now() + options_.compile_timeout;
+        auto interval = std::chrono::microseconds(100);
+        while (true) {
+            auto result = waitpid(child, &status, WNOHANG);
+            if (result == child || (result == -1 && errno != EINTR)) {
+                return true;
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            usleep(static_cast<useconds_t>(interval.count()));
+            interval = std::min(interval * 2, std::chrono::microseconds(10000));
+        }
+    }
+
+    // Clients that already mapped the image keep it alive.
+    void erase(std::list<Entry>::iterator entry) {
+        close(entry->image);
+        cached_bytes_ -= entry->size;
+        index_.erase(entry->hash);
+        entries_.erase(entry);
+    }
+
+private:
+    CompileServerOptions options_;
+    int socket_ = -1;
+    // Most recently used first.
+    std::list<Entry> entries_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    size_t cached_bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+export struct CompileClientOptions {
+    std::filesystem::path socket_path = getDefaultCompileServerSocket();
+    CompileOptions compile;
+    // How long to wait for the server to take the request or to answer it
+    // before compiling in this process instead. Longer than the server's
+    // default compile_timeout, so that a slow compile is not done twice.
+    std::chrono::milliseconds timeout = std::chrono::seconds(15);
+};
+
+// Asks the server for the image of `source`; -1 if there is no server, it
+// runs as another user, it could not compile the script, or the image it
+// sent could still be changed.
+auto requestImage(std::string_view source, const CompileClientOptions& options) -> int {
+    auto address = sockaddr_un{.sun_family = AF_UNIX};
+    if (options.socket_path.native().size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::strcpy(address.sun_path, options.socket_path.c_str());
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || getPeerUid(fd) != geteuid()) {
+        close(fd);
+        return -1;
+    }
+    setSocketTimeout(fd, options.timeout);
+
+    auto request = CompileRequest{
+        .inline_budget = options.compile.inline_budget,
+        .fold_constants = options.compile.fold_constants,
+        .optimize = options.compile.optimize,
+        .memoize = options.compile.memoize,
+        .source_size = source.size(),
+    };
+    auto response = CompileResponse();
+    auto image = -1;
+    if (writeAll(fd, &request, sizeof(request)) && writeAll(fd, source.data(), source.size())) {
+        image = receiveResponse(fd, response);
+    }
+    close(fd);
+    if (image != -1 && (response.status != 0 || !isImageFileSealed(image))) {
+        close(image);
+        return -1;
+    }
+    return image;
+}
+
+// Compiles `source` through the compile server at `options.socket_path`,
+// mapping the image the server shares with every other client. Without a
+// server, or when it fails, the script is compiled in this process instead,
+// into an image of its own, so the result is the same either way. Scripts
+// that call native functions are always compiled here, since the server
+// does not know them. Returns null and reports why only if no file for a
+// local image can be created; the chunk can then still be compiled and run
+// the usual way.
+export auto compileShared(std::string_view source, const CompileClientOptions& options = {}, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>()) -> ManagedShared<Snapshot> {
+    auto image = natives ? -1 : requestImage(source, options);
+    if (image != -1) {
+        auto snapshot = Snapshot::map(image, "<compile server>");
+        close(image);
+        if (snapshot) {
+            return snapshot;
+        }
+    }
+
+    auto chunk = compile(parse(tokenize(source)), {}, natives, options.compile);
+    image = createPrivateImageFile();
+    if (image == -1 || !writeImageFile(image, buildProgramImage(*chunk))) {
+        fprintf(stderr, "Failed to create an image file: %s\n", strerror(errno));
+        if (image != -1) {
+            close(image);
+        }
+        return ManagedShared<Snapshot>();
+    }
+    auto snapshot = Snapshot::map(image, "<compiled>", std::move(natives));
+    close(image);
+    return snapshot;
+}
@@ -0,0 +1,654 @@
+module;
+
+#include <span>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <utility>
+#include <filesystem>
+#include <string_view>
+#include <unistd.h>
+
+export module cpp_script:snapshot;
+import :ir;
+import :gc;
+import :vm;
+import :ast;
+import :native;
+import :source;
+import :array;
+import :memo;
+import :string;
+
+// A snapshot file is one flat image that refers to its own parts by byte
+// offsets from its start, never by address, so it can be mapped anywhere and
+// run in place. Bytecode is stored as the int arrays the interpreter reads.
+// Line tables and names of native functions are the only things rebuilt on
+// load. Interned string ids only mean something within one process, so
+// strings are stored as a table of their texts; code and slots refer to them
+// by index into it, and are translated to the ids of the loading process.
+// Arrays are stored the same way and built anew in the VM that loads them.
+static constexpr char kSnapshotMagic[8] = {'C', 'P', 'S', 'S', 'N', 'A', 'P', '\0'};
+static constexpr uint32_t kSnapshotVersion = 4;
+
+struct SnapshotRange {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+struct SnapshotCode {
+    // int[]
+    SnapshotRange code;
+    // (offset, line) pairs as uint32_t[2].
+    SnapshotRange lines;
+    // NUL-terminated.
+    SnapshotRange name;
+    uint64_t arity = 0;
+    uint64_t slots = 0;
+    // Non-zero if calls go through the VM's memo cache.
+    uint64_t memoize = 0;
+};
+
+struct SnapshotVariable {
+    SnapshotRange name;
+    uint64_t slot = 0;
+};
+
+struct SnapshotNative {
+    SnapshotRange name;
+    uint64_t arity = 0;
+};
+
+struct SnapshotHeader {
+    char magic[8] = {};
+    uint32_t version = 0;
+    // Number of opcodes the writer knew, so bytecode from a build with a
+    // different instruction set is rejected.
+    uint32_t opcode_count = 0;
+    uint64_t ip = 0;
+    SnapshotCode main;
+    // int[], one value per slot of the main chunk.
+    SnapshotRange globals;
+    // SnapshotCode[]
+    SnapshotRange functions;
+    // SnapshotVariable[]
+    SnapshotRange variables;
+    // SnapshotNative[]
+    SnapshotRange natives;
+    // SnapshotRange[] of NUL-terminated texts; the first is always "".
+    SnapshotRange strings;
+    // uint64_t[], slots of the main chunk that hold an index into `strings`.
+    SnapshotRange string_slots;
+    // SnapshotRange[] of int[], the contents of the arrays.
+    SnapshotRange arrays;
+    // uint64_t[], slots of the main chunk that hold an array: 0 for the
+    // empty one, or one more than an index into `arrays`.
+    SnapshotRange array_slots;
+};
+
+// Visits the offset of each instruction of `code`. Stops early and returns
+// false if an instruction runs past its end.
+template<typename Fn>
+auto forEachInstruction(std::span<const int> code, Fn&& fn) -> bool {
+    size_t ip = 0;
+    while (ip < code.size()) {
+        if (code[ip] < 0 || code[ip] >= kOpcodeCount) {
+            return false;
+        }
+        auto next = ip + 1 + getOperandCount(code[ip]);
+        if (next > code.size()) {
+            return false;
+        }
+        fn(ip);
+        ip = next;
+    }
+    return true;
+}
+
+// What the code of an image may refer to.
+struct SnapshotCodeLimits {
+    // Slots of the frame the code runs in.
+    size_t slots = 0;
+    size_t globals = 0;
+    size_t functions = 0;
+    size_t natives = 0;
+};
+
+// Checks that `code` only jumps to the start of its own instructions, cannot
+// run past its end, enters at an instruction when started at `entry`, and
+// only refers to slots, functions and natives that exist. The depth of the
+// operand stack is still trusted, like that of any other compiled code.
+auto verifyCode(std::span<const int> code, const SnapshotCodeLimits& limits, size_t entry = 0) -> bool {
+    auto starts = std::vector<bool>(code.size());
+    auto last = size_t(0);
+    if (code.empty() || !forEachInstruction(code, [&](size_t ip) { starts[ip] = true; last = ip; })) {
+        return false;
+    }
+    if (entry >= code.size() || !starts[entry] || (code[last] != OP_HALT && code[last] != OP_RET && code[last] != OP_JUMP)) {
+        return false;
+    }
+
+    auto below = [](int value, size_t limit) {
+        return value >= 0 && static_cast<size_t>(value) < limit;
+    };
+    auto valid = true;
+    forEachInstruction(code, [&](size_t ip) {
+        auto opcode = code[ip];
+        switch (opcode) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_JUMP_IF_LT_LOCAL_CONST:
+            case OP_JUMP_IF_LE_LOCAL_CONST:
+            case OP_JUMP_IF_GT_LOCAL_CONST:
+            case OP_JUMP_IF_GE_LOCAL_CONST:
+            case OP_JUMP_IF_EQ_LOCAL_CONST:
+            case OP_JUMP_IF_NE_LOCAL_CONST:
+                valid = valid && below(code[ip + 1], limits.slots);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                valid = valid && below(code[ip + 1], limits.globals);
+                break;
+            case OP_CALL:
+                valid = valid && below(code[ip + 1], limits.functions);
+                break;
+            case OP_CALL_NATIVE:
+                valid = valid && below(code[ip + 1], limits.natives);
+                break;
+            case OP_PRINT:
+            case OP_MAKE_ARRAY:
+                valid = valid && code[ip + 1] >= 0;
+                break;
+            default:
+                break;
+        }
+        if (isJump(opcode)) {
+            auto target = getJumpTarget(code.data(), ip);
+            valid = valid && target < code.size() && starts[target];
+        }
+    });
+    return valid;
+}
+
+// Texts of the strings an image refers to, in the order of their indices.
+class SnapshotStrings {
+public:
+    SnapshotStrings() {
+        add(StringTable::intern(""));
+    }
+
+    auto add(int id) -> int {
+        auto [it, inserted] = indices_.emplace(id, static_cast<int>(ids_.size()));
+        if (inserted) {
+            ids_.emplace_back(id);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] auto getIds() const -> const std::vector<int>& {
+        return ids_;
+    }
+
+private:
+    std::vector<int> ids_;
+    std::map<int, int> indices_;
+};
+
+// Native functions an image calls, in the order of their indices, each
+// named by its index in the registry the script was compiled against.
+class SnapshotNatives {
+public:
+    auto add(int index) -> int {
+        auto [it, inserted] = indices_.emplace(index, static_cast<int>(used_.size()));
+        if (inserted) {
+            used_.emplace_back(static_cast<size_t>(index));
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] auto getUsed() const -> const std::vector<size_t>& {
+        return used_;
+    }
+
+private:
+    std::vector<size_t> used_;
+    std::map<int, int> indices_;
+};
+
+// `code` with the operands of its PUSH_STRINGs turned into indices of
+// `strings`, and those of its CALL_NATIVEs into indices of `natives`.
+auto translateCode(std::span<const int> code, SnapshotStrings& strings, SnapshotNatives& natives) -> std::vector<int> {
+    auto translated = std::vector<int>(code.begin(), code.end());
+    forEachInstruction(code, [&](size_t ip) {
+        if (code[ip] == OP_PUSH_STRING) {
+            translated[ip + 1] = strings.add(code[ip + 1]);
+        } else if (code[ip] == OP_CALL_NATIVE) {
+            translated[ip + 1] = natives.add(code[ip + 1]);
+        }
+    });
+    return translated;
+}
+
+class SnapshotWriter {
+public:
+    auto finish(const SnapshotHeader& header) -> std::vector<char> {
+        std::memcpy(bytes_.data(), &header, sizeof(header));
+        return std::move(bytes_);
+    }
+
+    template<typename T>
+    auto append(std::span<const T> values) -> SnapshotRange {
+        bytes_.resize((bytes_.size() + alignof(uint64_t) - 1) / alignof(uint64_t) * alignof(uint64_t));
+        auto range = SnapshotRange{bytes_.size(), values.size()};
+        auto data = reinterpret_cast<const char*>(values.data());
+        bytes_.insert(bytes_.end(), data, data + values.size_bytes());
+        return range;
+    }
+
+    auto appendString(std::string_view text) -> SnapshotRange {
+        auto range = append(std::span(text.data(), text.size()));
+        bytes_.emplace_back('\0');
+        return range;
+    }
+
+    auto appendCode(std::span<const int> code, const LineTable& lines, std::string_view name, size_t arity, size_t slots, bool memoize = false) -> SnapshotCode {
+        auto entries = std::vector<uint32_t>();
+        lines.forEachEntry([&](size_t offset, uint32_t line) {
+            entries.emplace_back(static_cast<uint32_t>(offset));
+            entries.emplace_back(line);
+        });
+        return SnapshotCode{
+            .code = append(code),
+            .lines = append(std::span<const uint32_t>(entries)),
+            .name = appendString(name),
+            .arity = arity,
+            .slots = slots,
+            .memoize = memoize,
+        };
+    }
+
+private:
+    // The header is written last, once every offset is known.
+    std::vector<char> bytes_ = std::vector<char>(sizeof(SnapshotHeader));
+};
+
+// Image of `chunk` about to continue at `ip` with its slots set to
+// `globals`, where the slots holding strings have interned ids and those
+// holding arrays 0 or one more than an index into `arrays`. Every function
+// of the script is compiled first and goes into the image as bytecode, so
+// whoever loads it needs neither the source nor the compiler. Only the
+// natives the bytecode calls are recorded, so only those have to be
+// defined when it is loaded.
+auto buildSnapshotImage(const Chunk& chunk, size_t ip, std::span<const int> globals, std::span<const std::vector<int>> arrays = {}) -> std::vector<char> {
+    auto writer = SnapshotWriter();
+    auto header = SnapshotHeader();
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.opcode_count = kOpcodeCount;
+    header.ip = ip;
+
+    auto strings = SnapshotStrings();
+    auto used_natives = SnapshotNatives();
+    auto values = std::vector<int>(globals.begin(), globals.end());
+    auto string_slots = std::vector<uint64_t>();
+    auto array_slots = std::vector<uint64_t>();
+    for (const auto& [slot, type] : chunk.slot_types) {
+        if (static_cast<size_t>(slot) >= values.size()) {
+            continue;
+        }
+        if (type == ValueType::String) {
+            values[slot] = strings.add(values[slot]);
+            string_slots.emplace_back(static_cast<uint64_t>(slot));
+        } else if (type == ValueType::Array) {
+            array_slots.emplace_back(static_cast<uint64_t>(slot));
+        }
+    }
+    header.main = writer.appendCode(translateCode(chunk.opcodes, strings, used_natives), chunk.lines, chunk.name, 0, values.size());
+    header.globals = writer.append(std::span<const int>(values));
+    header.string_slots = writer.append(std::span<const uint64_t>(string_slots));
+    header.array_slots = writer.append(std::span<const uint64_t>(array_slots));
+
+    auto contents = std::vector<SnapshotRange>();
+    for (auto& array : arrays) {
+        contents.emplace_back(writer.append(std::span<const int>(array)));
+    }
+    header.arrays = writer.append(std::span<const SnapshotRange>(contents));
+
+    auto functions = std::vector<SnapshotCode>();
+    if (chunk.functions) {
+        for (size_t i = 0; i < chunk.functions->size(); ++i) {
+            auto& function = chunk.functions->getChunk(i);
+            auto target = chunk.functions->get(i);
+            functions.emplace_back(writer.appendCode(translateCode(function.opcodes, strings, used_natives), function.lines, function.name, target->arity, target->slots, target->memoize));
+        }
+    }
+    header.functions = writer.append(std::span<const SnapshotCode>(functions));
+
+    auto variables = std::vector<SnapshotVariable>();
+    for (const auto& [name, slot] : chunk.variables) {
+        variables.emplace_back(SnapshotVariable{writer.appendString(name), static_cast<uint64_t>(slot)});
+    }
+    header.variables = writer.append(std::span<const SnapshotVariable>(variables));
+
+    auto natives = std::vector<SnapshotNative>();
+    for (auto index : used_natives.getUsed()) {
+        natives.emplace_back(SnapshotNative{writer.appendString(chunk.natives->getName(index)), chunk.natives->getFunctions()[index].arity});
+    }
+    header.natives = writer.append(std::span<const SnapshotNative>(natives));
+
+    auto texts = std::vector<SnapshotRange>();
+    for (auto id : strings.getIds()) {
+        texts.emplace_back(writer.appendString(StringTable::lookup(id)));
+    }
+    header.strings = writer.append(std::span<const SnapshotRange>(texts));
+    return writer.finish(header);
+}
+
+// Image of `chunk` that runs it from the start, as a Snapshot taken before
+// its first instruction would.
+export auto buildProgramImage(const Chunk& chunk) -> std::vector<char> {
+    auto globals = std::vector<int>(chunk.getSlotCount());
+    return buildSnapshotImage(chunk, 0, globals);
+}
+
+// Saves the state of `vm`, which has to be running `chunk` and be suspended
+// by a `yield` at the top level of the script, to `path`. Strings the script
+// built are interned to be written. Slots holding the same array still share
+// it once the snapshot is loaded. The file is written under a temporary
+// name and renamed into place, so readers never see a partial snapshot.
+// Returns false and reports why on failure.
+export auto writeSnapshot(VM& vm, const Chunk& chunk, const std::filesystem::path& path) -> bool {
+    if (vm.getStatus() != VMStatus::Yielded || vm.getCallDepth() != 0 || !vm.getStack().empty()) {
+        fprintf(stderr, "Snapshots can only be taken at a top-level yield\n");
+        return false;
+    }
+
+    auto globals = std::vector<int>(chunk.getSlotCount());
+    for (size_t i = 0; i < globals.size(); ++i) {
+        globals[i] = vm.getGlobal(i);
+    }
+    auto arrays = std::vector<std::vector<int>>();
+    auto indices = std::map<int, int>();
+    for (const auto& [slot, type] : chunk.slot_types) {
+        if (static_cast<size_t>(slot) >= globals.size()) {
+            continue;
+        }
+        if (type == ValueType::String) {
+            globals[slot] = vm.getStrings().intern(globals[slot]);
+        } else if (type == ValueType::Array && globals[slot] != 0) {
+            auto [it, inserted] = indices.emplace(globals[slot], static_cast<int>(arrays.size()) + 1);
+            if (inserted) {
+                auto values = vm.getArrays().get(globals[slot]);
+                arrays.emplace_back(values.begin(), values.end());
+            }
+            globals[slot] = it->second;
+        }
+    }
+    auto bytes = buildSnapshotImage(chunk, vm.getFrame().ip, globals, arrays);
+    auto tmp_path = path;
+    tmp_path += "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary);
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        if (!file) {
+            fprintf(stderr, "Failed to write '%s'\n", tmp_path.c_str());
+            return false;
+        }
+    }
+    auto error = std::error_code();
+    std::filesystem::rename(tmp_path, path, error);
+    if (error) {
+        fprintf(stderr, "Failed to move '%s' into place: %s\n", tmp_path.c_str(), error.message().c_str());
+        std::filesystem::remove(tmp_path, error);
+        return false;
+    }
+    return true;
+}
+
+// A snapshot mapped into memory, from which any number of VMs can continue
+// the script where writeSnapshot() stopped it. Like a Chunk, it is only
+// read while scripts run, so VMs on different threads can share it.
+export class Snapshot : public ManagedObject {
+public:
+    Snapshot(const Snapshot&) = delete;
+    auto operator=(const Snapshot&) -> Snapshot& = delete;
+
+    // Maps the snapshot at `path`. Native functions the script calls are
+    // bound again by name from `natives`, which has to define all of them
+    // with the same arity. Returns null and reports why when the file is not
+    // a snapshot this build can run. The layout is checked, and so is the
+    // bytecode, see verifyCode().
+    static auto open(const std::filesystem::path& path, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>()) -> ManagedShared<Snapshot> {
+        auto source = MappedSource::open(path);
+        if (!source) {
+            return ManagedShared<Snapshot>();
+        }
+        return create(std::move(*source), std::move(natives), path);
+    }
+
+    // Same as open(), for a snapshot or program image already open as `fd`,
+    // such as a memfd. `fd` stays open; `name` only names it in messages.
+    static auto map(int fd, const std::filesystem::path& name, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>()) -> ManagedShared<Snapshot> {
+        auto source = MappedSource::map(fd, name);
+        if (!source) {
+            return ManagedShared<Snapshot>();
+        }
+        return create(std::move(*source), std::move(natives), name);
+    }
+
+    // Prepares `vm` to continue the script from the snapshot with run().
+    void load(VM& vm) const {
+        vm.load(getProgram());
+        vm.setInstructionPointer(ip_);
+        for (size_t i = 0; i < globals_.size(); ++i) {
+            vm.setGlobal(i, globals_[i]);
+        }
+        for (const auto& [slot, id] : string_globals_) {
+            vm.setGlobal(slot, id);
+        }
+        auto handles = std::vector<int>(arrays_.size(), 0);
+        for (const auto& [slot, index] : array_globals_) {
+            if (index == 0) {
+                continue;
+            }
+            if (handles[index - 1] == 0) {
+                handles[index - 1] = vm.getArrays().create(arrays_[index - 1]);
+            }
+            vm.setGlobal(slot, handles[index - 1]);
+        }
+    }
+
+    [[nodiscard]] auto getProgram() const -> Program {
+        Program program;
+        program.code = main_.code;
+        program.lines = main_.lines;
+        program.name = main_.name;
+        program.slots = globals_.size();
+        program.natives = natives_;
+        program.functions = &functions_;
+        return program;
+    }
+
+    // Size of the mapped image, shared with every process mapping the same file.
+    [[nodiscard]] auto getImageSize() const -> size_t {
+        return source_.view().size();
+    }
+
+    // Slot of the script's top-level variable `name`.
+    [[nodiscard]] auto findVariable(std::string_view name) const -> std::optional<size_t> {
+        for (const auto& [variable, slot] : variables_) {
+            if (variable == name) {
+                return slot;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    Snapshot(MappedSource source, ManagedShared<NativeRegistry> registry)
+        : source_(std::move(source)), registry_(std::move(registry)) {}
+
+    static auto create(MappedSource source, ManagedShared<NativeRegistry> natives, const std::filesystem::path& path) -> ManagedShared<Snapshot> {
+        auto snapshot = ManagedShared(new Snapshot(std::move(source), std::move(natives)));
+        if (!snapshot->bind(path)) {
+            return ManagedShared<Snapshot>();
+        }
+        return snapshot;
+    }
+
+    // Checks every range against the size of the mapping before anything
+    // points into it.
+    auto bind(const std::filesystem::path& path) -> bool {
+        auto data = source_.view();
+        auto header = SnapshotHeader();
+        if (data.size() < sizeof(header) || std::memcmp(data.data(), kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+            fprintf(stderr, "'%s' is not a snapshot\n", path.c_str());
+            return false;
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
+        if (header.version != kSnapshotVersion || header.opcode_count != kOpcodeCount) {
+            fprintf(stderr, "'%s' was written by an incompatible version\n", path.c_str());
+            return false;
+        }
+
+        auto valid = true;
+        auto read = [&]<typename T>(const SnapshotRange& range, T*) -> std::span<const T> {
+            if (range.offset % alignof(T) != 0 || range.offset > data.size() || range.size > (data.size() - range.offset) / sizeof(T)) {
+                valid = false;
+                return {};
+            }
+            return std::span(reinterpret_cast<const T*>(data.data() + range.offset), range.size);
+        };
+        auto readString = [&](const SnapshotRange& range) -> std::string_view {
+            auto text = read(SnapshotRange{range.offset, range.size + 1}, static_cast<char*>(nullptr));
+            if (text.empty() || text.back() != '\0') {
+                valid = false;
+                return {};
+            }
+            return std::string_view(text.data(), range.size);
+        };
+        auto ids = std::vector<int>();
+        for (const auto& text : read(header.strings, static_cast<SnapshotRange*>(nullptr))) {
+            ids.emplace_back(StringTable::intern(readString(text)));
+        }
+        // Code that pushes strings is copied to give it this process's ids,
+        // the rest runs from the mapping.
+        auto readInstructions = [&](const SnapshotRange& range) -> const int* {
+            auto code = read(range, static_cast<int*>(nullptr));
+            auto translated = std::vector<int>();
+            valid = valid && forEachInstruction(code, [&](size_t ip) {
+                if (code[ip] != OP_PUSH_STRING) {
+                    return;
+                }
+                if (translated.empty()) {
+                    translated.assign(code.begin(), code.end());
+                }
+                auto index = static_cast<size_t>(code[ip + 1]);
+                if (index >= ids.size()) {
+                    valid = false;
+                    return;
+                }
+                translated[ip + 1] = ids[index];
+            });
+            if (translated.empty()) {
+                return code.data();
+            }
+            return code_.emplace_back(std::move(translated)).data();
+        };
+        auto readCode = [&](const SnapshotCode& code, LineTable& lines, size_t entry = 0) -> CallTarget {
+            auto entries = read(code.lines, static_cast<uint32_t*>(nullptr));
+            for (size_t i = 0; i + 1 < entries.size(); i += 2) {
+                lines.addLine(entries[i], entries[i + 1]);
+            }
+            auto limits = SnapshotCodeLimits{
+                .slots = code.slots,
+                .globals = header.globals.size,
+                .functions = header.functions.size,
+                .natives = header.natives.size,
+            };
+            valid = valid && code.arity <= code.slots && (code.memoize == 0 || code.arity <= MemoCache::kMaxArgs);
+            valid = valid && verifyCode(read(code.code, static_cast<int*>(nullptr)), limits, entry);
+            return CallTarget{
+                .code = readInstructions(code.code),
+                .lines = &lines,
+                .name = readString(code.name).data(),
+                .arity = code.arity,
+                .slots = code.slots,
+                .memoize = code.memoize != 0,
+            };
+        };
+
+        main_ = readCode(header.main, lines_.emplace_back(), header.ip);
+        globals_ = read(header.globals, static_cast<int*>(nullptr));
+        ip_ = header.ip;
+        for (const auto& function : read(header.functions, static_cast<SnapshotCode*>(nullptr))) {
+            functions_.add(readCode(function, lines_.emplace_back()));
+        }
+        for (const auto& variable : read(header.variables, static_cast<SnapshotVariable*>(nullptr))) {
+            variables_.emplace_back(readString(variable.name), variable.slot);
+        }
+        auto natives = read(header.natives, static_cast<SnapshotNative*>(nullptr));
+        auto names = std::vector<std::string_view>();
+        for (const auto& native : natives) {
+            names.emplace_back(readString(native.name));
+        }
+        for (auto slot : read(header.string_slots, static_cast<uint64_t*>(nullptr))) {
+            if (slot >= globals_.size() || static_cast<size_t>(globals_[slot]) >= ids.size()) {
+                valid = false;
+                break;
+            }
+            string_globals_.emplace_back(slot, ids[globals_[slot]]);
+        }
+        for (const auto& array : read(header.arrays, static_cast<SnapshotRange*>(nullptr))) {
+            arrays_.emplace_back(read(array, static_cast<int*>(nullptr)));
+        }
+        for (auto slot : read(header.array_slots, static_cast<uint64_t*>(nullptr))) {
+            if (slot >= globals_.size() || globals_[slot] < 0 || static_cast<size_t>(globals_[slot]) > arrays_.size()) {
+                valid = false;
+                break;
+            }
+            array_globals_.emplace_back(slot, static_cast<size_t>(globals_[slot]));
+        }
+        if (!valid || main_.code == nullptr || globals_.size() != main_.slots || ip_ >= header.main.code.size) {
+            fprintf(stderr, "'%s' is damaged\n", path.c_str());
+            return false;
+        }
+
+        for (size_t i = 0; i < natives.size(); ++i) {
+            auto index = registry_ ? registry_->find(names[i]) : std::nullopt;
+            if (!index.has_value() || registry_->getFunctions()[*index].arity != natives[i].arity) {
+                fprintf(stderr, "'%s' needs native function '%.*s' with %llu arguments\n",
+                    path.c_str(), (int) names[i].size(), names[i].data(), static_cast<unsigned long long>(natives[i].arity));
+                return false;
+            }
+            natives_.emplace_back(registry_->getFunctions()[*index]);
+        }
+        return true;
+    }
+
+private:
+    MappedSource source_;
+    ManagedShared<NativeRegistry> registry_;
+    CallTarget main_;
+    std::span<const int> globals_;
+    // Slots of `globals_` that hold strings, with their ids in this process.
+    std::vector<std::pair<size_t, int>> string_globals_;
+    // Contents of the arrays, and the slots of `globals_` that hold one, with
+    // 0 for the empty array or one more than an index into `arrays_`.
+    std::vector<std::span<const int>> arrays_;
+    std::vector<std::pair<size_t, size_t>> array_globals_;
+    size_t ip_ = 0;
+    // Only get() is called through it, which changes nothing.
+    mutable PrecompiledFunctionTable functions_;
+    std::deque<LineTable> lines_;
+    // Copies of the code blocks that push strings.
+    std::deque<std::vector<int>> code_;
+    std::vector<std::pair<std::string_view, size_t>> variables_;
+    std::vector<NativeFunction> natives_;
+};
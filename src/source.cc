@@ -0,0 +1,90 @@
+module;
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <optional>
+#include <filesystem>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+export module cpp_script:source;
+
+// A script file mapped read-only into memory. The parser lexes the mapping
+// in place, one token at a time, so no token array is built. The AST copies
+// the names it keeps, and the text once if it defers any function body, so
+// the mapping only has to outlive parsing.
+export class MappedSource {
+public:
+    // Maps `path`, or reports why it could not and returns nothing.
+    static auto open(const std::filesystem::path& path) -> std::optional<MappedSource> {
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Failed to open '%s': %s\n", path.c_str(), strerror(errno));
+            return std::nullopt;
+        }
+        auto source = map(fd, path);
+        ::close(fd);
+        return source;
+    }
+
+    // Maps the whole file open as `fd`, which stays open. `path` only names
+    // it in messages.
+    static auto map(int fd, const std::filesystem::path& path) -> std::optional<MappedSource> {
+        struct stat info = {};
+        if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+            fprintf(stderr, "'%s' is not a regular file\n", path.c_str());
+            return std::nullopt;
+        }
+
+        // mmap() rejects empty mappings, and an empty script needs none.
+        auto size = static_cast<size_t>(info.st_size);
+        void* data = nullptr;
+        if (size != 0) {
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                fprintf(stderr, "Failed to map '%s': %s\n", path.c_str(), strerror(errno));
+                return std::nullopt;
+            }
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+        return MappedSource(static_cast<const char*>(data), size);
+    }
+
+    MappedSource(MappedSource&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+    auto operator=(MappedSource&& other) noexcept -> MappedSource& {
+        if (this != &other) {
+            unmap();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    ~MappedSource() {
+        unmap();
+    }
+
+    [[nodiscard]] auto view() const -> std::string_view {
+        return std::string_view(data_, size_);
+    }
+
+private:
+    MappedSource(const char* data, size_t size) : data_(data), size_(size) {}
+
+    void unmap() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
@@ -0,0 +1,950 @@
+module;
+
+#include <map>
+#include <utility>
+#include <span>
+#include <tuple>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <algorithm>
+
+export module cpp_script:ssa;
+import :ir;
+import :native;
+
+// What the optimizer has to know about the chunk it rewrites.
+export struct SsaOptions {
+    std::span<const NativeFunction> natives;
+    // Argument counts of the script functions CALL can refer to.
+    std::span<const size_t> function_arities;
+    // Number of local slots the chunk uses; temporaries are added after them.
+    size_t local_slots = 0;
+    // Number of the script's slots, which GLOBAL opcodes refer to.
+    size_t global_slots = 0;
+    // Local slots whose contents can be seen from outside the chunk, by the
+    // host after HALT and by script functions through GLOBAL opcodes.
+    std::vector<bool> shared_locals;
+    // Local slots that only hold values within one statement, like those
+    // borrowed by inlined calls. They are dead wherever control flow meets.
+    std::vector<bool> temporary_locals;
+    // Whether the chunk is a function body. Its locals die at RET, and calls
+    // may read and write the script's slots behind its back.
+    bool is_function = false;
+};
+
+// An instruction of the optimizer's SSA form. Every instruction defines one
+// value, named by its index, and is described by the opcode it lowers to:
+// PUSH is a constant, GET_* reads a slot whose contents are not known,
+// SET_* stores a value, and the remaining opcodes compute from their
+// operands. Slots are memory and values are registers: reading a slot after
+// storing to it yields the stored value directly.
+struct SsaInstruction {
+    int opcode = OP_HALT;
+    int arg = 0;
+    std::vector<uint32_t> operands;
+    uint32_t line = 0;
+    uint32_t uses = 0;
+    // Has effects beyond its value, so it is emitted where it stood.
+    bool root = false;
+    bool dead = false;
+};
+
+// Where a value can be read from without computing it again.
+struct SsaLocation {
+    bool global = false;
+    int slot = 0;
+
+    auto operator==(const SsaLocation&) const -> bool = default;
+};
+
+// Line of each offset, for code that is visited in order.
+class LineCursor {
+public:
+    explicit LineCursor(const LineTable& lines) {
+        lines.forEachEntry([&](size_t offset, uint32_t line) {
+            entries_.emplace_back(offset, line);
+        });
+    }
+
+    auto getLine(size_t offset) -> uint32_t {
+        while (next_ < entries_.size() && entries_[next_].first <= offset) {
+            line_ = entries_[next_++].second;
+        }
+        return line_;
+    }
+
+private:
+    std::vector<std::pair<size_t, uint32_t>> entries_;
+    size_t next_ = 0;
+    uint32_t line_ = 0;
+};
+
+// Lifts a basic block into SSA form. Common subexpressions share one value
+// (value numbering), reads of stored slots are forwarded to the stored
+// value (copy propagation) and arithmetic on constants is folded. A jump
+// that ends the block is a root whose `arg` is its original target.
+class SsaBuilder {
+public:
+    explicit SsaBuilder(const SsaOptions& options)
+        : options_(options), locals_(options.local_slots), globals_(options.global_slots) {}
+
+    // Lifts the block of `code` between `begin` and `end`.
+    auto build(const std::vector<int>& code, size_t begin, size_t end, LineCursor& lines) -> std::vector<SsaInstruction> {
+        size_t ip = begin;
+        while (ip < end) {
+            auto opcode = code[ip];
+            auto operands = std::span<const int>(code).subspan(ip + 1, getOperandCount(opcode));
+            line_ = lines.getLine(ip);
+            ip += 1 + operands.size();
+            if (!lift(opcode, operands)) {
+                return std::move(instructions_);
+            }
+        }
+        if (!stack_.empty()) {
+            fprintf(stderr, "SSA: values left on the stack at the end of a block\n");
+            abort();
+        }
+        return std::move(instructions_);
+    }
+
+private:
+    // Returns false at the end of the block.
+    auto lift(int opcode, std::span<const int> operands) -> bool {
+        auto arg = operands.empty() ? 0 : operands[0];
+        switch (opcode) {
+            case OP_HALT:
+            case OP_RET: {
+                add(opcode, 0, std::move(stack_), true);
+                return false;
+            }
+            case OP_JUMP:
+                endBlock();
+                add(OP_JUMP, arg, {}, true);
+                return false;
+            // The host may look at and change any slot while the script is
+            // suspended, so a yield ends the block like a jump.
+            case OP_YIELD:
+                endBlock();
+                add(OP_YIELD, 0, {}, true);
+                return false;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE: {
+                auto value = pop();
+                endBlock();
+                if (auto condition = instructions_[value]; isComparison(condition.opcode)) {
+                    auto comparison = opcode == OP_JUMP_IF_TRUE ? condition.opcode : negateComparison(condition.opcode);
+                    branch(comparison, condition.operands[0], condition.operands[1], arg);
+                } else if (auto constant = getConstant(value)) {
+                    if ((*constant != 0) == (opcode == OP_JUMP_IF_TRUE)) {
+                        add(OP_JUMP, arg, {}, true);
+                    }
+                } else {
+                    add(opcode, arg, {value}, true);
+                }
+                return false;
+            }
+            case OP_JUMP_IF_LT:
+            case OP_JUMP_IF_LE:
+            case OP_JUMP_IF_GT:
+            case OP_JUMP_IF_GE:
+            case OP_JUMP_IF_EQ:
+            case OP_JUMP_IF_NE: {
+                auto rhs = pop();
+                auto lhs = pop();
+                endBlock();
+                branch(getBranchComparison(opcode), lhs, rhs, arg);
+                return false;
+            }
+            case OP_JUMP_IF_LT_LOCAL_CONST:
+            case OP_JUMP_IF_LE_LOCAL_CONST:
+            case OP_JUMP_IF_GT_LOCAL_CONST:
+            case OP_JUMP_IF_GE_LOCAL_CONST:
+            case OP_JUMP_IF_EQ_LOCAL_CONST:
+            case OP_JUMP_IF_NE_LOCAL_CONST: {
+                auto lhs = load(false, arg);
+                auto rhs = number(OP_PUSH, operands[1], {});
+                endBlock();
+                branch(getBranchComparison(opcode), lhs, rhs, operands[2]);
+                return false;
+            }
+            case OP_PUSH:
+                stack_.emplace_back(number(OP_PUSH, arg, {}));
+                return true;
+            case OP_PUSH_STRING:
+                stack_.emplace_back(number(OP_PUSH_STRING, arg, {}));
+                return true;
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+                stack_.emplace_back(load(opcode == OP_GET_GLOBAL, arg));
+                return true;
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL: {
+                auto value = pop();
+                auto& def = slot(opcode == OP_SET_GLOBAL, arg);
+                // Storing what the slot already holds changes nothing.
+                if (def != value) {
+                    add(opcode, arg, {value}, true);
+                    def = value;
+                }
+                return true;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            case OP_EQ:
+            case OP_NE: {
+                auto rhs = pop();
+                auto lhs = pop();
+                stack_.emplace_back(binary(opcode, lhs, rhs));
+                return true;
+            }
+            case OP_NEG: {
+                auto value = pop();
+                if (auto constant = getConstant(value)) {
+                    stack_.emplace_back(number(OP_PUSH, *foldOperation(OP_NEG, 0, *constant), {}));
+                } else {
+                    stack_.emplace_back(number(OP_NEG, 0, {value}));
+                }
+                return true;
+            }
+            // Strings never change, so equal operands give equal strings. The
+            // VM builds a new one for each CONCAT, but nothing can tell.
+            case OP_CONCAT:
+            case OP_STRING_EQ:
+            case OP_STRING_NE: {
+                auto rhs = pop();
+                auto lhs = pop();
+                stack_.emplace_back(number(opcode, 0, {lhs, rhs}));
+                return true;
+            }
+            case OP_STRING_LENGTH: {
+                auto value = pop();
+                stack_.emplace_back(number(OP_STRING_LENGTH, 0, {value}));
+                return true;
+            }
+            // An array keeps its length, but its elements change, so reads
+            // stay in order with stores and calls. Making an array gives a
+            // new handle every time.
+            case OP_ARRAY_LENGTH: {
+                auto value = pop();
+                stack_.emplace_back(number(OP_ARRAY_LENGTH, 0, {value}));
+                return true;
+            }
+            case OP_MAKE_ARRAY:
+            case OP_NEW_ARRAY:
+            case OP_ARRAY_GET:
+            case OP_ARRAY_SUM:
+            case OP_ARRAY_DOT:
+            case OP_ARRAY_ARITH:
+                add(opcode, arg, popN(getArrayOperandCount(opcode, arg)), true);
+                stack_.emplace_back(static_cast<uint32_t>(instructions_.size() - 1));
+                return true;
+            case OP_ARRAY_SET:
+                add(OP_ARRAY_SET, 0, popN(3), true);
+                return true;
+            case OP_PRINT:
+                add(OP_PRINT, arg, popN(static_cast<size_t>(arg)), true);
+                return true;
+            case OP_PRINT_MIXED:
+                add(OP_PRINT_MIXED, arg, popN(static_cast<size_t>(arg & 0xff)), true);
+                return true;
+            case OP_POP:
+                pop();
+                return true;
+            case OP_CALL_NATIVE:
+                add(OP_CALL_NATIVE, arg, popN(options_.natives[arg].arity), true);
+                stack_.emplace_back(static_cast<uint32_t>(instructions_.size() - 1));
+                return true;
+            case OP_CALL:
+                add(OP_CALL, arg, popN(options_.function_arities[arg]), true);
+                stack_.emplace_back(static_cast<uint32_t>(instructions_.size() - 1));
+                // The callee may store to the shared slots, so what they held
+                // before has to be read again.
+                if (options_.is_function) {
+                    std::fill(globals_.begin(), globals_.end(), std::nullopt);
+                } else {
+                    for (size_t i = 0; i < locals_.size(); ++i) {
+                        if (isShared(i)) {
+                            locals_[i] = std::nullopt;
+                        }
+                    }
+                }
+                return true;
+            default:
+                fprintf(stderr, "SSA: unsupported opcode %d\n", opcode);
+                abort();
+        }
+    }
+
+    static auto getArrayOperandCount(int opcode, int arg) -> size_t {
+        switch (opcode) {
+            case OP_MAKE_ARRAY:
+                return static_cast<size_t>(arg);
+            case OP_NEW_ARRAY:
+            case OP_ARRAY_SUM:
+                return 1;
+            default:
+                return 2;
+        }
+    }
+
+    // Value of the slot, which is only read from memory if the block has
+    // not stored to or read it yet.
+    auto load(bool global, int index) -> uint32_t {
+        auto& def = slot(global, index);
+        if (!def.has_value()) {
+            add(global ? OP_GET_GLOBAL : OP_GET_LOCAL, index, {}, false);
+            def = static_cast<uint32_t>(instructions_.size() - 1);
+        }
+        return *def;
+    }
+
+    // Conditional jump to `target` if `comparison` holds between the values.
+    // Constant conditions become a plain jump or nothing at all, and a
+    // constant operand goes on the right, where lowering can fuse it.
+    void branch(int comparison, uint32_t lhs, uint32_t rhs, int target) {
+        auto a = getConstant(lhs);
+        auto b = getConstant(rhs);
+        if (a && b) {
+            if (*foldOperation(comparison, *a, *b) != 0) {
+                add(OP_JUMP, target, {}, true);
+            }
+            return;
+        }
+        if (a) {
+            std::swap(lhs, rhs);
+            comparison = mirrorComparison(comparison);
+        }
+        add(getBranchOpcode(comparison), target, {lhs, rhs}, true);
+    }
+
+    void endBlock() {
+        if (!stack_.empty()) {
+            fprintf(stderr, "SSA: values left on the stack across a jump\n");
+            abort();
+        }
+    }
+
+    auto binary(int opcode, uint32_t lhs, uint32_t rhs) -> uint32_t {
+        auto a = getConstant(lhs);
+        auto b = getConstant(rhs);
+        if (a && b) {
+            if (auto value = foldOperation(opcode, *a, *b)) {
+                return number(OP_PUSH, *value, {});
+            }
+        }
+        if ((opcode == OP_ADD || opcode == OP_SUB) && b == 0) {
+            return lhs;
+        }
+        if (opcode == OP_ADD && a == 0) {
+            return rhs;
+        }
+        if ((opcode == OP_MUL || opcode == OP_DIV) && b == 1) {
+            return lhs;
+        }
+        if (opcode == OP_MUL && a == 1) {
+            return rhs;
+        }
+        // Constants go on the right, so that they are pushed last.
+        if ((opcode == OP_ADD || opcode == OP_MUL) && a.has_value()) {
+            std::swap(lhs, rhs);
+        }
+        return number(opcode, 0, {lhs, rhs});
+    }
+
+    // Value of a pure operation, shared with an identical earlier one.
+    auto number(int opcode, int arg, std::vector<uint32_t> operands) -> uint32_t {
+        auto key = std::make_tuple(opcode, arg, operands);
+        // a + b and b + a are the same value. Operands keep their order for
+        // evaluation, only the key is sorted.
+        if (opcode == OP_ADD || opcode == OP_MUL) {
+            std::sort(std::get<2>(key).begin(), std::get<2>(key).end());
+        }
+        if (auto it = numbering_.find(key); it != numbering_.end()) {
+            return it->second;
+        }
+        add(opcode, arg, std::move(operands), false);
+        auto value = static_cast<uint32_t>(instructions_.size() - 1);
+        numbering_.emplace(std::move(key), value);
+        return value;
+    }
+
+    auto add(int opcode, int arg, std::vector<uint32_t> operands, bool root) -> SsaInstruction& {
+        auto& instruction = instructions_.emplace_back();
+        instruction.opcode = opcode;
+        instruction.arg = arg;
+        instruction.operands = std::move(operands);
+        instruction.line = line_;
+        instruction.root = root;
+        return instruction;
+    }
+
+    auto getConstant(uint32_t value) const -> std::optional<int> {
+        if (instructions_[value].opcode == OP_PUSH) {
+            return instructions_[value].arg;
+        }
+        return std::nullopt;
+    }
+
+    auto slot(bool global, int index) -> std::optional<uint32_t>& {
+        auto& slots = global ? globals_ : locals_;
+        if (index < 0 || static_cast<size_t>(index) >= slots.size()) {
+            fprintf(stderr, "SSA: slot %d out of range\n", index);
+            abort();
+        }
+        return slots[static_cast<size_t>(index)];
+    }
+
+    auto isShared(size_t slot) const -> bool {
+        return slot < options_.shared_locals.size() && options_.shared_locals[slot];
+    }
+
+    auto pop() -> uint32_t {
+        auto value = stack_.back();
+        stack_.pop_back();
+        return value;
+    }
+
+    auto popN(size_t count) -> std::vector<uint32_t> {
+        auto values = std::vector<uint32_t>(stack_.end() - static_cast<std::ptrdiff_t>(count), stack_.end());
+        stack_.resize(stack_.size() - count);
+        return values;
+    }
+
+private:
+    const SsaOptions& options_;
+    std::vector<SsaInstruction> instructions_;
+    std::map<std::tuple<int, int, std::vector<uint32_t>>, uint32_t> numbering_;
+    std::vector<std::optional<uint32_t>> locals_;
+    std::vector<std::optional<uint32_t>> globals_;
+    std::vector<uint32_t> stack_;
+    uint32_t line_ = 0;
+};
+
+// Removes stores that are overwritten or die before anything can read them,
+// then every pure value nothing uses any more. Unless the block ends
+// execution, other blocks may read any slot but temporaries after it.
+void eliminateDeadCode(std::vector<SsaInstruction>& instructions, const SsaOptions& options) {
+    auto ends = !instructions.empty() && (instructions.back().opcode == OP_HALT || instructions.back().opcode == OP_RET);
+    auto live_locals = std::vector<bool>(options.local_slots, !ends);
+    auto live_globals = std::vector<bool>(options.global_slots, !ends && options.is_function);
+    for (size_t i = 0; i < live_locals.size() && i < options.temporary_locals.size(); ++i) {
+        live_locals[i] = live_locals[i] && !options.temporary_locals[i];
+    }
+    auto share = [&] {
+        if (options.is_function) {
+            std::fill(live_globals.begin(), live_globals.end(), true);
+        } else {
+            for (size_t i = 0; i < live_locals.size() && i < options.shared_locals.size(); ++i) {
+                live_locals[i] = live_locals[i] || options.shared_locals[i];
+            }
+        }
+    };
+
+    for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+        switch (it->opcode) {
+            case OP_HALT:
+            case OP_RET:
+            case OP_CALL:
+                share();
+                break;
+            case OP_GET_LOCAL:
+                live_locals[it->arg] = true;
+                break;
+            case OP_GET_GLOBAL:
+                live_globals[it->arg] = true;
+                break;
+            case OP_SET_LOCAL:
+                it->dead = !live_locals[it->arg];
+                live_locals[it->arg] = false;
+                break;
+            case OP_SET_GLOBAL:
+                it->dead = !live_globals[it->arg];
+                live_globals[it->arg] = false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (auto& instruction : instructions) {
+        if (!instruction.dead) {
+            for (auto operand : instruction.operands) {
+                instructions[operand].uses += 1;
+            }
+        }
+    }
+    for (size_t i = instructions.size(); i-- > 0;) {
+        auto& instruction = instructions[i];
+        if (instruction.dead || instruction.root || instruction.uses != 0) {
+            continue;
+        }
+        // An unused division still has to trap if its divisor is bad.
+        if (instruction.opcode == OP_DIV) {
+            auto& divisor = instructions[instruction.operands[1]];
+            if (divisor.opcode != OP_PUSH || divisor.arg == 0 || divisor.arg == -1) {
+                instruction.root = true;
+                continue;
+            }
+        }
+        instruction.dead = true;
+        for (auto operand : instruction.operands) {
+            instructions[operand].uses -= 1;
+        }
+    }
+}
+
+// A jump emitted by SsaLowering, whose target operand at `offset` still
+// holds the offset of the target in the original code.
+struct SsaJump {
+    size_t offset;
+    int target;
+};
+
+// Turns the SSA form of a block back into stack code, appended to `code`.
+// Roots are emitted in their original order and pull in the trees of values
+// they use. A value needed more than once is read back from a slot that
+// holds it: the slot it was stored to, the slot it was loaded from, or a
+// temporary. Before a slot is overwritten, values that still live only
+// there are copied to temporaries.
+class SsaLowering {
+public:
+    SsaLowering(std::vector<SsaInstruction>& instructions, const SsaOptions& options, std::vector<int>& code)
+        : instructions_(instructions), options_(options), remaining_(instructions.size()), homes_(instructions.size()), code_(code), temps_used_(0) {
+        for (size_t i = 0; i < instructions_.size(); ++i) {
+            remaining_[i] = instructions_[i].uses;
+        }
+        findInlinedRoots();
+    }
+
+    void lower(LineTable& lines) {
+        for (size_t i = 0; i < instructions_.size(); ++i) {
+            auto& instruction = instructions_[i];
+            // A slot read by the original code holds its value from then on.
+            if (!instruction.dead && (instruction.opcode == OP_GET_LOCAL || instruction.opcode == OP_GET_GLOBAL)) {
+                setHome(static_cast<uint32_t>(i), SsaLocation{instruction.opcode == OP_GET_GLOBAL, instruction.arg});
+            }
+            if (!instruction.root || instruction.dead || inlined_[i]) {
+                continue;
+            }
+            lines.addLine(code_.size(), instruction.line);
+            emitRoot(static_cast<uint32_t>(i));
+        }
+    }
+
+    [[nodiscard]] auto getTemporaryCount() const -> size_t {
+        return temps_used_;
+    }
+
+    [[nodiscard]] auto getJumps() const -> const std::vector<SsaJump>& {
+        return jumps_;
+    }
+
+private:
+    // A call or array operation whose value is used once, by the tree of the
+    // next root that is not such a call itself, is emitted inside that tree
+    // when the tree reaches it before anything the original code did after
+    // it.
+    void findInlinedRoots() {
+        inlined_.assign(instructions_.size(), false);
+        visited_.assign(instructions_.size(), 0);
+        auto consumer = std::vector<std::optional<uint32_t>>(instructions_.size());
+        for (size_t i = 0; i < instructions_.size(); ++i) {
+            if (instructions_[i].dead) {
+                continue;
+            }
+            for (auto operand : instructions_[i].operands) {
+                consumer[operand] = static_cast<uint32_t>(i);
+            }
+        }
+
+        // Root whose tree the calls seen so far are emitted in, and for
+        // inlined calls, the root they were inlined into.
+        auto owner = std::vector<std::optional<uint32_t>>(instructions_.size());
+        std::optional<uint32_t> target;
+        for (size_t i = instructions_.size(); i-- > 0;) {
+            auto& instruction = instructions_[i];
+            if (!instruction.root || instruction.dead) {
+                continue;
+            }
+            auto call = static_cast<uint32_t>(i);
+            if (isCall(call) && instruction.uses == 1 && target.has_value()) {
+                // Follow the single use through pure values to a root.
+                auto user = consumer[call];
+                while (user.has_value() && !instructions_[*user].root && instructions_[*user].uses == 1) {
+                    user = consumer[*user];
+                }
+                if (user.has_value() && instructions_[*user].root && (user == target || owner[*user] == target) && isReachedInOrder(*target, call)) {
+                    inlined_[call] = true;
+                    owner[call] = target;
+                    continue;
+                }
+            }
+            target = call;
+        }
+    }
+
+    // Whether emitting the tree of `root` reaches `call` before any other
+    // call or read of a slot calls may store to that comes after `call` in
+    // the original code.
+    auto isReachedInOrder(uint32_t root, uint32_t call) -> bool {
+        visit_mark_ += 1;
+        auto ordered = true;
+        auto found = false;
+        auto visit = [&](auto& self, uint32_t value) -> void {
+            if (found || !ordered || visited_[value] == visit_mark_) {
+                return;
+            }
+            visited_[value] = visit_mark_;
+            if (value == call) {
+                found = true;
+                return;
+            }
+            if (value > call && (isCall(value) || isSharedRead(value))) {
+                ordered = false;
+                return;
+            }
+            // Values of roots emitted on their own are read from a slot.
+            if (instructions_[value].root && !inlined_[value]) {
+                return;
+            }
+            for (auto operand : instructions_[value].operands) {
+                self(self, operand);
+            }
+        };
+        visited_[root] = visit_mark_;
+        for (auto operand : instructions_[root].operands) {
+            visit(visit, operand);
+        }
+        return found && ordered;
+    }
+
+    auto isCall(uint32_t value) const -> bool {
+        switch (instructions_[value].opcode) {
+            case OP_CALL:
+            case OP_CALL_NATIVE:
+            case OP_MAKE_ARRAY:
+            case OP_NEW_ARRAY:
+            case OP_ARRAY_GET:
+            case OP_ARRAY_SUM:
+            case OP_ARRAY_DOT:
+            case OP_ARRAY_ARITH:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Reads a slot that script functions may store to.
+    auto isSharedRead(uint32_t value) const -> bool {
+        auto& instruction = instructions_[value];
+        if (instruction.opcode == OP_GET_GLOBAL) {
+            return true;
+        }
+        if (instruction.opcode == OP_GET_LOCAL && !options_.is_function) {
+            auto slot = static_cast<size_t>(instruction.arg);
+            return slot < options_.shared_locals.size() && options_.shared_locals[slot];
+        }
+        return false;
+    }
+
+    void emitRoot(uint32_t value) {
+        auto& instruction = instructions_[value];
+        switch (instruction.opcode) {
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL: {
+                auto operand = instruction.operands[0];
+                emitOperand(operand, true);
+                auto location = SsaLocation{instruction.opcode == OP_SET_GLOBAL, instruction.arg};
+                evict(location, value, operand);
+                emit(instruction.opcode, instruction.arg);
+                if (remaining_[operand] != 0 && !homes_[operand].has_value() && instructions_[operand].opcode != OP_PUSH && instructions_[operand].opcode != OP_PUSH_STRING) {
+                    setHome(operand, location);
+                }
+                return;
+            }
+            case OP_PRINT:
+            case OP_PRINT_MIXED:
+            case OP_ARRAY_SET:
+            case OP_HALT:
+            case OP_RET:
+                for (auto operand : instruction.operands) {
+                    emitOperand(operand, false);
+                }
+                if (instruction.opcode == OP_PRINT || instruction.opcode == OP_PRINT_MIXED) {
+                    emit(instruction.opcode, instruction.arg);
+                } else {
+                    emit(instruction.opcode);
+                }
+                return;
+            case OP_YIELD:
+                emit(OP_YIELD);
+                return;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                for (auto operand : instruction.operands) {
+                    emitOperand(operand, false);
+                }
+                emitJump(instruction.opcode, instruction.arg);
+                return;
+            case OP_JUMP_IF_LT:
+            case OP_JUMP_IF_LE:
+            case OP_JUMP_IF_GT:
+            case OP_JUMP_IF_GE:
+            case OP_JUMP_IF_EQ:
+            case OP_JUMP_IF_NE: {
+                auto lhs = instruction.operands[0];
+                auto rhs = instruction.operands[1];
+                auto& constant = instructions_[rhs];
+                // A value in a local compared with a constant needs neither
+                // on the stack.
+                if (constant.opcode == OP_PUSH && homes_[lhs].has_value() && !homes_[lhs]->global) {
+                    auto slot = homes_[lhs]->slot;
+                    remaining_[rhs] -= 1;
+                    if (--remaining_[lhs] == 0) {
+                        releaseHome(lhs);
+                    }
+                    emit(getLocalConstBranchOpcode(getBranchComparison(instruction.opcode)), slot);
+                    code_.emplace_back(constant.arg);
+                    emitJumpTarget(instruction.arg);
+                    return;
+                }
+                emitOperand(lhs, false);
+                emitOperand(rhs, false);
+                emitJump(instruction.opcode, instruction.arg);
+                return;
+            }
+            default:
+                // Calls, array operations and trapping divisions: keep the
+                // value for its uses or drop it right away.
+                compute(value);
+                if (remaining_[value] != 0) {
+                    auto temp = allocateTemp();
+                    emit(OP_SET_LOCAL, temp);
+                    setHome(value, SsaLocation{false, temp});
+                } else {
+                    emit(OP_POP);
+                }
+                return;
+        }
+    }
+
+    // Leaves `value` on the stack for one of its uses.
+    void emitOperand(uint32_t value, bool for_store) {
+        remaining_[value] -= 1;
+        auto& instruction = instructions_[value];
+        if (instruction.opcode == OP_PUSH || instruction.opcode == OP_PUSH_STRING) {
+            emit(instruction.opcode, instruction.arg);
+            return;
+        }
+        if (homes_[value].has_value()) {
+            auto home = *homes_[value];
+            emit(home.global ? OP_GET_GLOBAL : OP_GET_LOCAL, home.slot);
+            if (remaining_[value] == 0) {
+                releaseHome(value);
+            }
+            return;
+        }
+        compute(value);
+        // A store gives the value a home itself.
+        if (remaining_[value] != 0 && !for_store) {
+            auto temp = allocateTemp();
+            emit(OP_SET_LOCAL, temp);
+            emit(OP_GET_LOCAL, temp);
+            setHome(value, SsaLocation{false, temp});
+        }
+    }
+
+    void compute(uint32_t value) {
+        auto& instruction = instructions_[value];
+        for (auto operand : instruction.operands) {
+            emitOperand(operand, false);
+        }
+        switch (instruction.opcode) {
+            case OP_CALL:
+                clobber(value);
+                emit(OP_CALL, instruction.arg);
+                return;
+            default:
+                if (getOperandCount(instruction.opcode) != 0) {
+                    emit(instruction.opcode, instruction.arg);
+                } else {
+                    emit(instruction.opcode);
+                }
+                return;
+        }
+    }
+
+    // Copies values that still have uses out of `location` before the
+    // instruction `writer` overwrites it. Values the original code read
+    // after `writer` expect the new contents and stay.
+    void evict(SsaLocation location, uint32_t writer, std::optional<uint32_t> keep) {
+        auto values = std::exchange(getResidents(location), {});
+        auto staying = std::vector<uint32_t>();
+        for (auto value : values) {
+            if (homes_[value] != location || remaining_[value] == 0) {
+                continue;
+            }
+            if (value >= writer || value == keep) {
+                staying.emplace_back(value);
+                continue;
+            }
+            auto temp = allocateTemp();
+            emit(location.global ? OP_GET_GLOBAL : OP_GET_LOCAL, location.slot);
+            emit(OP_SET_LOCAL, temp);
+            setHome(value, SsaLocation{false, temp});
+        }
+        // Not kept as a reference across allocateTemp(), which may grow the
+        // table it points into.
+        getResidents(location) = std::move(staying);
+    }
+
+    // A call may store to every shared slot.
+    void clobber(uint32_t call) {
+        if (options_.is_function) {
+            for (size_t i = 0; i < options_.global_slots; ++i) {
+                evict(SsaLocation{true, static_cast<int>(i)}, call, std::nullopt);
+            }
+        } else {
+            for (size_t i = 0; i < options_.shared_locals.size(); ++i) {
+                if (options_.shared_locals[i]) {
+                    evict(SsaLocation{false, static_cast<int>(i)}, call, std::nullopt);
+                }
+            }
+        }
+    }
+
+    void setHome(uint32_t value, SsaLocation location) {
+        homes_[value] = location;
+        getResidents(location).emplace_back(value);
+    }
+
+    void releaseHome(uint32_t value) {
+        auto home = *homes_[value];
+        if (!home.global && static_cast<size_t>(home.slot) >= options_.local_slots) {
+            free_temps_.emplace_back(home.slot);
+        }
+    }
+
+    auto getResidents(SsaLocation location) -> std::vector<uint32_t>& {
+        auto& residents = location.global ? global_residents_ : local_residents_;
+        if (residents.size() <= static_cast<size_t>(location.slot)) {
+            residents.resize(location.slot + 1);
+        }
+        return residents[location.slot];
+    }
+
+    auto allocateTemp() -> int {
+        if (!free_temps_.empty()) {
+            auto temp = free_temps_.back();
+            free_temps_.pop_back();
+            getResidents(SsaLocation{false, temp}).clear();
+            return temp;
+        }
+        return static_cast<int>(options_.local_slots + temps_used_++);
+    }
+
+    void emitJump(int opcode, int target) {
+        emit(opcode);
+        emitJumpTarget(target);
+    }
+
+    void emitJumpTarget(int target) {
+        jumps_.emplace_back(SsaJump{code_.size(), target});
+        code_.emplace_back(target);
+    }
+
+    void emit(int opcode) {
+        code_.emplace_back(opcode);
+    }
+
+    void emit(int opcode, int arg) {
+        code_.emplace_back(opcode);
+        code_.emplace_back(arg);
+    }
+
+private:
+    std::vector<SsaInstruction>& instructions_;
+    const SsaOptions& options_;
+    std::vector<uint32_t> remaining_;
+    std::vector<std::optional<SsaLocation>> homes_;
+    std::vector<std::vector<uint32_t>> local_residents_;
+    std::vector<std::vector<uint32_t>> global_residents_;
+    std::vector<bool> inlined_;
+    std::vector<uint32_t> visited_;
+    uint32_t visit_mark_ = 0;
+    std::vector<int> free_temps_;
+    std::vector<int>& code_;
+    std::vector<SsaJump> jumps_;
+    size_t temps_used_;
+};
+
+// Offsets where basic blocks start: the entry, every jump target and every
+// instruction after a jump, a yield or the end of execution.
+auto findBlockStarts(const std::vector<int>& code) -> std::vector<size_t> {
+    auto starts = std::vector<bool>(code.size() + 1, false);
+    starts[0] = true;
+    for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+        auto next = ip + 1 + getOperandCount(code[ip]);
+        if (isJump(code[ip])) {
+            auto target = getJumpTarget(code.data(), ip);
+            if (target > code.size()) {
+                fprintf(stderr, "SSA: jump to %zu out of range\n", target);
+                abort();
+            }
+            starts[target] = true;
+            starts[std::min(next, code.size())] = true;
+        } else if (code[ip] == OP_HALT || code[ip] == OP_RET || code[ip] == OP_YIELD) {
+            starts[std::min(next, code.size())] = true;
+        }
+    }
+    auto offsets = std::vector<size_t>();
+    for (size_t ip = 0; ip < code.size(); ++ip) {
+        if (starts[ip]) {
+            offsets.emplace_back(ip);
+        }
+    }
+    return offsets;
+}
+
+// Rewrites `code` through SSA form, replacing `code` and `lines`. Each
+// basic block is optimized on its own: values never flow between blocks
+// other than through slots, so no phis are needed. Returns the number of
+// temporary slots the new code uses after the chunk's own
+// `options.local_slots`.
+export auto optimizeSsa(std::vector<int>& code, LineTable& lines, const SsaOptions& options) -> size_t {
+    auto starts = findBlockStarts(code);
+    auto cursor = LineCursor(lines);
+    auto optimized = std::vector<int>();
+    auto optimized_lines = LineTable();
+    // New offset of every block, by its old one.
+    auto moved = std::map<int, int>();
+    auto jumps = std::vector<SsaJump>();
+    size_t temps = 0;
+    for (size_t i = 0; i < starts.size(); ++i) {
+        auto end = i + 1 < starts.size() ? starts[i + 1] : code.size();
+        auto instructions = SsaBuilder(options).build(code, starts[i], end, cursor);
+        eliminateDeadCode(instructions, options);
+        moved.emplace(static_cast<int>(starts[i]), static_cast<int>(optimized.size()));
+        auto lowering = SsaLowering(instructions, options, optimized);
+        lowering.lower(optimized_lines);
+        temps = std::max(temps, lowering.getTemporaryCount());
+        jumps.insert(jumps.end(), lowering.getJumps().begin(), lowering.getJumps().end());
+    }
+    moved.emplace(static_cast<int>(code.size()), static_cast<int>(optimized.size()));
+    for (auto& jump : jumps) {
+        optimized[jump.offset] = moved.at(jump.target);
+    }
+    code = std::move(optimized);
+    lines = std::move(optimized_lines);
+    return temps;
+}
@@ -0,0 +1,117 @@
+module;
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+export module cpp_script:stats;
+import :gc;
+
+// Allocations made on the calling thread. Only executables that link the
+// replacement operator new from alloc.cpp (CPP_SCRIPT_COUNT_ALLOCATIONS)
+// count them, and alloc.cpp sets `cpp_script_allocations_counted` when it
+// is loaded; elsewhere the counters stay zero.
+extern "C++" {
+    thread_local uint64_t cpp_script_allocation_count = 0;
+    thread_local uint64_t cpp_script_allocation_bytes = 0;
+    bool cpp_script_allocations_counted = false;
+}
+
+// Whether allocation counts mean anything, rather than being zero because
+// nothing counts them.
+export auto areAllocationsCounted() -> bool {
+    return cpp_script_allocations_counted;
+}
+
+// `peak_live_objects` is the largest number of objects created during the
+// phase that were alive at once.
+export struct PhaseStats {
+    std::chrono::nanoseconds wall_time = {};
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t peak_live_objects = 0;
+    uint64_t created_objects = 0;
+};
+
+// Measures the enclosing scope into `stats`. A null `stats` measures nothing,
+// so callers can pass an optional pointer straight through.
+export class PhaseScope {
+public:
+    explicit PhaseScope(PhaseStats* stats) : stats_(stats) {
+        if (stats_ == nullptr) {
+            return;
+        }
+        auto& counters = ManagedObject::getThreadCounters();
+        allocations_ = cpp_script_allocation_count;
+        allocated_bytes_ = cpp_script_allocation_bytes;
+        created_objects_ = counters.created;
+        live_objects_ = counters.live;
+        // Scopes may nest, so the peak of the enclosing one is put back after.
+        outer_peak_live_objects_ = std::exchange(counters.peak_live, counters.live);
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    PhaseScope(const PhaseScope&) = delete;
+    auto operator=(const PhaseScope&) -> PhaseScope& = delete;
+
+    ~PhaseScope() {
+        if (stats_ == nullptr) {
+            return;
+        }
+        auto& counters = ManagedObject::getThreadCounters();
+        stats_->wall_time += std::chrono::steady_clock::now() - start_;
+        stats_->allocations += cpp_script_allocation_count - allocations_;
+        stats_->allocated_bytes += cpp_script_allocation_bytes - allocated_bytes_;
+        stats_->created_objects += counters.created - created_objects_;
+        stats_->peak_live_objects = std::max(stats_->peak_live_objects, static_cast<uint64_t>(counters.peak_live - live_objects_));
+        counters.peak_live = std::max(counters.peak_live, outer_peak_live_objects_);
+    }
+
+private:
+    PhaseStats* stats_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t allocations_ = 0;
+    uint64_t allocated_bytes_ = 0;
+    uint64_t created_objects_ = 0;
+    int64_t live_objects_ = 0;
+    int64_t outer_peak_live_objects_ = 0;
+};
+
+export struct EvaluationStats {
+    PhaseStats lex;
+    PhaseStats parse;
+    PhaseStats compile;
+    PhaseStats execute;
+    uint64_t token_count = 0;
+    uint64_t ast_node_count = 0;
+    uint64_t bytecode_size = 0;
+
+    [[nodiscard]] auto toJson() const -> std::string {
+        std::string json = "{";
+        json += "\"tokens\":" + std::to_string(token_count);
+        json += ",\"ast_nodes\":" + std::to_string(ast_node_count);
+        json += ",\"bytecode_size\":" + std::to_string(bytecode_size);
+        json += ",\"allocations_counted\":" + std::string(areAllocationsCounted() ? "true" : "false");
+        json += ",\"phases\":{";
+        json += "\"lex\":" + toJson(lex);
+        json += ",\"parse\":" + toJson(parse);
+        json += ",\"compile\":" + toJson(compile);
+        json += ",\"execute\":" + toJson(execute);
+        json += "}}";
+        return json;
+    }
+
+private:
+    static auto toJson(const PhaseStats& phase) -> std::string {
+        std::string json = "{";
+        json += "\"wall_ns\":" + std::to_string(phase.wall_time.count());
+        // Not counted is not the same as none.
+        json += ",\"allocations\":" + (areAllocationsCounted() ? std::to_string(phase.allocations) : "null");
+        json += ",\"allocated_bytes\":" + (areAllocationsCounted() ? std::to_string(phase.allocated_bytes) : "null");
+        json += ",\"peak_live_objects\":" + std::to_string(phase.peak_live_objects);
+        json += "}";
+        return json;
+    }
+};
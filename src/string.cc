@@ -0,0 +1,335 @@
+module;
+
+#include <bit>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+
+export module cpp_script:string;
+
+// Strings live on the VM stack and in variable slots as int handles, like
+// every other value. A handle that is not negative is the id of an
+// interned string, any other refers to a string a VM built while running.
+
+// Interned strings of the whole process. Interning the same text twice
+// gives the same id, so interned strings are equal exactly when their ids
+// are. Entries are never removed; string literals are interned when their
+// script is compiled, so running it never copies them. Ids are only valid
+// within the process.
+export class StringTable {
+public:
+    static auto intern(std::string_view text) -> int {
+        return get().add(text);
+    }
+
+    // Text of the interned string `id`. Lock-free, since whoever holds an
+    // id got it after its text was stored.
+    static auto lookup(int id) -> std::string_view {
+        auto index = static_cast<size_t>(id);
+        auto segment = getSegment(index);
+        return get().segments_[segment].load(std::memory_order_acquire)[index - getSegmentStart(segment)];
+    }
+
+private:
+    // The empty string is id 0, so zeroed slots hold it.
+    StringTable() {
+        add("");
+    }
+
+    // Segment `k` holds kFirstSegment << k entries, so a table of any size
+    // takes few of them and entries never move.
+    static constexpr size_t kFirstSegment = 64;
+    static constexpr size_t kSegments = 26;
+
+    static auto get() -> StringTable& {
+        static StringTable table;
+        return table;
+    }
+
+    static auto getSegment(size_t index) -> size_t {
+        return static_cast<size_t>(std::bit_width(index / kFirstSegment + 1)) - 1;
+    }
+
+    static auto getSegmentStart(size_t segment) -> size_t {
+        return kFirstSegment * ((size_t(1) << segment) - 1);
+    }
+
+    auto add(std::string_view text) -> int {
+        std::lock_guard lock(mutex_);
+        if (auto it = ids_.find(text); it != ids_.end()) {
+            return it->second;
+        }
+        auto index = texts_.size();
+        auto segment = getSegment(index);
+        if (segment >= kSegments) {
+            fprintf(stderr, "Too many interned strings\n");
+            abort();
+        }
+        auto entries = segments_[segment].load(std::memory_order_relaxed);
+        if (entries == nullptr) {
+            entries = new std::string_view[kFirstSegment << segment];
+            segments_[segment].store(entries, std::memory_order_release);
+        }
+        auto& stored = texts_.emplace_back(text);
+        entries[index - getSegmentStart(segment)] = stored;
+        ids_.emplace(stored, static_cast<int>(index));
+        return static_cast<int>(index);
+    }
+
+private:
+    std::mutex mutex_;
+    // A deque, so the texts stay where the views point.
+    std::deque<std::string> texts_;
+    std::unordered_map<std::string_view, int> ids_;
+    std::atomic<std::string_view*> segments_[kSegments] = {};
+};
+
+// Strings a VM builds while it runs. Short ones are stored inline in their
+// node, longer ones in blocks of the heap's arena. Concatenations of at
+// least `rope_threshold` bytes are not copied: they become ropes, nodes
+// pointing at their two halves, which are only flattened into one buffer
+// the first time their text is needed. Building a string piece by piece
+// thus costs linear time rather than quadratic. Everything is released at
+// once by clear(), when the VM loads a program.
+export class StringHeap {
+public:
+    static constexpr size_t kInlineCapacity = 16;
+    static constexpr size_t kDefaultRopeThreshold = 64;
+
+    StringHeap() = default;
+    StringHeap(const StringHeap&) = delete;
+    auto operator=(const StringHeap&) -> StringHeap& = delete;
+
+    static auto isInterned(int handle) -> bool {
+        return handle >= 0;
+    }
+
+    // Concatenations shorter than `threshold` bytes are copied right away;
+    // SIZE_MAX copies all of them. Values below the inline capacity are
+    // raised to it.
+    void setRopeThreshold(size_t threshold) {
+        rope_threshold_ = std::max(threshold, kInlineCapacity + 1);
+    }
+
+    [[nodiscard]] auto getRopeThreshold() const -> size_t {
+        return rope_threshold_;
+    }
+
+    // Number of strings built since the last clear().
+    [[nodiscard]] auto size() const -> size_t {
+        return nodes_.size();
+    }
+
+    void clear() {
+        nodes_.clear();
+        blocks_.clear();
+        block_used_ = 0;
+        block_size_ = 0;
+    }
+
+    [[nodiscard]] auto length(int handle) const -> size_t {
+        if (isInterned(handle)) {
+            return StringTable::lookup(handle).size();
+        }
+        return nodes_[getIndex(handle)].length;
+    }
+
+    auto concat(int lhs, int rhs) -> int {
+        auto lhs_length = length(lhs);
+        auto rhs_length = length(rhs);
+        if (lhs_length == 0) {
+            return rhs;
+        }
+        if (rhs_length == 0) {
+            return lhs;
+        }
+        auto total = lhs_length + rhs_length;
+        if (total > UINT32_MAX) {
+            fprintf(stderr, "String is too long\n");
+            abort();
+        }
+        if (total >= rope_threshold_) {
+            auto& node = addNode(total, Node::kRope);
+            node.halves.lhs = lhs;
+            node.halves.rhs = rhs;
+            return getHandle(nodes_.size() - 1);
+        }
+        // Shorter than the threshold, so neither half is a rope. Inline texts
+        // live in the nodes, which must not move while they are copied.
+        reserveNode();
+        auto a = view(lhs);
+        auto b = view(rhs);
+        auto data = reserve(total);
+        std::memcpy(data, a.data(), a.size());
+        std::memcpy(data + a.size(), b.data(), b.size());
+        return getHandle(nodes_.size() - 1);
+    }
+
+    // Text of the string, flattening it first if it is a rope. The view is
+    // only valid until the heap changes.
+    auto view(int handle) -> std::string_view {
+        if (isInterned(handle)) {
+            return StringTable::lookup(handle);
+        }
+        auto& node = nodes_[getIndex(handle)];
+        if (node.kind == Node::kRope) {
+            flatten(getIndex(handle));
+        }
+        return getText(nodes_[getIndex(handle)]);
+    }
+
+    // Interned strings compare by id alone; other strings compare by
+    // length first and by their text only when the lengths match.
+    auto equals(int lhs, int rhs) -> bool {
+        if (lhs == rhs) {
+            return true;
+        }
+        if (isInterned(lhs) && isInterned(rhs)) {
+            return false;
+        }
+        if (length(lhs) != length(rhs)) {
+            return false;
+        }
+        auto a = view(lhs);
+        auto b = view(rhs);
+        return std::memcmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    // Interned id of the string's text, which stays valid after clear().
+    auto intern(int handle) -> int {
+        return isInterned(handle) ? handle : StringTable::intern(view(handle));
+    }
+
+private:
+    struct Node {
+        enum Kind : uint8_t {
+            kInline,
+            kFlat,
+            kRope,
+        };
+
+        uint32_t length = 0;
+        Kind kind = kInline;
+        union {
+            char text[kInlineCapacity];
+            const char* data;
+            struct {
+                int lhs;
+                int rhs;
+            } halves;
+        };
+    };
+
+    static constexpr size_t kBlockSize = 64 * 1024;
+
+    static auto getIndex(int handle) -> size_t {
+        return static_cast<size_t>(-(static_cast<int64_t>(handle) + 1));
+    }
+
+    static auto getHandle(size_t index) -> int {
+        if (index > INT32_MAX) {
+            fprintf(stderr, "Too many strings\n");
+            abort();
+        }
+        return -static_cast<int>(index) - 1;
+    }
+
+    static auto getText(const Node& node) -> std::string_view {
+        return std::string_view(node.kind == Node::kInline ? node.text : node.data, node.length);
+    }
+
+    void reserveNode() {
+        if (nodes_.size() == nodes_.capacity()) {
+            nodes_.reserve(std::max<size_t>(nodes_.capacity() * 2, 64));
+        }
+    }
+
+    auto addNode(size_t length, Node::Kind kind) -> Node& {
+        auto& node = nodes_.emplace_back();
+        node.length = static_cast<uint32_t>(length);
+        node.kind = kind;
+        return node;
+    }
+
+    // Adds a node for a string of `length` bytes and returns where its text
+    // goes.
+    auto reserve(size_t length) -> char* {
+        if (length <= kInlineCapacity) {
+            return addNode(length, Node::kInline).text;
+        }
+        auto data = allocate(length);
+        addNode(length, Node::kFlat).data = data;
+        return data;
+    }
+
+    auto allocate(size_t size) -> char* {
+        if (size > kBlockSize / 4) {
+            // Large strings get a block of their own, put behind the current
+            // one so that it keeps filling up.
+            auto& block = blocks_.emplace_back(std::make_unique_for_overwrite<char[]>(size));
+            if (blocks_.size() > 1) {
+                std::swap(block, blocks_[blocks_.size() - 2]);
+                return blocks_[blocks_.size() - 2].get();
+            }
+            block_used_ = block_size_ = size;
+            return block.get();
+        }
+        if (block_size_ - block_used_ < size) {
+            blocks_.emplace_back(std::make_unique_for_overwrite<char[]>(kBlockSize));
+            block_size_ = kBlockSize;
+            block_used_ = 0;
+        }
+        auto data = blocks_.back().get() + block_used_;
+        block_used_ += size;
+        return data;
+    }
+
+    // Copies the leaves of the rope at `index` in order into one buffer,
+    // without recursion: a rope built by appending in a loop is as deep as
+    // it has pieces. The node becomes a flat string, so this happens once.
+    void flatten(size_t index) {
+        auto length = nodes_[index].length;
+        auto data = allocate(length);
+        auto out = data;
+        auto pending = std::vector<int>{getHandle(index)};
+        while (!pending.empty()) {
+            auto handle = pending.back();
+            pending.pop_back();
+            if (isInterned(handle)) {
+                auto text = StringTable::lookup(handle);
+                std::memcpy(out, text.data(), text.size());
+                out += text.size();
+                continue;
+            }
+            auto& node = nodes_[getIndex(handle)];
+            if (node.kind == Node::kRope) {
+                pending.emplace_back(node.halves.rhs);
+                pending.emplace_back(node.halves.lhs);
+                continue;
+            }
+            auto text = getText(node);
+            std::memcpy(out, text.data(), text.size());
+            out += text.size();
+        }
+        auto& node = nodes_[index];
+        node.kind = Node::kFlat;
+        node.data = data;
+    }
+
+private:
+    std::vector<Node> nodes_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t block_used_ = 0;
+    size_t block_size_ = 0;
+    size_t rope_threshold_ = kDefaultRopeThreshold;
+};
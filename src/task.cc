@@ -0,0 +1,216 @@
+module;
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+export module cpp_script:task;
+import :gc;
+import :vm;
+import :ast;
+import :pool;
+import :output;
+
+// A script running on a VM of its own that can be suspended and resumed,
+// possibly on another thread each time. It suspends at every `yield` and,
+// when resumed with a time slice, once the slice's fuel is spent.
+export class ScriptTask {
+public:
+    explicit ScriptTask(ManagedShared<Chunk> chunk, OutputSink& sink = getStdoutSink())
+        : chunk_(std::move(chunk)), vm_(sink) {
+        vm_.load(chunk_->getProgram());
+    }
+
+    ScriptTask(const ScriptTask&) = delete;
+    auto operator=(const ScriptTask&) -> ScriptTask& = delete;
+
+    // Runs the script until it yields, halts or, with a non-zero `slice`,
+    // has made `slice` loop iterations and calls. Must not be called again
+    // once the task is done.
+    auto resume(uint64_t slice = 0) -> VMStatus {
+        if (slice == 0) {
+            vm_.disableFuel();
+        } else {
+            vm_.setFuel(slice);
+        }
+        resumes_ += 1;
+        status_ = vm_.run();
+        return status_;
+    }
+
+    // Switches the task over to `chunk`, a newer version of its script, and
+    // returns whether it could. That takes the task being stopped outside of
+    // any function and `chunk` having the same top-level code and
+    // variables, so only functions may differ; they take effect from the
+    // next call on.
+    //
+    // Must not overlap a resume(); tasks run by a ScriptScheduler are
+    // reloaded through ScriptScheduler::reload() instead.
+    auto reload(ManagedShared<Chunk> chunk) -> bool {
+        if (vm_.getCallDepth() != 0 || chunk->opcodes != chunk_->opcodes || chunk->variables != chunk_->variables) {
+            return false;
+        }
+        vm_.swapProgram(chunk->getProgram());
+        chunk_ = std::move(chunk);
+        return true;
+    }
+
+    [[nodiscard]] auto isDone() const -> bool {
+        return status_ == VMStatus::Halted;
+    }
+
+    [[nodiscard]] auto getStatus() const -> VMStatus {
+        return status_;
+    }
+
+    // How many times resume() was called.
+    [[nodiscard]] auto getResumeCount() const -> uint64_t {
+        return resumes_;
+    }
+
+    [[nodiscard]] auto getVM() -> VM& {
+        return vm_;
+    }
+
+    [[nodiscard]] auto getChunk() const -> const Chunk& {
+        return *chunk_;
+    }
+
+private:
+    ManagedShared<Chunk> chunk_;
+    VM vm_;
+    VMStatus status_ = VMStatus::Yielded;
+    uint64_t resumes_ = 0;
+};
+
+export enum class TaskReload {
+    Applied,
+    Rejected,
+    // The task was being resumed; the reload is applied once its turn ends.
+    Queued,
+};
+
+export struct SchedulerOptions {
+    // Fuel a task may spend per turn before it is suspended and queued
+    // again, so scripts that never yield still share the threads. 0 lets
+    // every task run until it yields or halts.
+    uint64_t slice = 0;
+};
+
+// Multiplexes many suspended scripts over the threads of a pool. Tasks take
+// turns in FIFO order: a worker resumes the oldest ready task for one turn
+// and, unless it finished, puts it at the back of the queue. The queue is
+// kept here rather than in the pool because tasks a worker submits go to
+// the back of its own deque and would be resumed before older ones.
+export class ScriptScheduler {
+public:
+    explicit ScriptScheduler(ThreadPool& pool, SchedulerOptions options = {}) : pool_(pool), options_(options) {}
+
+    ScriptScheduler(const ScriptScheduler&) = delete;
+    auto operator=(const ScriptScheduler&) -> ScriptScheduler& = delete;
+
+    // Adds a task for `chunk` writing to `sink`. Tasks run on any worker, so
+    // a sink shared between tasks has to be thread-safe. The returned task
+    // lives as long as the scheduler.
+    //
+    // May be called from any thread, including while run() is in progress:
+    // the task joins the queue and run() waits for it as well, unless every
+    // other task had already halted, in which case it waits for the next
+    // call to run().
+    auto spawn(ManagedShared<Chunk> chunk, OutputSink& sink = getStdoutSink()) -> ScriptTask& {
+        auto task = std::make_unique<ScriptTask>(std::move(chunk), sink);
+        std::lock_guard lock(mutex_);
+        auto& spawned = *tasks_.emplace_back(std::move(task));
+        ready_.emplace_back(&spawned);
+        unfinished_ += 1;
+        ready_changed_.notify_one();
+        return spawned;
+    }
+
+    // Runs every spawned task to completion and returns once all of them
+    // halted. Blocks the calling thread, so it must not be called from a
+    // worker of the pool.
+    void run() {
+        for (size_t i = 0; i < pool_.getThreadCount(); ++i) {
+            pool_.submit([this] { workerLoop(); });
+        }
+        pool_.wait();
+    }
+
+    // Switches `task` over to `chunk` as ScriptTask::reload() does, but
+    // only ever between two of its turns: right away if no worker is
+    // resuming it, otherwise once its current turn ends, before it is queued
+    // again. A newer queued reload replaces an older one. Whether a queued
+    // reload was applied shows in the task's chunk afterwards. May be called
+    // from any thread.
+    auto reload(ScriptTask& task, ManagedShared<Chunk> chunk) -> TaskReload {
+        std::lock_guard lock(mutex_);
+        if (running_.contains(&task)) {
+            reloads_.insert_or_assign(&task, std::move(chunk));
+            return TaskReload::Queued;
+        }
+        return task.reload(std::move(chunk)) ? TaskReload::Applied : TaskReload::Rejected;
+    }
+
+    [[nodiscard]] auto getTaskCount() const -> size_t {
+        std::lock_guard lock(mutex_);
+        return tasks_.size();
+    }
+
+    [[nodiscard]] auto getTask(size_t index) -> ScriptTask& {
+        std::lock_guard lock(mutex_);
+        return *tasks_[index];
+    }
+
+private:
+    void workerLoop() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            ready_changed_.wait(lock, [this] { return !ready_.empty() || unfinished_ == 0; });
+            if (ready_.empty()) {
+                return;
+            }
+            auto task = ready_.front();
+            ready_.pop_front();
+            running_.insert(task);
+            lock.unlock();
+
+            task->resume(options_.slice);
+
+            lock.lock();
+            running_.erase(task);
+            if (auto it = reloads_.find(task); it != reloads_.end()) {
+                if (!task->isDone()) {
+                    task->reload(std::move(it->second));
+                }
+                reloads_.erase(it);
+            }
+            if (task->isDone()) {
+                if (--unfinished_ == 0) {
+                    ready_changed_.notify_all();
+                }
+            } else {
+                ready_.emplace_back(task);
+                ready_changed_.notify_one();
+            }
+        }
+    }
+
+private:
+    ThreadPool& pool_;
+    SchedulerOptions options_;
+    // Guards the tasks, the queue and the reloads.
+    mutable std::mutex mutex_;
+    std::deque<std::unique_ptr<ScriptTask>> tasks_;
+    std::condition_variable ready_changed_;
+    std::deque<ScriptTask*> ready_;
+    // Tasks a worker is resuming and the reloads waiting for them.
+    std::unordered_set<const ScriptTask*> running_;
+    std::unordered_map<const ScriptTask*, ManagedShared<Chunk>> reloads_;
+    size_t unfinished_ = 0;
+};
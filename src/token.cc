@@ -5,6 +5,10 @@
 module;
 
 #include <map>
+#include <span>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
 #include <string_view>
 
 export module cpp_script:token;
@@ -16,6 +20,11 @@ export enum TokenType : uint32_t {
 
     TOKEN_KEYWORD_AUTO,
     TOKEN_KEYWORD_RETURN,
+    TOKEN_KEYWORD_IF,
+    TOKEN_KEYWORD_ELSE,
+    TOKEN_KEYWORD_WHILE,
+    TOKEN_KEYWORD_FOR,
+    TOKEN_KEYWORD_YIELD,
 
     TOKEN_STRING_LITERAL,
     TOKEN_INTEGER_LITERAL,
@@ -39,164 +48,350 @@ export enum TokenType : uint32_t {
     TOKEN_SLASH,
 
     TOKEN_EQUAL,
+    TOKEN_EQUAL_EQUAL,
+    TOKEN_BANG_EQUAL,
+    TOKEN_LESS,
+    TOKEN_LESS_EQUAL,
+    TOKEN_GREATER,
+    TOKEN_GREATER_EQUAL,
 
     TOKEN_COMMA,
     TOKEN_SEMICOLON,
 };
 
+// ASCII classification usable in constant evaluation, matching the <cctype>
+// functions in the "C" locale.
+constexpr auto isSpace(char c) -> bool {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+constexpr auto isDigit(char c) -> bool {
+    return c >= '0' && c <= '9';
+}
+
+constexpr auto isAlpha(char c) -> bool {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+constexpr auto isAlnum(char c) -> bool {
+    return isAlpha(c) || isDigit(c);
+}
+
 export struct Token {
     TokenType           type;
     std::string_view    str;
+    uint32_t            line;
+    uint32_t            column;
 
-    explicit Token() : type(TOKEN_EOF), str() {}
-    explicit Token(TokenType type, std::string_view str) : type(type), str(str) {}
+    constexpr explicit Token() : type(TOKEN_EOF), str(), line(0), column(0) {}
+    constexpr explicit Token(TokenType type, std::string_view str) : type(type), str(str), line(0), column(0) {}
 };
 
 export struct TokenStream {
 public:
-    explicit TokenStream(std::string_view source) : source_(source), current_(0) {}
+    constexpr explicit TokenStream(std::string_view source) : source_(source), current_(0), line_(1), line_start_(0) {}
+
+    // Scans `source` from `offset`, which lies on line `line` starting at
+    // `line_start`, so that positions match a scan from the beginning.
+    constexpr explicit TokenStream(std::string_view source, size_t offset, uint32_t line, size_t line_start)
+        : source_(source), current_(offset), line_(line), line_start_(line_start) {}
+
+    // Replays tokens produced by an earlier tokenize() instead of scanning.
+    constexpr explicit TokenStream(std::span<const Token> tokens) : TokenStream(std::string_view()) {
+        tokens_ = tokens;
+    }
+
+    // Text being scanned, empty when replaying tokens.
+    [[nodiscard]] constexpr auto getSource() const -> std::string_view {
+        return source_;
+    }
     
-    [[nodiscard]] auto peekToken() const -> Token {
+    [[nodiscard]] constexpr auto peekToken() const -> Token {
         return token_;
     }
 
-    void readToken() {
-        while (true) {
-            if (current_ >= source_.size()) {
-                token_ = Token(TOKEN_EOF, "");
-                return;
+    constexpr void readToken() {
+        if (tokens_.data() != nullptr) {
+            token_ = current_ < tokens_.size() ? tokens_[current_++] : Token(TOKEN_EOF, "");
+            return;
+        }
+        auto start = skipWhitespace();
+        auto line = line_;
+        auto column = static_cast<uint32_t>(start - line_start_ + 1);
+        scanToken();
+        token_.line = line;
+        token_.column = column;
+    }
+
+private:
+    constexpr auto skipWhitespace() -> size_t {
+        while (current_ < source_.size() && isSpace(source_[current_])) {
+            if (source_[current_] == '\n') {
+                line_ += 1;
+                line_start_ = current_ + 1;
             }
+            current_ += 1;
+        }
+        return current_;
+    }
+
+    constexpr void scanToken() {
+        if (current_ >= source_.size()) {
+            token_ = Token(TOKEN_EOF, "");
+            return;
+        }
 
-            if (std::isspace(source_[current_])) {
+        if (isDigit(source_[current_])) {
+            auto start = current_;
+            while (current_ < source_.size() && isDigit(source_[current_])) {
                 current_ += 1;
-                continue;
             }
-            if (std::isdigit(source_[current_])) {
-                auto start = current_;
-                while (current_ < source_.size() && std::isdigit(source_[current_])) {
-                    current_ += 1;
-                }
-                token_ = Token(TOKEN_INTEGER_LITERAL, source_.substr(start, current_ - start));
-                return;
+            token_ = Token(TOKEN_INTEGER_LITERAL, source_.substr(start, current_ - start));
+            return;
+        }
+        if (isAlpha(source_[current_])) {
+            auto start = current_;
+            while (current_ < source_.size() && isAlnum(source_[current_])) {
+                current_ += 1;
             }
-            if (std::isalpha(source_[current_])) {
-                auto start = current_;
-                while (current_ < source_.size() && std::isalnum(source_[current_])) {
-                    current_ += 1;
-                }
-                auto str = source_.substr(start, current_ - start);
-                if (str == "null") {
-                    token_ = Token(TOKEN_NULL_LITERAL, str);
-                } else if (str == "true") {
-                    token_ = Token(TOKEN_TRUE_LITERAL, str);
-                } else if (str == "false") {
-                    token_ = Token(TOKEN_FALSE_LITERAL, str);
-                } else if (str == "auto") {
-                    token_ = Token(TOKEN_KEYWORD_AUTO, str);
-                } else if (str == "return") {
-                    token_ = Token(TOKEN_KEYWORD_RETURN, str);
-                } else {
-                    token_ = Token(TOKEN_IDENTIFIER, str);
-                }
-                return;
+            auto str = source_.substr(start, current_ - start);
+            if (str == "null") {
+                token_ = Token(TOKEN_NULL_LITERAL, str);
+            } else if (str == "true") {
+                token_ = Token(TOKEN_TRUE_LITERAL, str);
+            } else if (str == "false") {
+                token_ = Token(TOKEN_FALSE_LITERAL, str);
+            } else if (str == "auto") {
+                token_ = Token(TOKEN_KEYWORD_AUTO, str);
+            } else if (str == "return") {
+                token_ = Token(TOKEN_KEYWORD_RETURN, str);
+            } else if (str == "if") {
+                token_ = Token(TOKEN_KEYWORD_IF, str);
+            } else if (str == "else") {
+                token_ = Token(TOKEN_KEYWORD_ELSE, str);
+            } else if (str == "while") {
+                token_ = Token(TOKEN_KEYWORD_WHILE, str);
+            } else if (str == "for") {
+                token_ = Token(TOKEN_KEYWORD_FOR, str);
+            } else if (str == "yield") {
+                token_ = Token(TOKEN_KEYWORD_YIELD, str);
+            } else {
+                token_ = Token(TOKEN_IDENTIFIER, str);
             }
+            return;
+        }
 
-            switch (source_[current_]) {
-                case '"' : {
-                    current_ += 1;
-                    auto start = current_;
-                    while (current_ < source_.size() && source_[current_] != '"') {
-                        current_ += 1;
-                    }
-                    if (current_ >= source_.size()) {
-                        token_ = Token(TOKEN_ERROR, "");
-                    }
-                    auto end = current_;
-                    current_ += 1;
-                    token_ = Token(TOKEN_STRING_LITERAL, source_.substr(start, end - start));
-                    return;
-                }
-                case '(': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_LEFT_PAREN, "(");
-                    return;
-                }
-                case ')': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_RIGHT_PAREN, ")");
-                    return;
-                }
-                case '{': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_LEFT_CURLY, "{");
-                    return;
-                }
-                case '}': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_RIGHT_CURLY, "}");
-                    return;
-                }
-                case '[': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_LEFT_SQUARE, "[");
-                    return;
-                }
-                case ']': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_RIGHT_SQUARE, "]");
-                    return;
-                }
-                case '+': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_PLUS, "");
-                    return;
-                }
-                case '-': {
-                    current_ += 1;
-                    if (source_[current_] == '>') {
-                        current_ += 1;
-                        token_ = Token(TOKEN_ARROW, "");
-                    } else {
-                        token_ = Token(TOKEN_MINUS, "");
+        switch (source_[current_]) {
+            case '"' : {
+                current_ += 1;
+                auto start = current_;
+                while (current_ < source_.size() && source_[current_] != '"') {
+                    if (source_[current_] == '\n') {
+                        line_ += 1;
+                        line_start_ = current_ + 1;
                     }
-                    return;
-                }
-                case '*': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_STAR, "");
-                    return;
-                }
-                case '/': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_SLASH, "");
-                    return;
-                }
-                case '=': {
                     current_ += 1;
-                    token_ = Token(TOKEN_EQUAL, "");
-                    return;
-                }
-                case ',': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_COMMA, "");
-                    return;
                 }
-                case ';': {
-                    current_ += 1;
-                    token_ = Token(TOKEN_SEMICOLON, "");
+                if (current_ >= source_.size()) {
+                    token_ = Token(TOKEN_ERROR, "");
                     return;
                 }
-                default: {
+                auto end = current_;
+                current_ += 1;
+                token_ = Token(TOKEN_STRING_LITERAL, source_.substr(start, end - start));
+                return;
+            }
+            case '(': {
+                current_ += 1;
+                token_ = Token(TOKEN_LEFT_PAREN, "(");
+                return;
+            }
+            case ')': {
+                current_ += 1;
+                token_ = Token(TOKEN_RIGHT_PAREN, ")");
+                return;
+            }
+            // Braces refer to the source, so that the parser can find the
+            // text of a function body without keeping its tokens around.
+            case '{': {
+                current_ += 1;
+                token_ = Token(TOKEN_LEFT_CURLY, source_.substr(current_ - 1, 1));
+                return;
+            }
+            case '}': {
+                current_ += 1;
+                token_ = Token(TOKEN_RIGHT_CURLY, source_.substr(current_ - 1, 1));
+                return;
+            }
+            case '[': {
+                current_ += 1;
+                token_ = Token(TOKEN_LEFT_SQUARE, "[");
+                return;
+            }
+            case ']': {
+                current_ += 1;
+                token_ = Token(TOKEN_RIGHT_SQUARE, "]");
+                return;
+            }
+            case '+': {
+                current_ += 1;
+                token_ = Token(TOKEN_PLUS, "");
+                return;
+            }
+            case '-': {
+                current_ += 1;
+                if (current_ < source_.size() && source_[current_] == '>') {
                     current_ += 1;
-                    token_ = Token(TOKEN_ERROR, "");
-                    return;
+                    token_ = Token(TOKEN_ARROW, "");
+                } else {
+                    token_ = Token(TOKEN_MINUS, "");
                 }
+                return;
+            }
+            case '*': {
+                current_ += 1;
+                token_ = Token(TOKEN_STAR, "");
+                return;
+            }
+            case '/': {
+                current_ += 1;
+                token_ = Token(TOKEN_SLASH, "");
+                return;
+            }
+            case '=': {
+                current_ += 1;
+                token_ = Token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL, "");
+                return;
+            }
+            case '!': {
+                current_ += 1;
+                token_ = Token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_ERROR, "");
+                return;
+            }
+            case '<': {
+                current_ += 1;
+                token_ = Token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS, "");
+                return;
+            }
+            case '>': {
+                current_ += 1;
+                token_ = Token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER, "");
+                return;
+            }
+            case ',': {
+                current_ += 1;
+                token_ = Token(TOKEN_COMMA, "");
+                return;
+            }
+            case ';': {
+                current_ += 1;
+                token_ = Token(TOKEN_SEMICOLON, "");
+                return;
+            }
+            default: {
+                current_ += 1;
+                token_ = Token(TOKEN_ERROR, "");
+                return;
             }
         }
     }
+
+    // Consumes the next character if it is `c`.
+    constexpr auto match(char c) -> bool {
+        if (current_ < source_.size() && source_[current_] == c) {
+            current_ += 1;
+            return true;
+        }
+        return false;
+    }
     
 private:
     std::string_view source_;
     size_t current_;
+    uint32_t line_;
+    size_t line_start_;
+    std::span<const Token> tokens_;
     Token token_;
-};
\ No newline at end of file
+};
+
+export auto tokenize(std::string_view source) -> std::vector<Token> {
+    std::vector<Token> tokens;
+    auto stream = TokenStream(source);
+    stream.readToken();
+    while (stream.peekToken().type != TOKEN_EOF) {
+        tokens.emplace_back(stream.peekToken());
+        stream.readToken();
+    }
+    return tokens;
+}
+// Range of a source that holds whole top-level statements, together with
+// the position a TokenStream needs to resume scanning at `begin`.
+struct SourcePiece {
+    size_t begin;
+    size_t end;
+    uint32_t line;
+    size_t line_start;
+};
+
+// Whether the text at `offset` starts with the keyword `else`, so that the
+// statement before it is the branch of an `if`.
+auto continuesWithElse(std::string_view source, size_t offset) -> bool {
+    while (offset < source.size() && isSpace(source[offset])) {
+        offset += 1;
+    }
+    auto rest = source.substr(offset);
+    return rest.starts_with("else") && (rest.size() == 4 || !isAlnum(rest[4]));
+}
+
+// Cuts `source` into about `count` pieces of similar size. Cuts are made
+// right after a `;` outside of parentheses, braces, brackets and string
+// literals, which ends a top-level statement unless an `else` follows.
+// This is a single pass over the bytes and much cheaper than lexing them.
+auto splitSource(std::string_view source, size_t count) -> std::vector<SourcePiece> {
+    std::vector<SourcePiece> pieces;
+    auto target = source.size() / std::max<size_t>(count, 1);
+    auto piece = SourcePiece{0, 0, 1, 0};
+    uint32_t line = 1;
+    size_t line_start = 0;
+    size_t depth = 0;
+    bool in_string = false;
+    for (size_t i = 0; i < source.size(); ++i) {
+        auto c = source[i];
+        if (c == '\n') {
+            line += 1;
+            line_start = i + 1;
+            continue;
+        }
+        if (in_string) {
+            in_string = c != '"';
+            continue;
+        }
+        switch (c) {
+            case '"':
+                in_string = true;
+                break;
+            case '(':
+            case '{':
+            case '[':
+                depth += 1;
+                break;
+            case ')':
+            case '}':
+            case ']':
+                depth -= depth != 0 ? 1 : 0;
+                break;
+            case ';':
+                if (depth == 0 && i + 1 - piece.begin >= target && pieces.size() + 1 < count && !continuesWithElse(source, i + 1)) {
+                    piece.end = i + 1;
+                    pieces.emplace_back(piece);
+                    piece = SourcePiece{i + 1, 0, line, line_start};
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    piece.end = source.size();
+    pieces.emplace_back(piece);
+    return pieces;
+}
@@ -0,0 +1,809 @@
+module;
+
+#include <span>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+export module cpp_script:vm;
+import :ir;
+import :output;
+import :native;
+import :string;
+import :array;
+import :kernel;
+import :memo;
+
+// Compiled code of a script function, as CALL needs it. The first `arity`
+// of its `slots` variable slots receive the arguments. Calls to a `memoize`
+// function, which is pure and takes at most MemoCache::kMaxArgs arguments,
+// go through the VM's memo cache.
+export struct CallTarget {
+    const int* code = nullptr;
+    const LineTable* lines = nullptr;
+    const char* name = "";
+    size_t arity = 0;
+    size_t slots = 0;
+    bool memoize = false;
+};
+
+// Script functions a program calls by index. A function may be compiled on
+// demand: get() takes the slow path through compile() only until the first
+// call has published its code, and callers racing on that first call on
+// different threads all get the same code. Functions can only be added
+// while nothing runs.
+export class FunctionTable {
+public:
+    virtual ~FunctionTable() = default;
+
+    auto get(size_t index) -> const CallTarget* {
+        auto target = targets_[index].load(std::memory_order_acquire);
+        if (target == nullptr) [[unlikely]] {
+            target = compile(index);
+            targets_[index].store(target, std::memory_order_release);
+        }
+        return target;
+    }
+
+    [[nodiscard]] auto isCompiled(size_t index) const -> bool {
+        return targets_[index].load(std::memory_order_acquire) != nullptr;
+    }
+
+    [[nodiscard]] auto size() const -> size_t {
+        return targets_.size();
+    }
+
+protected:
+    // Compiles function `index`. Has to be idempotent and thread-safe, since
+    // several threads may call it for the same function at once.
+    virtual auto compile(size_t index) -> const CallTarget* = 0;
+
+    // Adds a function, compiled on its first call unless `target` is
+    // already its compiled form.
+    auto addTarget(const CallTarget* target = nullptr) -> size_t {
+        targets_.emplace_back(target);
+        return targets_.size() - 1;
+    }
+
+private:
+    std::deque<std::atomic<const CallTarget*>> targets_;
+};
+
+// Functions that were all compiled before they were added, such as those of
+// a frozen chunk or a snapshot. Each is published as it is added, so get()
+// never takes the compile path and never writes to the table. The code the
+// targets point to has to outlive the table.
+export class PrecompiledFunctionTable : public FunctionTable {
+public:
+    void add(CallTarget target) {
+        addTarget(&targets_.emplace_back(target));
+    }
+
+protected:
+    auto compile(size_t index) -> const CallTarget* override {
+        return &targets_[index];
+    }
+
+private:
+    // A deque, so targets stay where they are as more are added.
+    std::deque<CallTarget> targets_;
+};
+
+// Everything the VM needs to run a piece of compiled code.
+export struct Program {
+    const int* code = nullptr;
+    const LineTable* lines = nullptr;
+    const char* name = "<main>";
+    size_t slots = SIZE_MAX;
+    std::span<const NativeFunction> natives;
+    FunctionTable* functions = nullptr;
+};
+
+export enum class VMStatus {
+    Ready,
+    Halted,
+    // Stopped because the fuel ran out. Calling run() again with more fuel
+    // continues where it stopped.
+    OutOfFuel,
+    // Suspended by a `yield`. Calling run() again continues after it.
+    Yielded,
+};
+
+// What natively compiled code gets from the VM. The layout is plain C so a
+// generated translation unit can declare the same struct.
+export struct CompiledEnvironment {
+    void* output;
+    void (*print)(void* output, const int* values, int count);
+    const NativeFunction* natives;
+};
+
+// Entry point of a natively compiled program: runs against the variable
+// slots, leaves its final operand stack in `stack` and returns its depth.
+export using CompiledEntry = size_t (*)(int* globals, int* stack, const CompiledEnvironment* env);
+
+// Execution context for compiled code. The VM owns everything a running
+// script mutates (operand stack, variable slots, call frames, registers and
+// the output buffer), while the bytecode it runs is only read, so one
+// compiled chunk can be executed by any number of VMs on different threads
+// at the same time. Every call frame gets its own window of the slot array
+// right above its caller's.
+export class VM {
+public:
+    static constexpr size_t kStackSize = 1024;
+    static constexpr size_t kGlobalsSize = 4096;
+    static constexpr size_t kMaxCallDepth = 256;
+
+    explicit VM(OutputSink& sink = getStdoutSink())
+        : stack_(std::make_unique_for_overwrite<int[]>(kStackSize)),
+          globals_(std::make_unique_for_overwrite<int[]>(kGlobalsSize)),
+          frames_(std::make_unique<Frame[]>(kMaxCallDepth)),
+          output_(sink) {}
+
+    VM(const VM&) = delete;
+    auto operator=(const VM&) -> VM& = delete;
+
+    // Prepares the VM to run `program` from the beginning with fresh state.
+    // Only the first `program.slots` variable slots are cleared, which is all
+    // compiled code ever touches; binding parameters with setGlobal() comes
+    // after this.
+    void load(const Program& program) {
+        auto& frame = frames_[0];
+        frame = Frame();
+        frame.name = program.name;
+        frame.code = program.code;
+        frame.lines = program.lines;
+        frame.slots = std::min(program.slots, kGlobalsSize);
+        frame_ = &frame;
+        natives_ = program.natives.data();
+        functions_ = program.functions;
+        sp_ = 0;
+        fp_ = 0;
+        std::fill_n(globals_.get(), frame.slots, 0);
+        strings_.clear();
+        arrays_.clear();
+        memo_.clear();
+        status_ = VMStatus::Ready;
+    }
+
+    void load(const int* code) {
+        load(Program{.code = code});
+    }
+
+    // Switches a VM stopped at the top level of its program over to
+    // `program`, which has to have the same top-level code. The state of the
+    // run is kept, and calls from then on go to the functions of `program`.
+    void swapProgram(const Program& program) {
+        if (getCallDepth() != 0) {
+            fprintf(stderr, "Cannot swap the program of a VM that is inside a call\n");
+            abort();
+        }
+        auto& frame = frames_[0];
+        frame.name = program.name;
+        frame.code = program.code;
+        frame.lines = program.lines;
+        natives_ = program.natives.data();
+        functions_ = program.functions;
+        memo_.clear();
+    }
+
+    // Meters the following runs: each backward jump and each call costs one
+    // unit of fuel, so every loop iteration and every call is paid for while
+    // straight-line code is free. A run that reaches one it cannot pay for
+    // still performs it and then stops with VMStatus::OutOfFuel. Fuel is not
+    // reset by load().
+    void setFuel(uint64_t fuel) {
+        fuel_ = fuel;
+        metered_ = true;
+    }
+
+    void disableFuel() {
+        metered_ = false;
+    }
+
+    [[nodiscard]] auto isMetered() const -> bool {
+        return metered_;
+    }
+
+    [[nodiscard]] auto getFuel() const -> uint64_t {
+        return fuel_;
+    }
+
+    // Runs the loaded program until it halts, or, when fuel is metered, runs
+    // out of fuel. After VMStatus::OutOfFuel, the jump or call it stopped at
+    // is paid for first.
+    auto run() -> VMStatus {
+        auto profiled = profiler_active.load(std::memory_order_relaxed);
+        if (!metered_) {
+            return profiled ? interpret<false, true>() : interpret<false, false>();
+        }
+        if (status_ == VMStatus::OutOfFuel) {
+            if (fuel_ == 0) {
+                return status_;
+            }
+            fuel_ -= 1;
+        }
+        return profiled ? interpret<true, true>() : interpret<true, false>();
+    }
+
+    // Runs the loaded program like run(), but resumes it at every yield, so
+    // it only returns once it halts or runs out of fuel.
+    auto runToCompletion() -> VMStatus {
+        auto status = run();
+        while (status == VMStatus::Yielded) {
+            status = run();
+        }
+        return status;
+    }
+
+    // Runs natively compiled code in place of the loaded program's bytecode.
+    // The VM ends up in the same state run() would have left it in. Native
+    // code is not metered.
+    auto run(CompiledEntry entry) -> VMStatus {
+        auto env = CompiledEnvironment{
+            .output = &output_,
+            .print = [](void* output, const int* values, int count) {
+                auto& buffer = *static_cast<OutputBuffer*>(output);
+                for (int i = 0; i < count; i++) {
+                    buffer.writeInt(values[i]);
+                    buffer.writeChar(' ');
+                }
+            },
+            .natives = natives_,
+        };
+        sp_ = entry(globals_.get() + fp_, stack_.get(), &env);
+        output_.flush();
+        status_ = VMStatus::Halted;
+        return status_;
+    }
+
+    [[nodiscard]] auto getStatus() const -> VMStatus {
+        return status_;
+    }
+
+    [[nodiscard]] auto getFrame() const -> const Frame& {
+        return frames_[0];
+    }
+
+    // Number of script function calls the loaded program is inside of, which
+    // is only non-zero while it is stopped early.
+    [[nodiscard]] auto getCallDepth() const -> size_t {
+        return frame_ != nullptr ? static_cast<size_t>(frame_ - frames_.get()) : 0;
+    }
+
+    void setInstructionPointer(size_t ip) {
+        frames_[0].ip = ip;
+    }
+
+    [[nodiscard]] auto getStack() const -> std::span<const int> {
+        return std::span(stack_.get(), sp_);
+    }
+
+    // Value on top of the operand stack, which is where a top-level `return`
+    // leaves the script's result before HALT.
+    [[nodiscard]] auto getResult() const -> int {
+        return sp_ != 0 ? stack_[sp_ - 1] : 0;
+    }
+
+    [[nodiscard]] auto getGlobal(size_t slot) const -> int {
+        return globals_[slot];
+    }
+
+    void setGlobal(size_t slot, int value) {
+        globals_[slot] = value;
+    }
+
+    [[nodiscard]] auto getOutput() -> OutputBuffer& {
+        return output_;
+    }
+
+    // Strings built by the loaded program, which string handles in its
+    // slots and on its stack refer to.
+    [[nodiscard]] auto getStrings() -> StringHeap& {
+        return strings_;
+    }
+
+    // Arrays built by the loaded program, which array handles refer to.
+    [[nodiscard]] auto getArrays() -> ArrayHeap& {
+        return arrays_;
+    }
+
+    // Results of calls to memoized functions, kept until the next load().
+    [[nodiscard]] auto getMemo() -> MemoCache& {
+        return memo_;
+    }
+
+private:
+    // The interpreter loop, with and without fuel checks and with and
+    // without publishing `ip` before every instruction, so that runs pay
+    // nothing for metering or profiling unless they use it.
+    template<bool kMetered, bool kProfiled>
+    auto interpret() -> VMStatus {
+        static constexpr void* jumps[] = {
+            &&JUMP_OP_HALT,
+            &&JUMP_OP_GET_LOCAL,
+            &&JUMP_OP_SET_LOCAL,
+            &&JUMP_OP_GET_GLOBAL,
+            &&JUMP_OP_SET_GLOBAL,
+            &&JUMP_OP_PUSH,
+            &&JUMP_OP_CALL,
+            &&JUMP_OP_RET,
+            &&JUMP_OP_ADD,
+            &&JUMP_OP_SUB,
+            &&JUMP_OP_MUL,
+            &&JUMP_OP_DIV,
+            &&JUMP_OP_NEG,
+            &&JUMP_OP_PRINT,
+            &&JUMP_OP_POP,
+            &&JUMP_OP_CALL_NATIVE,
+            &&JUMP_OP_LT,
+            &&JUMP_OP_LE,
+            &&JUMP_OP_GT,
+            &&JUMP_OP_GE,
+            &&JUMP_OP_EQ,
+            &&JUMP_OP_NE,
+            &&JUMP_OP_JUMP,
+            &&JUMP_OP_JUMP_IF_FALSE,
+            &&JUMP_OP_JUMP_IF_TRUE,
+            &&JUMP_OP_JUMP_IF_LT,
+            &&JUMP_OP_JUMP_IF_LE,
+            &&JUMP_OP_JUMP_IF_GT,
+            &&JUMP_OP_JUMP_IF_GE,
+            &&JUMP_OP_JUMP_IF_EQ,
+            &&JUMP_OP_JUMP_IF_NE,
+            &&JUMP_OP_JUMP_IF_LT_LOCAL_CONST,
+            &&JUMP_OP_JUMP_IF_LE_LOCAL_CONST,
+            &&JUMP_OP_JUMP_IF_GT_LOCAL_CONST,
+            &&JUMP_OP_JUMP_IF_GE_LOCAL_CONST,
+            &&JUMP_OP_JUMP_IF_EQ_LOCAL_CONST,
+            &&JUMP_OP_JUMP_IF_NE_LOCAL_CONST,
+            &&JUMP_OP_YIELD,
+            &&JUMP_OP_PUSH_STRING,
+            &&JUMP_OP_CONCAT,
+            &&JUMP_OP_STRING_EQ,
+            &&JUMP_OP_STRING_NE,
+            &&JUMP_OP_STRING_LENGTH,
+            &&JUMP_OP_PRINT_MIXED,
+            &&JUMP_OP_MAKE_ARRAY,
+            &&JUMP_OP_NEW_ARRAY,
+            &&JUMP_OP_ARRAY_GET,
+            &&JUMP_OP_ARRAY_SET,
+            &&JUMP_OP_ARRAY_LENGTH,
+            &&JUMP_OP_ARRAY_SUM,
+            &&JUMP_OP_ARRAY_DOT,
+            &&JUMP_OP_ARRAY_ARITH,
+        };
+
+#define DISPATCH() \
+    if constexpr (kProfiled) { \
+        frame->ip = ip; \
+    } \
+    goto *jumps[code[ip++]]
+
+#define CHARGE() \
+    if (fuel == 0) [[unlikely]] { \
+        goto JUMP_OUT_OF_FUEL; \
+    } \
+    fuel -= 1
+
+// Continues at `target`, publishing `ip` and paying for the jump if it
+// goes backward. `ip` points past the opcode, so a jump to an earlier
+// offset is backward.
+#define JUMP_TO(target) \
+    { \
+        auto to = static_cast<size_t>(target); \
+        auto backward = to < ip; \
+        ip = to; \
+        if (backward) { \
+            frame->ip = ip; \
+            if constexpr (kMetered) { \
+                CHARGE(); \
+            } \
+        } \
+    }
+
+#define BRANCH_TO(condition, target, next) \
+    if (condition) { \
+        JUMP_TO(target); \
+    } else { \
+        ip = next; \
+    }
+
+        Frame* frame = frame_;
+        const int* code = frame->code;
+        size_t ip = frame->ip;
+        size_t sp = sp_;
+        size_t fp = fp_;
+        uint64_t fuel = fuel_;
+        int* stack = stack_.get();
+        int* globals = globals_.get();
+        const NativeFunction* natives = natives_;
+        VMStatus status;
+
+        // The frames of a run that stopped early are still linked, so only
+        // the bottom one has to be hooked up to frames of outer VMs.
+        frames_[0].caller = active_frame;
+        publishFrame(frame);
+
+        DISPATCH();
+
+    JUMP_OP_HALT:
+        {
+            status = VMStatus::Halted;
+            goto JUMP_EXIT;
+        }
+    JUMP_OP_GET_LOCAL:
+        {
+            auto arg = code[ip++];
+            stack[sp++] = globals[fp + arg];
+            DISPATCH();
+        }
+    JUMP_OP_SET_LOCAL:
+        {
+            auto arg = code[ip++];
+            globals[fp + arg] = stack[--sp];
+            DISPATCH();
+        }
+    JUMP_OP_GET_GLOBAL:
+        {
+            auto arg = code[ip++];
+            stack[sp++] = globals[arg];
+            DISPATCH();
+        }
+    JUMP_OP_SET_GLOBAL:
+        {
+            auto arg = code[ip++];
+            globals[arg] = stack[--sp];
+            DISPATCH();
+        }
+    JUMP_OP_PUSH:
+        {
+            auto value = code[ip++];
+            stack[sp++] = value;
+            DISPATCH();
+        }
+    JUMP_OP_CALL:
+        {
+            auto target = functions_->get(code[ip++]);
+            // A memoized call that was made before costs fuel like any
+            // other, but runs nothing.
+            auto memoized = target->memoize && memo_.isEnabled();
+            if (memoized) [[unlikely]] {
+                auto result = 0;
+                if (memo_.find(target->code, stack + sp - target->arity, target->arity, result)) {
+                    sp -= target->arity;
+                    stack[sp++] = result;
+                    if constexpr (kMetered) {
+                        CHARGE();
+                    }
+                    DISPATCH();
+                }
+            }
+            auto callee = frame + 1;
+            if (callee == &frames_[kMaxCallDepth] || frame->fp + frame->slots + target->slots > kGlobalsSize) {
+                fprintf(stderr, "Stack overflow in '%s'\n", target->name);
+                abort();
+            }
+            frame->ip = ip;
+            callee->name = target->name;
+            callee->code = target->code;
+            callee->lines = target->lines;
+            callee->caller = frame;
+            callee->ip = 0;
+            callee->fp = frame->fp + frame->slots;
+            callee->slots = target->slots;
+            callee->memoized = memoized;
+
+            sp -= target->arity;
+            std::copy_n(stack + sp, target->arity, globals + callee->fp);
+
+            frame = callee;
+            publishFrame(frame);
+            code = frame->code;
+            ip = 0;
+            fp = frame->fp;
+            if constexpr (kMetered) {
+                CHARGE();
+            }
+            DISPATCH();
+        }
+    JUMP_OP_RET:
+        {
+            // The return value stays on top of the operand stack.
+            if (frame->memoized) [[unlikely]] {
+                memo_.finish(stack[sp - 1]);
+            }
+            frame = frame->caller;
+            publishFrame(frame);
+            code = frame->code;
+            ip = frame->ip;
+            fp = frame->fp;
+            DISPATCH();
+        }
+    JUMP_OP_ADD:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = lhs + rhs;
+            DISPATCH();
+        }
+    JUMP_OP_SUB:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = lhs - rhs;
+            DISPATCH();
+        }
+    JUMP_OP_MUL:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = lhs * rhs;
+            DISPATCH();
+        }
+    JUMP_OP_DIV:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = lhs / rhs;
+            DISPATCH();
+        }
+    JUMP_OP_NEG:
+        {
+            auto rhs = stack[--sp];
+            stack[sp++] = -rhs;
+            DISPATCH();
+        }
+    JUMP_OP_PRINT:
+        {
+            auto argc = code[ip++];
+            for (int i = 0; i < argc; i++) {
+                output_.writeInt(stack[sp - argc + i]);
+                output_.writeChar(' ');
+            }
+            sp -= argc;
+            DISPATCH();
+        }
+    JUMP_OP_POP:
+        {
+            sp -= 1;
+            DISPATCH();
+        }
+    JUMP_OP_CALL_NATIVE:
+        {
+            auto& native = natives[code[ip++]];
+            sp -= native.arity;
+            stack[sp] = native.invoke(native.callable, stack + sp);
+            sp += 1;
+            DISPATCH();
+        }
+
+#define COMPARE(name, op) \
+    JUMP_OP_##name: \
+        { \
+            auto rhs = stack[--sp]; \
+            auto lhs = stack[--sp]; \
+            stack[sp++] = lhs op rhs ? 1 : 0; \
+            DISPATCH(); \
+        }
+
+#define BRANCH(name, op) \
+    JUMP_OP_JUMP_IF_##name: \
+        { \
+            auto rhs = stack[--sp]; \
+            auto lhs = stack[--sp]; \
+            BRANCH_TO(lhs op rhs, code[ip], ip + 1); \
+            DISPATCH(); \
+        } \
+    JUMP_OP_JUMP_IF_##name##_LOCAL_CONST: \
+        { \
+            auto lhs = globals[fp + code[ip]]; \
+            BRANCH_TO(lhs op code[ip + 1], code[ip + 2], ip + 3); \
+            DISPATCH(); \
+        }
+
+    COMPARE(LT, <)
+    COMPARE(LE, <=)
+    COMPARE(GT, >)
+    COMPARE(GE, >=)
+    COMPARE(EQ, ==)
+    COMPARE(NE, !=)
+    BRANCH(LT, <)
+    BRANCH(LE, <=)
+    BRANCH(GT, >)
+    BRANCH(GE, >=)
+    BRANCH(EQ, ==)
+    BRANCH(NE, !=)
+
+#undef BRANCH
+#undef COMPARE
+
+    JUMP_OP_JUMP:
+        {
+            JUMP_TO(code[ip]);
+            DISPATCH();
+        }
+    JUMP_OP_JUMP_IF_FALSE:
+        {
+            auto value = stack[--sp];
+            BRANCH_TO(value == 0, code[ip], ip + 1);
+            DISPATCH();
+        }
+    JUMP_OP_JUMP_IF_TRUE:
+        {
+            auto value = stack[--sp];
+            BRANCH_TO(value != 0, code[ip], ip + 1);
+            DISPATCH();
+        }
+    JUMP_OP_YIELD:
+        {
+            status = VMStatus::Yielded;
+            goto JUMP_EXIT;
+        }
+    JUMP_OP_PUSH_STRING:
+        {
+            auto id = code[ip++];
+            stack[sp++] = id;
+            DISPATCH();
+        }
+    JUMP_OP_CONCAT:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = strings_.concat(lhs, rhs);
+            DISPATCH();
+        }
+    JUMP_OP_STRING_EQ:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = strings_.equals(lhs, rhs) ? 1 : 0;
+            DISPATCH();
+        }
+    JUMP_OP_STRING_NE:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = strings_.equals(lhs, rhs) ? 0 : 1;
+            DISPATCH();
+        }
+    JUMP_OP_STRING_LENGTH:
+        {
+            auto value = stack[--sp];
+            stack[sp++] = static_cast<int>(strings_.length(value));
+            DISPATCH();
+        }
+    JUMP_OP_PRINT_MIXED:
+        {
+            auto arg = code[ip++];
+            auto argc = arg & 0xff;
+            auto strings = arg >> 8;
+            for (int i = 0; i < argc; i++) {
+                auto value = stack[sp - argc + i];
+                if ((strings >> i) & 1) {
+                    output_.write(strings_.view(value));
+                } else {
+                    output_.writeInt(value);
+                }
+                output_.writeChar(' ');
+            }
+            sp -= argc;
+            DISPATCH();
+        }
+    JUMP_OP_MAKE_ARRAY:
+        {
+            auto count = code[ip++];
+            sp -= count;
+            stack[sp] = arrays_.create(std::span<const int>(stack + sp, count));
+            sp += 1;
+            DISPATCH();
+        }
+    JUMP_OP_NEW_ARRAY:
+        {
+            auto length = stack[--sp];
+            if (length < 0) {
+                fprintf(stderr, "Negative array length %d in '%s'\n", length, frame->name);
+                abort();
+            }
+            stack[sp++] = arrays_.create(static_cast<size_t>(length));
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_GET:
+        {
+            auto index = stack[--sp];
+            auto elements = arrays_.get(stack[--sp]);
+            if (index < 0 || static_cast<size_t>(index) >= elements.size()) [[unlikely]] {
+                fprintf(stderr, "Index %d is out of bounds for %zu elements in '%s'\n", index, elements.size(), frame->name);
+                abort();
+            }
+            stack[sp++] = elements[index];
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_SET:
+        {
+            auto value = stack[--sp];
+            auto index = stack[--sp];
+            auto elements = arrays_.get(stack[--sp]);
+            if (index < 0 || static_cast<size_t>(index) >= elements.size()) [[unlikely]] {
+                fprintf(stderr, "Index %d is out of bounds for %zu elements in '%s'\n", index, elements.size(), frame->name);
+                abort();
+            }
+            elements[index] = value;
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_LENGTH:
+        {
+            auto array = stack[--sp];
+            stack[sp++] = static_cast<int>(arrays_.length(array));
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_SUM:
+        {
+            auto array = stack[--sp];
+            stack[sp++] = arrays_.sum(array);
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_DOT:
+        {
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = arrays_.dot(lhs, rhs);
+            DISPATCH();
+        }
+    JUMP_OP_ARRAY_ARITH:
+        {
+            auto arg = code[ip++];
+            auto rhs = stack[--sp];
+            auto lhs = stack[--sp];
+            stack[sp++] = arrays_.apply(static_cast<BatchOp>(arg & 3), lhs, (arg & 4) != 0, rhs, (arg & 8) != 0);
+            DISPATCH();
+        }
+    JUMP_OUT_OF_FUEL:
+        status = VMStatus::OutOfFuel;
+    JUMP_EXIT:
+        output_.flush();
+        publishFrame(frames_[0].caller);
+        // Unhooked only once the outer frame is published.
+        std::atomic_signal_fence(std::memory_order_release);
+        frames_[0].caller = nullptr;
+        frame->ip = ip;
+        frame_ = frame;
+        sp_ = sp;
+        fp_ = fp;
+        fuel_ = fuel;
+        status_ = status;
+        return status_;
+
+#undef BRANCH_TO
+#undef JUMP_TO
+#undef CHARGE
+#undef DISPATCH
+    }
+
+    const NativeFunction* natives_ = nullptr;
+    FunctionTable* functions_ = nullptr;
+    // Innermost frame, where run() continues.
+    Frame* frame_ = nullptr;
+    size_t sp_ = 0;
+    size_t fp_ = 0;
+    uint64_t fuel_ = 0;
+    bool metered_ = false;
+    VMStatus status_ = VMStatus::Ready;
+    std::unique_ptr<int[]> stack_;
+    std::unique_ptr<int[]> globals_;
+    std::unique_ptr<Frame[]> frames_;
+    OutputBuffer output_;
+    StringHeap strings_;
+    ArrayHeap arrays_;
+    MemoCache memo_;
+};
+
+export void execute(const int* code, size_t ip) {
+    VM vm;
+    vm.load(code);
+    vm.setInstructionPointer(ip);
+    vm.run();
+}
@@ -0,0 +1,78 @@
+#include <string>
+#include <cstdlib>
+#include <fstream>
+#include <filesystem>
+#include <sys/stat.h>
+
+import cpp_script;
+import cpp_script_test;
+
+// Only what the translator handles: no arrays and no calls into script
+// functions.
+static constexpr auto kSource = R"(
+auto total = 0;
+auto odd = 0;
+auto j = 0;
+for (auto i = 0; i < 1000; i = i + 1) {
+    if (i / 3 * 3 == i) { total = total + i; } else { total = total - 1; }
+    j = j + 1;
+    if (j == 2) { j = 0; } else { odd = odd + i * 2; }
+}
+print(total, odd, -odd / 7, -2147483647 - 1);
+)";
+
+static auto runVM(const Chunk& chunk) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    execute(vm, chunk);
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+static auto runAot(const AotModule& module) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    execute(vm, module);
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+auto main() -> int {
+    char pattern[] = "/tmp/cpp_script_aot_test.XXXXXX";
+    check(mkdtemp(pattern) != nullptr, "creating a scratch directory");
+    auto scratch = std::filesystem::path(pattern);
+    auto chunk = compile(parse(tokenize(kSource)));
+    auto expected = runVM(*chunk);
+
+    if (std::system("cc --version > /dev/null 2>&1") == 0) {
+        auto options = AotOptions{.cache_directory = scratch / "cache"};
+        auto module = compileAot(chunk, options);
+        check(module.get() != nullptr, "compiling a script ahead of time");
+        if (module.get() != nullptr) {
+            check(runAot(*module) == expected, "compiled code prints what the VM does");
+        }
+        auto cached = compileAot(compile(parse(tokenize(kSource))), options);
+        check(cached.get() != nullptr && runAot(*cached) == expected, "loading a script from the cache");
+    } else {
+        fprintf(stderr, "No C compiler, skipping the comparison with the VM\n");
+    }
+
+    // Anyone could plant a shared object in a directory others can write to.
+    auto shared = scratch / "shared";
+    std::filesystem::create_directory(shared);
+    chmod(shared.c_str(), 0777);
+    check(compileAot(chunk, {.cache_directory = shared}).get() == nullptr, "a cache directory others can write to is refused");
+
+    auto file = scratch / "file";
+    std::ofstream(file) << "not a directory";
+    check(compileAot(chunk, {.cache_directory = file}).get() == nullptr, "a cache path that is a file is refused");
+
+    check(compileAot(chunk, {.compiler = "false", .cache_directory = scratch / "failing"}).get() == nullptr, "a failing compiler gives no module");
+    check(runVM(*chunk) == expected, "a script the AOT compiler refused still runs on the VM");
+
+    auto arrays = compile(parse(tokenize("auto a = array(3); a[1] = 2; print(sum(a));")));
+    check(compileAot(arrays, {.cache_directory = scratch / "arrays"}).get() == nullptr, "a script the translator cannot express gives no module");
+
+    std::filesystem::remove_all(scratch);
+    return finish();
+}
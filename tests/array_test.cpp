@@ -0,0 +1,61 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto run(std::string_view source, size_t limit = ArrayHeap::kDefaultLimit) -> std::string {
+    auto chunk = compile(parse(tokenize(source)));
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk->getProgram());
+    vm.getArrays().setLimit(limit);
+    vm.run();
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+auto main() -> int {
+    // 19 elements, so that both the vector loops and their scalar tails run.
+    auto numbers = std::string("auto a = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19];");
+    check(run(numbers + "auto b = a / 2; auto c = 100 / a; print(b[0], b[18], c[0], c[18]);") == "0 9 100 5 ", "array division");
+    check(run(numbers + "auto b = a / -1; print(b[0], sum(b));") == "-1 -190 ", "array division by -1");
+
+    checkFails("array division by a zero constant", [&] {
+        run(numbers + "auto b = a / 0;");
+    });
+    checkFails("array division by a zero element", [&] {
+        run(numbers + "auto b = a - 10; auto c = a / b;");
+    });
+    checkFails("constant division by a zero element", [&] {
+        run(numbers + "auto b = a - 10; auto c = 7 / b;");
+    });
+    checkFails("array division of INT_MIN by a constant -1", [&] {
+        run(numbers + "a[8] = -2147483647 - 1; auto b = a / -1;");
+    });
+    checkFails("array division of INT_MIN by an element -1", [&] {
+        run(numbers + "a[8] = -2147483647 - 1; auto b = a - a - 1; auto c = a / b;");
+    });
+
+    checkFails("reading a negative index", [&] {
+        run(numbers + "print(a[-1]);");
+    });
+    checkFails("writing a negative index", [&] {
+        run(numbers + "a[-1] = 5;");
+    });
+    checkFails("reading past the end", [&] {
+        run(numbers + "print(a[19]);");
+    });
+
+    // Nothing is freed while a script runs, so a loop that builds arrays
+    // runs into the limit instead of taking all of the host's memory.
+    auto building = "auto a = array(1000); for (auto i = 0; i < 100; i = i + 1) { a = a + 1; } print(a[0]);";
+    check(run(building) == "100 ", "building arrays below the limit");
+    checkFails("building arrays past the limit", [&] {
+        run(building, 64 * 1024);
+    });
+    checkFails("an array larger than the limit", [&] {
+        run("auto a = array(100000);", 64 * 1024);
+    });
+
+    return finish();
+}
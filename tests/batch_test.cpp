@@ -0,0 +1,89 @@
+#include <string>
+#include <vector>
+#include <climits>
+
+import cpp_script;
+import cpp_script_test;
+
+// Runs `source` over the columns `a` and `b` in batch and once per row in
+// the VM, and checks that both give the same `result`.
+static void checkAgainstVm(const char* source, const std::vector<int>& a, const std::vector<int>& b) {
+    auto chunk = compile(parse(tokenize(source)), std::vector<std::string>{"a", "b"});
+    auto out = std::vector<int>(a.size());
+    auto program = BatchProgram<int>(chunk);
+    program.bind("a", a);
+    program.bind("b", b);
+    program.run(out, "result");
+
+    auto matches = true;
+    auto vm = VM();
+    for (size_t i = 0; i < a.size(); ++i) {
+        vm.load(chunk->getProgram());
+        vm.setGlobal(0, a[i]);
+        vm.setGlobal(1, b[i]);
+        vm.run();
+        matches = matches && out[i] == vm.getGlobal(chunk->getVariable("result"));
+    }
+    check(matches, source);
+}
+
+static void runBatch(const char* source, const std::vector<int>& a, const std::vector<int>& b) {
+    auto chunk = compile(parse(tokenize(source)), std::vector<std::string>{"a", "b"});
+    auto out = std::vector<int>(a.size());
+    auto program = BatchProgram<int>(chunk);
+    program.bind("a", a);
+    program.bind("b", b);
+    program.run(out, "result");
+}
+
+auto main() -> int {
+    // More rows than a block, and not a multiple of the vector width, so
+    // that both the vector loops and their scalar tails run.
+    static constexpr size_t kRows = BatchProgram<int>::kBlockSize * 2 + 13;
+
+    auto a = std::vector<int>(kRows);
+    auto b = std::vector<int>(kRows);
+    for (size_t i = 0; i < kRows; ++i) {
+        a[i] = static_cast<int>(i * 7919 % 20001) - 10000;
+        b[i] = static_cast<int>(i % 37) - 18;
+        if (b[i] == 0) {
+            b[i] = 5;
+        }
+    }
+
+    checkAgainstVm("auto result = a / b;", a, b);
+    checkAgainstVm("auto result = a / 7 - b / -3;", a, b);
+    checkAgainstVm("auto result = (a * b + 1) / (b - 100);", a, b);
+
+    // A bad divisor in a single row, past the first block.
+    auto zero = b;
+    zero[BatchProgram<int>::kBlockSize + 100] = 0;
+    checkFails("batch division by a zero column element", [&] {
+        runBatch("auto result = a / b;", a, zero);
+    });
+    checkFails("batch division by a zero constant", [&] {
+        runBatch("auto result = a / 0;", a, b);
+    });
+
+    auto minimum = a;
+    auto minus_one = b;
+    minimum[8] = INT_MIN;
+    minus_one[8] = -1;
+    checkFails("batch division of INT_MIN by -1", [&] {
+        runBatch("auto result = a / b;", minimum, minus_one);
+    });
+    checkFails("batch division of INT_MIN by a constant -1", [&] {
+        runBatch("auto result = a / -1;", minimum, b);
+    });
+
+    // Dividing every other value by -1 is fine.
+    checkAgainstVm("auto result = a / -1;", a, b);
+
+    // Common subexpressions become temps whose slots are reused within one
+    // expression, while loads of their earlier values are still in use.
+    checkAgainstVm("auto result = a * b + (a * b + (a - b) * (a - b));", a, b);
+    checkAgainstVm("auto result = (a + b) * (a - b) + (a + b) * (a - b) - (a * 3 + b) / ((a + b) * (a + b) + 1);", a, b);
+    checkAgainstVm("auto x = a * b; auto y = a * b - (a - b) * (a - b); auto result = x + y + (a - b) * (a - b);", a, b);
+
+    return finish();
+}
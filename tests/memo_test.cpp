@@ -0,0 +1,118 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+struct MemoRun {
+    std::string output;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+static auto run(std::string_view source, CompileOptions options = {}, size_t capacity = MemoCache::kDefaultCapacity) -> MemoRun {
+    auto chunk = compile(parse(tokenize(source)), {}, ManagedShared<NativeRegistry>(), options);
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk->getProgram());
+    vm.getMemo().setCapacity(capacity);
+    vm.runToCompletion();
+    vm.getOutput().flush();
+    return MemoRun{std::string(output.getContents()), vm.getMemo().getHits(), vm.getMemo().getMisses()};
+}
+
+// Whether function `name` of `source` is memoized, compiled against
+// `natives` with the default options.
+static auto isMemoized(std::string_view source, std::string_view name, ManagedShared<NativeRegistry> natives = ManagedShared<NativeRegistry>()) -> bool {
+    auto chunk = compile(parse(tokenize(source)), {}, std::move(natives));
+    return chunk->functions->isMemoized(*chunk->functions->find(std::string(name)));
+}
+
+static void checkCounts() {
+    auto fib = R"(
+        auto fib(auto n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }
+        print(fib(20), fib(20));
+    )";
+    auto memoized = run(fib);
+    check(memoized.output == "6765 6765 ", "memoized results");
+    // fib(20) and each fib(n - 1) down to fib(1) miss, and so does fib(0)
+    // from fib(2). Every other fib(n - 2) was stored by the fib(n - 1)
+    // before it, and the second fib(20) by the first.
+    check(memoized.misses == 21, "a miss for each argument");
+    check(memoized.hits == 19, "a hit for each call made again");
+
+    auto disabled = run(fib, {}, 0);
+    check(disabled.output == memoized.output, "same results without a memo cache");
+    check(disabled.hits == 0 && disabled.misses == 0, "no lookups without a memo cache");
+
+    auto unannotated = run(fib, {.memoize = false});
+    check(unannotated.output == memoized.output, "same results with memoization compiled out");
+    check(unannotated.hits == 0 && unannotated.misses == 0, "no lookups with memoization compiled out");
+
+    // Two entries only: calls evict each other, but results stay right.
+    auto small = run(fib, {}, 2);
+    check(small.output == memoized.output, "same results with a tiny memo cache");
+    check(small.hits + small.misses >= memoized.hits + memoized.misses, "a tiny memo cache is consulted on every call");
+}
+
+static void checkPurity() {
+    auto globals = R"(
+        auto g = 5;
+        auto reads(auto n) { auto s = 0; for (auto i = 0; i < n; i = i + 1) { s = s + g; } return s; }
+        auto writes(auto n) { for (auto i = 0; i < n; i = i + 1) { g = g + 1; } return n; }
+        auto shadows(auto n) { auto s = 0; for (auto i = 0; i < n; i = i + 1) { auto g = i; s = s + g; } return s; }
+        auto callsImpure(auto n) { for (auto i = 0; i < n; i = i + 1) {} return reads(n); }
+        auto prints(auto n) { for (auto i = 0; i < n; i = i + 1) { print(i); } return n; }
+        print(reads(3), reads(3), writes(2), writes(2), g, shadows(4), callsImpure(1), prints(1));
+    )";
+    check(!isMemoized(globals, "reads"), "functions reading globals are not memoized");
+    check(!isMemoized(globals, "writes"), "functions writing globals are not memoized");
+    check(isMemoized(globals, "shadows"), "locals shadowing a global are the function's own");
+    check(!isMemoized(globals, "callsImpure"), "functions calling impure ones are not memoized");
+    check(!isMemoized(globals, "prints"), "functions that print are not memoized");
+    check(run(globals).output == run(globals, {.memoize = false}).output, "impure functions run on every call");
+
+    // Writing into an array parameter changes the caller's array, so such
+    // functions are never memoized. A function filling an array of its own
+    // still is.
+    auto arrays = R"(
+        auto fill(array xs, auto v) { for (auto i = 0; i < len(xs); i = i + 1) { xs[i] = v; } return 0; }
+        auto total(auto n) { auto xs = array(n); fill(xs, 2); return sum(xs); }
+        auto a = array(3);
+        fill(a, 1);
+        a[0] = 7;
+        fill(a, 1);
+        print(a[0], total(4), total(4));
+    )";
+    check(!isMemoized(arrays, "fill"), "functions taking arrays are not memoized");
+    check(isMemoized(arrays, "total"), "functions writing their own arrays are memoized");
+    check(run(arrays).output == "1 8 8 ", "writes into an array parameter happen on every call");
+    checkFails("[[memoize]] on a function taking an array", [] {
+        run("auto fill(array xs, auto v) [[memoize]] { xs[0] = v; return 0; } print(fill(array(1), 1));");
+    });
+
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("twice", [](int v) { return v * 2; });
+    auto calls_native = "auto f(auto n) { auto s = 0; for (auto i = 0; i < n; i = i + 1) { s = s + twice(i); } return s; } print(f(3));";
+    check(!isMemoized(calls_native, "f", natives), "functions calling natives are not memoized");
+    checkFails("[[memoize]] on a function calling a native", [&] {
+        compile(parse(tokenize("auto f(auto n) [[memoize]] { return twice(n); } print(f(1));")), {}, natives);
+    });
+
+    auto annotated = R"(
+        auto cheap(auto n) [[memoize]] { return n * 3; }
+        auto off(auto n) [[memoize(false)]] { auto s = 0; for (auto i = 0; i < n; i = i + 1) { s = s + 1; } return s; }
+        auto loops(auto n) { auto s = 0; for (auto i = 0; i < n; i = i + 1) { s = s + 1; } return s; }
+        auto plain(auto n) { return n * 3; }
+        print(cheap(2), off(2), loops(2), plain(2));
+    )";
+    check(isMemoized(annotated, "cheap"), "[[memoize]] memoizes cheap pure functions");
+    check(!isMemoized(annotated, "off"), "[[memoize(false)]] turns memoization off");
+    check(isMemoized(annotated, "loops"), "pure functions that loop are memoized");
+    check(!isMemoized(annotated, "plain"), "cheap pure functions are left to inlining");
+}
+
+auto main() -> int {
+    checkCounts();
+    checkPurity();
+    return finish();
+}
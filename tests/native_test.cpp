@@ -0,0 +1,35 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto run(const Chunk& chunk) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk.getProgram());
+    vm.run();
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+auto main() -> int {
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("twice", [](int value) { return value * 2; });
+    natives->define("add", [](int a, int b) { return a + b; });
+
+    auto chunk = compile(parse(tokenize("print(twice(add(1, 2)));")), {}, natives);
+    check(natives->isFrozen(), "compiling against a registry freezes it");
+    check(run(*chunk) == "6 ", "natives are called with their arguments");
+
+    // Programs point into the registry's table, so it cannot grow anymore.
+    checkFails("defining a native after compiling against the registry", [&] {
+        natives->define("late", [] { return 0; });
+    });
+
+    // Another registry is unaffected.
+    auto other = ManagedShared(new NativeRegistry());
+    other->define("twice", [](int value) { return value * 2; });
+    check(!other->isFrozen(), "a registry nothing was compiled against is not frozen");
+
+    return finish();
+}
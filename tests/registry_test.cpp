@@ -0,0 +1,103 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+import cpp_script;
+import cpp_script_test;
+
+// Prints `version` through a function, so running it reads the function
+// table as well as the top-level code.
+static auto compileVersion(int version) -> ManagedShared<Chunk> {
+    auto source = "auto scale(auto x) { return x * " + std::to_string(version) + "; }\nprint(scale(2) / 2);\n";
+    return compile(parse(tokenize(source)));
+}
+
+static auto run(const FrozenChunk& chunk) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    execute(vm, chunk);
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+static void checkRetire() {
+    auto registry = ChunkRegistry();
+    check(registry.read().find("script") == nullptr, "an empty registry finds nothing");
+
+    registry.publish("script", *compileVersion(1));
+    registry.collect();
+    check(registry.getRetiredCount() == 0, "versions nobody reads are freed right away");
+
+    {
+        auto reader = registry.read();
+        auto first = reader.find("script");
+        check(first != nullptr && run(*first) == "1 ", "a published chunk is found");
+
+        registry.publish("script", *compileVersion(2));
+        check(registry.getRetiredCount() == 1, "a replaced version waits for its readers");
+        check(reader.find("script") == first && run(*first) == "1 ", "a reader keeps seeing the version it started with");
+        check(run(*registry.read().find("script")) == "2 ", "a new reader sees the new version");
+
+        registry.collect();
+        check(registry.getRetiredCount() == 1, "collecting keeps versions that are still read");
+    }
+    registry.collect();
+    check(registry.getRetiredCount() == 0, "a retired version is freed once its epoch has no readers");
+
+    auto kept = registry.acquire("script");
+    check(registry.remove("script"), "removing a published key");
+    check(!registry.remove("script"), "removing a missing key");
+    registry.collect();
+    check(registry.read().find("script") == nullptr, "a removed key is not found");
+    check(run(*kept) == "2 ", "an acquired chunk outlives its removal");
+}
+
+// Readers run whatever they find while a writer keeps replacing it. Every
+// lookup has to find a whole version, never an older one than the reader
+// found before.
+static void checkConcurrentReaders() {
+    constexpr int kVersions = 200;
+    auto versions = std::vector<ManagedShared<Chunk>>();
+    for (int version = 1; version <= kVersions; ++version) {
+        versions.emplace_back(compileVersion(version));
+    }
+
+    auto registry = ChunkRegistry();
+    registry.publish("script", *versions.front());
+    auto done = std::atomic<bool>(false);
+    auto failures = std::atomic<int>(0);
+    auto readers = std::vector<std::thread>();
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            auto newest = 0;
+            while (!done.load()) {
+                auto reader = registry.read();
+                auto chunk = reader.find("script");
+                auto version = chunk != nullptr ? std::stoi(run(*chunk)) : 0;
+                if (version < newest || version > kVersions) {
+                    failures += 1;
+                }
+                newest = version;
+            }
+        });
+    }
+    for (const auto& chunk : versions) {
+        registry.publish("script", *chunk);
+    }
+    done.store(true);
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    check(failures.load() == 0, "readers only see whole versions, newest last");
+    check(run(*registry.read().find("script")) == std::to_string(kVersions) + " ", "the last version published wins");
+    registry.collect();
+    check(registry.getRetiredCount() == 0, "every version is freed once the readers are gone");
+}
+
+auto main() -> int {
+    checkRetire();
+    checkConcurrentReaders();
+    return finish();
+}
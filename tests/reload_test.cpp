@@ -0,0 +1,126 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto run(const Chunk& chunk) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    execute(vm, chunk);
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+static auto replace(std::string source, std::string_view from, std::string_view to) -> std::string {
+    source.replace(source.find(from), from.size(), to);
+    return source;
+}
+
+static void checkIncrementalReload() {
+    auto v1 = std::string(R"(auto k = 3;
+auto leaf(auto x) { return x + k; }
+auto mid(auto x) { return leaf(x) * 2; }
+auto big(auto x) { auto s = 0; for (auto i = 0; i < x; i = i + 1) { s = s + mid(i); } return s; }
+auto other(auto x) { return x - 1; }
+print(big(5), other(7));
+)");
+    auto hot = HotScript(v1);
+    hot.getChunk()->functions->compileAll();
+    check(run(*hot.getChunk()) == "50 6 ", "first version");
+    check(hot.getGeneration() == 1, "the first version is a generation");
+
+    // mid and big may have inlined leaf, so they are recompiled with it.
+    auto v2 = replace(v1, "x + k", "x + k + 100");
+    auto stats = hot.reload(v2);
+    check(stats.changed == 3, "a changed callee makes its callers dirty");
+    check(stats.reused == 1, "unrelated functions are reused");
+    check(hot.getGeneration() == 2, "reloading publishes a generation");
+    check(run(*hot.getChunk()) == run(*compile(parse(tokenize(v2)))), "a reloaded version runs like a fresh compile");
+    hot.getChunk()->functions->compileAll();
+
+    // Moving every function down keeps all of them.
+    auto v3 = "\n\n" + v2;
+    stats = hot.reload(v3);
+    check(stats.changed == 0 && stats.reused == 4, "moved functions are reused");
+    check(run(*hot.getChunk()) == run(*compile(parse(tokenize(v3)))), "moved functions run like a fresh compile");
+
+    // k moves to another slot, so everything reading it is dirty.
+    auto v4 = "auto z = 1;\n" + v3;
+    stats = hot.reload(v4);
+    check(stats.changed == 3 && stats.reused == 1, "functions reading a moved variable are dirty");
+    check(run(*hot.getChunk()) == run(*compile(parse(tokenize(v4)))), "moved variables run like a fresh compile");
+}
+
+static void checkTaskReload() {
+    auto v1 = std::string("auto f(auto x) { return x + 1; }\nauto n = 0;\nwhile (n < 3) { print(f(n)); n = n + 1; yield; }\n");
+    auto hot = HotScript(v1, ManagedShared<NativeRegistry>(), {.inline_budget = 0});
+    auto output = MemoryOutputSink();
+    auto task = ScriptTask(hot.getChunk(), output);
+    task.resume();
+
+    hot.reload(replace(v1, "x + 1", "x + 10"));
+    check(task.reload(hot.getChunk()), "a task stopped at the top level takes a changed function");
+    while (task.resume() != VMStatus::Halted) {
+    }
+    task.getVM().getOutput().flush();
+    check(output.getContents() == "1 11 12 ", "a reloaded function is used from the next call on");
+
+    hot.reload(replace(v1, "n < 3", "n < 4"));
+    check(!task.reload(hot.getChunk()), "a changed top level is rejected");
+}
+
+static void checkReloadInsideFunction() {
+    auto v1 = std::string("auto f(auto x) { yield; return x + 1; }\nprint(f(1), f(2));\n");
+    auto hot = HotScript(v1, ManagedShared<NativeRegistry>(), {.inline_budget = 0});
+    auto output = MemoryOutputSink();
+    auto task = ScriptTask(hot.getChunk(), output);
+    task.resume();
+    check(task.getVM().getCallDepth() != 0, "the task yielded inside f");
+
+    hot.reload(replace(v1, "x + 1", "x + 10"));
+    check(!task.reload(hot.getChunk()), "a task inside a function is not reloaded");
+    while (task.resume() != VMStatus::Halted) {
+    }
+    task.getVM().getOutput().flush();
+    check(output.getContents() == "2 3 ", "a rejected reload leaves the task on its version");
+}
+
+// A reload asked for while the task runs waits for the end of its turn.
+static void checkSchedulerReload() {
+    ScriptTask* running = nullptr;
+    ScriptScheduler* scheduler = nullptr;
+    HotScript* hot = nullptr;
+    auto result = TaskReload::Applied;
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("swap", [&] {
+        result = scheduler->reload(*running, hot->getChunk());
+        return 0;
+    });
+
+    auto v1 = std::string("auto f(auto x) { return x + 1; }\nauto n = 0;\nwhile (n < 3) { print(f(n)); if (n == 0) { swap(); } n = n + 1; yield; }\n");
+    auto script = HotScript(v1, natives, {.inline_budget = 0});
+    hot = &script;
+    auto pool = ThreadPool(1);
+    auto tasks = ScriptScheduler(pool);
+    scheduler = &tasks;
+    auto output = MemoryOutputSink();
+    running = &tasks.spawn(script.getChunk(), output);
+
+    script.reload(replace(v1, "x + 1", "x + 10"));
+    tasks.run();
+    running->getVM().getOutput().flush();
+    check(result == TaskReload::Queued, "a reload during a turn is queued");
+    check(output.getContents() == "1 11 12 ", "a queued reload is applied before the next turn");
+
+    script.reload(replace(v1, "x + 1", "x + 20"));
+    check(tasks.reload(*running, script.getChunk()) == TaskReload::Applied, "a task no worker is resuming is reloaded right away");
+    check(running->getChunk().functions == script.getChunk()->functions, "the task is on the latest version");
+}
+
+auto main() -> int {
+    checkIncrementalReload();
+    checkTaskReload();
+    checkReloadInsideFunction();
+    checkSchedulerReload();
+    return finish();
+}
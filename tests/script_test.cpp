@@ -0,0 +1,62 @@
+#include <array>
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+// Reads and writes globals, an array, strings and a function, so that
+// anything a run leaves behind would change the next one.
+static constexpr auto kBody = R"(
+auto runs = 0;
+runs = runs + 1;
+auto scale(auto v) { return v * y; }
+auto a = array(4);
+a[1] = a[1] + x;
+auto s = "";
+for (auto i = 0; i < x; i = i + 1) { s = s + "ab"; }
+auto total = 0;
+for (auto i = 0; i < 10; i = i + 1) { total = total + scale(i) + a[1]; }
+print(runs, a[1], s == "abab", total);
+return total + runs;
+)";
+
+struct Run {
+    int result = 0;
+    std::string output;
+};
+
+static auto runPrepared(const PreparedScript& script, VM& vm, MemoryOutputSink& output, int x, int y) -> Run {
+    auto arguments = std::array{x, y};
+    auto result = script.execute(vm, arguments);
+    vm.getOutput().flush();
+    auto run = Run{result, std::string(output.getContents())};
+    output.clear();
+    return run;
+}
+
+// The same script compiled afresh with the parameters as plain variables.
+static auto runFresh(int x, int y) -> Run {
+    auto source = "auto x = " + std::to_string(x) + "; auto y = " + std::to_string(y) + ";" + kBody;
+    auto chunk = compile(parse(tokenize(source)));
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    execute(vm, *chunk);
+    vm.getOutput().flush();
+    return Run{vm.getResult(), std::string(output.getContents())};
+}
+
+auto main() -> int {
+    auto script = PreparedScript(kBody, {"x", "y"});
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+
+    for (auto [x, y] : {std::pair(2, 3), std::pair(5, -1), std::pair(2, 3), std::pair(0, 0)}) {
+        auto prepared = runPrepared(script, vm, output, x, y);
+        auto fresh = runFresh(x, y);
+        check(prepared.output == fresh.output, "a repeated execute prints what a fresh compile does");
+        check(prepared.result == fresh.result, "a repeated execute returns what a fresh compile does");
+    }
+    check(runPrepared(script, vm, output, 2, 3).output.starts_with("1 2 1 "), "variables, arrays and strings start over on every execute");
+
+    return finish();
+}
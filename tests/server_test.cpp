@@ -0,0 +1,90 @@
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <filesystem>
+#include <sys/socket.h>
+
+import cpp_script;
+import cpp_script_test;
+
+static constexpr auto kScript = "auto sq(auto x) { return x * x; } auto s = 0; for (auto i = 0; i < 10; i = i + 1) { s = s + sq(i); } print(s);";
+
+static auto run(const ManagedShared<Snapshot>& snapshot) -> std::string {
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    snapshot->load(vm);
+    vm.runToCompletion();
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+// Serves `requests` requests with `options` in a child process.
+static auto startServer(CompileServerOptions options, int requests) -> pid_t {
+    auto child = fork();
+    if (child == 0) {
+        auto server = CompileServer(std::move(options));
+        if (!server.listen()) {
+            _exit(1);
+        }
+        for (int i = 0; i < requests; ++i) {
+            server.serveOne();
+        }
+        _exit(0);
+    }
+    return child;
+}
+
+static void waitForSocket(const std::filesystem::path& path) {
+    while (access(path.c_str(), F_OK) != 0) {
+        usleep(1000);
+    }
+}
+
+auto main() -> int {
+    auto directory = std::filesystem::temp_directory_path() / ("cpp_script_server_test." + std::to_string(getpid()));
+    mkdir(directory.c_str(), 0700);
+    auto socket_path = directory / "compile.sock";
+    auto client = CompileClientOptions{.socket_path = socket_path, .timeout = std::chrono::milliseconds(200)};
+
+    check(run(compileShared(kScript, client)) == "285 ", "without a server the script is compiled locally");
+
+    auto server = startServer({.socket_path = socket_path}, 2);
+    waitForSocket(socket_path);
+    auto shared = compileShared(kScript, client);
+    check(run(shared) == "285 ", "a script compiled by the server");
+    check(run(compileShared(kScript, client)) == "285 ", "a script the server had compiled before");
+    auto status = 0;
+    waitpid(server, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the server answers both requests");
+    std::filesystem::remove(socket_path);
+
+    // A server that accepts connections but never answers: the client gives
+    // up after its timeout instead of waiting forever.
+    {
+        auto address = sockaddr_un{.sun_family = AF_UNIX};
+        std::strcpy(address.sun_path, socket_path.c_str());
+        auto stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+        bind(stalled, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        listen(stalled, 1);
+        auto start = std::chrono::steady_clock::now();
+        check(run(compileShared(kScript, client)) == "285 ", "a client falls back when the server does not answer");
+        check(std::chrono::steady_clock::now() - start < std::chrono::seconds(5), "a client waits no longer than its timeout");
+        close(stalled);
+        std::filesystem::remove(socket_path);
+    }
+
+    // A compile that runs past the server's deadline is killed, and the
+    // client compiles the script itself.
+    server = startServer({.socket_path = socket_path, .compile_timeout = std::chrono::milliseconds(0)}, 1);
+    waitForSocket(socket_path);
+    check(run(compileShared(kScript, client)) == "285 ", "a client falls back when the server gives up on a compile");
+    waitpid(server, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the server survives a compile it killed");
+
+    std::filesystem::remove_all(directory);
+    return finish();
+}
@@ -0,0 +1,53 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto run(std::string_view source, CompileOptions options) -> std::string {
+    auto chunk = compile(parse(tokenize(source)), {}, ManagedShared<NativeRegistry>(), options);
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk->getProgram());
+    vm.run();
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+// Redeclared variables need slots of their own, and the frame has to cover
+// all of them, or a callee's frame starts on top of the last one.
+static void checkRedeclarations(CompileOptions options, const char* what) {
+    auto top_level = R"(
+        auto a = 1;
+        auto b = 2;
+        auto a = 3;
+        auto f(auto x) { auto y = x * 10; return y; }
+        auto r = f(7);
+        print(a, b, r);
+    )";
+    check(run(top_level, options) == "3 2 70 ", what);
+
+    auto in_function = R"(
+        auto g(auto x) { auto y = x * 2; auto z = y + 1; return z; }
+        auto f(auto n) {
+            auto a = n;
+            auto a = a + 1;
+            auto a = a + 1;
+            auto r = g(100);
+            return a * 1000 + r;
+        }
+        print(f(1), f(5));
+    )";
+    check(run(in_function, options) == "3201 7201 ", what);
+}
+
+auto main() -> int {
+    checkRedeclarations({.inline_budget = 0, .fold_constants = false, .optimize = false, .memoize = false}, "redeclared slots, unoptimized");
+    checkRedeclarations({.inline_budget = 0}, "redeclared slots, optimized");
+    checkRedeclarations({}, "redeclared slots, inlined");
+
+    auto chunk = compile(parse(tokenize("auto a = 1; auto a = 2; auto b = a;")));
+    check(chunk->getProgram().slots == chunk->getSlotCount(), "programs get the frame size of their chunk");
+    check(chunk->getSlotCount() >= 3, "every declaration has a slot in the frame");
+
+    return finish();
+}
@@ -0,0 +1,111 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unistd.h>
+#include <filesystem>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto kScript = R"(
+    auto greet(string name) -> string { return "hello, " + name; }
+    auto tri(auto n) { auto s = 0; for (auto i = 0; i < n; i = i + 1) { s = s + i; } return s; }
+    auto table = 0;
+    for (auto i = 0; i < 100; i = i + 1) { table = table + twice(i); }
+    auto xs = [1, 2, 3];
+    auto ys = xs;
+    auto word = greet("world");
+    auto input = 0;
+    yield;
+    ys[0] = 10;
+    print(table, tri(input), twice(input), xs[0], sum(ys), word);
+)";
+
+static auto makeNatives(bool with_unused) -> ManagedShared<NativeRegistry> {
+    auto natives = ManagedShared(new NativeRegistry());
+    if (with_unused) {
+        natives->define("unused", [](int v) { return v; });
+    }
+    natives->define("twice", [](int v) { return v * 2; });
+    return natives;
+}
+
+static void writeImage(const std::filesystem::path& path, const std::vector<char>& bytes) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+// Runs the image of `chunk` after `patch` changed its bytecode, and tells
+// whether the image was accepted.
+template<typename Fn>
+static auto openPatched(const std::filesystem::path& path, ManagedShared<Chunk> chunk, Fn&& patch) -> bool {
+    patch(chunk->opcodes);
+    writeImage(path, buildProgramImage(*chunk));
+    return static_cast<bool>(Snapshot::open(path, chunk->natives));
+}
+
+auto main() -> int {
+    auto directory = std::filesystem::temp_directory_path() / ("cpp_script_snapshot_test." + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    auto path = directory / "script.snap";
+
+    for (auto options : {CompileOptions{.inline_budget = 0, .fold_constants = false, .optimize = false, .memoize = false}, CompileOptions{}}) {
+        auto chunk = compile(parse(tokenize(kScript)), {}, makeNatives(true), options);
+        auto direct = MemoryOutputSink();
+        auto vm = VM(direct);
+        vm.load(chunk->getProgram());
+        check(vm.run() == VMStatus::Yielded, "the script stops at its yield");
+        check(writeSnapshot(vm, *chunk, path), "a snapshot is written at a top-level yield");
+        vm.setGlobal(chunk->getVariable("input"), 10);
+        vm.runToCompletion();
+
+        // The registry differs from the one the script was compiled
+        // against, but defines every native the script calls.
+        auto snapshot = Snapshot::open(path, makeNatives(false));
+        check(static_cast<bool>(snapshot), "a snapshot needs only the natives its code calls");
+        if (snapshot) {
+            auto restored = MemoryOutputSink();
+            auto copy = VM(restored);
+            snapshot->load(copy);
+            copy.setGlobal(*snapshot->findVariable("input"), 10);
+            check(copy.runToCompletion() == VMStatus::Halted, "a restored script runs to its end");
+            check(restored.getContents() == direct.getContents(), "a restored script continues where it stopped");
+            check(restored.getContents() == "9900 45 20 10 15 hello, world ", "arrays stay shared and strings keep their text");
+        }
+        check(!Snapshot::open(path, ManagedShared(new NativeRegistry())), "a snapshot is rejected without the natives it calls");
+    }
+
+    auto compileLoop = [] {
+        return compile(parse(tokenize("auto s = 0; for (auto i = 0; i < 4; i = i + 1) { s = s + i; } print(s);")), {}, ManagedShared(new NativeRegistry()), {.inline_budget = 0, .fold_constants = false, .optimize = false, .memoize = false});
+    };
+    check(openPatched(path, compileLoop(), [](std::vector<int>&) {}), "an unchanged program image is accepted");
+    check(!openPatched(path, compileLoop(), [](std::vector<int>& code) { code[0] = kOpcodeCount; }), "unknown opcodes are rejected");
+    check(!openPatched(path, compileLoop(), [](std::vector<int>& code) { code.back() = OP_POP; }), "code that runs past its end is rejected");
+    check(!openPatched(path, compileLoop(), [](std::vector<int>& code) {
+        for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+            if (isJump(code[ip])) {
+                code[ip + getOperandCount(code[ip])] = static_cast<int>(code.size()) + 100;
+                return;
+            }
+        }
+    }), "jumps out of the code are rejected");
+    check(!openPatched(path, compileLoop(), [](std::vector<int>& code) {
+        for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+            if (isJump(code[ip])) {
+                code[ip + getOperandCount(code[ip])] = 1;
+                return;
+            }
+        }
+    }), "jumps into the middle of an instruction are rejected");
+    check(!openPatched(path, compileLoop(), [](std::vector<int>& code) {
+        for (size_t ip = 0; ip < code.size(); ip += 1 + getOperandCount(code[ip])) {
+            if (code[ip] == OP_SET_GLOBAL || code[ip] == OP_SET_LOCAL) {
+                code[ip + 1] = 1000;
+                return;
+            }
+        }
+    }), "slots outside the frame are rejected");
+
+    std::filesystem::remove_all(directory);
+    return finish();
+}
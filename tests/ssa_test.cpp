@@ -0,0 +1,109 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static constexpr auto kUnoptimized = CompileOptions{.inline_budget = 0, .fold_constants = false, .optimize = false, .memoize = false};
+
+// The output of a script, what its native saw, and the globals it left.
+static auto run(std::string_view source, CompileOptions options) -> std::string {
+    auto calls = std::string();
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("note", [&calls](int v) { calls += std::to_string(v) + ","; return v + 1; });
+
+    auto chunk = compile(parse(tokenize(source)), {}, natives, options);
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk->getProgram());
+    vm.run();
+    vm.getOutput().flush();
+
+    auto result = std::string(output.getContents()) + "| " + calls + " |";
+    for (auto& [name, slot] : chunk->variables) {
+        if (!name.starts_with('$')) {
+            result += " " + name + "=" + std::to_string(vm.getGlobal(slot));
+        }
+    }
+    return result;
+}
+
+// Every optimization has to leave what a script does unchanged.
+static void checkEquivalent(std::string_view source, const char* what) {
+    auto expected = run(source, kUnoptimized);
+    check(run(source, {.inline_budget = 0, .memoize = false}) == expected, what);
+    check(run(source, {.memoize = false}) == expected, what);
+    check(run(source, {}) == expected, what);
+}
+
+auto main() -> int {
+    checkEquivalent(R"(
+        auto a = 3;
+        auto b = a * 4;
+        auto c = a * 4 + b;
+        auto d = c;
+        d = d + 1;
+        a = 5;
+        print(a * 4, b, c, d);
+    )", "common subexpressions and copies");
+
+    checkEquivalent(R"(
+        auto total = 0;
+        for (auto i = 0; i < 10; i = i + 1) {
+            auto x = i * 2;
+            if (x > 6) {
+                total = total + x;
+            } else {
+                total = total - 1;
+            }
+        }
+        auto n = 4;
+        while (n > 0) {
+            n = n - 1;
+            total = total + n * n;
+        }
+        print(total, n);
+    )", "loops and branches");
+
+    checkEquivalent(R"(
+        auto g = 2;
+        auto scale(auto x) { return x * g; }
+        auto twice(auto x) { auto y = scale(x); return y + scale(y); }
+        auto bump(auto x) { g = g + x; return g; }
+        print(twice(3), bump(1), twice(3), g);
+    )", "calls reading and writing globals");
+
+    checkEquivalent(R"(
+        auto fib(auto n) {
+            if (n < 2) return n;
+            return fib(n - 1) + fib(n - 2);
+        }
+        auto r = 0;
+        for (auto i = 0; i < 12; i = i + 1) {
+            r = r + fib(i);
+        }
+        print(r, fib(15));
+    )", "recursion");
+
+    checkEquivalent(R"(
+        auto f(auto x) { return note(x) * 2; }
+        auto a = f(1);
+        auto b = f(1);
+        auto c = note(a) + note(a);
+        print(a, b, c);
+    )", "natives run once per call");
+
+    checkEquivalent(R"(
+        auto x = 7;
+        auto f(auto p) {
+            auto l = p + 1;
+            p = l * 2;
+            if (p > 10) return p / 3;
+            { auto l = p - 1; print(l); }
+            return l;
+        }
+        { auto x = f(2); print(x); }
+        print(f(x), x);
+    )", "shadowed locals and parameters");
+
+    return finish();
+}
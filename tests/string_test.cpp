@@ -0,0 +1,74 @@
+#include <string>
+
+import cpp_script;
+import cpp_script_test;
+
+static auto run(std::string_view source, size_t threshold = StringHeap::kDefaultRopeThreshold) -> std::string {
+    auto chunk = compile(parse(tokenize(source)));
+    auto output = MemoryOutputSink();
+    auto vm = VM(output);
+    vm.load(chunk->getProgram());
+    vm.getStrings().setRopeThreshold(threshold);
+    vm.run();
+    vm.getOutput().flush();
+    return output.getContents();
+}
+
+static void checkInterning() {
+    auto id = StringTable::intern("interned text");
+    check(id >= 0 && StringHeap::isInterned(id), "interned ids are not negative");
+    check(StringTable::intern("interned text") == id, "interning the same text twice gives the same id");
+    check(StringTable::intern("other text") != id, "different texts get different ids");
+    check(StringTable::lookup(id) == "interned text", "an id looks up its text");
+}
+
+static void checkHeap() {
+    auto heap = StringHeap();
+    auto hello = StringTable::intern("hello, ");
+    auto world = StringTable::intern("world");
+    auto empty = StringTable::intern("");
+
+    auto short_string = heap.concat(hello, world);
+    check(short_string < 0 && !StringHeap::isInterned(short_string), "built strings get negative handles");
+    check(heap.view(short_string) == "hello, world", "concatenating two interned strings");
+    check(heap.length(short_string) == 12, "length of a built string");
+    check(heap.concat(short_string, empty) == short_string && heap.concat(empty, world) == world, "concatenating an empty string");
+    check(heap.equals(short_string, heap.concat(hello, world)), "built strings compare by text");
+    check(!heap.equals(short_string, hello), "strings of different lengths differ");
+    check(heap.intern(short_string) == StringTable::intern("hello, world"), "interning a built string");
+
+    // Appending one piece at a time builds a rope as deep as it has pieces.
+    auto piece = StringTable::intern("0123456789");
+    auto rope = piece;
+    auto expected = std::string("0123456789");
+    for (int i = 0; i < 1000; ++i) {
+        rope = heap.concat(rope, piece);
+        expected += "0123456789";
+    }
+    check(heap.length(rope) == expected.size(), "a rope knows its length before it is flattened");
+    check(heap.view(rope) == expected, "flattening a deep rope");
+    check(heap.view(rope) == expected, "a flattened rope keeps its text");
+
+    // Both halves of a rope may be ropes, and may be the same one.
+    auto doubled = heap.concat(rope, rope);
+    check(heap.view(doubled) == expected + expected, "flattening a rope of ropes");
+    check(heap.equals(doubled, heap.concat(rope, rope)), "ropes compare by text");
+
+    heap.clear();
+    check(heap.size() == 0, "clearing the heap drops every built string");
+    check(StringTable::lookup(hello) == "hello, ", "interned strings survive clearing the heap");
+    check(heap.view(heap.concat(hello, world)) == "hello, world", "the heap is usable again after clearing");
+}
+
+auto main() -> int {
+    checkInterning();
+    checkHeap();
+
+    auto building = "auto s = \"x\"; for (auto i = 0; i < 200; i = i + 1) { s = s + \"ab\"; } print(s == \"x\" + \"ab\" + \"ab\", s);";
+    auto copied = run(building, SIZE_MAX);
+    check(copied.starts_with("0 xabab") && copied.size() == 2 + 401 + 1, "building a string by copying");
+    check(run(building) == copied, "building a string as a rope prints the same text");
+    check(run("print(\"ab\" + \"cd\" == \"abcd\", \"ab\" == \"ab\");") == "1 1 ", "comparing built and literal strings");
+
+    return finish();
+}
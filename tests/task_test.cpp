@@ -0,0 +1,80 @@
+#include <string>
+#include <vector>
+
+import cpp_script;
+import cpp_script_test;
+
+static void checkYield() {
+    auto output = MemoryOutputSink();
+    auto task = ScriptTask(compile(parse(tokenize("print(1); yield; print(2); yield; print(3);"))), output);
+    check(task.resume() == VMStatus::Yielded, "a task suspends at a yield");
+    check(!task.isDone(), "a yielded task is not done");
+    check(task.resume() == VMStatus::Yielded, "a task continues after a yield");
+    check(task.resume() == VMStatus::Halted, "a task halts at its end");
+    check(task.isDone(), "a halted task is done");
+    check(task.getResumeCount() == 3, "every resume is counted");
+    task.getVM().getOutput().flush();
+    check(output.getContents() == "1 2 3 ", "a yielding task prints everything once");
+}
+
+static void checkSlices() {
+    auto source = "auto s = 0; for (auto i = 0; i < 100; i = i + 1) { s = s + i; } print(s);";
+    auto output = MemoryOutputSink();
+    auto task = ScriptTask(compile(parse(tokenize(source))), output);
+    check(task.resume(10) == VMStatus::OutOfFuel, "a slice stops a loop that never yields");
+    while (task.resume(10) != VMStatus::Halted) {
+    }
+    check(task.getResumeCount() >= 10, "a long loop takes several slices");
+    task.getVM().getOutput().flush();
+    check(output.getContents() == "4950 ", "slicing does not change the result");
+}
+
+// With a single worker, tasks take turns in the order they were spawned.
+static void checkOrder() {
+    auto order = std::vector<int>();
+    auto natives = ManagedShared(new NativeRegistry());
+    natives->define("mark", [&](int value) {
+        order.emplace_back(value);
+        return 0;
+    });
+
+    auto pool = ThreadPool(1);
+    auto tasks = ScriptScheduler(pool);
+    for (int id = 1; id <= 3; ++id) {
+        auto source = "auto n = 0; while (n < " + std::to_string(id) + ") { mark(" + std::to_string(id) + "); n = n + 1; yield; }";
+        tasks.spawn(compile(parse(tokenize(source)), {}, natives));
+    }
+    tasks.run();
+
+    check(order == std::vector<int>{1, 2, 3, 2, 3, 3}, "tasks are resumed in FIFO order");
+    for (size_t i = 0; i < tasks.getTaskCount(); ++i) {
+        check(tasks.getTask(i).isDone(), "run() returns once every task is done");
+    }
+    check(tasks.getTask(2).getResumeCount() == 4, "a task is resumed once per yield and once more to halt");
+}
+
+static void checkSlicedTasks() {
+    auto pool = ThreadPool(4);
+    auto tasks = ScriptScheduler(pool, {.slice = 7});
+    auto sinks = std::vector<MemoryOutputSink>(8);
+    for (auto& sink : sinks) {
+        tasks.spawn(compile(parse(tokenize("auto s = 0; for (auto i = 0; i < 1000; i = i + 1) { s = s + i; } print(s);"))), sink);
+    }
+    tasks.run();
+
+    for (size_t i = 0; i < tasks.getTaskCount(); ++i) {
+        auto& task = tasks.getTask(i);
+        task.getVM().getOutput().flush();
+        check(task.isDone(), "every sliced task finishes");
+        check(task.getResumeCount() > 1, "a sliced task takes several turns");
+        check(sinks[i].getContents() == "499500 ", "a sliced task computes its result");
+    }
+}
+
+auto main() -> int {
+    checkYield();
+    checkSlices();
+    checkOrder();
+    checkSlicedTasks();
+    return finish();
+}
@@ -0,0 +1,49 @@
+module;
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string_view>
+#include <source_location>
+
+export module cpp_script_test;
+
+// Checks shared by the test executables. A failed check is reported and
+// counted, and the test goes on, so that one run shows every failure;
+// main() returns finish() to turn the count into the exit status.
+
+int failures = 0;
+
+export void check(bool condition, std::string_view what, std::source_location location = std::source_location::current()) {
+    if (!condition) {
+        fprintf(stderr, "%s:%u: check failed: %.*s\n", location.file_name(), location.line(), (int) what.size(), what.data());
+        failures += 1;
+    }
+}
+
+// Checks that `fn` kills the process, by abort() or by a trap, the way
+// script errors end a run. It runs in a forked child with stderr closed, so
+// the expected error message does not clutter the test output.
+export template<typename Fn>
+void checkFails(std::string_view what, Fn&& fn, std::source_location location = std::source_location::current()) {
+    fflush(stdout);
+    fflush(stderr);
+    auto child = fork();
+    if (child == 0) {
+        close(STDERR_FILENO);
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    check(WIFSIGNALED(status), what, location);
+}
+
+export auto finish() -> int {
+    if (failures != 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}